@@ -33,8 +33,29 @@ namespace Ethernet {
       };
     };
     bool        is_multicast() const { return byte[0] & 1; }
+    bool        is_broadcast() const { return (_w1 == ~0U) and (_w2 == 0xFFFF); }
     const char *to_str()       const;
 
+    /// Parse an address in the usual colon-separated notation.
+    /// Returns false, if str is not an address.
+    static bool from_str(char const *str, Address &addr);
+
+    /// Addresses as 48-bit numbers. Used to hand out ranges of
+    /// addresses.
+    uint64_t to_u64() const
+    {
+      uint64_t v = 0;
+      for (uint8_t b : byte) v = (v << 8) | b;
+      return v;
+    }
+
+    static Address from_u64(uint64_t v)
+    {
+      Address a;
+      for (int i = 5; i >= 0; i--, v >>= 8) a.byte[i] = v;
+      return a;
+    }
+
     Address() : byte() {}
     Address(uint8_t a1, uint8_t a2, uint8_t a3, uint8_t a4, uint8_t a5, uint8_t a6) { 
       byte[0] = a1; byte[1] = a2;
@@ -51,6 +72,7 @@ namespace Ethernet {
   enum struct Ethertype : uint16_t {
     IPV4 = Endian::const_hton16(0x0800),
     IPV6 = Endian::const_hton16(0x86DD),
+    VLAN = Endian::const_hton16(0x8100),
   };
 
   struct PACKED Header {
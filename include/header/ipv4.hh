@@ -59,6 +59,19 @@ namespace IPv4 {
       return 0 == sum;
     }
 
+    enum {
+      FRAG_MF     = 0x2000,	// More fragments
+      FRAG_OFFSET = 0x1FFF,	// In units of 8 bytes
+    };
+
+    /// Make this header describe a fragment starting at payload
+    /// offset (in bytes). Clears DF.
+    void set_fragment(unsigned offset, bool more)
+    {
+      uint16_t *f = &id + 1;	// The bitfields above are useless.
+      *f = Endian::bswap16(((offset / 8) & FRAG_OFFSET) | (more ? FRAG_MF : 0));
+    }
+
     // Returns payload length in host byte order.
     uint16_t payload_length() const {
       return Endian::bswap16(len) - ihl*4;
@@ -0,0 +1,87 @@
+// Copyright (C) 2013, Julian Stecklina <jsteckli@os.inf.tu-dresden.de>
+// Economic rights: Technische Universitaet Dresden (Germany)
+
+// This file is part of sv3.
+
+// sv3 is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License version 2 as
+// published by the Free Software Foundation.
+
+// sv3 is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License version 2 for more details.
+
+// Latency histograms
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+namespace Switch {
+
+  /// A histogram of cycle counts with logarithmic buckets in the
+  /// style of HdrHistogram: each power of two is split into
+  /// SUB_BUCKETS linear buckets, so every value is recorded with a
+  /// relative error below 1/SUB_BUCKETS. Adding a value is a couple of
+  /// instructions and touches one bucket. Only one thread may add
+  /// values.
+  struct Histogram {
+    enum {
+      SUB_BITS    = 3,
+      SUB_BUCKETS = 1 << SUB_BITS,
+      // Up to 2^50 cycles, which are a couple of days.
+      BUCKETS     = 48 * SUB_BUCKETS,
+    };
+
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t bucket[BUCKETS];
+
+    static unsigned index(uint64_t v)
+    {
+      if (v < SUB_BUCKETS) return v;
+
+      unsigned shift = 63 - __builtin_clzll(v) - SUB_BITS;
+      unsigned idx   = (shift + 1) * SUB_BUCKETS + ((v >> shift) & (SUB_BUCKETS - 1));
+      return idx < BUCKETS ? idx : BUCKETS - 1;
+    }
+
+    /// The smallest value that ends up in bucket idx.
+    static uint64_t lower_bound(unsigned idx)
+    {
+      if (idx < SUB_BUCKETS) return idx;
+      return uint64_t(SUB_BUCKETS + idx % SUB_BUCKETS) << (idx / SUB_BUCKETS - 1);
+    }
+
+    void add(uint64_t v)
+    {
+      count += 1;
+      sum   += v;
+      if (v > max) max = v;
+      bucket[index(v)] += 1;
+    }
+
+    /// The value below which fraction p (0..1) of all values are, as
+    /// far as our buckets can tell.
+    uint64_t percentile(double p) const
+    {
+      uint64_t want = p * count;
+      uint64_t seen = 0;
+
+      for (unsigned i = 0; i < BUCKETS; i++) {
+        seen += bucket[i];
+        if (seen > want) return lower_bound(i);
+      }
+
+      return max;
+    }
+
+    void reset() { memset(this, 0, sizeof(*this)); }
+  };
+
+}
+
+// EOF
@@ -16,9 +16,12 @@
 #include <unistd.h>
 
 #include <thread>
+#include <memory>
 
 #include <vfio.hh>
+#include <numa.hh>
 #include <switch.hh>
+#include <udpfrag.hh>
 
 namespace Switch {
 
@@ -35,10 +38,13 @@ namespace Switch {
     throw PollTimeout();
   }
 
-  class Intel82599 : public VfioDevice {
+  class Intel82599 {
 
   protected:
 
+    // The device itself or a model of it.
+    std::unique_ptr<PciDevice> _pci;
+
     uint32_t volatile *_reg;
 
     struct desc { uint64_t hi; uint64_t lo; };
@@ -55,6 +61,9 @@ namespace Switch {
     // Can't set this lower than 6 according to Linux driver.
     const unsigned _itr_us;
 
+    // NUMA node the device is attached to or -1.
+    const int      _device_node;
+
     uint64_t receive_address(unsigned idx);
 
     // Stop issuing master requests.
@@ -69,8 +78,11 @@ namespace Switch {
       size_t alloc_size = (size + 0xFFF) & ~0xFFF;
       if (0 != posix_memalign((void **)&p, 0x1000, alloc_size))
 	throw Exception("posix_memalign failed");
+      // Rings and buffers belong next to the device. This only works
+      // before memset faults the pages in (or moves them).
+      Numa::prefer(p, alloc_size, _device_node);
       memset(p, 0, alloc_size);
-      map_memory_to_device(p, alloc_size, true, true);
+      _pci->map_memory_to_device(p, alloc_size, true, true);
       return p;
     }
 
@@ -89,7 +101,8 @@ namespace Switch {
     std::string status();
     void        reset();
 
-    Intel82599(VfioGroup group, std::string device_id, int fd, int rxtx_eventfd,
+    /// Take over pci, which must be an 82599.
+    Intel82599(PciDevice *pci, std::string device_id, int rxtx_eventfd,
                bool enable_lro, unsigned irq_rate);
   };
 
@@ -149,6 +162,10 @@ namespace Switch {
       // pass over the descriptor chain.
       uint32_t   packet_length;
 
+      // How many ports still hold this packet. Only valid for the last
+      // buffer in a chain. See defer_done.
+      uint16_t   holders;
+
       // We need space to construct a header. Here is as good as any.
       virtio_net_hdr_mrg_rxbuf hdr;
     } _rx_buffers[QUEUE_LEN];
@@ -161,6 +178,12 @@ namespace Switch {
       Packet::CompletionInfo info;
     } _tx_buffers[QUEUE_LEN];
 
+    // Headers we build for packets we fragment in software (see
+    // receive_ufo). Indexed like _tx_desc.
+    struct tx_header {
+      uint8_t data[UdpFragmenter::MAX_HEADER];
+    } *_tx_headers;
+
     uint16_t advance_qp(uint16_t idx) {
       assert(idx < QUEUE_LEN);
       idx += 1;
@@ -171,7 +194,16 @@ namespace Switch {
     // Is there space for a single TX descriptor?
     bool tx_has_room();
 
+    // How many TX descriptors can we still queue?
+    unsigned tx_room();
+
     void misc_thread_fn();
+
+    // Put a packet into the TX queue. Returns the index of its last
+    // descriptor or -1, if the queue is full. The caller sets up the
+    // completion.
+    int  transmit(Packet &p);
+    void receive_ufo(Packet &p);
     desc populate_rx_desc(uint8_t *data);
     desc populate_tx_desc(uint8_t *data, uint16_t len, uint16_t total_len,
 			  bool first, uint64_t first_flags,
@@ -181,10 +213,20 @@ namespace Switch {
     void receive(Packet &p) override;
     bool poll(Packet &p, bool enable_notifications) override;
     void mark_done(Packet::CompletionInfo &p) override;
+    void defer_done(Packet::CompletionInfo &p, unsigned holders) override;
+    void drop_held(Port const *src) override;
 
-    Intel82599Port(VfioGroup group, std::string device_id, int fd,
+    Intel82599Port(PciDevice *pci, std::string device_id,
 		   Switch &sw, std::string name,
 		   bool enable_lro, unsigned irq_rate);
+
+    /// For VfioGroup::get_device.
+    Intel82599Port(VfioGroup group, std::string device_id, int fd,
+		   Switch &sw, std::string name,
+		   bool enable_lro, unsigned irq_rate)
+      : Intel82599Port(new VfioDevice(group, device_id, fd), device_id,
+		       sw, name, enable_lro, irq_rate)
+    { }
   };
 
 }
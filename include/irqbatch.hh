@@ -0,0 +1,74 @@
+// Copyright (C) 2013, Julian Stecklina <jsteckli@os.inf.tu-dresden.de>
+// Economic rights: Technische Universitaet Dresden (Germany)
+
+// This file is part of sv3.
+
+// sv3 is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License version 2 as
+// published by the Free Software Foundation.
+
+// sv3 is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License version 2 for more details.
+
+#pragma once
+
+#include <cstdint>
+#include <compiler.h>
+#include <util.hh>
+
+namespace Switch {
+
+  /// Collects the eventfd writes that deliver guest interrupts during
+  /// a switching quantum and submits them with a single io_uring_enter
+  /// call. Falls back to one write() per interrupt, if io_uring is
+  /// not available. Only used by the switch thread.
+  class IrqBatch : Uncopyable {
+    enum {
+      ENTRIES = 256,
+    };
+
+    int       _ring_fd;		// -1, if we use write()
+
+    // Submission queue
+    uint32_t *_sq_head;
+    uint32_t *_sq_tail;
+    uint32_t  _sq_mask;
+    void     *_sqes;		// struct io_uring_sqe[]
+
+    // Completion queue
+    uint32_t *_cq_head;
+    uint32_t *_cq_tail;
+    uint32_t  _cq_mask;
+    void     *_cqes;		// struct io_uring_cqe[]
+
+    // Mappings to undo in the destructor.
+    void     *_map[3];
+    size_t    _map_size[3];
+
+    unsigned  _queued;
+
+    void setup();
+    void teardown();
+    void reap();
+
+  public:
+
+    /// Does the batch go through io_uring?
+    bool batching() const { return _ring_fd >= 0; }
+
+    /// Queue an eventfd write. Takes effect on the next flush() at
+    /// the latest.
+    void trigger(int fd);
+
+    /// Submit all queued writes.
+    void flush();
+
+    IrqBatch();
+    ~IrqBatch();
+  };
+
+}
+
+// EOF
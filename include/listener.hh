@@ -20,35 +20,63 @@
 #include <sys/un.h>
 #include <sys/mman.h>
 
-#include <list>
+#include <vector>
 #include <thread>
 
 #include <switch.hh>
 #include <session.hh>
+#include <vhostuser.hh>
 
 #include <hw/misc/externalpci.h>
 
 namespace Switch {
 
+  /// Accepts sessions and handles their requests. A couple of worker
+  /// threads wait on a single epoll set, so sessions are set up in
+  /// parallel when many guests start at once. A session is only ever
+  /// handled by one worker at a time.
   class Listener {
     Switch     &_sw;
 
+    enum {
+      MAX_WORKERS = 8,
+    };
+
     int         _sfd;
     sockaddr_un _local_addr;
 
-    std::thread _thread;
+    // vhost-user socket. -1, if we don't listen for vhost-user
+    // clients.
+    int         _vfd;
+    sockaddr_un _vhost_addr;
+
+    // Listening sockets, sessions and _quit_fd.
+    int         _epfd;
+
+    // Readable once the listener is destroyed.
+    int         _quit_fd;
+
+    std::vector<std::thread> _workers;
+
+    void worker();
+    void accept_session(int sfd, bool vhost_user);
 
-    std::list<Session *> _sessions;
+    /// Wait for the next event of a session. Sessions are owned by
+    /// their registration and deleted by the worker that sees them
+    /// close.
+    void arm_session(Session *s, int op);
 
-    void thread_fun();
-    void accept_session();
+    // Create a listening unix socket at path.
+    int  open_socket(sockaddr_un &addr, char const *path, int type, bool force);
 
   public:
 
     // Create a listening socket for the switch through which it can
     // be controlled by sv3-remote. If force is set, the unix file
-    // socket is unlinked prior to creating a new one.
-    Listener(Switch &sw, bool force = false);
+    // socket is unlinked prior to creating a new one. If vhost_path
+    // is given, we also accept vhost-user clients there.
+    Listener(Switch &sw, bool force = false, char const *vhost_path = nullptr,
+             char const *control_path = "/tmp/sv3");
     ~Listener();
   };
 
@@ -0,0 +1,47 @@
+// Copyright (C) 2013, Julian Stecklina <jsteckli@os.inf.tu-dresden.de>
+// Economic rights: Technische Universitaet Dresden (Germany)
+
+// This file is part of sv3.
+
+// sv3 is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License version 2 as
+// published by the Free Software Foundation.
+
+// sv3 is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License version 2 for more details.
+
+// NUMA topology helpers. We use the system calls directly to not
+// depend on libnuma. Node -1 means "unknown" everywhere, which is
+// what single-node systems and old kernels give us.
+
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+namespace Switch {
+  namespace Numa {
+
+    /// Number of NUMA nodes in the system.
+    unsigned nodes();
+
+    /// The node the page at p lives on. The page must be present.
+    int node_of(void const *p);
+
+    /// The node a PCI device (e.g. "0000:02:00.1") is attached to.
+    int pci_node(std::string const &device_id);
+
+    /// Prefer node for the pages in [p, p + len). Pages that are
+    /// already present are moved, if possible. p must be page
+    /// aligned. Returns false, if this didn't work.
+    bool prefer(void *p, size_t len, int node);
+
+    /// Restrict the calling thread to the CPUs of node, as far as its
+    /// original affinity allows. Returns false, if nothing changed.
+    bool run_on(int node);
+  }
+}
+
+// EOF
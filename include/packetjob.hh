@@ -12,6 +12,7 @@
 // MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
 // General Public License version 2 for more details.
 
+#pragma once
 
 #include <functional>
 #include <header/ethernet.hh>
@@ -41,6 +42,8 @@ namespace Switch {
       union {
 	struct {
 	  unsigned index;
+	  // Incarnation of the TX ring the chain came from.
+	  unsigned generation;
 	} virtio;
 	struct {
 	  // Queue index of last buffer in buffer chain.
@@ -50,27 +53,59 @@ namespace Switch {
     } completion_info;
 
     // Return a copy of the completion info and remember that we did
-    // so to avoid completing this packet to early.
+    // so to avoid completing this packet to early. Whoever holds the
+    // copy has to call src_port->mark_done() on it exactly once.
     CompletionInfo copy_completion_info()
     {
       copied += 1;
       return completion_info;
     }
 
-    Ethernet::Header const &ethernet_header() const
+    // The virtio header is always at the start of fragment 0. The
+    // Ethernet frame either follows it in the same fragment
+    // (VIRTIO_F_ANY_LAYOUT) or starts in fragment 1.
+    unsigned payload_fragment() const
     {
-      assert(fragments > 1);
-      assert(fragment_length[0] == sizeof(struct virtio_net_hdr_mrg_rxbuf));
-      assert(fragment_length[1] >= sizeof(Ethernet::Header));
+      assert(fragments > 0);
+      assert(fragment_length[0] >= sizeof(struct virtio_net_hdr_mrg_rxbuf));
+      return (fragment_length[0] == sizeof(struct virtio_net_hdr_mrg_rxbuf)) ? 1 : 0;
+    }
 
-      return *reinterpret_cast<Ethernet::Header const *>(fragment[1]);
+    // Offset of the Ethernet frame in fragment i.
+    unsigned payload_offset(unsigned i) const
+    { return (i == 0) ? sizeof(struct virtio_net_hdr_mrg_rxbuf) : 0; }
+
+    // Start of the Ethernet frame.
+    uint8_t *payload() const
+    {
+      unsigned i = payload_fragment();
+      return fragment[i] + payload_offset(i);
+    }
+
+    // Bytes of the Ethernet frame that are contiguous at payload().
+    unsigned payload_length() const
+    {
+      unsigned i = payload_fragment();
+      return (i < fragments) ? fragment_length[i] - payload_offset(i) : 0;
+    }
+
+    Ethernet::Header const &ethernet_header() const
+    {
+      assert(payload_length() >= sizeof(Ethernet::Header));
+      return *reinterpret_cast<Ethernet::Header const *>(payload());
     }
 
     void copy_from(Packet const &src, virtio_net_hdr const *hdr);
 
+    /// Copy len bytes of the Ethernet frame starting at offset to
+    /// dst. Returns false, if the frame is too short.
+    bool read(unsigned offset, void *dst, size_t len) const;
+
     Packet(Port *src_port)
       : packet_length(0), fragments(0), copied(0)
     { completion_info.src_port = src_port; }
+
+    Packet() : Packet(nullptr) { }
   };
 
 }
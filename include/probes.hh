@@ -0,0 +1,74 @@
+// Copyright (C) 2013, Julian Stecklina <jsteckli@os.inf.tu-dresden.de>
+// Economic rights: Technische Universitaet Dresden (Germany)
+
+// This file is part of sv3.
+
+// sv3 is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License version 2 as
+// published by the Free Software Foundation.
+
+// sv3 is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License version 2 for more details.
+
+// Static probes (USDT) for perf, bpftrace and SystemTap
+//
+// Each probe is a nop in the instruction stream plus a note in the
+// binary that tells tools where it is and where its arguments live.
+// Until someone attaches, a probe costs the nop and keeping its
+// arguments in registers. List them with:
+//
+//   bpftrace -l 'usdt:./sv3:sv3:*'
+//
+// All probes are in the provider sv3. Ports are identified by
+// Port::id(), lengths are Ethernet frame lengths.
+//
+//   poll(port, length)                 The switch got a packet from port.
+//   deliver(src, dst, length)          ... and gave it to dst.
+//   flood(port, length)                ... or flooded it.
+//   drop(port, reason, length)         A packet was dropped. See DropReason.
+//   irq(port, vector)                  We sent an interrupt to a guest.
+//   kick(port, queue)                  A guest notified us.
+//   nic_irq_unmask(port)               The NIC may interrupt us again.
+//   nic_tx_complete(port, count)       The NIC sent count descriptors.
+//   block() / wakeup()                 The switch thread sleeps or wakes up.
+//   quiescent()                        The switch thread is in an RCU
+//                                      quiescent state.
+//   attach(port, name) / detach(port, name)
+//
+// Without <sys/sdt.h> at build time, there are no probes.
+
+#pragma once
+
+#ifdef NO_SDT
+
+#define PROBE0(name)                    do { } while (0)
+#define PROBE1(name, a)                 do { (void)(a); } while (0)
+#define PROBE2(name, a, b)              do { (void)(a); (void)(b); } while (0)
+#define PROBE3(name, a, b, c)           do { (void)(a); (void)(b); (void)(c); } while (0)
+
+#else
+
+#include <sys/sdt.h>
+
+#define PROBE0(name)                    STAP_PROBE(sv3, name)
+#define PROBE1(name, a)                 STAP_PROBE1(sv3, name, a)
+#define PROBE2(name, a, b)              STAP_PROBE2(sv3, name, a, b)
+#define PROBE3(name, a, b, c)           STAP_PROBE3(sv3, name, a, b, c)
+
+#endif
+
+namespace Switch {
+
+  /// The reason argument of the drop probe. Same as the drops_*
+  /// counters in PortStats.
+  enum DropReason {
+    DROP_RX_RING_EMPTY = 0,
+    DROP_TX_QUEUE_FULL = 1,
+    DROP_BROKEN        = 2,
+  };
+
+}
+
+// EOF
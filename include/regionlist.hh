@@ -0,0 +1,122 @@
+// Copyright (C) 2013, Julian Stecklina <jsteckli@os.inf.tu-dresden.de>
+// Economic rights: Technische Universitaet Dresden (Germany)
+
+// This file is part of sv3.
+
+// sv3 is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License version 2 as
+// published by the Free Software Foundation.
+
+// sv3 is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License version 2 for more details.
+
+// Guest-physical to host-virtual address translation
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+#include <vector>
+
+#include <urcu-qsbr.h>
+
+#include <compiler.h>
+#include <util.hh>
+
+namespace Switch {
+
+  struct Region {
+    uint64_t addr;
+    uint64_t size;
+
+    uint8_t *mapping;
+
+    /// Does [a, a + s) lie completely within this region? Empty
+    /// regions contain nothing.
+    bool contains(uint64_t a, uint64_t s) const
+    {
+      return a >= addr and a - addr < size and s <= size - (a - addr);
+    }
+
+    uint8_t *translate(uint64_t a) const { return mapping + (a - addr); }
+
+    Region(uint64_t addr, uint64_t size, uint8_t *mapping)
+      : addr(addr), size(size), mapping(mapping) {}
+
+    Region() = default;
+  };
+
+  /// A set of non-overlapping memory regions. Lookups are a binary
+  /// search in a sorted array. Callers that translate many addresses
+  /// in the same region (e.g. all descriptors of a virtqueue) pass a
+  /// cache that makes the common case a couple of compares.
+  ///
+  /// The array is replaced as a whole under RCU, so the switch thread
+  /// can translate while the listener thread adds memory.
+  class RegionList : Uncopyable {
+    typedef std::vector<Region> Table;
+
+    Table *_table;
+
+    /// Publish a new table and free the old one after a grace
+    /// period.
+    void replace(Table *t);
+
+  public:
+    bool insert(Region const &r);
+
+    /// Unmap and forget all regions. Nobody may hold translations or
+    /// caches that point into them.
+    void clear();
+
+    template<typename P>
+    P *translate_ptr(uint64_t addr) {
+      return reinterpret_cast<P *>(translate_ptr(addr, sizeof(P)));
+    }
+
+    /// Translate [addr, addr + size) into a pointer. The range must
+    /// be contained in a single region. If cache is given, it is
+    /// tried first and updated on a miss.
+    uint8_t *translate_ptr(uint64_t addr, size_t size, Region *cache = nullptr)
+    {
+      if (cache and LIKELY(cache->contains(addr, size)))
+        return cache->translate(addr);
+
+      Table const  &t = *rcu_dereference(_table);
+      Region const *r = t.data();
+      size_t        n = t.size();
+
+      if (UNLIKELY(n == 0)) return nullptr;
+
+      // Find the last region that starts at or below addr (or the
+      // first region, if there is none). Without branches, the
+      // compiler turns this into conditional moves.
+      while (n > 1) {
+        size_t half = n / 2;
+        r  = (r[half].addr <= addr) ? r + half : r;
+        n -= half;
+      }
+
+      if (not r->contains(addr, size)) return nullptr;
+      if (cache) *cache = *r;
+      return r->translate(addr);
+    }
+
+    /// Call f for every region. Only for the thread that modifies the
+    /// list.
+    template<typename F>
+    void for_each(F f) const
+    {
+      for (Region const &r : *_table) f(r);
+    }
+
+    RegionList() : _table(new Table) {}
+    ~RegionList();
+  };
+
+}
+
+// EOF
@@ -0,0 +1,131 @@
+// Copyright (C) 2013, Julian Stecklina <jsteckli@os.inf.tu-dresden.de>
+// Economic rights: Technische Universitaet Dresden (Germany)
+
+// This file is part of sv3.
+
+// sv3 is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License version 2 as
+// published by the Free Software Foundation.
+
+// sv3 is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License version 2 for more details.
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+#include <compiler.h>
+#include <endian.hh>
+#include <header/ethernet.hh>
+
+namespace Switch {
+
+  /// Decides which flooded packets a port wants to see. The semantics
+  /// follow the virtio-net receive filter as implemented by qemu. A
+  /// freshly reset filter accepts everything.
+  class RxFilter {
+  public:
+    enum {
+      MAC_TABLE_ENTRIES = 64,
+      MAX_VLAN          = 1 << 12,
+    };
+
+  private:
+    bool     _promisc;
+    bool     _allmulti;
+    bool     _alluni;
+    bool     _nomulti;
+    bool     _nouni;
+    bool     _nobcast;
+
+    // Only look at VLAN tags, if the guest asked us to filter them.
+    bool     _filter_vlans;
+
+    // The primary MAC of the port. Unicast packets to other MACs are
+    // only accepted, if we know this.
+    bool              _has_mac;
+    Ethernet::Address _mac;
+
+    // Unicast entries come first, then multicast entries.
+    unsigned          _uni_entries;
+    unsigned          _multi_entries;
+    bool              _uni_overflow;
+    bool              _multi_overflow;
+    Ethernet::Address _macs[MAC_TABLE_ENTRIES];
+
+    uint32_t          _vlans[MAX_VLAN / 32];
+
+    static bool lookup(Ethernet::Address const *table, unsigned entries,
+                       Ethernet::Address const &addr)
+    {
+      for (unsigned i = 0; i < entries; i++)
+        if (table[i] == addr) return true;
+      return false;
+    }
+
+    bool vlan_ok(Ethernet::Header const &hdr, size_t len) const
+    {
+      if (LIKELY(not _filter_vlans or hdr.type != Ethernet::Ethertype::VLAN))
+        return true;
+
+      if (UNLIKELY(len < sizeof(hdr) + sizeof(uint16_t)))
+        return false;
+
+      uint16_t tci = *reinterpret_cast<uint16_t const *>(reinterpret_cast<uint8_t const *>(&hdr) +
+                                                         sizeof(hdr));
+      unsigned vid = Endian::bswap16(tci) & (MAX_VLAN - 1);
+      return _vlans[vid / 32] & (1U << (vid % 32));
+    }
+
+  public:
+
+    /// Check whether a packet with the given Ethernet header should
+    /// be delivered. len is the number of header bytes we may look
+    /// at.
+    bool accepts(Ethernet::Header const &hdr, size_t len) const
+    {
+      if (LIKELY(_promisc)) return true;
+      if (not vlan_ok(hdr, len)) return false;
+
+      Ethernet::Address const &dst = hdr.dst;
+      if (dst.is_multicast()) {
+        if (dst.is_broadcast())         return not _nobcast;
+        if (_nomulti)                   return false;
+        if (_allmulti or _multi_overflow) return true;
+
+        return lookup(_macs + _uni_entries, _multi_entries, dst);
+      }
+
+      if (_nouni)                       return false;
+      if (_alluni or _uni_overflow)     return true;
+      if (not _has_mac or dst == _mac)  return true;
+
+      return lookup(_macs, _uni_entries, dst);
+    }
+
+    /// Set one of the VIRTIO_NET_CTRL_RX_* modes. Returns false for
+    /// unknown modes.
+    bool set_mode(unsigned mode, bool on);
+
+    /// Replace the MAC filter table. Excess entries turn into
+    /// overflow, which accepts everything of that kind.
+    void set_mac_table(Ethernet::Address const *uni,   unsigned uni_entries,
+                       Ethernet::Address const *multi, unsigned multi_entries);
+
+    void set_mac(Ethernet::Address const &mac) { _mac = mac; _has_mac = true; }
+
+    void set_vlan_filtering(bool on) { _filter_vlans = on; }
+    bool add_vlan(unsigned vid);
+    bool del_vlan(unsigned vid);
+
+    void reset();
+
+    RxFilter() { reset(); }
+  };
+
+}
+
+// EOF
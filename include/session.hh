@@ -16,8 +16,12 @@
 
 #include <cstdint>
 #include <algorithm>
+#include <list>
+#include <thread>
+#include <vector>
 
 #include <unistd.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/mman.h>
@@ -25,50 +29,11 @@
 // From QEMU source
 #include <hw/misc/externalpci.h>
 
+#include <regionlist.hh>
 #include <virtiodevice.hh>
 
 namespace Switch {
 
-  struct Region {
-    uint64_t addr;
-    uint64_t size;
-
-    uint8_t *mapping;
-
-    Region(uint64_t addr, uint64_t size, uint8_t *mapping)
-      : addr(addr), size(size), mapping(mapping) {}
-  };
-
-  class RegionList {
-    std::list<Region> _list;
-
-  public:
-    bool insert(Region const &r);
-
-    template<typename P>
-    P *translate_ptr(uint64_t addr) {
-      return reinterpret_cast<P *>(translate_ptr(addr, sizeof(P)));
-    }
-
-    uint8_t *translate_ptr(uint64_t addr, size_t size)
-    {
-      if (addr + size <= addr) return nullptr;
-
-      for (auto &r : _list) {
-	if (r.addr <= addr and
-	    addr + size < r.addr + r.size)
-	  return r.mapping + (addr - r.addr);
-      }
-
-      return nullptr;
-    }
-
-    ~RegionList() {
-      for (auto &r : _list)
-	munmap(r.mapping, r.size);
-    }
-  };
-
   class Session {
     // XXX Write proper accessors.
   public:
@@ -82,23 +47,61 @@ namespace Switch {
     /// Client socket address.
     sockaddr_un  _sa;
 
+    /// The file descriptors of this session we wait on: the socket
+    /// and whatever subclasses add.
+    int          _epfd;
+
     RegionList   _regions;
 
     /// File descriptors we accepted that must be cleaned up on session
     /// termination.
     std::list<int>    _file_descriptors;
 
+    /// Threads that fault in guest memory.
+    std::vector<std::thread> _prefault;
+
     VirtioDevice      _device;
 
     template<typename P>
     P       *translate_ptr(uint64_t addr)
     { return _regions.translate_ptr<P>(addr); }
 
-    uint8_t *translate_ptr(uint64_t addr, size_t size)
-    { return _regions.translate_ptr(addr, size); }
+    uint8_t *translate_ptr(uint64_t addr, size_t size, Region *cache = nullptr)
+    { return _regions.translate_ptr(addr, size, cache); }
+
+    /// Start or stop waiting for fd to become readable.
+    void watch(int fd);
+    void unwatch(int fd);
+
+    /// Handle fd, which is readable. Returns false, if the session
+    /// should be closed.
+    virtual bool handle(int fd);
+
+    /// The listener waits for this to become readable and then calls
+    /// handle_events().
+    int  epoll_fd() const { return _epfd; }
+
+    /// Handle everything that is pending on our file descriptors.
+    /// Returns false, if the session should be closed.
+    bool handle_events();
 
     /// Check for a message. Shouldn't block.
-    bool poll();
+    virtual bool poll();
+
+    static void prefault(uint8_t *p, size_t size);
+
+    /// Map size bytes of fd starting at offset somewhere we can also
+    /// use for 1:1 DMA mappings. Returns nullptr on failure. The
+    /// memory is faulted in in the background.
+    uint8_t *map_memory(int fd, uint64_t offset, uint64_t size);
+
+    /// Wait until all guest memory is faulted in. The switch thread
+    /// must not touch guest memory before.
+    void     wait_for_memory();
+
+    /// The NUMA node most of the guest memory is on or -1. Only
+    /// meaningful after wait_for_memory().
+    int      memory_node();
 
     /// Insert a region into the region list.
     bool insert_region(Region const &r);
@@ -117,11 +120,13 @@ namespace Switch {
       _file_descriptors.erase(it);
     }
 
-    Session(Switch &sw, int fd, sockaddr_un sa) :
-      _sw(sw), _fd(fd), _sa(sa), _regions(),
-      _file_descriptors(),
-      _device(*this)
-    { }
+    Session(Switch &sw, int fd, sockaddr_un sa, bool assign_mac = true) :
+      _sw(sw), _fd(fd), _sa(sa), _epfd(epoll_create1(EPOLL_CLOEXEC)),
+      _regions(), _file_descriptors(), _prefault(),
+      _device(*this, assign_mac)
+    {
+      watch(_fd);
+    }
 
     virtual ~Session();
   };
@@ -0,0 +1,217 @@
+// Copyright (C) 2013, Julian Stecklina <jsteckli@os.inf.tu-dresden.de>
+// Economic rights: Technische Universitaet Dresden (Germany)
+
+// This file is part of sv3.
+
+// sv3 is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License version 2 as
+// published by the Free Software Foundation.
+
+// sv3 is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License version 2 for more details.
+
+// Per-port statistics in shared memory
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <mutex>
+#include <string>
+
+#include <compiler.h>
+#include <util.hh>
+#include <histogram.hh>
+
+namespace Switch {
+
+  /// Counters of a single port. Each counter is only written by a
+  /// single thread (the switch thread, unless noted otherwise), so
+  /// there are no atomics. Readers in other processes may see counters
+  /// that are a little behind. Directions are from the point of view
+  /// of the switch: rx is what the port gave us, tx is what we handed
+  /// to it.
+  struct alignas(64) PortStats {
+    uint64_t rx_packets;
+    uint64_t rx_bytes;
+    uint64_t tx_packets;
+    uint64_t tx_bytes;
+
+    /// Packets from this port that were flooded.
+    uint64_t floods;
+
+    /// Packets for this port we dropped, because it had no buffers
+    /// (e.g. a guest's RX ring was empty for too long) ...
+    uint64_t drops_rx_ring_empty;
+    /// ... because its transmit queue was full ...
+    uint64_t drops_tx_queue_full;
+    /// ... or packets we dropped, because the port misbehaved.
+    uint64_t drops_broken;
+
+    /// Interrupts we sent to the port's guest.
+    uint64_t irqs;
+
+    /// Guest notifications that came through the listener. Written
+    /// by the listener.
+    uint64_t kicks;
+
+    /// Bytes we copied into this port (or had the NIC fetch) and how
+    /// many of them came from a port on another NUMA node.
+    uint64_t copy_bytes;
+    uint64_t remote_copy_bytes;
+
+    /// Latencies in cycles. From polling a packet from this port
+    /// until all destinations have it, ...
+    alignas(64) Histogram poll_to_deliver;
+    /// ... from a guest notification until we poll the port, ...
+    Histogram kick_to_poll;
+    /// ... from putting something into a guest ring until we
+    /// interrupt the guest.
+    Histogram deliver_to_irq;
+  };
+
+  /// Where a switching thread spends its cycles. See charge().
+  enum Stage : unsigned {
+    STAGE_POLL,                 // Polling a packet from a port
+    STAGE_POLL_EMPTY,           // Polling ports that had nothing
+    STAGE_LOOKUP,               // MAC lookup and learning
+    STAGE_COPY,                 // Copying packets into guest buffers
+    STAGE_DELIVER,              // The rest of handing packets to ports
+    STAGE_COMPLETE,             // Returning buffers to the source (vq_flush)
+    STAGE_IRQ,                  // Queueing and sending interrupts
+    STAGE_QUIESCENT,            // rcu_quiescent_state()
+    STAGE_BLOCK,                // Waiting for work
+    STAGE_OTHER,                // Everything else in the main loop
+    STAGES,
+  };
+
+  /// Counters of a thread that switches packets.
+  struct alignas(64) WorkerStats {
+    /// Cycles spent in each Stage.
+    uint64_t cycles[STAGES];
+
+    /// Cycles per work_quantum() that did something.
+    alignas(64) Histogram quantum;
+  };
+
+  struct StageClock {
+    uint64_t *cycles;           // nullptr, if this thread doesn't account
+    uint64_t  last;
+  };
+
+  extern thread_local StageClock stage_clock;
+
+  /// Start or stop accounting cycles of the calling thread to stats.
+  void stage_clock_start(WorkerStats *stats);
+  void stage_clock_stop();
+
+  /// Account the cycles since the last call to stage and return the
+  /// current time. Call this at the end of a stage. Costs a rdtsc
+  /// and an add, so the caller can use the time stamp for other
+  /// measurements instead of reading the clock again.
+  static inline uint64_t charge(Stage stage)
+  {
+    uint64_t    now = rdtsc();
+    StageClock &c   = stage_clock;
+
+    if (LIKELY(c.cycles)) {
+      c.cycles[stage] += now - c.last;
+      c.last           = now;
+    }
+
+    return now;
+  }
+
+  /// A file with a slot of statistics for every port and every
+  /// switching thread. Agents map it and read the counters whenever
+  /// they like. The layout is:
+  ///
+  ///   StatsFile::Header
+  ///   StatsFile::Slot<WorkerStats>[header.workers]
+  ///   StatsFile::Slot<PortStats>[header.slots]
+  ///
+  /// A slot belongs to a port or thread while in_use is set.
+  /// generation changes whenever a slot is taken or given back, so
+  /// readers can tell a new port from an old one with the same slot.
+  ///
+  /// To reset all histograms, increment reset_requests. The switch
+  /// does the rest, because only the writer of a histogram may clear
+  /// it.
+  class StatsFile : Uncopyable {
+  public:
+    enum {
+      MAGIC   = 0x73763373,	// "sv3s"
+      VERSION = 3,
+      SLOTS   = 256,
+      WORKERS = 8,
+    };
+
+    struct alignas(64) Header {
+      uint32_t magic;
+      uint32_t version;
+      uint32_t slots;
+      uint32_t slot_size;
+      uint32_t workers;
+      uint32_t worker_size;
+      uint32_t reset_requests;
+      uint32_t _align;
+      uint64_t cycles_per_second;
+    };
+
+    template <typename T>
+    struct alignas(64) Slot {
+      uint32_t  in_use;
+      uint32_t  generation;
+      char      name[56];
+      T         stats;
+    };
+
+  private:
+    std::string        _path;		// Empty, if the file is anonymous
+    size_t             _size;
+    Header            *_header;
+    Slot<WorkerStats> *_workers;
+    Slot<PortStats>   *_slots;
+    std::mutex         _mtx;
+
+    // reset_requests when we last reset histograms.
+    uint32_t           _resets_seen;
+
+    template <typename T>
+    T   *allocate(Slot<T> *slots, unsigned count, std::string const &name);
+    template <typename T>
+    bool release(Slot<T> *slots, unsigned count, T *stats);
+
+  public:
+
+    /// Stats for a new port or thread. Never fails. If all slots are
+    /// taken, the caller still gets counters, but they are not
+    /// exported.
+    PortStats   *allocate(std::string const &name);
+    void         release(PortStats *stats);
+    WorkerStats *allocate_worker(std::string const &name);
+    void         release(WorkerStats *stats);
+
+    /// Reset histograms, if an agent asked for it. Called by the
+    /// switch thread.
+    void         check_reset()
+    {
+      if (UNLIKELY(__atomic_load_n(&_header->reset_requests, __ATOMIC_RELAXED) != _resets_seen))
+        reset_histograms();
+    }
+
+    void         reset_histograms();
+
+    std::string const &path() const { return _path; }
+
+    /// Create the file at path. Without a path, the stats are only
+    /// visible in our own memory.
+    explicit StatsFile(char const *path = nullptr);
+    ~StatsFile();
+  };
+
+}
+
+// EOF
@@ -16,13 +16,14 @@
 
 #include <urcu-qsbr.h>
 
-#include <list>
 #include <vector>
 #include <map>
 #include <functional>
 #include <mutex>
+#include <condition_variable>
 #include <string>
 #include <atomic>
+#include <memory>
 
 #include <header/ethernet.hh>
 #include <hash/ethernet.hh>
@@ -30,18 +31,75 @@
 
 #include <util.hh>
 #include <packetjob.hh>
+#include <rxfilter.hh>
+#include <irqbatch.hh>
+#include <stats.hh>
 
 namespace Switch {
 
   class Switch;
 
   class Port : Uncopyable {
+    friend class Switch;
+
   protected:
     Switch     &_switch;
     std::string _name;
 
+    /// Identifies the port in traces.
+    int32_t const _id;
+
+    /// If set, the switch stopped polling this port, because the
+    /// destination of its last packet was congested. It polls again
+    /// at _pushback_until (TSC) at the latest. Then the congested port
+    /// becomes _pushback_expired and drops what we send to it, until
+    /// it is not congested anymore. Only accessed by the switch loop.
+    Port       *_pushback;
+    uint64_t    _pushback_until;
+    Port const *_pushback_expired;
+
+    /// Which flooded packets does this port want? Only modified by
+    /// the switch thread, or while the port is not attached.
+    RxFilter    _rx_filter;
+
+    /// An address the switch always forwards to this port, even
+    /// before the port has sent anything. Set before the port is
+    /// enabled and not changed while it is attached.
+    bool              _has_static_mac;
+    Ethernet::Address _static_mac;
+
+    /// The NUMA node this port's packet memory lives on or -1, if
+    /// unknown. Set before the port is enabled.
+    int               _numa_node;
+
+    /// Our counters. They live in the switch's statistics file.
+    PortStats * const _stats;
+
+    /// Account for a copy of bytes from src into this port.
+    void account_copy(Port const *src, size_t bytes)
+    {
+      _stats->copy_bytes += bytes;
+      if (src and src->_numa_node != _numa_node and
+          src->_numa_node >= 0 and _numa_node >= 0)
+        _stats->remote_copy_bytes += bytes;
+    }
+
   public:
     std::string const name() const { return _name; }
+    int32_t           id()   const { return _id; }
+
+    int numa_node() const { return _numa_node; }
+
+    PortStats       &stats()       { return *_stats; }
+    PortStats const &stats() const { return *_stats; }
+
+    /// Check whether the port wants a flooded packet.
+    bool accepts(Ethernet::Header const &hdr, size_t len) const
+    { return _rx_filter.accepts(hdr, len); }
+
+    /// Check whether addr is the static address of this port.
+    bool owns(Ethernet::Address const &addr) const
+    { return _has_static_mac and _static_mac == addr; }
 
     /// Log a message.
     void logf(char const *str, ...) __attribute__((format (printf,2,3)));
@@ -58,10 +116,39 @@ namespace Switch {
     /// switch doesn't need to access packet data anymore.
     virtual void mark_done(Packet::CompletionInfo &p) = 0;
 
-    /// Check whether interrupts are pending and deliver them. Default
-    /// method is empty.
+    /// Called instead of mark_done, if other ports still hold on to
+    /// the packet (see Packet::copy_completion_info). Each of the
+    /// holders calls mark_done, but the packet must only be completed
+    /// after the last one did.
+    virtual void defer_done(Packet::CompletionInfo &p, unsigned holders) = 0;
+
+    /// Returns true, if the port cannot keep up with the packets sent
+    /// to it. The switch stops polling ports that send to a
+    /// congested port, until the congestion is gone.
+    virtual bool congested() { return false; }
+
+    /// When the port wants to be polled (or poll_irq() called), even
+    /// if nothing else happens, e.g. to expire packets it holds. TSC
+    /// value or 0 for never. The switch wakes up for it, when it
+    /// blocks. Default method returns 0.
+    virtual uint64_t deadline() { return 0; }
+
+    /// Check whether interrupts are pending and deliver them. This is
+    /// called once at the end of every switching quantum, so ports
+    /// can also publish work they batched up. Default method is
+    /// empty.
     virtual void poll_irq() { };
 
+    /// Deliver interrupts that poll_irq() held back. Called before
+    /// the switch blocks. Default method is empty.
+    virtual void flush_irq() { };
+
+    /// Complete the packets this port holds on to (see defer_done)
+    /// that come from src, or all of them, if src is null. They are
+    /// dropped. Called by the switch thread, when src or this port
+    /// was detached, while both still exist. Default method is empty.
+    virtual void drop_held(Port const *src) { };
+
     /// Call this after the instance is completely constructed and
     /// ready to receive packets.
     virtual void enable();
@@ -91,10 +178,19 @@ namespace Switch {
       : _port(port), _reason(reason) { }
   };
 
-  class Switch final : protected rcu_head, Uncopyable {
+  class Switch final : Uncopyable {
     friend class Listener;
+  public:
+    enum {
+      // How long a port waits for a congested destination, before
+      // we let the destination drop its packets.
+      PUSHBACK_US = 1000,
+    };
+
   protected:
-    typedef std::list<Port *> PortsList;
+    /// A flat array, so the switch loop walks ports without chasing
+    /// pointers.
+    typedef std::vector<Port *> PortsList;
 
     /// The event fd the switch main loop uses to block, when idle.
     int              _event_fd;
@@ -105,24 +201,47 @@ namespace Switch {
     /// How many packets to switch from a single port in one batch.
     const unsigned   _batch_size;
 
+    /// PUSHBACK_US in TSC cycles.
+    const uint64_t   _pushback_cycles;
+
     // Signal handling
     std::atomic<bool> _shutdown_called;
 
-    // RCU
-    std::vector<std::function<void()>> _pending_free;
-    std::mutex                         _pending_free_mtx;
-
-    static void         cb_free_pending(struct rcu_head *);
-    void                free_pending(); // called via RCU
-
+    // Published via RCU.
     SwitchHash      *_mac_table;
     PortsList const *_ports;
 
-    // Serializes access to _ports and _mac_table
-    std::mutex       _ports_mtx;
-
-    // Modify the list of ports.
-    void modify_ports(std::function<void(PortsList &)> f);
+    /// Changes to the set of ports are queued and applied in
+    /// batches. A batch costs one copy of the port array, one new MAC
+    /// table and one grace period, no matter how many ports come and
+    /// go in it. _ports_mtx protects everything below and serializes
+    /// writers of _ports and _mac_table.
+    std::mutex              _ports_mtx;
+    std::condition_variable _ports_cv;
+    std::vector<std::function<void(PortsList &)>> _port_changes;
+    uint64_t                _ports_published; // Batches applied
+    uint64_t                _ports_synced;    // Batches nobody sees the old ports of
+    bool                    _ports_leader;    // Somebody waits for a grace period
+    uint64_t                _ports_released;  // Batches the switch thread dropped packets for
+    bool                    _looping;         // Is the switch thread in loop()?
+
+    /// The batch _ports comes from. Read by the switch thread before
+    /// it reads _ports.
+    std::atomic<uint64_t>   _ports_version;
+
+    /// Apply all queued changes.
+    void publish_ports();
+
+    /// Change the set of ports. If wait is set, this returns when the
+    /// switch loop doesn't use the old set anymore. The switch thread
+    /// itself must not wait. Other RCU readers are offline while they
+    /// wait. Returns the batch that has the change.
+    uint64_t modify_ports(std::function<void(PortsList &)> f, bool wait = true);
+
+    /// Ports that are in old, but not in ports, were detached. Other
+    /// ports must not hold on to their packets and vice versa. Called
+    /// by the switch thread, when it first sees ports.
+    void release_ports(PortsList const &old, PortsList const &ports);
 
     /// DMA region management
 
@@ -135,6 +254,9 @@ namespace Switch {
     dma_memory_callback                        _dma_cb;
     std::map<Port *, std::vector<dma_region> > _dma_regions;
 
+    // Sessions announce memory from several listener threads.
+    std::mutex                                 _dma_mtx;
+
       // Work loop.
 
 
@@ -142,6 +264,54 @@ namespace Switch {
 		      SwitchHash      &mac_cache,
 		      bool             enabled_notifications);
 
+    /// Check whether a port still has to wait for the port it pushes
+    /// packets to.
+    bool pushed_back(PortsList const &ports, Port &src_port);
+
+    /// The earliest time the switch must look at ports, even if
+    /// nobody wakes it up (TSC) or 0. See Port::deadline.
+    uint64_t deadline(PortsList const &ports);
+
+    /// Wait for a wakeup or until deadline, if it is not 0. Returns
+    /// false, if the event fd is broken.
+    bool block(uint64_t deadline);
+
+    /// Completions of packets that were held by ports that went away.
+    /// These are executed by the switch thread.
+    std::vector<Packet::CompletionInfo> _orphans;
+    std::mutex                          _orphans_mtx;
+    std::atomic<bool>                   _have_orphans;
+
+    void complete_orphans(PortsList const &ports);
+
+    /// Find the port that has dst as its static address and put it
+    /// back into the MAC cache. Called when the cache misses.
+    Port *static_lookup(PortsList const &ports, SwitchHash &mac_cache,
+                        Ethernet::Address const &dst);
+
+    /// Pool of addresses handed out to guests. The pool is empty
+    /// unless configure_mac_pool is called.
+    uint64_t          _mac_pool_first;
+    std::vector<bool> _mac_pool_used;
+    std::mutex        _mac_pool_mtx;
+
+    /// Where ports keep their counters.
+    std::unique_ptr<StatsFile> _stats_file;
+
+    /// Counters of the thread in loop().
+    WorkerStats     *_worker_stats;
+
+    /// Interrupts ports raise during a quantum. Submitted at its end.
+    IrqBatch         _irq_batch;
+
+    /// The NUMA node most ports are on, or -1. The switch thread moves
+    /// there, when this changes.
+    std::atomic<int> _preferred_node;
+
+    /// Upper bounds for interrupt coalescing of guest ports.
+    unsigned         _coal_max_us;
+    unsigned         _coal_max_packets;
+
     /// Has the shutdown been initiated?
     /// XXX Can we get by with mo_relaxed here?
     bool should_shutdown()
@@ -153,19 +323,46 @@ namespace Switch {
     /// outside of the switch process.
     int event_fd() const { return _event_fd; }
 
-    std::list<Port *> const &ports() const { return *_ports; }
+    std::vector<Port *> const &ports() const { return *_ports; }
 
     void logf(char const *, ...) __attribute__((format (printf,2,3)));
 
     void loop();
     void attach_port(Port &p);
-    void detach_port(Port &p);
+
+    /// Stop switching for p. If wait is set, returns when the switch
+    /// loop doesn't use p anymore and no other port holds packets
+    /// from p (see Port::drop_held).
+    void detach_port(Port &p, bool wait = true);
 
     /// This function can be called from any thread or from signal
     /// context to shut the switch down. It will exit from its loop()
     /// method, if that is currently executing.
     void shutdown();
 
+    /// Deliver an interrupt by writing to an eventfd. Only called
+    /// from the switch thread, usually in poll_irq(). The write
+    /// happens at the end of the current quantum.
+    void trigger_irq(int fd) { _irq_batch.trigger(fd); }
+
+    /// Allow ports to delay interrupts by up to max_us microseconds or
+    /// max_packets packets. Ports scale this down when the load is
+    /// low. Call before ports are created.
+    void configure_irq_coalescing(unsigned max_us, unsigned max_packets)
+    { _coal_max_us = max_us; _coal_max_packets = max_packets; }
+
+    unsigned irq_coalescing_us()      const { return _coal_max_us; }
+    unsigned irq_coalescing_packets() const { return _coal_max_packets; }
+
+    /// Export port statistics in a file at path. Call before ports
+    /// are created.
+    void configure_stats(char const *path);
+
+    /// Counters for a new port and back. Can be called from any
+    /// thread.
+    PortStats *allocate_stats(std::string const &name) { return _stats_file->allocate(name); }
+    void       release_stats(PortStats *stats)         { _stats_file->release(stats); }
+
     /// Wake up the polling thread and have it poll all ports.
     void schedule_poll();
 
@@ -181,6 +378,22 @@ namespace Switch {
     /// Remove all DMA memory regions added by the given port.
     void remove_dma_memory(Port &port);
 
+    /// Hand a packet a port still holds to the switch thread, which
+    /// will complete it. Used when ports are destroyed. Can be called
+    /// from any thread.
+    void complete_orphan(Packet::CompletionInfo const &c);
+
+    /// Hand out count addresses starting at first to ports that ask
+    /// for one. Call before ports are created.
+    void configure_mac_pool(Ethernet::Address const &first, unsigned count);
+
+    /// Take an address from the pool. Returns false, if the pool is
+    /// exhausted. Can be called from any thread.
+    bool allocate_mac(Ethernet::Address &addr);
+
+    /// Return an address to the pool.
+    void release_mac(Ethernet::Address const &addr);
+
     explicit Switch(unsigned poll_us, unsigned batch_size);
     ~Switch();
 
@@ -42,10 +42,19 @@ namespace Switch {
       return now > _end_time;
     }
 
+    /// Change the period. Takes effect the next time the timer is
+    /// armed.
+    void set_period(unsigned periods, unsigned frequency)
+    {
+      _period_cycles = (double(cycles_per_second()) * periods) / frequency;
+    }
+
     Timer(unsigned periods, unsigned frequency)
       : _period_cycles((double(cycles_per_second()) * periods) / frequency),
         _end_time(0)
     {}
+
+    Timer() : _period_cycles(0), _end_time(0) {}
   };
 
 }
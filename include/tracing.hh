@@ -12,14 +12,22 @@
 // MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
 // General Public License version 2 for more details.
 
+// Event tracing. Each thread writes into its own ring in a trace
+// file. Tracing is off by default and can be switched on and off
+// while we run (see trace_toggle()). When it is off, trace() costs a
+// load and a predicted branch.
+
 #pragma once
 
 #include <cstdint>
+#include <atomic>
+
+#include <compiler.h>
 #include <util.hh>
 
 namespace Switch {
 
-  enum {
+  enum TraceEvent : uint16_t {
     BLOCK,
     WAKEUP,
     PACKET_RX,
@@ -27,46 +35,70 @@ namespace Switch {
     WENT_IDLE,
     IRQ,
     QUIESCENT,
+    LOOKUP,                     // arg is the destination port or -1
+    FLOOD,
+    COPY_START,
+    COPY_END,
+    COMPLETION,                 // arg is the number of holders
   };
 
-#ifdef TRACING
-
-  extern char   *trace_buffer;
-  extern size_t  trace_offset;
-
-  enum { TRACE_SIZE = 1024*1024*16 };
-
-  struct trace_entry {
+  struct TraceEntry {
     uint64_t time;
-    uint8_t  event;
-    uint8_t  port;
-    uint16_t length;
+    uint16_t event;
+    uint16_t _align;
+    int32_t  port;              // Port::id() or -1
+    uint32_t length;
+    uint32_t _align2;
+    uint64_t arg;
+  };
 
+  /// The trace file is a TraceHeader followed by rings of
+  /// TraceRing plus ring_entries TraceEntry each.
+  struct alignas(64) TraceHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t rings;
+    uint32_t ring_entries;
+    uint32_t entry_size;
     uint32_t _align;
+    uint64_t cycles_per_second;
   };
 
-  static inline void
-  trace(uint8_t event, uint8_t port = 0, uint16_t length = 0,
-        uint64_t now = rdtsc())
-  {
-    trace_entry *e = reinterpret_cast<trace_entry *>(trace_buffer + trace_offset);
+  struct alignas(64) TraceRing {
+    uint32_t tid;               // 0, if the ring is unused
+    uint32_t _align;
+    uint64_t written;           // Entries ever written
+  };
+
+  enum {
+    TRACE_MAGIC        = 0x73763374, // "sv3t"
+    TRACE_VERSION      = 2,
+    TRACE_RINGS        = 16,
+    TRACE_RING_ENTRIES = 1 << 19,    // 16 MiB per thread
+  };
 
-    e->time   = now;
-    e->event  = event;
-    e->port   = port;
-    e->length = length;
-    e->_align = 0;
+  extern std::atomic<bool> trace_enabled;
 
-    trace_offset = (trace_offset + sizeof(trace_entry)) % TRACE_SIZE;
-  }
+  void trace_slow(TraceEvent event, int32_t port, uint32_t length,
+                  uint64_t arg, uint64_t now);
 
-#else
+  /// Record an event, if tracing is on. If now is 0, we read the time
+  /// stamp counter ourselves.
   static inline void
-  trace(uint8_t event, uint8_t port = 0, uint16_t length = 0,
-        uint64_t now = 0)
+  trace(TraceEvent event, int32_t port = -1, uint32_t length = 0,
+        uint64_t arg = 0, uint64_t now = 0)
   {
+    if (LIKELY(not trace_enabled.load(std::memory_order_relaxed))) return;
+    trace_slow(event, port, length, arg, now);
   }
-#endif
+
+  /// Create the trace file. Without this, tracing cannot be switched
+  /// on. If keep is false, the file is removed in trace_close().
+  void trace_open(char const *path, bool keep);
+  void trace_close();
+
+  /// Switch tracing on or off. Can be called from signal handlers.
+  void trace_toggle();
 
 }
 
@@ -0,0 +1,147 @@
+// Copyright (C) 2013, Julian Stecklina <jsteckli@os.inf.tu-dresden.de>
+// Economic rights: Technische Universitaet Dresden (Germany)
+
+// This file is part of sv3.
+
+// sv3 is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License version 2 as
+// published by the Free Software Foundation.
+
+// sv3 is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License version 2 for more details.
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <switch.hh>
+#include <histogram.hh>
+
+namespace Switch {
+
+  /// An upstream port that generates traffic instead of talking to a
+  /// NIC. It sends UDP/IPv4 frames at a given rate, cycling through
+  /// frame sizes and flows, and counts what comes back. Each frame
+  /// carries a time stamp behind its UDP (or TCP) header, so frames
+  /// that guests reflect back to us tell us latency and loss. Once a
+  /// second, the port logs what it has seen.
+  class TrafficGenerator : public Port {
+  public:
+    struct Config {
+      /// Frames per second. 0 is as fast as the switch polls us.
+      uint64_t              rate;
+
+      /// Frame lengths (without FCS) in the order we send them. Use
+      /// a length several times to weight it.
+      std::vector<unsigned> sizes;
+
+      /// Number of source MAC addresses, destination IP addresses and
+      /// flows (UDP source ports). Flow i uses MAC i % macs and IP i
+      /// % ips.
+      unsigned              macs;
+      unsigned              ips;
+      unsigned              flows;
+
+      /// Where frames go. Broadcast by default.
+      Ethernet::Address     dst;
+
+      /// Frames longer than MAX_FRAME are sent as TCP with TSO and
+      /// this segment size. 0 disallows them.
+      unsigned              mss;
+
+      Config() : rate(0), sizes({ 60 }), macs(1), ips(1), flows(1),
+                 dst(0xff, 0xff, 0xff, 0xff, 0xff, 0xff), mss(0) { }
+    };
+
+    enum {
+      MAX_FRAME     = 1514,
+      MAX_TSO_FRAME = 65000,
+    };
+
+  private:
+    /// What we put behind the L4 header. Small enough for minimum
+    /// sized UDP frames.
+    struct PACKED Stamp {
+      uint32_t magic;           // STAMP_MAGIC + Port::id() of the sender
+      uint32_t seq;
+      uint64_t sent;            // TSC
+    };
+
+    enum : uint32_t {
+      STAMP_MAGIC = 0x67337673, // "sv3g"
+      BUFFERS     = 1024,
+      // When we were not polled for a while, we only catch up this
+      // many frames.
+      BURST       = 32,
+    };
+
+    Config const          _config;
+
+    // Frame buffers. Each starts with a virtio header.
+    uint8_t              *_buffers;
+    size_t                _buffer_size;
+    std::vector<uint32_t> _free;
+    std::vector<uint16_t> _holders; // See defer_done
+
+    unsigned              _size_idx;
+    unsigned              _flow_idx;
+    uint32_t              _seq;
+
+    // Rate limiting in TSC cycles
+    uint64_t              _interval;
+    std::atomic<uint64_t> _next;
+
+    // Sink
+    struct Counters {
+      uint64_t tx_packets;
+      uint64_t tx_bytes;
+      uint64_t rx_packets;      // Frames with our time stamp
+      uint64_t rx_bytes;
+      uint64_t rx_other;        // Frames without
+      uint64_t reordered;
+    };
+
+    Counters              _counters;
+    Counters              _reported;
+    uint32_t              _last_seq;
+    Histogram             _latency;
+    uint64_t              _report_cycles;
+    uint64_t              _last_report;
+
+    // Wakes up the switch, when the next frame is due and the switch
+    // blocks.
+    std::mutex              _wakeup_mtx;
+    std::condition_variable _wakeup_cv;
+    bool                    _wakeup_armed;
+    bool                    _stop;
+    std::thread             _wakeup_thread;
+
+    uint8_t *buffer(unsigned idx) { return _buffers + size_t(idx) * _buffer_size; }
+
+    /// Build the next frame in buffer idx. Returns its length
+    /// including the virtio header.
+    unsigned build_frame(unsigned idx, uint64_t now);
+
+    void arm_wakeup();
+    void wakeup_thread_fn();
+    void report(uint64_t now, bool final = false);
+
+  public:
+    void receive(Packet &p) override;
+    bool poll(Packet &p, bool enable_notifications) override;
+    void mark_done(Packet::CompletionInfo &c) override;
+    void defer_done(Packet::CompletionInfo &c, unsigned holders) override;
+
+    TrafficGenerator(Switch &sw, std::string name, Config const &config);
+    ~TrafficGenerator();
+  };
+
+}
+
+// EOF
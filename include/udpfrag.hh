@@ -0,0 +1,103 @@
+// Copyright (C) 2013, Julian Stecklina <jsteckli@os.inf.tu-dresden.de>
+// Economic rights: Technische Universitaet Dresden (Germany)
+
+// This file is part of sv3.
+
+// sv3 is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License version 2 as
+// published by the Free Software Foundation.
+
+// sv3 is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License version 2 for more details.
+
+// Software fallback for UDP fragmentation offload (UFO)
+
+#pragma once
+
+#include <packetjob.hh>
+#include <header/ethernet.hh>
+#include <header/ipv4.hh>
+
+namespace Switch {
+
+  /// Does the packet carry a UDP datagram that the receiver has to
+  /// fragment (VIRTIO_NET_HDR_GSO_UDP)?
+  static inline bool is_ufo(Packet const &p)
+  {
+    virtio_net_hdr const *hdr = reinterpret_cast<virtio_net_hdr const *>(p.fragment[0]);
+    return (hdr->gso_type & ~VIRTIO_NET_HDR_GSO_ECN) == VIRTIO_NET_HDR_GSO_UDP;
+  }
+
+  /// Splits a UFO packet into IPv4 fragments of at most gso_size
+  /// bytes of IP payload. Fragments point into the payload of the
+  /// original packet. Only their headers (virtio, Ethernet, IPv4 and
+  /// the UDP header in the first fragment) live in a buffer of their
+  /// own, which next() overwrites.
+  ///
+  /// The UDP checksum is completed in software, because it covers
+  /// the whole datagram. The original packet is never modified, so
+  /// it can be fragmented for several receivers.
+  class UdpFragmenter {
+  public:
+    enum {
+      // virtio + Ethernet + IPv4 with options + UDP
+      MAX_HEADER = sizeof(virtio_net_hdr_mrg_rxbuf) + sizeof(Ethernet::Header) + 60 + 8,
+    };
+
+  private:
+    Packet const &_src;
+    bool          _valid;
+
+    uint8_t       _hdr[MAX_HEADER];
+    unsigned      _ip_hlen;
+    uint8_t       _udp[8];
+
+    unsigned      _frag_size;	// IP payload per fragment, multiple of 8
+    unsigned      _total;	// IP payload of the datagram
+    unsigned      _offset;	// IP payload already handed out
+
+    // Position of the next payload byte in _src.
+    unsigned      _src_i;
+    unsigned      _src_off;
+
+    // Find the fragment and offset of a byte in the Ethernet frame.
+    void seek(unsigned frame_offset, unsigned &i, unsigned &off) const;
+
+  public:
+
+    /// False, if we don't know how to fragment this packet (not IPv4,
+    /// headers not contiguous, ...).
+    bool valid() const { return _valid; }
+
+    /// Upper bound for the bytes all fragments of p take, including
+    /// their virtio headers.
+    static uint32_t fragmented_length(Packet const &p);
+
+    /// How many fragments next() still hands out.
+    unsigned fragments() const
+    {
+      return _valid ? (_total - _offset + _frag_size - 1) / _frag_size : 0;
+    }
+
+    /// Upper bound for the buffers (Packet::fragment entries) these
+    /// fragments take together. Each has its header and each boundary
+    /// between two fragments splits at most one source buffer.
+    unsigned buffers() const
+    {
+      unsigned n = fragments();
+      return n ? 2 * n - 1 + (_src.fragments - _src_i) : 0;
+    }
+
+    /// Populate frag with the next fragment. If hdr_buf is given, the
+    /// headers are put there (MAX_HEADER bytes) instead of into our
+    /// own buffer. Returns false, when there are no fragments left.
+    bool next(Packet &frag, uint8_t *hdr_buf = nullptr);
+
+    explicit UdpFragmenter(Packet const &src);
+  };
+
+}
+
+// EOF
@@ -47,7 +47,28 @@ namespace Switch {
     VfioGroup(std::string groupdev);
   };
 
-  class VfioDevice {
+  /// What a driver needs from a PCI device. VfioDevice talks to
+  /// real hardware. Device models implement it in software, so
+  /// drivers can run without the hardware.
+  class PciDevice {
+  public:
+
+    typedef std::vector<unsigned> irq_list;
+
+    virtual void     map_memory_to_device(void *m, size_t len, bool read, bool write) = 0;
+    virtual void    *map_bar(int bar, size_t *size) = 0;
+    virtual void     set_irq_eventfd(unsigned idx, unsigned start, int event_fd) = 0;
+    virtual uint32_t read_config(int reg, int width) = 0;
+    virtual void     write_config(int reg, uint32_t val, int width) = 0;
+
+    /// Returns a list of all currently active IRQs. Only useful after
+    /// actually configuring IRQs.
+    virtual irq_list irqs() = 0;
+
+    virtual ~PciDevice() { }
+  };
+
+  class VfioDevice : public PciDevice {
     friend class VfioGroup;
 
     VfioGroup   _group;
@@ -59,17 +80,12 @@ namespace Switch {
 
   public:
 
-    typedef std::vector<unsigned> irq_list;
-
-    void     map_memory_to_device(void *m, size_t len, bool read, bool write);
-    void    *map_bar(int bar, size_t *size);
-    void     set_irq_eventfd(unsigned idx, unsigned start, int event_fd);
-    uint32_t read_config(int reg, int width);
-    void     write_config(int reg, uint32_t val, int width);
-
-    /// Returns a list of all currently active IRQs. Only useful after
-    /// actually configuring IRQs.
-    irq_list irqs();
+    void     map_memory_to_device(void *m, size_t len, bool read, bool write) override;
+    void    *map_bar(int bar, size_t *size) override;
+    void     set_irq_eventfd(unsigned idx, unsigned start, int event_fd) override;
+    uint32_t read_config(int reg, int width) override;
+    void     write_config(int reg, uint32_t val, int width) override;
+    irq_list irqs() override;
 
     VfioDevice(VfioGroup group, std::string device_id, int fd);
   };
@@ -0,0 +1,158 @@
+// Copyright (C) 2013, Julian Stecklina <jsteckli@os.inf.tu-dresden.de>
+// Economic rights: Technische Universitaet Dresden (Germany)
+
+// This file is part of sv3.
+
+// sv3 is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License version 2 as
+// published by the Free Software Foundation.
+
+// sv3 is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License version 2 for more details.
+
+// vhost-user backend for unmodified qemu
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <session.hh>
+
+namespace Switch {
+
+  // Protocol definitions. See docs/interop/vhost-user.rst in the qemu
+  // source.
+
+  enum VhostUserRequest : uint32_t {
+    VHOST_USER_GET_FEATURES          = 1,
+    VHOST_USER_SET_FEATURES          = 2,
+    VHOST_USER_SET_OWNER             = 3,
+    VHOST_USER_RESET_OWNER           = 4,
+    VHOST_USER_SET_MEM_TABLE         = 5,
+    VHOST_USER_SET_LOG_BASE          = 6,
+    VHOST_USER_SET_LOG_FD            = 7,
+    VHOST_USER_SET_VRING_NUM         = 8,
+    VHOST_USER_SET_VRING_ADDR        = 9,
+    VHOST_USER_SET_VRING_BASE        = 10,
+    VHOST_USER_GET_VRING_BASE        = 11,
+    VHOST_USER_SET_VRING_KICK        = 12,
+    VHOST_USER_SET_VRING_CALL        = 13,
+    VHOST_USER_SET_VRING_ERR         = 14,
+  };
+
+  enum {
+    VHOST_USER_VERSION          = 0x1,
+    VHOST_USER_VERSION_MASK     = 0x3,
+    VHOST_USER_REPLY            = 0x4,
+
+    VHOST_USER_MAX_REGIONS      = 8,
+
+    // SET_VRING_KICK/CALL/ERR payload
+    VHOST_USER_VRING_IDX_MASK   = 0xFF,
+    VHOST_USER_VRING_NOFD       = 0x100,
+  };
+
+  struct VhostUserVringState {
+    uint32_t index;
+    uint32_t num;
+  };
+
+  struct VhostUserVringAddr {
+    uint32_t index;
+    uint32_t flags;
+    uint64_t desc_user_addr;
+    uint64_t used_user_addr;
+    uint64_t avail_user_addr;
+    uint64_t log_guest_addr;
+  };
+
+  struct VhostUserMemoryRegion {
+    uint64_t guest_phys_addr;
+    uint64_t memory_size;
+    uint64_t userspace_addr;
+    uint64_t mmap_offset;
+  };
+
+  struct VhostUserMemory {
+    uint32_t              nregions;
+    uint32_t              padding;
+    VhostUserMemoryRegion regions[VHOST_USER_MAX_REGIONS];
+  };
+
+  struct VhostUserMsg {
+    uint32_t request;
+    uint32_t flags;
+    uint32_t size;		// of the payload
+
+    union {
+      uint64_t            u64;
+      VhostUserVringState state;
+      VhostUserVringAddr  addr;
+      VhostUserMemory     memory;
+    };
+  } __attribute__((packed));
+
+  enum {
+    VHOST_USER_HDR_SIZE = offsetof(VhostUserMsg, u64),
+  };
+
+  /// A guest attached via vhost-user. The frontend (qemu) shares
+  /// guest memory and the rings with us, we drive them with the same
+  /// VirtioDevice that serves externalpci guests.
+  ///
+  /// Guest kicks arrive on eventfds that qemu hands us. The listener
+  /// waits for them along with the socket and forwards them to the
+  /// switch.
+  class VhostUserSession : public Session {
+
+    struct Vring {
+      unsigned           num;
+      uint16_t           base;
+      VhostUserVringAddr addr;
+      bool               have_addr;
+      bool               started;
+      int                kick_fd;	// -1, if none
+    } _vring[VirtioDevice::VHOST_QUEUES];
+
+    /// Guest memory as qemu sees it. Ring addresses are in qemu's
+    /// address space, descriptors contain guest-physical addresses.
+    /// Mappings are owned by _regions.
+    std::vector<Region> _user_regions;
+
+    uint8_t *translate_user(uint64_t addr, size_t size) const;
+
+    /// Receive a message and the file descriptors that come with
+    /// it. Returns false, if the connection is broken.
+    bool     receive(VhostUserMsg &msg, int *fds, unsigned &nfds);
+    bool     reply(VhostUserMsg &msg, uint32_t size);
+
+    /// Handle a single message. File descriptors we keep are replaced
+    /// by -1 in fds, the caller closes the rest.
+    bool     handle_message(VhostUserMsg &msg, int *fds, unsigned nfds);
+    bool     set_mem_table(VhostUserMemory const &mem, int *fds, unsigned nfds);
+
+    /// Start the ring, once we know everything about it.
+    bool     start_vring(unsigned idx);
+    void     stop_vring(unsigned idx);
+    void     set_kick(unsigned idx, int fd);
+    void     set_call(unsigned idx, int fd);
+
+    /// Undo everything the frontend has configured.
+    void     reset_owner();
+
+  public:
+
+    virtual bool handle(int fd) override;
+    virtual bool poll()         override;
+
+    VhostUserSession(Switch &sw, int fd, sockaddr_un sa);
+    virtual ~VhostUserSession();
+  };
+
+}
+
+// EOF
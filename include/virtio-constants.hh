@@ -35,6 +35,10 @@ enum {
 /* Config space size */
 #define VIRTIO_PCI_CONFIG_MSI 24
 
+/* The config space comes after the MSI-X registers, which are only
+ * there, if MSI-X is enabled. */
+#define VIRTIO_PCI_CONFIG_OFF(msix_enabled) ((msix_enabled) ? VIRTIO_PCI_CONFIG_MSI : 20)
+
 /* PCI I/O BAR layout. From Linux's linux/virtio_pci.h */
 
 /* A 32-bit r/o bitmask of the features supported by the host */
@@ -133,6 +137,9 @@ enum {
  * callbacks */
 #define VIRTIO_F_NOTIFY_ON_EMPTY        24
 
+/* Can the device handle any descriptor layout? */
+#define VIRTIO_F_ANY_LAYOUT             27
+
 /* The Guest publishes the used index for which it expects an interrupt
  * at the end of the avail ring. Host should ignore the avail->flags field. */
 /* The Host publishes the avail index for which it expects a kick
@@ -142,6 +149,10 @@ enum {
 /* A guest should never accept this.  It implies negotiation is broken. */
 #define VIRTIO_F_BAD_FEATURE            30
 
+/* Modern virtio. Only negotiable over transports with 64 feature bits,
+ * i.e. vhost-user for us. */
+#define VIRTIO_F_VERSION_1              32
+
 /* This marks a buffer as continuing via the next field. */
 #define VRING_DESC_F_NEXT       1
 /* This marks a buffer as write-only (otherwise read-only). */
@@ -283,4 +294,18 @@ struct virtio_net_ctrl_mq {
  #define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MIN        1
  #define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MAX        0x8000
 
+/*
+ * Notification coalescing (VIRTIO_NET_F_NOTF_COAL). The device sends
+ * an interrupt when max_packets buffers have been used or usecs have
+ * passed since the first one, whatever comes first.
+ */
+struct virtio_net_ctrl_coal {
+    uint32_t max_packets;
+    uint32_t usecs;
+};
+
+#define VIRTIO_NET_CTRL_NOTF_COAL 6
+ #define VIRTIO_NET_CTRL_NOTF_COAL_TX_SET       0
+ #define VIRTIO_NET_CTRL_NOTF_COAL_RX_SET       1
+
 /* EOF */
@@ -18,13 +18,14 @@
 #include <string>
 
 #include <externaldevice.hh>
+#include <regionlist.hh>
 #include <switch.hh>
+#include <udpfrag.hh>
+#include <timer.hh>
 #include <virtio-constants.hh>
 
 namespace Switch {
 
-  struct Region;
-
   enum {
     INVALID_DESC_ID = ~0U,
   };
@@ -59,8 +60,9 @@ namespace Switch {
 
   struct VRing
   {
-    // num is always equal QUEUE_ELEMENTS
-    // unsigned int num;
+    // A power of two, at most QUEUE_ELEMENTS. Legacy PCI guests
+    // always use QUEUE_ELEMENTS, vhost-user frontends pick their own.
+    unsigned int num;
 
     VRingDesc  *desc;
     VRingAvail *avail;
@@ -76,8 +78,24 @@ namespace Switch {
     int inuse;
     uint16_t vector;
 
+    // Entries that were filled into the used ring, but are not yet
+    // visible to the guest, because used->idx was not advanced.
+    uint16_t unpublished;
+
     // An entry was added to the used list and IRQs were enabled.
     bool pending_irq;
+
+    // When pending_irq was set (TSC).
+    uint64_t pending_since;
+
+    // Used entries since the last interrupt and since the last time
+    // we adapted interrupt coalescing.
+    uint32_t unsignalled;
+    uint32_t used;
+
+    // The guest memory region we translated the last descriptor
+    // through.
+    Region   last_region;
   };
 
 
@@ -88,6 +106,25 @@ namespace Switch {
       MSIX_VECTORS = 3,
       VIRT_QUEUES  = 3,
       QUEUE_ELEMENTS = 1024,
+
+      // How many RX descriptor chains we take from the guest in one go.
+      RX_STASH_CHAINS = 64,
+
+      // Limits for packets we hold back, because the guest has no RX
+      // buffers. When we are above BACKLOG_BYTES, we push back on the
+      // sender. Packets are dropped, if the guest does not give us RX
+      // buffers for BACKLOG_US or if the backlog overflows anyway
+      // (e.g. due to broadcasts).
+      BACKLOG_PACKETS = 64,
+      BACKLOG_BYTES   = 256 << 10,
+      BACKLOG_US      = 2000,
+
+      // Interrupt coalescing adapts to the packet rate measured over
+      // COAL_ADAPT_US. It is off below COAL_LOW_PPS and at its limits
+      // from COAL_HIGH_PPS on.
+      COAL_ADAPT_US   = 1000,
+      COAL_LOW_PPS    = 20000,
+      COAL_HIGH_PPS   = 800000,
     };
 
     int _irq_fd[MSIX_VECTORS];
@@ -95,6 +132,12 @@ namespace Switch {
     /* virtio */
     bool                 online; // Are we attached to the switch?
 
+    // Does the guest use MSI-X? We cannot see the enable bit in PCI
+    // configuration space. Drivers program the configuration vector
+    // right after they enable MSI-X and clear it before they disable
+    // it, so we follow that.
+    bool                 msix_enabled;
+
     uint8_t              status;
     std::atomic<uint8_t> isr;
     uint16_t             queue_sel;
@@ -105,14 +148,97 @@ namespace Switch {
 
     VirtQueue  vq[VIRT_QUEUES];
 
+    /// An RX descriptor chain that we already popped from the avail
+    /// ring and translated into host pointers.
+    struct RxChain {
+      unsigned  head;
+      uint32_t  length;
+      unsigned  fragments;
+      uint8_t  *fragment[Packet::MAX_FRAGMENTS];
+      uint32_t  fragment_length[Packet::MAX_FRAGMENTS];
+    };
+
+    /// RX chains private to the switch thread. Chains in here count
+    /// as in use by the device. We refill this in bulk when it runs
+    /// empty to avoid touching avail->idx for every packet.
+    struct {
+      unsigned first;
+      unsigned count;
+      uint32_t bytes;		// Sum of all chain lengths
+      RxChain  chain[RX_STASH_CHAINS];
+    } _rx_stash;
+
+    /// Packets we hold on to, until the guest gives us RX buffers. We
+    /// hold them like any port that doesn't copy immediately: via
+    /// Packet::copy_completion_info.
+    struct {
+      unsigned first;
+      unsigned count;
+      uint32_t bytes;
+      Packet   packet[BACKLOG_PACKETS];
+      uint64_t deadline[BACKLOG_PACKETS];
+    } _backlog;
+
+    uint64_t _backlog_cycles;
+
+    /// When the guest kicked us last and we have not polled since
+    /// (TSC). Zero, if there is no such kick. Written by the listener
+    /// thread.
+    std::atomic<uint64_t> _kick_time;
+
+    /// Interrupt coalescing for the RX and TX queue. An interrupt is
+    /// held back until max_packets entries were used or max_usecs
+    /// passed since the first one. Unless the guest configured the
+    /// queue itself, we follow the packet rate within the limits the
+    /// switch was given.
+    struct IrqCoalescing {
+      unsigned max_usecs;
+      unsigned max_packets;
+      bool     adaptive;
+      bool     armed;		// Are we holding back an interrupt?
+      Timer    timer;
+    } _coal[2];
+
+    Timer _coal_adapt_timer;
+
+    IrqCoalescing &rx_coal() { return _coal[0]; }
+    IrqCoalescing &tx_coal() { return _coal[1]; }
+
+    void coal_set(IrqCoalescing &coal, unsigned usecs, unsigned packets);
+    void coal_reset();
+    void coal_adapt(IrqCoalescing &coal, VirtQueue &vq);
+
+    /// How many ports hold on to a TX chain. See defer_done.
+    uint16_t _tx_holders[QUEUE_ELEMENTS];
+
+    /// Bumped, when we give up on TX chains other ports hold (see
+    /// tx_drain). Their completions are ignored, when they come.
+    unsigned _tx_generation;
+
+    // Virtio headers of TX packets, where the guest split the header
+    // over several buffers. Indexed by descriptor head.
+    virtio_net_hdr_mrg_rxbuf _tx_hdr[QUEUE_ELEMENTS];
+
+    // Copy a fragmented virtio header into _tx_hdr and make it
+    // fragment 0 of p.
+    void tx_gather_header(Packet &p);
+
     VirtQueue &rx_vq()   { return vq[0]; }
     VirtQueue &tx_vq()   { return vq[1]; }
     VirtQueue &ctrl_vq() { return vq[2]; }
 
+    /// Apply the features the guest acked, as far as we offered
+    /// them.
+    void     set_guest_features(uint32_t features);
+
+    /// Attach to the switch, once RX and TX queue are set up, and
+    /// detach, when one of them goes away.
+    void     update_online();
+
     void     vq_set_addr (VirtQueue &vq,   uint64_t addr);
     int      vq_num_heads(VirtQueue &vq,   unsigned idx);
     unsigned vq_get_head (VirtQueue &vq,   unsigned idx);
-    unsigned vq_next_desc(VRingDesc *desc);
+    unsigned vq_next_desc(VirtQueue &vq, VRingDesc *desc);
 
     /// Pop a set of descriptors. If last_desc is set, it will be set
     /// to the last descriptor in the chain that was popped. If
@@ -120,6 +246,11 @@ namespace Switch {
     /// descriptor that is popped.
     template <typename T>
     int      vq_pop_generic(VirtQueue &vq, bool writeable_bufs, T closure);
+
+    /// Like vq_pop_generic, but the caller has already checked that
+    /// there is at least one chain available.
+    template <typename T>
+    unsigned vq_pop_available(VirtQueue &vq, bool writeable_bufs, T closure);
     int      vq_pop      (VirtQueue &vq, Packet &elem, bool writeable_bufs);
 
     /// Fill a single entry in the used ring. idx is used to fill
@@ -134,7 +265,69 @@ namespace Switch {
     /// chain needs to be handled.
     void     vq_push     (VirtQueue &vq, unsigned head, uint32_t len);
 
-    void     vq_irq      (VirtQueue &vq);
+    /// Queue a single entry in the used ring without telling the
+    /// guest. Entries are published in order by vq_publish.
+    void     vq_defer    (VirtQueue &vq, unsigned head, uint32_t len);
+
+    /// Make all entries queued with vq_defer visible to the guest with
+    /// a single update of used->idx.
+    void     vq_publish  (VirtQueue &vq);
+
+    /// Interrupt the guest, if it wants to know about used entries
+    /// in vq. With coal, the interrupt may be held back. force
+    /// delivers held back interrupts.
+    void     vq_irq      (VirtQueue &vq, IrqCoalescing *coal = nullptr,
+                          uint64_t now = 0, bool force = false);
+
+    /// Return the next stashed RX chain or nullptr, if the guest has
+    /// no RX buffers left.
+    RxChain *rx_stash_get();
+    void     rx_stash_refill();
+    void     rx_stash_clear() { _rx_stash.first = _rx_stash.count = _rx_stash.bytes = 0; }
+
+    /// Check whether the guest has given us enough RX buffers to
+    /// receive a packet of the given size.
+    bool     rx_has_room(uint32_t bytes);
+
+    /// Copy a packet into the guest's RX buffers.
+    void     rx_copy(Packet const &src);
+
+    /// Does the guest want us to fragment UFO packets?
+    bool     rx_needs_ufo_fallback(Packet const &src) const
+    { return is_ufo(src) and not (guest_features & (1 << VIRTIO_NET_F_GUEST_UFO)); }
+
+    /// How much RX buffer space the packet takes in the guest.
+    uint32_t rx_length(Packet const &src) const
+    {
+      return UNLIKELY(rx_needs_ufo_fallback(src)) ?
+        UdpFragmenter::fragmented_length(src) : src.packet_length;
+    }
+
+    /// Copy a packet into the guest's RX buffers, fragmenting it
+    /// first, if the guest cannot take it as it is.
+    void     rx_deliver(Packet const &src);
+
+    void     backlog_push(Packet &src);
+    void     backlog_drain(uint64_t now);
+
+    /// Give all backlogged packets back to the switch. Must only be
+    /// called when we are not attached to the switch. The switch
+    /// usually has dropped them already (see drop_held).
+    void     backlog_orphan();
+
+    /// Wait until other ports have completed all TX chains we gave
+    /// them. Must only be called when we are not attached to the
+    /// switch. Returns false, if some are still out after
+    /// TX_DRAIN_MS. We give up on those. Their _tx_holders entries are
+    /// left for the caller.
+    bool     tx_drain();
+
+    /// Process requests the guest has put into the control queue.
+    void     ctrl_poll();
+
+    /// Execute a single control command and return the status for
+    /// the guest.
+    virtio_net_ctrl_ack ctrl_handle(uint8_t const *cmd, size_t len);
 
     /// Return a string describing the feature bit mask.
     static std::string features_to_string(uint32_t features);
@@ -178,6 +371,37 @@ namespace Switch {
 
     virtual void reset() override;
 
+    /// The guest notified us about new buffers in a queue.
+    void queue_notify(unsigned queue);
+
+    // vhost-user backend. The frontend tells us where the rings are
+    // instead of the guest programming the I/O BAR. It handles the
+    // control queue and configuration space itself.
+
+    enum {
+      VHOST_QUEUES = 2,		// RX and TX
+      TX_DRAIN_MS  = 1000,	// See tx_drain
+    };
+
+    /// Features we offer to a vhost-user frontend.
+    uint64_t vhost_features() const;
+    void     vhost_set_features(uint64_t features);
+
+    /// Start processing a ring. ring.num must be a power of two up to
+    /// QUEUE_ELEMENTS. Returns false, if we cannot use the ring.
+    bool     vhost_start_vring(unsigned idx, VRing const &ring, uint16_t base);
+
+    /// Stop processing a ring and return the index of the next avail
+    /// entry we would have looked at. For TX, waits for packets that
+    /// are still in flight. Chains that don't come back in time are
+    /// not counted as consumed.
+    uint16_t vhost_stop_vring(unsigned idx);
+
+    /// Set the eventfd that interrupts the guest for a ring and
+    /// return the previous one (0 for none). The caller must wait for
+    /// a grace period before closing the previous one.
+    int      vhost_set_call(unsigned idx, int fd);
+
     // Port methods
 
     virtual void enable()  override { Port::enable();  online = true; }
@@ -187,9 +411,17 @@ namespace Switch {
     virtual bool poll     (Packet &p, bool enable_notifications) override;
     virtual void receive  (Packet &p)                            override;
     virtual void mark_done(Packet::CompletionInfo &p)            override;
+    virtual void defer_done(Packet::CompletionInfo &p, unsigned holders) override;
     virtual void poll_irq ()                                     override;
-
-    VirtioDevice(Session &session);
+    virtual void flush_irq()                                     override;
+    virtual bool congested()                                     override;
+    virtual uint64_t deadline()                                  override;
+    virtual void drop_held(Port const *src)                      override;
+
+    /// If assign_mac is set, the guest gets an address from the
+    /// switch's MAC pool via the configuration space.
+    VirtioDevice(Session &session, bool assign_mac = true);
+    ~VirtioDevice();
   };
 
 }
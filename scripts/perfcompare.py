@@ -0,0 +1,82 @@
+#!/usr/bin/env python3
+# Compare results of test/perfsuite against a baseline. Every result
+# is a rate, so a benchmark regressed, if its mean dropped by more than
+# the tolerance. Exits with 1 on regressions, so it can gate a build.
+#
+# The tolerance is the default from --tolerance, unless the baseline
+# has a "tolerance" for a benchmark or one is given with
+# --tolerance-for name=fraction. Benchmarks that are noisier than
+# their tolerance are pointed out; rerun them with more --repeat.
+
+import argparse
+import json
+import sys
+
+def load(path):
+    with open(path) as f:
+        return json.load(f)
+
+def main():
+    parser = argparse.ArgumentParser(description="Compare perfsuite results against a baseline.")
+    parser.add_argument("baseline")
+    parser.add_argument("result")
+    parser.add_argument("-t", "--tolerance", type=float, default=0.05,
+                        help="allowed relative slowdown (default 0.05)")
+    parser.add_argument("--tolerance-for", action="append", default=[], metavar="NAME=FRACTION",
+                        help="tolerance for a single benchmark")
+    args = parser.parse_args()
+
+    try:
+        base = load(args.baseline)
+    except IOError:
+        print("No baseline in %s. Record one with 'scons perf-baseline'." % args.baseline)
+        return 2
+    result = load(args.result)
+
+    overrides = {}
+    for o in args.tolerance_for:
+        name, _, value = o.partition("=")
+        overrides[name] = float(value)
+
+    for key in ["cpu_model", "optimized"]:
+        if base.get(key) != result.get(key):
+            print("warning: %s differs: baseline %s, result %s" % (key, base.get(key), result.get(key)))
+
+    regressions = 0
+    print("%-24s %12s %12s %8s" % ("benchmark", "baseline", "result", "change"))
+
+    for name, b in sorted(base["benchmarks"].items()):
+        r = result["benchmarks"].get(name)
+        if r is None:
+            print("%-24s %12.3f %12s %8s  not run" % (name, b["mean"], "-", "-"))
+            continue
+
+        tolerance = overrides.get(name, b.get("tolerance", args.tolerance))
+        change    = (r["mean"] - b["mean"]) / b["mean"] if b["mean"] else 0.0
+        note      = ""
+
+        if change < -tolerance:
+            note = "REGRESSION"
+            regressions += 1
+        elif change > tolerance:
+            note = "faster"
+
+        if r["mean"] and r["ci95"] / r["mean"] > tolerance:
+            note += " noisy"
+
+        line = "%-24s %12.3f %12.3f %+7.1f%%  %s %s" % (name, b["mean"], r["mean"], change * 100,
+                                                       b.get("unit", ""), note)
+        print(line.rstrip())
+
+    for name in sorted(set(result["benchmarks"]) - set(base["benchmarks"])):
+        print("%-24s %12s %12.3f %8s  not in baseline" % (name, "-", result["benchmarks"][name]["mean"], "-"))
+
+    if regressions:
+        print("%d benchmark%s regressed." % (regressions, "" if regressions == 1 else "s"))
+        return 1
+    return 0
+
+if __name__ == "__main__":
+    sys.exit(main())
+
+# EOF
@@ -0,0 +1,131 @@
+#!/usr/bin/env python3
+# Print the port counters, latency histograms and where the switch
+# threads spend their cycles, as sv3 exports them with --stats <file>.
+# With an interval, print rates instead. "reset" asks the switch to
+# clear all histograms.
+
+import mmap
+import struct
+import sys
+import time
+
+MAGIC   = 0x73763373
+VERSION = 3
+
+header_struct = 'IIIIIIIIQ'
+reset_offset  = 24
+counters      = ["rx_packets", "rx_bytes", "tx_packets", "tx_bytes", "floods",
+                 "drops_rx_ring_empty", "drops_tx_queue_full", "drops_broken",
+                 "irqs", "kicks", "copy_bytes", "remote_copy_bytes"]
+
+# See include/histogram.hh
+SUB_BITS       = 3
+SUB_BUCKETS    = 1 << SUB_BITS
+BUCKETS        = 48 * SUB_BUCKETS
+histogram_size = 8 * (3 + BUCKETS)
+
+# Histograms and their offsets in PortStats and WorkerStats.
+port_histograms   = [("poll_to_deliver", 128),
+                     ("kick_to_poll",    128 + histogram_size),
+                     ("deliver_to_irq",  128 + 2 * histogram_size)]
+worker_histograms = [("quantum", 128)]
+
+# See Stage in include/stats.hh
+stages = ["poll", "poll_empty", "lookup", "copy", "deliver", "complete",
+          "irq", "quiescent", "block", "other"]
+
+def lower_bound(idx):
+    if idx < SUB_BUCKETS: return idx
+    return (SUB_BUCKETS + idx % SUB_BUCKETS) << (idx // SUB_BUCKETS - 1)
+
+class Histogram:
+    def __init__(self, m, off):
+        self.count, self.sum, self.max = struct.unpack_from('QQQ', m, off)
+        self.bucket = struct.unpack_from('Q' * BUCKETS, m, off + 24)
+
+    def percentile(self, p):
+        want = int(p * self.count)
+        seen = 0
+        for i, b in enumerate(self.bucket):
+            seen += b
+            if seen > want: return lower_bound(i)
+        return self.max
+
+    def format(self, cycles_per_us):
+        if not self.count: return "-"
+        us = lambda c: c / cycles_per_us
+        return "p50=%.1fus p99=%.1fus p999=%.1fus max=%.1fus n=%d" % (
+            us(self.percentile(0.5)), us(self.percentile(0.99)),
+            us(self.percentile(0.999)), us(self.max), self.count)
+
+def read_header(m):
+    h = struct.unpack_from(header_struct, m, 0)
+    if h[0] != MAGIC or h[1] != VERSION:
+        raise ValueError("not a sv3 statistics file")
+    return h
+
+def read_slots(m, first, count, size, histograms):
+    slots = {}
+    for i in range(count):
+        off = first + i * size
+        in_use, generation = struct.unpack_from('II', m, off)
+        if not in_use: continue
+        name   = m[off + 8:off + 64].split(b'\0')[0].decode()
+        names  = counters if histograms is port_histograms else stages
+        values = dict(zip(names, struct.unpack_from('Q' * len(names), m, off + 64)))
+        hists  = [(h, Histogram(m, off + 64 + o)) for h, o in histograms]
+        # Skip slots that changed owner while we looked.
+        if struct.unpack_from('II', m, off) != (in_use, generation): continue
+        slots[(i, generation)] = (name, values, hists)
+    return slots
+
+def read_all(m):
+    _, _, slots, slot_size, workers, worker_size, _, _, cps = read_header(m)
+    w = read_slots(m, 64, workers, worker_size, worker_histograms)
+    p = read_slots(m, 64 + workers * worker_size, slots, slot_size, port_histograms)
+    return cps, w, p
+
+def reset(statsfile):
+    with open(statsfile, 'r+b') as f:
+        m = mmap.mmap(f.fileno(), 0)
+        read_header(m)
+        requests, = struct.unpack_from('I', m, reset_offset)
+        struct.pack_into('I', m, reset_offset, (requests + 1) & 0xffffffff)
+
+def main(statsfile, interval = None):
+    if interval == "reset": return reset(statsfile)
+
+    with open(statsfile, 'rb') as f:
+        m = mmap.mmap(f.fileno(), 0, prot = mmap.PROT_READ)
+        cps, workers, old = read_all(m)
+        cycles_per_us = cps / 1e6
+        if interval is None:
+            for name, cycles, hists in workers.values():
+                total = max(1, sum(cycles.values()))
+                print("%-16s %s" % (name, " ".join("%s=%.1f%%" % (k, 100. * v / total)
+                                                   for k, v in cycles.items())))
+                for h, hist in hists:
+                    print("%-16s %-16s %s" % (name, h, hist.format(cycles_per_us)))
+            for name, c, hists in old.values():
+                print("%-16s %s" % (name, " ".join("%s=%d" % kv for kv in c.items())))
+                for h, hist in hists:
+                    print("%-16s %-16s %s" % ("", h, hist.format(cycles_per_us)))
+            return
+        while True:
+            time.sleep(float(interval))
+            _, workers_new, new = read_all(m)
+            for key, (name, cycles, _) in workers_new.items():
+                if key not in workers: continue
+                spent = dict((k, v - workers[key][1][k]) for k, v in cycles.items())
+                total = max(1, sum(spent.values()))
+                print("%-16s %s" % (name, " ".join("%s=%.1f%%" % (k, 100. * v / total)
+                                                   for k, v in spent.items())))
+            workers = workers_new
+            for key, (name, c, _) in new.items():
+                if key not in old: continue
+                rates = ((k, (v - old[key][1][k]) / float(interval)) for k, v in c.items())
+                print("%-16s %s" % (name, " ".join("%s=%.0f/s" % kv for kv in rates)))
+            old = new
+
+if __name__ == "__main__":
+    main(*sys.argv[1:])
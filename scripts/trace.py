@@ -1,36 +1,52 @@
 #!/usr/bin/env python3
+# Print the events in a sv3 trace file in time order. Start sv3 and
+# send it SIGUSR2 to switch tracing on and off.
 
+import mmap
 import struct
 import sys
 
-trace_event_struct = 'QBBHI'
+TRACE_MAGIC   = 0x73763374
+TRACE_VERSION = 2
+
+header_struct = 'IIIIIIQ'
+ring_struct   = 'IIQ'
+entry_struct  = 'QHHiIIq'
 
-cpu_hz = 1000*int(open("/sys/devices/system/cpu/cpu0/cpufreq/scaling_max_freq").read())
 event_names = ["BLOCK", "WAKEUP", "PACKET_RX", "PACKET_TX", "WENT_IDLE",
-               "IRQ", "QUIESCENT"]
+               "IRQ", "QUIESCENT", "LOOKUP", "FLOOD", "COPY_START",
+               "COPY_END", "COMPLETION"]
 
-def print_event(time_rel, time, event, port, length, dummy):
-    if (time != 0):
-        print("%016x +%08dns: %12s port=%03s length=%04x" %
-              (time, 1000000000*time_rel/cpu_hz,
-               event_names[event],
-               port, length))
+def read_events(m):
+    magic, version, rings, ring_entries, entry_size, _, cpu_hz = struct.unpack_from(header_struct, m, 0)
+    if magic != TRACE_MAGIC or version != TRACE_VERSION:
+        raise ValueError("not a sv3 trace file")
 
-def main(tracefile, *selected_events):
+    ring_size = 64 + ring_entries * entry_size
     events = []
+    for r in range(rings):
+        off = 64 + r * ring_size
+        tid, _, written = struct.unpack_from(ring_struct, m, off)
+        if tid == 0: continue
+        # Only the last ring_entries events survive.
+        for i in range(max(0, written - ring_entries), written):
+            e = struct.unpack_from(entry_struct, m, off + 64 + (i % ring_entries) * entry_size)
+            events.append((e[0], tid, e[1], e[3], e[4], e[6]))
+    return cpu_hz, events
+
+def main(tracefile, *selected_events):
     with open(tracefile, 'rb') as tf:
-        while True:
-            bytes_read = tf.read(struct.calcsize(trace_event_struct))
-            if not bytes_read: break
-            event = struct.unpack(trace_event_struct, bytes_read)
-            event_name = event_names[event[1]]
-            if event[0] != 0 and (len(selected_events) == 0 or event_name in selected_events):
-                events.append(event)
+        m = mmap.mmap(tf.fileno(), 0, prot = mmap.PROT_READ)
+        cpu_hz, events = read_events(m)
+
     last_time = None
-    for e in sorted(events, key = lambda t: t[0]):
-        print_event(e[0] - last_time if last_time else 0,
-                    *e)
-        last_time = e[0]
+    for time, tid, event, port, length, arg in sorted(events):
+        name = event_names[event] if event < len(event_names) else str(event)
+        if selected_events and name not in selected_events: continue
+        rel = time - last_time if last_time else 0
+        print("%016x +%08dns tid=%-6d %12s port=%3d length=%6d arg=%d" %
+              (time, 1000000000 * rel // cpu_hz, tid, name, port, length, arg))
+        last_time = time
 
 if __name__ == "__main__":
     main(*sys.argv[1:])
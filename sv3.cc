@@ -14,6 +14,10 @@
 
 
 #include <cstdio>
+#include <cctype>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
 #include <algorithm>
 #include <unistd.h>
 #include <sys/types.h>
@@ -33,44 +37,16 @@
 #include <tracing.hh>
 #include <upstream.hh>
 
-/// Tracing
-
-#ifdef TRACING
-
-void open_trace_file(std::string file)
-{
-  if (not file.length()) {
-    std::stringstream ss;
-    ss << "trace-" << getpid();
-    file = ss.str();
-  }
-
-  printf("Trace output is in '%s'.\n\n", file.c_str());
-  int fd = open(file.c_str(), O_RDWR | O_TRUNC | O_CREAT, 0644);
-  if (fd < 0 or ftruncate(fd, Switch::TRACE_SIZE) != 0) {
-    perror("open");
-    exit(EXIT_FAILURE);
-  }
-  
-  void *r = mmap(nullptr, Switch::TRACE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
-                      fd, 0);
-  if (r == MAP_FAILED) {
-    perror("mmap");
-    exit(EXIT_FAILURE);
-  }
-
-  Switch::trace_buffer = reinterpret_cast<char *>(r);
-
-  close(fd);
-}
-
-#endif
-
 /// Signal handling
 
 static Switch::Switch *signal_switch;
 static bool            signal_caught;
 
+static void sigusr2_handler(int)
+{
+  Switch::trace_toggle();
+}
+
 static void sigint_handler(int)
 {
   // Try graceful shutdown first. On second signal exit directly.
@@ -117,21 +93,32 @@ int main(int argc, char **argv)
     { "force",            no_argument, &force,                       1  },
     { "poll-us",          required_argument, 0,                     'p' },
     { "batch-size",       required_argument, 0,                     'b' },
-#ifdef TRACING
     { "trace-file",       required_argument, 0,                     't' },
-#endif
+    { "trace",            no_argument,       0,                     'T' },
     { "upstream-port",    required_argument, 0,                     'u' },
+    { "mac-pool",         required_argument, 0,                     'm' },
+    { "irq-coalesce",     required_argument, 0,                     'c' },
+    { "vhost-user",       required_argument, 0,                     'v' },
+    { "stats",            required_argument, 0,                     's' },
     { 0, 0, 0, 0 },
   };
 
   int         poll_us    =  0;
   int         batch_size = 16;
-#ifdef TRACING
   std::string trace_file;
-#endif
+  bool        trace_on   = false;
 
   std::vector<std::string> upstream_port;
 
+  Ethernet::Address mac_pool_first;
+  unsigned          mac_pool_count = 0;
+
+  unsigned coalesce_us      = 50;
+  unsigned coalesce_packets = 32;
+
+  char const *vhost_path = nullptr;
+  char const *stats_path = nullptr;
+
   int opt;
   int opt_idx;
 
@@ -148,11 +135,49 @@ int main(int argc, char **argv)
     case 'b':
       batch_size = atoi(optarg);
       break;
-#ifdef TRACING
     case 't':
       trace_file = optarg;
       break;
-#endif
+    case 'T':
+      trace_on = true;
+      break;
+    case 'm': {
+      std::vector<std::string> pool = string_split(optarg, ',');
+      if (pool.size() >= 1 and pool.size() <= 2 and
+          Ethernet::Address::from_str(pool[0].c_str(), mac_pool_first)) {
+        if (pool.size() == 1) {
+          mac_pool_count = 256;
+          break;
+        }
+
+        // atoi() takes garbage as 0 and strtoul() negative numbers.
+        char const   *count = pool[1].c_str();
+        char         *end;
+        errno = 0;
+        unsigned long n = strtoul(count, &end, 10);
+        if (isdigit(count[0]) and *end == 0 and errno == 0 and n <= UINT_MAX) {
+          mac_pool_count = n;
+          break;
+        }
+      }
+    }
+      goto usage;
+    case 'c': {
+      std::vector<std::string> coal = string_split(optarg, ',');
+      if (coal.size() >= 1 and coal.size() <= 2) {
+        coalesce_us      = atoi(coal[0].c_str());
+        if (coal.size() == 2)
+          coalesce_packets = std::max(atoi(coal[1].c_str()), 1);
+        break;
+      }
+    }
+      goto usage;
+    case 'v':
+      vhost_path = optarg;
+      break;
+    case 's':
+      stats_path = optarg;
+      break;
     case 'u':
       upstream_port = string_split(optarg, ',');
       if (upstream_port.size() >= 1)
@@ -160,22 +185,51 @@ int main(int argc, char **argv)
       // FALLTHROUGH
     case '?':
     default: /* '?' */
+    usage:
       fprintf(stderr,
               "Usage: %s [-f|--force] [--poll-us us] [--batch-size n]\n"
-              "          [--trace-file file]\n"
-	      "          [--upstream-port <type>,<arg1>,<arg2>,...]\n",
+              "          [--trace-file file] [--trace]\n"
+	      "          [--upstream-port <type>,<arg1>,<arg2>,...]\n"
+	      "          [--mac-pool <first-mac>[,<count>]]\n"
+	      "          [--irq-coalesce <max-us>[,<max-packets>]]\n"
+	      "          [--vhost-user <socket-path>]\n"
+	      "          [--stats <file>]\n",
               argv[0]);
       return EXIT_FAILURE;
     }
   }
 
-#ifdef TRACING
-  open_trace_file(trace_file);
-#endif
-
   try {
+    // Tracing is off until someone sends us SIGUSR2 (or --trace is
+    // given). Unless the user wants the trace file, it goes away when
+    // we exit.
+    bool keep_trace = trace_file.length();
+    if (not keep_trace)
+      trace_file = "/dev/shm/sv3-trace-" + std::to_string(getpid());
+
+    try {
+      Switch::trace_open(trace_file.c_str(), keep_trace);
+    } catch (Switch::SystemError &e) {
+      // Nobody asked for the trace file. Run without it.
+      if (keep_trace or trace_on) throw;
+      fprintf(stderr, "%sTracing is not available.\n", e.reason().c_str());
+      trace_file.clear();
+    }
+    auto close_trace = [] () { Switch::trace_close(); };
+    Finally<decltype(close_trace)> when_done(close_trace);
+
+    if (trace_on) Switch::trace_toggle();
+    if (trace_file.length())
+      printf("Trace output is in '%s'. Tracing is %s, send SIGUSR2 to toggle.\n\n",
+             trace_file.c_str(), trace_on ? "on" : "off");
+
     Switch::Switch   sv3(poll_us, batch_size);
-    Switch::Listener listener(sv3, force);
+    sv3.configure_mac_pool(mac_pool_first, mac_pool_count);
+    sv3.configure_irq_coalescing(coalesce_us, coalesce_packets);
+    if (stats_path)
+      sv3.configure_stats(stats_path);
+
+    Switch::Listener listener(sv3, force, vhost_path);
 
     if (upstream_port.size() != 0)
       Switch::create_upstream_port(sv3, upstream_port);
@@ -190,6 +244,11 @@ int main(int argc, char **argv)
     sigaction(SIGINT,  &sa, nullptr);
     sigaction(SIGTERM, &sa, nullptr);
 
+    // Toggling tracing must not disturb anyone blocking.
+    sa.sa_handler   = sigusr2_handler;
+    sa.sa_flags     = SA_RESTART;
+    sigaction(SIGUSR2, &sa, nullptr);
+
     sv3.loop();
 
     return EXIT_SUCCESS;
@@ -27,6 +27,21 @@ namespace Ethernet {
     return buf;
   }
 
+  bool Address::from_str(char const *str, Address &addr)
+  {
+    unsigned b[6];
+    char     end;
+    if (sscanf(str, "%x:%x:%x:%x:%x:%x%c",
+               &b[0], &b[1], &b[2], &b[3], &b[4], &b[5], &end) != 6)
+      return false;
+
+    for (unsigned i = 0; i < 6; i++) {
+      if (b[i] > 0xFF) return false;
+      addr.byte[i] = b[i];
+    }
+    return true;
+  }
+
   uint32_t hash(Address const &addr)
   {
     uint32_t r1 = 0;
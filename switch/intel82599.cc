@@ -19,6 +19,7 @@
 #include <algorithm>
 
 #include <intel82599.hh>
+#include <probes.hh>
 
 namespace Switch {
 
@@ -283,7 +284,7 @@ namespace Switch {
     _reg[EIMC] = ~0U;
 
     // Enable bus master support
-    write_config(4, read_config(4, 2) | 7, 2);
+    _pci->write_config(4, _pci->read_config(4, 2) | 7, 2);
 
     uint64_t mac = receive_address(0);
     if (mac >> 63 == 0) printf("No valid MAC!\n");
@@ -319,8 +320,8 @@ namespace Switch {
     _reg[IVAR0] = (0x80 | MSIX_RXTX_VECTOR) |
       ((0x80 | MSIX_RXTX_VECTOR) << 8);
 
-    set_irq_eventfd(VFIO_PCI_MSIX_IRQ_INDEX, MSIX_MISC_VECTOR, _misc_eventfd);
-    set_irq_eventfd(VFIO_PCI_MSIX_IRQ_INDEX, MSIX_RXTX_VECTOR, _rxtx_eventfd);
+    _pci->set_irq_eventfd(VFIO_PCI_MSIX_IRQ_INDEX, MSIX_MISC_VECTOR, _misc_eventfd);
+    _pci->set_irq_eventfd(VFIO_PCI_MSIX_IRQ_INDEX, MSIX_RXTX_VECTOR, _rxtx_eventfd);
 
     /* RX/TX */
     _reg[HLREG0]  |= HLREG0_TXCRCEN | HLREG0_TXPADEN | HLREG0_RXCRCSTRIP;
@@ -423,16 +424,17 @@ namespace Switch {
     _reg[EIMS] = 1;
   }
 
-  Intel82599::Intel82599(VfioGroup group, std::string device_id, int fd, int rxtx_eventfd,
+  Intel82599::Intel82599(PciDevice *pci, std::string device_id, int rxtx_eventfd,
 			 bool enable_lro, unsigned irq_rate)
-    : VfioDevice(group, device_id, fd), _rxtx_eventfd(rxtx_eventfd),
-      _enable_lro(enable_lro), _itr_us(irq_rate == 0 ? 0 : std::max<unsigned>(6, 1000000 / irq_rate))
+    : _pci(pci), _rxtx_eventfd(rxtx_eventfd),
+      _enable_lro(enable_lro), _itr_us(irq_rate == 0 ? 0 : std::max<unsigned>(6, 1000000 / irq_rate)),
+      _device_node(Numa::pci_node(device_id))
   {
     size_t mmio_size;
-    _reg = (uint32_t volatile *)map_bar(VFIO_PCI_BAR0_REGION_INDEX, &mmio_size);
+    _reg = (uint32_t volatile *)_pci->map_bar(VFIO_PCI_BAR0_REGION_INDEX, &mmio_size);
     _misc_eventfd = eventfd(0, 0);
 
-    uint32_t id = read_config(0, 4);
+    uint32_t id = _pci->read_config(0, 4);
     if (id != 0x151c8086 /* 82599/X520 "Niantic" 10G NIC */)
       throw ConfigurationError("Wrong type of device: %04x:%04x",
 			       id & 0xFFFF, id >> 16);
@@ -445,24 +447,88 @@ namespace Switch {
     return advance_qp(_shadow_tdt0) != _shadow_tdh0;
   }
 
+  unsigned Intel82599Port::tx_room()
+  {
+    // One descriptor always stays free, otherwise a full queue would
+    // look empty.
+    return (_shadow_tdh0 + QUEUE_LEN - _shadow_tdt0 - 1) % QUEUE_LEN;
+  }
+
   void Intel82599Port::receive(Packet &p)
+  {
+    // We don't copy, but the NIC still has to fetch the packet from
+    // wherever it lives.
+    account_copy(p.completion_info.src_port, p.packet_length);
+
+    if (UNLIKELY(is_ufo(p))) {
+      receive_ufo(p);
+      return;
+    }
+
+    int last_tdt = transmit(p);
+    if (last_tdt < 0) return;
+
+    _tx_buffers[last_tdt].need_completion = true;
+    _tx_buffers[last_tdt].info = p.copy_completion_info();
+  }
+
+  void Intel82599Port::receive_ufo(Packet &p)
+  {
+    // The NIC only segments TCP and its UDP segmentation produces
+    // separate datagrams, not IP fragments. So we fragment
+    // ourselves, but still let the NIC fetch the payload from guest
+    // memory.
+    UdpFragmenter frags(p);
+    if (UNLIKELY(not frags.valid())) {
+      logf("Dropping UFO packet we cannot fragment.");
+      return;
+    }
+
+    // Either all fragments go out or none. A datagram with fragments
+    // missing is useless to the receiver. Fragments need no context
+    // descriptor, so each buffer is one descriptor.
+    if (UNLIKELY(frags.buffers() > tx_room())) {
+      logf("TX queue full!");
+      _stats->drops_tx_queue_full += 1;
+      PROBE3(drop, id(), DROP_TX_QUEUE_FULL, p.packet_length - sizeof(virtio_net_hdr_mrg_rxbuf));
+      return;
+    }
+
+    Packet frag;
+    int    last_tdt = -1;
+
+    // The headers go to the slot of the first data descriptor of each
+    // fragment, which is free until the NIC is done with the fragment.
+    while (frags.next(frag, _tx_headers[_shadow_tdt0].data)) {
+      int tdt = transmit(frag);
+      if (tdt < 0) break;
+      last_tdt = tdt;
+    }
+
+    // Complete the packet after its last fragment.
+    if (last_tdt < 0) return;
+
+    _tx_buffers[last_tdt].need_completion = true;
+    _tx_buffers[last_tdt].info = p.copy_completion_info();
+  }
+
+  int Intel82599Port::transmit(Packet &p)
   {
     // logf("TX %u fragment(s). XXX Ignoring virtio header!", p.fragments);
     
     virtio_net_hdr_mrg_rxbuf const *hdr = reinterpret_cast<virtio_net_hdr_mrg_rxbuf *>(p.fragment[0]);
-    assert(p.fragment_length[0] == sizeof(*hdr));
-    assert(p.fragments > 1);
+    assert(p.fragment_length[0] >= sizeof(*hdr));
 
     // We assume that flags is a good indicator for anything that needs offloads.
     assert(not (not hdr->flags and hdr->gso_type));
 
-    unsigned payload_size  = p.packet_length - p.fragment_length[0];
+    unsigned payload_size  = p.packet_length - sizeof(*hdr);
     uint64_t offload_flags = 0;
 
     if (hdr->flags) {
       if (not tx_has_room()) goto fail;
 
-      Ethernet::Header *ehdr = (Ethernet::Header *)p.fragment[1];
+      Ethernet::Header *ehdr = (Ethernet::Header *)p.payload();
       unsigned maclen = sizeof(Ethernet::Header);
       bool     ipv4   = ehdr->type == Ethernet::Ethertype::IPV4;
       bool     udp    = (uint16_t)IPv4::Proto::UDP == (ipv4 ?
@@ -549,15 +615,17 @@ namespace Switch {
       unsigned last_tdt   = shadow_tdt;
       unsigned s = 0;
 
-      for (unsigned i = 1; i < p.fragments; i++) {
+      unsigned first_i = p.payload_fragment();
+      for (unsigned i = first_i; i < p.fragments; i++) {
 	last_tdt = shadow_tdt;
 
 	_tx_buffers[shadow_tdt].need_completion = false;
 
 	// logf("TX %s len %x", (i+1 == p.fragments) ? "EOP" : "   ", p.fragment_length[i]);
-	_tx_desc[shadow_tdt] = populate_tx_desc(p.fragment[i], p.fragment_length[i],
+	_tx_desc[shadow_tdt] = populate_tx_desc(p.fragment[i]        + p.payload_offset(i),
+						p.fragment_length[i] - p.payload_offset(i),
 						payload_size,
-						i == 1, offload_flags,
+						i == first_i, offload_flags,
 						i+1 == p.fragments);
 
 	// logf(" TX %016llx %016llx", _tx_desc[shadow_tdt].hi, _tx_desc[shadow_tdt].lo);
@@ -568,21 +636,21 @@ namespace Switch {
 	  goto fail;
       }
 
-      _tx_buffers[last_tdt].need_completion = true;
-      _tx_buffers[last_tdt].info = p.copy_completion_info();
-
       _tx0_inflight += s;
       _shadow_tdt0 = shadow_tdt;
       __atomic_store_n(&_reg[TDT0], shadow_tdt, __ATOMIC_RELEASE);
-    }
 
-    assert(_shadow_tdt0 == _reg[TDT0]);
-    return;
+      assert(_shadow_tdt0 == _reg[TDT0]);
+      return last_tdt;
+    }
 
   fail:
     logf("TX queue full!");
+    _stats->drops_tx_queue_full += 1;
+    PROBE3(drop, id(), DROP_TX_QUEUE_FULL, p.packet_length - sizeof(virtio_net_hdr_mrg_rxbuf));
 
     assert(_shadow_tdt0 == _reg[TDT0]);
+    return -1;
   }
 
   bool Intel82599Port::poll(Packet &p, bool enable_notifications)
@@ -596,11 +664,13 @@ namespace Switch {
       // logf("Unmasking RX/TX IRQ. EICR %08x EIMS %08x",
       // 	   _reg[EICR], _reg[EIMS]);
       unmask_rxtx_irq();
+      PROBE1(nic_irq_unmask, id());
     }
 
     // XXX As long as we don't use DCA, we can prefetch _tx_writeback
     // here and only access it after we look for received packets.
-    unsigned tx_wb = __atomic_load_n(_tx_writeback, __ATOMIC_RELAXED);
+    unsigned tx_wb     = __atomic_load_n(_tx_writeback, __ATOMIC_RELAXED);
+    unsigned completed = 0;
     while (tx_wb != _shadow_tdh0) {
       auto &info = _tx_buffers[_shadow_tdh0];
       // logf("%u %u:%u Completed TX index %u. Needed callback: %u.",
@@ -616,8 +686,11 @@ namespace Switch {
       assert(_tx0_inflight >= 0);
 
       _shadow_tdh0 = advance_qp(_shadow_tdh0);
+      completed++;
     }
 
+    if (completed) PROBE2(nic_tx_complete, id(), completed);
+
     // Consume buffers and remember our knowledge about buffer chains
     // in _rx_buffers until we either run out of descriptors with DD
     // set or we found a complete packet (EOP set).
@@ -748,10 +821,36 @@ namespace Switch {
     return true;
   }
 
+  void Intel82599Port::drop_held(Port const *src)
+  {
+    // The NIC may still be reading these buffers, but their source
+    // is going away and cannot wait for it. The memory stays mapped
+    // for DMA, so at worst we send garbage.
+    for (uint16_t i = _shadow_tdh0; i != _shadow_tdt0; i = advance_qp(i)) {
+      auto &info = _tx_buffers[i];
+      if (info.need_completion and (src == nullptr or info.info.src_port == src)) {
+        info.need_completion = false;
+        info.info.src_port->mark_done(info.info);
+      }
+    }
+  }
+
+  void Intel82599Port::defer_done(Packet::CompletionInfo &c, unsigned holders)
+  {
+    _rx_buffers[c.intel82599.rx_idx].holders = holders;
+  }
+
   void Intel82599Port::mark_done(Packet::CompletionInfo &c)
   {
     unsigned not_first;
     unsigned idx = c.intel82599.rx_idx;
+
+    // Someone else still looks at the packet.
+    if (_rx_buffers[idx].holders > 1) {
+      _rx_buffers[idx].holders--;
+      return;
+    }
+
     do {
       unsigned   next_idx = _rx_buffers[idx].rsc_last;
       rx_buffer *buf      = _rx_buffers[idx].buffer;
@@ -815,10 +914,10 @@ namespace Switch {
     return r;
   }
 
-  Intel82599Port::Intel82599Port(VfioGroup group, std::string device_id, int fd,
+  Intel82599Port::Intel82599Port(PciDevice *pci, std::string device_id,
                                  Switch &sw, std::string name,
 				 bool enable_lro, unsigned irq_rate)
-    : Intel82599(group, device_id, fd, sw.event_fd(), enable_lro, irq_rate),
+    : Intel82599(pci, device_id, sw.event_fd(), enable_lro, irq_rate),
       Port(sw, name),
       _misc_thread(&Intel82599Port::misc_thread_fn, this),
       _shadow_rdt0(0), _shadow_rdh0(0),
@@ -826,11 +925,15 @@ namespace Switch {
   {
     _switch.register_dma_memory_callback([&] (void *p, size_t s) {
 	logf("Registering DMA memory: %p+%zx", p, s);
-	map_memory_to_device(p, s, true, true);
+	_pci->map_memory_to_device(p, s, true, true);
       });
 
     logf("Interrupt rate set to %u.", irq_rate);
 
+    _numa_node = _device_node;
+    if (_numa_node >= 0)
+      logf("Device is on NUMA node %d.", _numa_node);
+
     logf("Resetting device.");
     reset();
 
@@ -842,7 +945,7 @@ namespace Switch {
       uint64_t set = 0;
       for (auto cpu : cpus) set |= (1ULL << cpu);
 
-      for (unsigned irq : irqs()) {
+      for (unsigned irq : _pci->irqs()) {
 	std::stringstream ss; ss << boost::format("/proc/irq/%d/smp_affinity") % irq;
 	std::fstream pirq(ss.str(), std::ios_base::out);
 	pirq << boost::format("%x") % set;
@@ -857,6 +960,7 @@ namespace Switch {
 
     memset(_rx_buffers, 0, sizeof(_rx_buffers));
     memset(_tx_buffers, 0, sizeof(_tx_buffers));
+    _tx_headers = alloc_dma_mem<tx_header>(sizeof(tx_header[QUEUE_LEN]));
 
     logf("Queueing RX buffers.");
     // Create initial set of buffers and enqueue them.
@@ -0,0 +1,211 @@
+// Copyright (C) 2013, Julian Stecklina <jsteckli@os.inf.tu-dresden.de>
+// Economic rights: Technische Universitaet Dresden (Germany)
+
+// This file is part of sv3.
+
+// sv3 is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License version 2 as
+// published by the Free Software Foundation.
+
+// sv3 is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License version 2 for more details.
+
+
+#include <irqbatch.hh>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#ifndef NO_IO_URING
+# include <linux/io_uring.h>
+#endif
+
+namespace Switch {
+
+  // What all eventfd writes write.
+  static const uint64_t irq_value = 1;
+
+#ifndef NO_IO_URING
+
+  void IrqBatch::setup()
+  {
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+
+    int fd = syscall(__NR_io_uring_setup, ENTRIES, &p);
+    if (fd < 0) return;
+
+    // Writes to eventfds never block, so we don't need any of the
+    // fancy features. IORING_OP_WRITE is 5.6 and later, though. We
+    // notice missing support in reap().
+    _map_size[0] = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+    _map_size[1] = p.cq_off.cqes  + p.cq_entries * sizeof(io_uring_cqe);
+    _map_size[2] = p.sq_entries * sizeof(io_uring_sqe);
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+      _map_size[0] = _map_size[1] = std::max(_map_size[0], _map_size[1]);
+    }
+
+    _map[0] = mmap(nullptr, _map_size[0], PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    _map[1] = (p.features & IORING_FEAT_SINGLE_MMAP) ? _map[0] :
+      mmap(nullptr, _map_size[1], PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    _map[2] = mmap(nullptr, _map_size[2], PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+
+    _ring_fd = fd;
+    if (_map[0] == MAP_FAILED or _map[1] == MAP_FAILED or _map[2] == MAP_FAILED) {
+      teardown();
+      return;
+    }
+
+    uint8_t *sq = static_cast<uint8_t *>(_map[0]);
+    uint8_t *cq = static_cast<uint8_t *>(_map[1]);
+
+    _sq_head = reinterpret_cast<uint32_t *>(sq + p.sq_off.head);
+    _sq_tail = reinterpret_cast<uint32_t *>(sq + p.sq_off.tail);
+    _sq_mask = *reinterpret_cast<uint32_t *>(sq + p.sq_off.ring_mask);
+    _sqes    = _map[2];
+
+    _cq_head = reinterpret_cast<uint32_t *>(cq + p.cq_off.head);
+    _cq_tail = reinterpret_cast<uint32_t *>(cq + p.cq_off.tail);
+    _cq_mask = *reinterpret_cast<uint32_t *>(cq + p.cq_off.ring_mask);
+    _cqes    = cq + p.cq_off.cqes;
+
+    // We fill SQEs in ring order, so the indirection array is the
+    // identity.
+    uint32_t *array = reinterpret_cast<uint32_t *>(sq + p.sq_off.array);
+    for (unsigned i = 0; i < p.sq_entries; i++) array[i] = i;
+  }
+
+  void IrqBatch::teardown()
+  {
+    bool single_mmap = (_map[1] == _map[0]);
+
+    for (unsigned i = 0; i < 3; i++) {
+      if (_map[i] != MAP_FAILED and _map[i] != nullptr and
+          (i != 1 or not single_mmap))
+        munmap(_map[i], _map_size[i]);
+      _map[i] = nullptr;
+    }
+
+    if (_ring_fd >= 0) close(_ring_fd);
+    _ring_fd = -1;
+  }
+
+  void IrqBatch::reap()
+  {
+    uint32_t head = *_cq_head;
+    uint32_t tail = __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+    bool     failed = false;
+
+    for (; head != tail; head++) {
+      io_uring_cqe const &cqe = static_cast<io_uring_cqe const *>(_cqes)[head & _cq_mask];
+
+      // A kernel without IORING_OP_WRITE. Don't lose the interrupt
+      // and don't try again. Other errors (e.g. the guest closed its
+      // eventfd) would hit a plain write() just the same, so we drop
+      // those interrupts.
+      if (UNLIKELY(cqe.res == -EINVAL or cqe.res == -EOPNOTSUPP)) {
+        int fd = cqe.user_data;
+        write(fd, &irq_value, sizeof(irq_value));
+        failed = true;
+      }
+    }
+
+    __atomic_store_n(_cq_head, head, __ATOMIC_RELEASE);
+
+    if (UNLIKELY(failed)) teardown();
+  }
+
+  void IrqBatch::trigger(int fd)
+  {
+    if (UNLIKELY(_queued == ENTRIES)) flush();
+
+    // flush() gives up on io_uring, when the kernel lets us down.
+    if (UNLIKELY(_ring_fd < 0)) {
+      write(fd, &irq_value, sizeof(irq_value));
+      return;
+    }
+
+    uint32_t      tail = *_sq_tail;
+    io_uring_sqe &sqe  = static_cast<io_uring_sqe *>(_sqes)[tail & _sq_mask];
+
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode    = IORING_OP_WRITE;
+    sqe.fd        = fd;
+    sqe.addr      = reinterpret_cast<uintptr_t>(&irq_value);
+    sqe.len       = sizeof(irq_value);
+    sqe.user_data = fd;
+
+    __atomic_store_n(_sq_tail, tail + 1, __ATOMIC_RELEASE);
+    _queued++;
+  }
+
+  void IrqBatch::flush()
+  {
+    if (LIKELY(_queued == 0)) return;
+
+    // The kernel may take fewer entries than we ask it to. Submit
+    // the rest, as long as it makes progress.
+    while (_queued) {
+      long r = syscall(__NR_io_uring_enter, _ring_fd, _queued, 0, 0, nullptr, 0);
+      if (UNLIKELY(r <= 0)) break;
+      _queued -= std::min<unsigned long>(r, _queued);
+    }
+
+    if (UNLIKELY(_queued)) {
+      // Deliver what the kernel didn't take the old way and give up
+      // on io_uring.
+      uint32_t head = __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE);
+      for (; head != *_sq_tail; head++) {
+        int fd = static_cast<io_uring_sqe *>(_sqes)[head & _sq_mask].fd;
+        write(fd, &irq_value, sizeof(irq_value));
+      }
+      _queued = 0;
+      reap();
+      teardown();
+      return;
+    }
+
+    // Eventfd writes complete during submission, so we can collect
+    // the completions right away. The completion queue is twice as
+    // large as the submission queue and never overflows.
+    reap();
+  }
+
+#else  // NO_IO_URING
+
+  void IrqBatch::setup()    { }
+  void IrqBatch::teardown() { }
+  void IrqBatch::reap()     { }
+  void IrqBatch::flush()    { }
+
+  void IrqBatch::trigger(int fd)
+  {
+    write(fd, &irq_value, sizeof(irq_value));
+  }
+
+#endif
+
+  IrqBatch::IrqBatch()
+    : _ring_fd(-1), _map(), _map_size(), _queued(0)
+  {
+    setup();
+  }
+
+  IrqBatch::~IrqBatch()
+  {
+    teardown();
+  }
+
+}
+
+// EOF
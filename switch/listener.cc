@@ -16,33 +16,45 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/un.h>
 #include <sys/mman.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
 #include <unistd.h>
 
+#include <atomic>
 #include <cinttypes>
+#include <map>
 
 #include <listener.hh>
+#include <numa.hh>
+#include <timer.hh>
 #include <system_error>
 
 namespace Switch {
 
   Session::~Session() {
+    // Prefaulting must be done, before guest memory goes away.
+    wait_for_memory();
+
     close(_fd);
+    close(_epfd);
 
     for (int fd : _file_descriptors)
       close(fd);
   }
 
-  void Listener::accept_session()
+  void Listener::accept_session(int sfd, bool vhost_user)
   {
     sockaddr_un sa;
     socklen_t   si = sizeof(sa);
 
-    int     res = accept(_sfd, reinterpret_cast<sockaddr *>(&sa), &si);
+    // All workers may wake up for a new connection. Only one gets it.
+    int     res = accept4(sfd, reinterpret_cast<sockaddr *>(&sa), &si, SOCK_CLOEXEC);
     if (res < 0) {
-      perror("accept");
+      if (errno != EAGAIN) perror("accept");
       return;
     }
 
@@ -51,28 +63,109 @@ namespace Switch {
       return;
     }
 
-    _sessions.push_back(new Session(_sw, res, sa));
+    if (vhost_user)
+      arm_session(new VhostUserSession(_sw, res, sa), EPOLL_CTL_ADD);
+    else
+      arm_session(new Session(_sw, res, sa), EPOLL_CTL_ADD);
   }
 
-  bool RegionList::insert(Region const &r)
+  void Listener::arm_session(Session *s, int op)
   {
-    // Overflow or empty region
-    if (r.addr + r.size <= r.addr) return false;
+    epoll_event ev;
+    ev.events   = EPOLLIN | EPOLLET | EPOLLONESHOT;
+    ev.data.ptr = s;
 
-    uint64_t r_end  = r .addr + r .size;
-    for (auto &lr : _list) {
-      uint64_t lr_end = lr.addr + lr.size;
-      if (r.addr < lr_end and lr.addr < r_end) {
-	return false;
-      }
-    }
+    if (0 != epoll_ctl(_epfd, op, s->epoll_fd(), &ev))
+      throw std::system_error(errno, std::system_category());
+  }
+
+  uint8_t *Session::map_memory(int fd, uint64_t offset, uint64_t size)
+  {
+    // We need this hint, because otherwise are pretty certain to
+    // get virtual addresses for which we cannot create 1:1 DMA
+    // mappings. Don't worry about races here, mmap takes care of
+    // that. Keeping it 1 GiB aligned lets hugetlbfs mappings use it.
+    // Sessions are set up in parallel, so every mapping reserves its
+    // own piece of address space.
+    static const uintptr_t         hint_align   = 1ULL << 30;
+    static std::atomic<uintptr_t>  address_hint { 1ULL << 32 };
+
+    uintptr_t hint = address_hint.fetch_add((size + hint_align - 1) & ~(hint_align - 1));
+    void *m = mmap(reinterpret_cast<void *>(hint), size,
+		   PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset);
+    if (m == MAP_FAILED) return nullptr;
+
+    // hugetlbfs files give us hugepages anyway. For anything else
+    // (usually tmpfs), ask for transparent hugepages. Guest memory
+    // also has no business in our core dumps.
+    struct statfs fs;
+    bool hugetlbfs = fstatfs(fd, &fs) == 0 and fs.f_type == HUGETLBFS_MAGIC;
+    if (hugetlbfs)
+      _sw.logf("Guest memory is on hugetlbfs with %lu KiB pages.", long(fs.f_bsize) >> 10);
+    else if (madvise(m, size, MADV_HUGEPAGE) != 0)
+      _sw.logf("No transparent hugepages for guest memory. Back it with hugetlbfs for speed.");
+
+    madvise(m, size, MADV_DONTDUMP);
+
+    // Fault everything in now, so the switch thread doesn't do it
+    // when the first packets arrive. This takes a while for large
+    // guests, so don't hold up the listener. See wait_for_memory().
+    uint8_t *p = reinterpret_cast<uint8_t *>(m);
+    _prefault.emplace_back([this, p, size] () {
+	uint64_t start = rdtsc();
+	prefault(p, size);
+	_sw.logf("Prefaulted %" PRIu64 " MiB of guest memory at %p in %" PRIu64 " ms.",
+		 size >> 20, p, (rdtsc() - start) / (cycles_per_second() / 1000));
+      });
+
+    return p;
+  }
 
-    // Sorted insert
-    auto it = _list.begin();
-    for (; it != _list.end() and (*it).addr < r_end; ++it) {}
-    _list.insert(it, r);
+  void Session::prefault(uint8_t *p, size_t size)
+  {
+#ifdef MADV_POPULATE_WRITE
+    // Populate writable page table entries without touching the
+    // contents (Linux 5.14 and later). Older kernels say EINVAL.
+    if (madvise(p, size, MADV_POPULATE_WRITE) == 0) return;
+#endif
+
+    // Otherwise write to every page without changing it. The guest
+    // may be writing concurrently, so this has to be atomic.
+    size_t page = sysconf(_SC_PAGESIZE);
+    for (size_t off = 0; off < size; off += page)
+      __atomic_fetch_add(p + off, 0, __ATOMIC_RELAXED);
+  }
 
-    return true;
+  void Session::wait_for_memory()
+  {
+    for (auto &t : _prefault)
+      t.join();
+    _prefault.clear();
+  }
+
+  int Session::memory_node()
+  {
+    if (Numa::nodes() < 2) return -1;
+
+    // Look at a couple of pages in every region. They are all
+    // present, because we prefaulted them.
+    static const unsigned samples = 64;
+    std::map<int, uint64_t> bytes;
+
+    _regions.for_each([&] (Region const &r) {
+	uint64_t page = sysconf(_SC_PAGESIZE);
+	for (unsigned i = 0; i < samples; i++) {
+	  uint64_t off = (r.size / samples * i) & ~(page - 1);
+	  bytes[Numa::node_of(r.mapping + off)] += r.size / samples;
+	}
+      });
+
+    int node = -1;
+    for (auto &b : bytes)
+      if (b.first >= 0 and (node < 0 or b.second > bytes[node]))
+	node = b.first;
+
+    return node;
   }
 
   bool Session::insert_region(Region const &r)
@@ -110,24 +203,14 @@ namespace Switch {
       break;
     }
     case EXTERNALPCI_REQ_REGION: {
-      // We need this hint, because otherwise are pretty certain to
-      // get virtual addresses for which we cannot create 1:1 DMA
-      // mappings. Don't worry about races here, mmap takes care of
-      // that.
-      static uintptr_t address_hint = (1ULL << 32);
       Region r(req.region.phys_addr,
 	       req.region.size,
-	       reinterpret_cast<uint8_t *>(mmap((void *)address_hint, req.region.size,
-						PROT_READ | PROT_WRITE,
-						MAP_SHARED,
-						req.region.fd,
-						req.region.offset)));
-      close(req.region.fd);
-      if (r.mapping == MAP_FAILED) {
+	       map_memory(req.region.fd, req.region.offset, req.region.size));
+      close_fd(req.region.fd);
+      if (r.mapping == nullptr) {
 	_sw.logf("mmap failed. Did you use -mem-path for qemu?");
 	return false;
       }
-      address_hint += req.region.size;
       return insert_region(r);
     }
     case EXTERNALPCI_REQ_RESET: {
@@ -166,6 +249,44 @@ namespace Switch {
   }
 
 
+  void Session::watch(int fd)
+  {
+    epoll_event ev;
+    ev.events  = EPOLLIN;
+    ev.data.fd = fd;
+
+    if (0 != epoll_ctl(_epfd, EPOLL_CTL_ADD, fd, &ev))
+      throw std::system_error(errno, std::system_category());
+  }
+
+  void Session::unwatch(int fd)
+  {
+    epoll_ctl(_epfd, EPOLL_CTL_DEL, fd, nullptr);
+  }
+
+  bool Session::handle(int fd)
+  {
+    return fd != _fd or poll();
+  }
+
+  bool Session::handle_events()
+  {
+    // Take events one at a time, because handling one may remove
+    // file descriptors the others refer to.
+    while (true) {
+      epoll_event ev;
+      int n = epoll_wait(_epfd, &ev, 1, 0);
+
+      if (n == 0) return true;
+      if (n < 0) {
+	if (errno == EINTR) continue;
+	return false;
+      }
+
+      if (not handle(ev.data.fd)) return false;
+    }
+  }
+
   bool Session::poll()
   {
     externalpci_req req;
@@ -267,89 +388,120 @@ namespace Switch {
     return false;             // Remove!
   }
 
-  void Listener::thread_fun()
+  void Listener::worker()
   {
-    rcu_register_thread();
-
-    do {
-      fd_set fdset;
-      int    nfds = 0;
-      FD_ZERO(&fdset);
-      FD_SET(_sfd, &fdset); if (_sfd >= nfds) nfds = _sfd + 1;
-      for (auto &s : _sessions) {
-	FD_SET(s->_fd, &fdset);
-	if (s->_fd >= nfds) nfds = s->_fd + 1;
-      }
-
-      struct timeval to;
-      to.tv_sec = 0;
-      to.tv_usec = 100000;
-      rcu_thread_offline();
-      int res = select(nfds, &fdset, NULL, NULL, &to);
-      rcu_thread_online();
-      if (res < 0) {
-	// When our destructor closes _sfd, select() will exit with an
-	// error and we exit the thread.
-
-	// XXX Delete all sessions.
-
-	return;
-      }
+    // Workers are no RCU readers. Handling a session blocks (waiting
+    // for prefaulting, for the switch to let go of a ring or for grace
+    // periods), which would hold up everyone's grace periods. The only
+    // RCU protected data they read is the region list of the session
+    // they handle, which no other thread changes meanwhile.
+    while (true) {
+      epoll_event ev;
 
-      if (FD_ISSET(_sfd, &fdset)) accept_session();
+      int n = epoll_wait(_epfd, &ev, 1, -1);
 
-      for (auto s = _sessions.begin(); s != _sessions.end(); ++s) {
-	Session *session = *s;
-	if (FD_ISSET(session->_fd, &fdset))
-	  if (not session->poll()) {
-	    // XXX Use unique_ptr
+      if (n < 0 and errno != EINTR) break;
+      if (n <= 0) continue;
 
-	    s = _sessions.erase(s);
-	    delete session;
-	  }
+      if (ev.data.ptr == &_quit_fd) {
+	// XXX Delete all sessions.
+	break;
       }
 
-    } while (true);
+      if (ev.data.ptr == &_sfd) { accept_session(_sfd, false); continue; }
+      if (ev.data.ptr == &_vfd) { accept_session(_vfd, true);  continue; }
 
-    rcu_unregister_thread();
+      Session *session = static_cast<Session *>(ev.data.ptr);
+      if (session->handle_events())
+	arm_session(session, EPOLL_CTL_MOD);
+      else
+	// Closing its file descriptors takes the session out of our
+	// epoll set.
+	delete session;
+    }
   }
 
-  Listener::Listener(Switch &sw, bool force) : _sw(sw)
+  int Listener::open_socket(sockaddr_un &addr, char const *path, int type, bool force)
   {
-    _sfd = socket(AF_LOCAL, SOCK_SEQPACKET, 0);
-    if (_sfd < 0) throw std::system_error(errno, std::system_category());
-
-    _local_addr.sun_family = AF_LOCAL;
-    snprintf(_local_addr.sun_path, sizeof(_local_addr.sun_path),
-	     "/tmp/sv3" /* "-%u", getpid() */);
+    // Non-blocking, because workers race to accept.
+    int fd = socket(AF_LOCAL, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) throw std::system_error(errno, std::system_category());
 
-    _sw.logf("Listening for clients on %s.", _local_addr.sun_path);
+    addr.sun_family = AF_LOCAL;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
 
     if (force) {
       // Try to unlink the file. We don't care about failures,
       // because bind() will catch them anyway.
       
-      int res = unlink(_local_addr.sun_path);
+      int res = unlink(addr.sun_path);
       if (res == 0) _sw.logf("Cleaned up stale socket.");
     }
 
-    if (0 != bind(_sfd, reinterpret_cast<sockaddr *>(&_local_addr), sizeof(_local_addr)))
+    if (0 != bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)))
       throw std::system_error(errno, std::system_category());
 
-    if (0 != listen(_sfd, 5))
+    if (0 != listen(fd, 5))
       throw std::system_error(errno, std::system_category());
 
-    _thread = std::thread(&Listener::thread_fun, this);
+    return fd;
+  }
+
+  Listener::Listener(Switch &sw, bool force, char const *vhost_path,
+                     char const *control_path)
+    : _sw(sw), _vfd(-1), _epfd(epoll_create1(EPOLL_CLOEXEC)),
+      _quit_fd(eventfd(0, EFD_CLOEXEC))
+  {
+    if (_epfd < 0 or _quit_fd < 0)
+      throw std::system_error(errno, std::system_category());
+
+    _sfd = open_socket(_local_addr, control_path, SOCK_SEQPACKET, force);
+    _sw.logf("Listening for clients on %s.", _local_addr.sun_path);
+
+    if (vhost_path) {
+      _vfd = open_socket(_vhost_addr, vhost_path, SOCK_STREAM, force);
+      _sw.logf("Listening for vhost-user clients on %s.", _vhost_addr.sun_path);
+    }
+
+    // Wake up one worker per connection and all of them to quit.
+    auto add = [&] (int *fd, uint32_t events) {
+      epoll_event ev;
+      ev.events   = events;
+      ev.data.ptr = fd;
+      if (0 != epoll_ctl(_epfd, EPOLL_CTL_ADD, *fd, &ev))
+	throw std::system_error(errno, std::system_category());
+    };
+
+    add(&_quit_fd, EPOLLIN);
+    add(&_sfd,     EPOLLIN | EPOLLEXCLUSIVE);
+    if (_vfd >= 0)
+      add(&_vfd,   EPOLLIN | EPOLLEXCLUSIVE);
+
+    unsigned workers = std::min<unsigned>(MAX_WORKERS, std::max(1U, std::thread::hardware_concurrency()));
+    for (unsigned i = 0; i < workers; i++)
+      _workers.emplace_back(&Listener::worker, this);
+
+    _sw.logf("Handling clients with %u thread%s.", workers, workers == 1 ? "" : "s");
   }
 
   Listener::~Listener()
   {
+    uint64_t val = 1;
+    write(_quit_fd, &val, sizeof(val));
+
+    _sw.logf("Waiting for listener threads to join.");
+    for (auto &t : _workers) t.join();
+    _sw.logf("Listener threads joined.");
+
+    close(_quit_fd);
+    close(_epfd);
     close(_sfd);
     unlink(_local_addr.sun_path);
 
-    _sw.logf("Waiting for listener thread to join.");
-    _thread.join();
-    _sw.logf("Listener thread joined.");
+    if (_vfd >= 0) {
+      close(_vfd);
+      unlink(_vhost_addr.sun_path);
+    }
   }
 
 }
@@ -0,0 +1,116 @@
+// Copyright (C) 2013, Julian Stecklina <jsteckli@os.inf.tu-dresden.de>
+// Economic rights: Technische Universitaet Dresden (Germany)
+
+// This file is part of sv3.
+
+// sv3 is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License version 2 as
+// published by the Free Software Foundation.
+
+// sv3 is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License version 2 for more details.
+
+
+#include <numa.hh>
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+namespace Switch {
+  namespace Numa {
+
+    static std::string read_line(std::string const &file)
+    {
+      std::ifstream in(file);
+      std::string   line;
+      std::getline(in, line);
+      return line;
+    }
+
+    unsigned nodes()
+    {
+      static unsigned n = 0;
+      if (n) return n;
+
+      while (access(("/sys/devices/system/node/node" + std::to_string(n)).c_str(), F_OK) == 0)
+        n++;
+
+      return n = std::max(n, 1U);
+    }
+
+    int node_of(void const *p)
+    {
+      if (nodes() < 2) return -1;
+
+      int node = -1;
+      if (syscall(SYS_get_mempolicy, &node, nullptr, 0, p, MPOL_F_NODE | MPOL_F_ADDR) != 0)
+        return -1;
+      return node;
+    }
+
+    int pci_node(std::string const &device_id)
+    {
+      if (nodes() < 2) return -1;
+
+      std::string node = read_line("/sys/bus/pci/devices/" + device_id + "/numa_node");
+      return node.empty() ? -1 : atoi(node.c_str());
+    }
+
+    bool prefer(void *p, size_t len, int node)
+    {
+      if (node < 0) return false;
+
+      unsigned long mask[16] = {};
+      unsigned long bits     = sizeof(mask) * 8;
+      if (unsigned(node) >= bits) return false;
+
+      mask[node / (8 * sizeof(long))] |= 1UL << (node % (8 * sizeof(long)));
+      return syscall(SYS_mbind, p, len, MPOL_PREFERRED, mask, bits, MPOL_MF_MOVE) == 0;
+    }
+
+    bool run_on(int node)
+    {
+      // The affinity we were started with. Someone may have used
+      // taskset on us and we stay within that.
+      static cpu_set_t original;
+      static bool      have_original = false;
+
+      if (not have_original) {
+        if (sched_getaffinity(0, sizeof(original), &original) != 0) return false;
+        have_original = true;
+      }
+
+      cpu_set_t set;
+      CPU_ZERO(&set);
+
+      // Parse lists like "0-7,16-23".
+      std::stringstream cpulist(read_line("/sys/devices/system/node/node" +
+                                          std::to_string(node) + "/cpulist"));
+      std::string range;
+      while (std::getline(cpulist, range, ',')) {
+        unsigned first, last;
+        int      n = sscanf(range.c_str(), "%u-%u", &first, &last);
+        if (n < 1) continue;
+        if (n == 1) last = first;
+
+        for (unsigned cpu = first; cpu <= last and cpu < CPU_SETSIZE; cpu++)
+          if (CPU_ISSET(cpu, &original)) CPU_SET(cpu, &set);
+      }
+
+      if (CPU_COUNT(&set) == 0) return false;
+      return sched_setaffinity(0, sizeof(set), &set) == 0;
+    }
+
+  }
+}
+
+// EOF
@@ -23,17 +23,17 @@ namespace Switch {
     Packet  &dst = *this;
 
     // Copy header
-    assert(dst.fragment_length[0] == sizeof(*hdr));
     memcpy(dst.fragment[0], hdr, sizeof(*hdr));
 
-    size_t   dst_i     = 1;
-    uint8_t *dst_ptr   = dst.fragment[1];
-    size_t   dst_space = dst.fragment_length[1]; /* Space left in current
+    size_t   dst_i     = dst.payload_fragment();
+    uint8_t *dst_ptr   = dst.fragment[dst_i] + dst.payload_offset(dst_i);
+    size_t   dst_space = dst.fragment_length[dst_i] - dst.payload_offset(dst_i);
+						 /* Space left in current
 						    destination segment. */
 
-    for (unsigned src_i = 1; src_i < src.fragments; src_i++) {
-      uint8_t const *src_ptr   = src.fragment[src_i];
-      size_t         src_space = src.fragment_length[src_i];
+    for (unsigned src_i = src.payload_fragment(); src_i < src.fragments; src_i++) {
+      uint8_t const *src_ptr   = src.fragment[src_i]        + src.payload_offset(src_i);
+      size_t         src_space = src.fragment_length[src_i] - src.payload_offset(src_i);
 
       do {
 	size_t chunk = std::min(dst_space, src_space);
@@ -57,6 +57,30 @@ namespace Switch {
     }
   }
 
+  bool
+  Packet::read(unsigned offset, void *dst, size_t len) const
+  {
+    uint8_t *out = static_cast<uint8_t *>(dst);
+
+    for (unsigned i = payload_fragment(); len and i < fragments; i++) {
+      size_t   flen = fragment_length[i] - payload_offset(i);
+      uint8_t *fptr = fragment[i] + payload_offset(i);
+
+      if (offset >= flen) {
+	offset -= flen;
+	continue;
+      }
+
+      size_t chunk = std::min(len, flen - offset);
+      memcpy(out, fptr + offset, chunk);
+      out    += chunk;
+      len    -= chunk;
+      offset  = 0;
+    }
+
+    return len == 0;
+  }
+
 }
 
 // EOF
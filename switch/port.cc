@@ -15,9 +15,13 @@
 
 #include <switch.hh>
 #include <cstdarg>
+#include <cinttypes>
+#include <atomic>
 
 namespace Switch {
 
+  static std::atomic<int32_t> next_id { 0 };
+
   void Port::logf(char const *str, ...)
   {
     va_list  ap;
@@ -36,18 +40,27 @@ namespace Switch {
   void Port::disable()
   {
     _switch.detach_port(*this);
-    synchronize_rcu();
   }
 
   Port::Port(Switch &sw, std::string name)
-    : _switch(sw),  _name(name)
+    : _switch(sw),  _name(name), _id(next_id++),
+      _pushback(nullptr), _pushback_until(0), _pushback_expired(nullptr),
+      _has_static_mac(false), _numa_node(-1),
+      _stats(sw.allocate_stats(name))
   {
   }
 
   Port::~Port()
   {
     disable();
+
+    if (_stats->remote_copy_bytes)
+      logf("Copied %" PRIu64 " bytes, %" PRIu64 " (%" PRIu64 "%%) of them across NUMA nodes.",
+           _stats->copy_bytes, _stats->remote_copy_bytes,
+           _stats->remote_copy_bytes * 100 / _stats->copy_bytes);
+
     _switch.remove_dma_memory(*this);
+    _switch.release_stats(_stats);
   }
 
 }
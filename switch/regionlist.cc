@@ -0,0 +1,73 @@
+// Copyright (C) 2013, Julian Stecklina <jsteckli@os.inf.tu-dresden.de>
+// Economic rights: Technische Universitaet Dresden (Germany)
+
+// This file is part of sv3.
+
+// sv3 is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License version 2 as
+// published by the Free Software Foundation.
+
+// sv3 is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License version 2 for more details.
+
+
+#include <regionlist.hh>
+
+#include <sys/mman.h>
+
+namespace Switch {
+
+  void RegionList::replace(Table *t)
+  {
+    Table *old = _table;
+    rcu_assign_pointer(_table, t);
+    synchronize_rcu();
+    delete old;
+  }
+
+  bool RegionList::insert(Region const &r)
+  {
+    // Overflow or empty region
+    if (r.addr + r.size <= r.addr) return false;
+
+    uint64_t r_end  = r .addr + r .size;
+    for (auto &lr : *_table) {
+      uint64_t lr_end = lr.addr + lr.size;
+      if (r.addr < lr_end and lr.addr < r_end) {
+	return false;
+      }
+    }
+
+    // Sorted insert
+    Table *t = new Table(*_table);
+    auto it = std::upper_bound(t->begin(), t->end(), r.addr,
+                               [] (uint64_t a, Region const &lr) { return a < lr.addr; });
+    t->insert(it, r);
+
+    replace(t);
+    return true;
+  }
+
+  void RegionList::clear()
+  {
+    Table *old = _table;
+    rcu_assign_pointer(_table, new Table);
+    synchronize_rcu();
+
+    for (auto &r : *old)
+      munmap(r.mapping, r.size);
+    delete old;
+  }
+
+  RegionList::~RegionList()
+  {
+    for (auto &r : *_table)
+      munmap(r.mapping, r.size);
+    delete _table;
+  }
+
+}
+
+// EOF
@@ -0,0 +1,80 @@
+// Copyright (C) 2013, Julian Stecklina <jsteckli@os.inf.tu-dresden.de>
+// Economic rights: Technische Universitaet Dresden (Germany)
+
+// This file is part of sv3.
+
+// sv3 is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License version 2 as
+// published by the Free Software Foundation.
+
+// sv3 is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License version 2 for more details.
+
+
+#include <rxfilter.hh>
+#include <virtio-constants.hh>
+
+#include <algorithm>
+
+namespace Switch {
+
+  bool RxFilter::set_mode(unsigned mode, bool on)
+  {
+    switch (mode) {
+    case VIRTIO_NET_CTRL_RX_PROMISC:  _promisc  = on; break;
+    case VIRTIO_NET_CTRL_RX_ALLMULTI: _allmulti = on; break;
+    case VIRTIO_NET_CTRL_RX_ALLUNI:   _alluni   = on; break;
+    case VIRTIO_NET_CTRL_RX_NOMULTI:  _nomulti  = on; break;
+    case VIRTIO_NET_CTRL_RX_NOUNI:    _nouni    = on; break;
+    case VIRTIO_NET_CTRL_RX_NOBCAST:  _nobcast  = on; break;
+    default:
+      return false;
+    }
+
+    return true;
+  }
+
+  void RxFilter::set_mac_table(Ethernet::Address const *uni,   unsigned uni_entries,
+                               Ethernet::Address const *multi, unsigned multi_entries)
+  {
+    _uni_overflow   = uni_entries > MAC_TABLE_ENTRIES;
+    _uni_entries    = _uni_overflow ? 0 : uni_entries;
+    std::copy(uni, uni + _uni_entries, _macs);
+
+    _multi_overflow = multi_entries > MAC_TABLE_ENTRIES - _uni_entries;
+    _multi_entries  = _multi_overflow ? 0 : multi_entries;
+    std::copy(multi, multi + _multi_entries, _macs + _uni_entries);
+  }
+
+  bool RxFilter::add_vlan(unsigned vid)
+  {
+    if (vid >= MAX_VLAN) return false;
+    _vlans[vid / 32] |= 1U << (vid % 32);
+    return true;
+  }
+
+  bool RxFilter::del_vlan(unsigned vid)
+  {
+    if (vid >= MAX_VLAN) return false;
+    _vlans[vid / 32] &= ~(1U << (vid % 32));
+    return true;
+  }
+
+  void RxFilter::reset()
+  {
+    _promisc  = true;
+    _allmulti = _alluni = _nomulti = _nouni = _nobcast = false;
+
+    _filter_vlans   = false;
+    _has_mac        = false;
+    _uni_entries    = _multi_entries  = 0;
+    _uni_overflow   = _multi_overflow = false;
+
+    std::fill(_vlans, _vlans + MAX_VLAN / 32, 0);
+  }
+
+}
+
+// EOF
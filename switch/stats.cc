@@ -0,0 +1,160 @@
+// Copyright (C) 2013, Julian Stecklina <jsteckli@os.inf.tu-dresden.de>
+// Economic rights: Technische Universitaet Dresden (Germany)
+
+// This file is part of sv3.
+
+// sv3 is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License version 2 as
+// published by the Free Software Foundation.
+
+// sv3 is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License version 2 for more details.
+
+
+#include <stats.hh>
+#include <exceptions.hh>
+#include <timer.hh>
+
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+namespace Switch {
+
+  thread_local StageClock stage_clock;
+
+  void stage_clock_start(WorkerStats *stats)
+  {
+    stage_clock.last   = rdtsc();
+    stage_clock.cycles = stats->cycles;
+  }
+
+  void stage_clock_stop()
+  {
+    charge(STAGE_OTHER);
+    stage_clock.cycles = nullptr;
+  }
+
+  template <typename T>
+  T *StatsFile::allocate(Slot<T> *slots, unsigned count, std::string const &name)
+  {
+    std::lock_guard<std::mutex> lock(_mtx);
+
+    for (unsigned i = 0; i < count; i++) {
+      Slot<T> &s = slots[i];
+      if (s.in_use) continue;
+
+      memset(&s.stats, 0, sizeof(s.stats));
+      snprintf(s.name, sizeof(s.name), "%s", name.c_str());
+      __atomic_store_n(&s.generation, s.generation + 1, __ATOMIC_RELEASE);
+      __atomic_store_n(&s.in_use, 1, __ATOMIC_RELEASE);
+      return &s.stats;
+    }
+
+    void *p;
+    if (0 != posix_memalign(&p, alignof(T), sizeof(T)))
+      throw Exception("posix_memalign failed");
+    memset(p, 0, sizeof(T));
+    return static_cast<T *>(p);
+  }
+
+  template <typename T>
+  bool StatsFile::release(Slot<T> *slots, unsigned count, T *stats)
+  {
+    std::lock_guard<std::mutex> lock(_mtx);
+
+    uintptr_t p = reinterpret_cast<uintptr_t>(stats);
+    uintptr_t b = reinterpret_cast<uintptr_t>(slots);
+
+    if (p < b or p >= b + count * sizeof(Slot<T>))
+      return false;
+
+    Slot<T> &s = slots[(p - b) / sizeof(Slot<T>)];
+    __atomic_store_n(&s.in_use, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&s.generation, s.generation + 1, __ATOMIC_RELEASE);
+    return true;
+  }
+
+  PortStats *StatsFile::allocate(std::string const &name)
+  {
+    return allocate(_slots, SLOTS, name);
+  }
+
+  void StatsFile::release(PortStats *stats)
+  {
+    if (not release(_slots, SLOTS, stats)) free(stats);
+  }
+
+  WorkerStats *StatsFile::allocate_worker(std::string const &name)
+  {
+    return allocate(_workers, WORKERS, name);
+  }
+
+  void StatsFile::release(WorkerStats *stats)
+  {
+    if (not release(_workers, WORKERS, stats)) free(stats);
+  }
+
+  void StatsFile::reset_histograms()
+  {
+    std::lock_guard<std::mutex> lock(_mtx);
+
+    _resets_seen = __atomic_load_n(&_header->reset_requests, __ATOMIC_RELAXED);
+
+    for (unsigned i = 0; i < WORKERS; i++)
+      _workers[i].stats.quantum.reset();
+
+    for (unsigned i = 0; i < SLOTS; i++) {
+      PortStats &s = _slots[i].stats;
+      s.poll_to_deliver.reset();
+      s.kick_to_poll.reset();
+      s.deliver_to_irq.reset();
+    }
+  }
+
+  StatsFile::StatsFile(char const *path)
+    : _path(path ? path : ""),
+      _size(sizeof(Header) + WORKERS * sizeof(Slot<WorkerStats>) + SLOTS * sizeof(Slot<PortStats>)),
+      _resets_seen(0)
+  {
+    int fd = -1;
+
+    if (path) {
+      fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+      if (fd < 0 or ftruncate(fd, _size) != 0)
+	throw SystemError("Could not create statistics file %s.", path);
+    }
+
+    void *m = mmap(nullptr, _size, PROT_READ | PROT_WRITE,
+		   path ? MAP_SHARED : (MAP_PRIVATE | MAP_ANONYMOUS), fd, 0);
+    if (fd >= 0) close(fd);
+    if (m == MAP_FAILED)
+      throw SystemError("Could not map statistics.");
+
+    _header  = static_cast<Header *>(m);
+    _workers = reinterpret_cast<Slot<WorkerStats> *>(_header + 1);
+    _slots   = reinterpret_cast<Slot<PortStats> *>(_workers + WORKERS);
+
+    _header->slots             = SLOTS;
+    _header->slot_size         = sizeof(Slot<PortStats>);
+    _header->workers           = WORKERS;
+    _header->worker_size       = sizeof(Slot<WorkerStats>);
+    _header->cycles_per_second = cycles_per_second();
+    _header->version           = VERSION;
+    __atomic_store_n(&_header->magic, MAGIC, __ATOMIC_RELEASE);
+  }
+
+  StatsFile::~StatsFile()
+  {
+    munmap(_header, _size);
+    if (not _path.empty()) unlink(_path.c_str());
+  }
+
+}
+
+// EOF
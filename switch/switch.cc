@@ -14,12 +14,18 @@
 
 
 #include <switch.hh>
+#include <exceptions.hh>
+#include <algorithm>
+#include <cerrno>
 #include <cstdarg>
 #include <unistd.h>
+#include <poll.h>
 #include <sys/eventfd.h>
 
+#include <numa.hh>
 #include <timer.hh>
 #include <tracing.hh>
+#include <probes.hh>
 
 namespace Switch {
 
@@ -42,13 +48,23 @@ namespace Switch {
 
   void Switch::announce_dma_memory(Port &port, void *p, size_t len)
   {
-    dma_region r = {p, len};
-    _dma_regions[&port].push_back(r);
-    _dma_cb(p, len);
+    dma_memory_callback cb;
+    {
+      std::lock_guard<std::mutex> lock(_dma_mtx);
+      dma_region r = {p, len};
+      _dma_regions[&port].push_back(r);
+      cb = _dma_cb;
+    }
+
+    // Mapping memory for DMA takes a while. Don't serialize guests
+    // that start at the same time.
+    cb(p, len);
   }
 
   void Switch::register_dma_memory_callback(dma_memory_callback cb)
   {
+    std::lock_guard<std::mutex> lock(_dma_mtx);
+
     for (auto it : _dma_regions)
       for (auto r : it.second)
 	cb(r.addr, r.len);
@@ -58,9 +74,109 @@ namespace Switch {
 
   void Switch::remove_dma_memory(Port &port)
   {
-    auto it = _dma_regions.find(&port);
-    assert(it != _dma_regions.end());
-    _dma_regions.erase(it);
+    // Ports may go away before they had any memory (or remove it
+    // twice, when a vhost-user frontend replaces guest memory).
+    std::lock_guard<std::mutex> lock(_dma_mtx);
+    _dma_regions.erase(&port);
+  }
+
+  void Switch::complete_orphan(Packet::CompletionInfo const &c)
+  {
+    {
+      std::lock_guard<std::mutex> lock(_orphans_mtx);
+      _orphans.push_back(c);
+    }
+
+    _have_orphans.store(true, std::memory_order_release);
+    schedule_poll();
+  }
+
+  void Switch::release_ports(PortsList const &old, PortsList const &ports)
+  {
+    // Detached ports still exist, because detach_port() waits for us.
+    std::vector<Port *> gone;
+    for (Port *port : old)
+      if (std::find(ports.begin(), ports.end(), port) == ports.end())
+        gone.push_back(port);
+
+    for (Port *g : gone) {
+      for (Port *port : old)
+        if (port != g) port->drop_held(g);
+      g->drop_held(nullptr);
+    }
+
+    // Nobody polls detached ports anymore. Get completions to their
+    // guests now.
+    for (Port *g : gone) g->flush_irq();
+    _irq_batch.flush();
+  }
+
+  void Switch::complete_orphans(PortsList const &ports)
+  {
+    std::vector<Packet::CompletionInfo> orphans;
+    {
+      std::lock_guard<std::mutex> lock(_orphans_mtx);
+      _have_orphans.store(false, std::memory_order_relaxed);
+      orphans.swap(_orphans);
+    }
+
+    // Packets from ports that are gone don't need to be completed.
+    for (Packet::CompletionInfo &c : orphans)
+      if (std::find(ports.begin(), ports.end(), c.src_port) != ports.end())
+	c.src_port->mark_done(c);
+  }
+
+  bool Switch::pushed_back(PortsList const &ports, Port &src_port)
+  {
+    // The port we were waiting for might be gone. Only look at it, if
+    // it is still in the list of ports, because then it is safe to
+    // access.
+    for (Port *port : ports)
+      if (port == src_port._pushback and port->congested()) {
+        if (rdtsc() < src_port._pushback_until)
+          return true;
+
+        // Don't hold up everything else the source sends (think of
+        // an uplink) for a single port. The port has to drop.
+        src_port._pushback_expired = port;
+        break;
+      }
+
+    src_port._pushback = nullptr;
+    return false;
+  }
+
+  uint64_t Switch::deadline(PortsList const &ports)
+  {
+    uint64_t first = 0;
+
+    for (Port *port : ports) {
+      uint64_t d = port->deadline();
+      if (port->_pushback and (d == 0 or port->_pushback_until < d))
+        d = port->_pushback_until;
+      if (d and (first == 0 or d < first))
+        first = d;
+    }
+
+    return first;
+  }
+
+  bool Switch::block(uint64_t deadline)
+  {
+    if (deadline) {
+      uint64_t now    = rdtsc();
+      uint64_t cycles = deadline > now ? deadline - now : 0;
+      uint64_t ns     = cycles * 1000000000.0 / cycles_per_second();
+
+      pollfd   pfd = { _event_fd, POLLIN, 0 };
+      timespec ts  = { time_t(ns / 1000000000), long(ns % 1000000000) };
+      int r = ppoll(&pfd, 1, &ts, nullptr);
+      if (r == 0 or (r < 0 and errno == EINTR))
+        return true;
+    }
+
+    uint64_t val;
+    return read(_event_fd, &val, sizeof(val)) == sizeof(val);
   }
 
   /// Switch a couple of packets. Returns false if we were idle.
@@ -72,6 +188,12 @@ namespace Switch {
 
     for (Port *src_port : ports) { // Packet switching loop
 
+      // Leave packets where they are, while their destination is
+      // congested. This is no work. If we block, we wake up when the
+      // congestion expires (see deadline).
+      if (UNLIKELY(src_port->_pushback) and pushed_back(ports, *src_port))
+	continue;
+
       // XXX Be fair! Instead of a fixed batch size, count packets
       // copied, fragments handled and packets handled and compute an
       // estimate of the time we needed from that. Then we can switch
@@ -80,21 +202,45 @@ namespace Switch {
       for (unsigned quota = _batch_size; quota > 0; quota--) {
 	Packet p(src_port);
 
-	if (not src_port->poll(p, enabled_notifications)) break;
+	if (not src_port->poll(p, enabled_notifications)) {
+	  charge(STAGE_POLL_EMPTY);
+	  break;
+	}
+
+	uint64_t polled       = charge(STAGE_POLL);
+	uint32_t frame_length = p.packet_length - sizeof(virtio_net_hdr_mrg_rxbuf);
+	src_port->_stats->rx_packets += 1;
+	src_port->_stats->rx_bytes   += frame_length;
+	PROBE2(poll, src_port->id(), frame_length);
 	// logf("Polling port '%s' returned %u byte packet.", src_port->name().c_str(),
 	//      p.packet_length);
 
 	// Mark the packet as done when we leave this scope. We make
 	// sure to call this even if one of the receive() methods
 	// throws an exception.
-	auto closure = [&] () { if (p.copied == 0) src_port->mark_done(p.completion_info); };
+	auto closure = [&] () {
+	  src_port->_stats->poll_to_deliver.add(charge(STAGE_DELIVER) - polled);
+	  trace(COMPLETION, src_port->id(), 0, p.copied);
+	  if (p.copied == 0)
+	    src_port->mark_done(p.completion_info);
+	  else
+	    src_port->defer_done(p.completion_info, p.copied);
+	  charge(STAGE_COMPLETE);
+	};
 	Finally<decltype(closure)> when_done(closure);
 
 	auto &ehdr = p.ethernet_header();
 	// logf("Destination %s", ehdr.dst.to_str());
 	// logf("Source      %s", ehdr.src.to_str());
 
-	Port *dst_port = LIKELY(not ehdr.dst.is_multicast()) ? mac_cache[ehdr.dst] : nullptr;
+	Port *dst_port = nullptr;
+	if (LIKELY(not ehdr.dst.is_multicast())) {
+	  dst_port = mac_cache[ehdr.dst];
+	  if (UNLIKELY(dst_port == nullptr))
+	    dst_port = static_lookup(ports, mac_cache, ehdr.dst);
+	}
+	trace(LOOKUP, src_port->id(), frame_length, dst_port ? dst_port->id() : -1);
+
 	if (UNLIKELY(dst_port == src_port)) {
 	  logf("Destination port is same as source port?");
 	  continue;
@@ -109,13 +255,37 @@ namespace Switch {
 	  mac_cache.add(ehdr.src, src_port);
 	}
 
+	charge(STAGE_LOOKUP);
 
 	if (LIKELY(dst_port)) {
 	  dst_port->receive(p);
+	  dst_port->_stats->tx_packets += 1;
+	  dst_port->_stats->tx_bytes   += frame_length;
+	  PROBE3(deliver, src_port->id(), dst_port->id(), frame_length);
+
+	  if (UNLIKELY(dst_port->congested())) {
+	    // Push back on the source instead of having the destination
+	    // drop packets. Unless we did that already for too long.
+	    if (src_port->_pushback_expired != dst_port) {
+	      src_port->_pushback       = dst_port;
+	      src_port->_pushback_until = rdtsc() + _pushback_cycles;
+	      work_done = true;
+	      break;
+	    }
+	  } else if (UNLIKELY(src_port->_pushback_expired == dst_port))
+	    src_port->_pushback_expired = nullptr;
 	} else {
+	  // Don't waste a copy on ports that will throw the packet away.
+	  src_port->_stats->floods += 1;
+	  trace(FLOOD, src_port->id(), frame_length);
+	  PROBE2(flood, src_port->id(), frame_length);
 	  for (Port *dst_port : ports)
-	    if (dst_port != src_port)
+	    if (dst_port != src_port and dst_port->accepts(ehdr, p.payload_length())) {
 	      dst_port->receive(p);
+	      dst_port->_stats->tx_packets += 1;
+	      dst_port->_stats->tx_bytes   += frame_length;
+	      PROBE3(deliver, src_port->id(), dst_port->id(), frame_length);
+	    }
 	}
 
 	work_done = true;
@@ -123,8 +293,11 @@ namespace Switch {
       }
     }
 
-    // Deliver interrupts.
+    // Deliver interrupts. Ports only queue them, so we submit them
+    // with a single system call.
     for (Port *port : ports) port->poll_irq();
+    _irq_batch.flush();
+    charge(STAGE_IRQ);
 
     return work_done;
   }
@@ -139,6 +312,20 @@ namespace Switch {
 
     trace(WAKEUP);
 
+    int numa_node = -1;
+
+    _worker_stats = _stats_file->allocate_worker("switch");
+    stage_clock_start(_worker_stats);
+
+    {
+      std::lock_guard<std::mutex> lock(_ports_mtx);
+      _looping = true;
+    }
+
+    // The ports we worked with last time around.
+    std::vector<Port *> seen;
+    uint64_t            seen_version = 0;
+
     do {			// Main loop
       enum {
 	WORK,
@@ -146,17 +333,46 @@ namespace Switch {
 	NOTIFICATION_ENABLE,
       } state = WORK;
 
+      charge(STAGE_OTHER);
       trace(QUIESCENT);
       rcu_quiescent_state();
+      PROBE0(quiescent);
+      charge(STAGE_QUIESCENT);
+
+      _stats_file->check_reset();
+
+      if (UNLIKELY(_preferred_node.load(std::memory_order_relaxed) != numa_node)) {
+        numa_node = _preferred_node.load(std::memory_order_relaxed);
+        if (numa_node >= 0 and Numa::run_on(numa_node))
+          logf("Switching on NUMA node %d.", numa_node);
+      }
+
+      // The ports are at least as new as their version.
+      uint64_t         version   = _ports_version.load(std::memory_order_acquire);
 
       // Casting madness... Otherwise this won't compile.
       PortsList      **pports    =  const_cast<PortsList **>(&_ports);
       PortsList const &ports     = *rcu_dereference(*pports);
       SwitchHash      &mac_cache = *rcu_dereference(_mac_table);
       bool             work_done = false;
+
+      if (UNLIKELY(version != seen_version)) {
+        release_ports(seen, ports);
+        seen         = ports;
+        seen_version = version;
+
+        std::lock_guard<std::mutex> lock(_ports_mtx);
+        _ports_released = version;
+        _ports_cv.notify_all();
+      }
+
+      if (UNLIKELY(_have_orphans.load(std::memory_order_acquire)))
+	complete_orphans(ports);
+
       // We will exit our main polling loop according to this timer to
       // enter a quiescent state.
       rcu_timer.arm();
+      uint64_t quantum_start = rdtsc();
 
       while (LIKELY(not should_shutdown())) { // RCU Loop
         work_done = false;
@@ -164,7 +380,10 @@ namespace Switch {
 	  work_done = work_quantum(ports, mac_cache, state == NOTIFICATION_ENABLE);
 	} catch (PortBrokenException e) {
 	  e.port().logf("Illegal behavior: %s", e.reason());
-	  detach_port(e.port());
+	  e.port()._stats->drops_broken += 1;
+	  PROBE3(drop, e.port().id(), DROP_BROKEN, 0);
+	  // We cannot wait for a grace period here.
+	  detach_port(e.port(), false);
 	  work_done = true;
           // Exit loop to force a quiescent state.
           break;
@@ -172,6 +391,10 @@ namespace Switch {
 
         uint64_t now = rdtsc();
 
+	if (LIKELY(work_done))
+	  _worker_stats->quantum.add(now - quantum_start);
+	quantum_start = now;
+
 	// We have seen action.
 	if (LIKELY(work_done)) {
 	  state = WORK;
@@ -187,7 +410,7 @@ namespace Switch {
 	  // The switch was idle for the first time.
 	  if (_poll_us) {
 	    // Start the idle clock.
-            trace(WENT_IDLE, 0, 0, now);
+            trace(WENT_IDLE, -1, 0, 0, now);
 	    state = IDLE;
 	    idle_timer.arm(now);
 	  } else {
@@ -216,93 +439,244 @@ namespace Switch {
         // block.
         continue;
 
-      // Block
-      trace(BLOCK);
-      rcu_thread_offline();
+      // Nobody will look at held back interrupts while we sleep.
+      for (Port *port : ports) port->flush_irq();
+      _irq_batch.flush();
+      charge(STAGE_IRQ);
+
+      // Block. Backlogs and push back expire, even if nobody wakes us.
       {
-	uint64_t val;
-	int r = read(_event_fd, &val, sizeof(val));
-	if (r != sizeof(val))
+	uint64_t until = deadline(ports);
+
+	trace(BLOCK);
+	PROBE0(block);
+	rcu_thread_offline();
+	if (not block(until))
 	  break;
       }
       rcu_thread_online();
+      charge(STAGE_BLOCK);
       trace(WAKEUP);
+      PROBE0(wakeup);
 
 
     } while (not should_shutdown());
 
+    {
+      std::lock_guard<std::mutex> lock(_ports_mtx);
+      _looping = false;
+      _ports_cv.notify_all();
+    }
+
+    stage_clock_stop();
+    _stats_file->release(_worker_stats);
+    _worker_stats = nullptr;
+
     logf("Main loop returned.");
   }
 
-  void Switch::cb_free_pending(struct rcu_head *head)
-  {
-    Switch *sw = static_cast<Switch *>(head);
-    sw->free_pending();
-  }
+  // What a batch of port changes replaced. Freed after a grace period.
+  struct RetiredPorts : rcu_head {
+    std::vector<Port *> const *ports;
+    SwitchHash                *mac_table;
 
-  void Switch::free_pending()
-  {
-    std::vector<std::function<void()>> pending;
+    static void free(rcu_head *head)
     {
-      std::lock_guard<std::mutex> lock(_pending_free_mtx);
-      pending.swap(_pending_free);
+      RetiredPorts *r = static_cast<RetiredPorts *>(head);
+      delete r->ports;
+      delete r->mac_table;
+      delete r;
     }
+  };
 
-    for (std::function<void()> &p : pending) p();
+  // Takes an RCU reader offline while it waits for other threads.
+  // Otherwise, it would hold up the grace period they wait for.
+  class RcuOffline : Uncopyable {
+    bool const _online;
+
+  public:
+    RcuOffline() : _online(rcu_read_ongoing()) { if (_online) rcu_thread_offline(); }
+    ~RcuOffline() { if (_online) rcu_thread_online(); }
+  };
+
+  void Switch::publish_ports()
+  {
+    PortsList *newp = new PortsList(*_ports);
+    for (auto &f : _port_changes) f(*newp);
+    _port_changes.clear();
+
+    // Start with an empty MAC address cache, except for addresses
+    // that ports own.
+    SwitchHash *newm = new SwitchHash;
+    for (Port *port : *newp)
+      if (port->_has_static_mac)
+        newm->add(port->_static_mac, port);
+
+    RetiredPorts *r = new RetiredPorts;
+    r->ports     = _ports;
+    r->mac_table = rcu_xchg_pointer(&_mac_table, newm);
+    rcu_assign_pointer(_ports, newp);
+    call_rcu(r, RetiredPorts::free);
+
+    _ports_published++;
+    _ports_version.store(_ports_published, std::memory_order_release);
+
+    // Switch where most packets need to be copied from or to.
+    std::map<int, unsigned> nodes;
+    for (Port *port : *newp)
+      if (port->_numa_node >= 0)
+        nodes[port->_numa_node]++;
+
+    int node = -1;
+    for (auto &n : nodes)
+      if (node < 0 or n.second > nodes[node])
+        node = n.first;
+
+    _preferred_node.store(node, std::memory_order_relaxed);
   }
 
-  void Switch::modify_ports(std::function<void(PortsList &)> f)
+  uint64_t Switch::modify_ports(std::function<void(PortsList &)> f, bool wait)
   {
-    std::list<Port *> const *oldp;
-    std::list<Port *>       *newp = new std::list<Port *>(*_ports);
-    SwitchHash              *oldm;
-    SwitchHash              *newm = new SwitchHash;
+    std::unique_lock<std::mutex> lock(_ports_mtx);
 
-    // Update ports list. Use a mutex to not race with other calls to
-    // this function.
-    {
-      std::lock_guard<std::mutex> lock(_ports_mtx);
-      oldp   = _ports;
-      f(*newp);
-      _ports = newp;
+    _port_changes.push_back(f);
+
+    if (not wait) {
+      publish_ports();
+      return _ports_published;
     }
 
-    // Delete MAC address cache. No problem to race here.
-    oldm = rcu_xchg_pointer(&_mac_table, newm);
+    // Our change goes out with the next batch. Whoever finds nobody
+    // else waiting for a grace period publishes everything that is
+    // queued and waits for everyone. Changes that come in meanwhile
+    // pile up for the next batch.
+    uint64_t   batch = _ports_published + 1;
+    RcuOffline offline;
 
-    {
-      std::lock_guard<std::mutex> lock(_pending_free_mtx);
-      _pending_free.push_back([=] () {
-	  delete oldm;
-	  delete oldp;
-	});
+    while (_ports_synced < batch) {
+      if (_ports_leader) {
+        _ports_cv.wait(lock);
+        continue;
+      }
+
+      _ports_leader = true;
+      if (not _port_changes.empty()) publish_ports();
+      uint64_t published = _ports_published;
+
+      lock.unlock();
+      synchronize_rcu();
+      lock.lock();
+
+      _ports_synced = published;
+      _ports_leader = false;
+      _ports_cv.notify_all();
     }
 
-    call_rcu(this, cb_free_pending);
+    return batch;
   }
 
   void Switch::attach_port(Port &p)
   {
     size_t size;
-    modify_ports([&](PortsList &ports) { ports.push_front(&p); size = ports.size(); });
+    modify_ports([&](PortsList &ports) { ports.insert(ports.begin(), &p); size = ports.size(); });
 
-    logf("Attaching port '%s'. We have %zu port%s.",
-	 p.name().c_str(), size, size == 1 ? "" : "s");
+    logf("Attaching port '%s' (id %d). We have %zu port%s.",
+	 p.name().c_str(), p.id(), size, size == 1 ? "" : "s");
+    PROBE2(attach, p.id(), p.name().c_str());
   }
 
-  void Switch::detach_port(Port &p)
+  void Switch::detach_port(Port &p, bool wait)
   {
     size_t size;
-    modify_ports([&](PortsList &ports) {
+    uint64_t batch = modify_ports([&](PortsList &ports) {
 	for (auto it = ports.begin(); it != ports.end(); ++it)
 	  if (*it == &p) {
 	    ports.erase(it);
 	    size = ports.size();
 	    logf("Detaching port '%s'. %zu port%s left.",
 		 p.name().c_str(), size, size == 1 ? "" : "s");
+	    PROBE2(detach, p.id(), p.name().c_str());
 	    break;
 	  }
-      });
+      }, wait);
+
+    if (not wait) return;
+
+    // Other ports may still hold packets from p and vice versa. The
+    // switch thread gives them back, when it sees the new set of
+    // ports. Until then, p must keep its queues. The grace period
+    // doesn't tell us, because the switch thread is offline while it
+    // blocks, so wake it up.
+    schedule_poll();
+
+    RcuOffline                   offline;
+    std::unique_lock<std::mutex> lock(_ports_mtx);
+    _ports_cv.wait(lock, [&] { return _ports_released >= batch or not _looping; });
+  }
+
+  Port *Switch::static_lookup(PortsList const &ports, SwitchHash &mac_cache,
+                              Ethernet::Address const &dst)
+  {
+    // This is only a list walk on the way to flooding the packet,
+    // which is a list walk as well.
+    for (Port *port : ports)
+      if (port->owns(dst)) {
+        mac_cache.add(dst, port);
+        return port;
+      }
+
+    return nullptr;
+  }
+
+  void Switch::configure_mac_pool(Ethernet::Address const &first, unsigned count)
+  {
+    std::lock_guard<std::mutex> lock(_mac_pool_mtx);
+
+    if (first.is_multicast())
+      throw ConfigurationError("MAC pool must not start with a multicast address.");
+    if (first.to_u64() + count > (1ULL << 48))
+      throw ConfigurationError("MAC pool exceeds the address space.");
+
+    // The multicast bit is bit 40 of the first address. A pool that
+    // carries into it would hand out multicast addresses.
+    uint64_t last = first.to_u64() + count - 1;
+    if (count and (last >> 40) != (first.to_u64() >> 40))
+      throw ConfigurationError("MAC pool must not contain multicast addresses.");
+
+    _mac_pool_first = first.to_u64();
+    _mac_pool_used.assign(count, false);
+
+    if (count)
+      logf("Handing out MAC addresses %s + %u.", first.to_str(), count);
+  }
+
+  bool Switch::allocate_mac(Ethernet::Address &addr)
+  {
+    std::lock_guard<std::mutex> lock(_mac_pool_mtx);
+
+    for (size_t i = 0; i < _mac_pool_used.size(); i++)
+      if (not _mac_pool_used[i]) {
+        _mac_pool_used[i] = true;
+        addr = Ethernet::Address::from_u64(_mac_pool_first + i);
+        return true;
+      }
+
+    return false;
+  }
+
+  void Switch::release_mac(Ethernet::Address const &addr)
+  {
+    std::lock_guard<std::mutex> lock(_mac_pool_mtx);
+
+    uint64_t i = addr.to_u64() - _mac_pool_first;
+    if (i < _mac_pool_used.size())
+      _mac_pool_used[i] = false;
+  }
+
+  void Switch::configure_stats(char const *path)
+  {
+    _stats_file.reset(new StatsFile(path));
+    logf("Port statistics are in %s.", path);
   }
 
   void Switch::schedule_poll()
@@ -313,17 +687,27 @@ namespace Switch {
 
   Switch::Switch(unsigned poll_us, unsigned batch_size)
     : _poll_us(poll_us), _batch_size(batch_size),
+      _pushback_cycles(cycles_per_second() / 1000000 * PUSHBACK_US),
       _shutdown_called(false),
       _mac_table(new SwitchHash), _ports(new PortsList),
-      _ports_mtx()
+      _ports_mtx(), _ports_published(0), _ports_synced(0), _ports_leader(false),
+      _ports_released(0), _looping(false), _ports_version(0),
+      _have_orphans(false),
+      _mac_pool_first(0), _stats_file(new StatsFile), _worker_stats(nullptr),
+      _preferred_node(-1),
+      _coal_max_us(0), _coal_max_packets(1)
   {
     _event_fd = eventfd(0, 0);
+
+    logf("Guest interrupts are %s.",
+         _irq_batch.batching() ? "batched via io_uring" : "delivered via write()");
     register_dma_memory_callback([&] (void *p, size_t s) { });
   }
 
   Switch::~Switch()
   {
-    // Don't need to do anything here for now.
+    // Wait until retired port lists are freed.
+    rcu_barrier();
     logf("Switch destroyed.");
   }
 
@@ -14,14 +14,115 @@
 
 
 #include <tracing.hh>
+#include <exceptions.hh>
+#include <timer.hh>
 
-#ifdef TRACING
+#include <string>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 
 namespace Switch {
-  char  *trace_buffer;
-  size_t trace_offset;
-}
 
-#endif
+  std::atomic<bool> trace_enabled { false };
+
+  static TraceHeader *trace_header;
+  static size_t       trace_size;
+  static std::string  trace_path;
+  static bool         trace_keep;
+
+  static std::atomic<unsigned> trace_rings_used { 0 };
+
+  static inline TraceRing *ring_at(unsigned i)
+  {
+    size_t ring_size = sizeof(TraceRing) + TRACE_RING_ENTRIES * sizeof(TraceEntry);
+    return reinterpret_cast<TraceRing *>(reinterpret_cast<char *>(trace_header + 1) +
+                                         i * ring_size);
+  }
+
+  void trace_slow(TraceEvent event, int32_t port, uint32_t length,
+                  uint64_t arg, uint64_t now)
+  {
+    // Each thread takes a ring the first time it traces. Threads that
+    // come too late aren't traced.
+    static thread_local TraceRing *ring;
+    static thread_local bool       no_ring;
+
+    if (UNLIKELY(not ring)) {
+      if (no_ring or not trace_header) return;
+
+      unsigned i = trace_rings_used.fetch_add(1);
+      if (i >= TRACE_RINGS) { no_ring = true; return; }
+
+      ring = ring_at(i);
+      __atomic_store_n(&ring->tid, uint32_t(syscall(SYS_gettid)), __ATOMIC_RELEASE);
+    }
+
+    TraceEntry *e = reinterpret_cast<TraceEntry *>(ring + 1) +
+      (ring->written % TRACE_RING_ENTRIES);
+
+    e->time   = now ? now : rdtsc();
+    e->event  = event;
+    e->port   = port;
+    e->length = length;
+    e->arg    = arg;
+
+    __atomic_store_n(&ring->written, ring->written + 1, __ATOMIC_RELEASE);
+  }
+
+  void trace_open(char const *path, bool keep)
+  {
+    trace_size = sizeof(TraceHeader) +
+      TRACE_RINGS * (sizeof(TraceRing) + TRACE_RING_ENTRIES * sizeof(TraceEntry));
+
+    // The file is sparse. It only takes up space for what we trace.
+    int fd = open(path, O_RDWR | O_TRUNC | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+      throw SystemError("Could not create trace file %s.", path);
+
+    void *m = MAP_FAILED;
+    if (ftruncate(fd, trace_size) == 0)
+      m = mmap(nullptr, trace_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (m == MAP_FAILED) {
+      // Don't leave a broken file behind.
+      SystemError e("Could not set up trace file %s.", path);
+      close(fd);
+      unlink(path);
+      throw e;
+    }
+    close(fd);
+
+    TraceHeader *h = static_cast<TraceHeader *>(m);
+    h->version           = TRACE_VERSION;
+    h->rings             = TRACE_RINGS;
+    h->ring_entries      = TRACE_RING_ENTRIES;
+    h->entry_size        = sizeof(TraceEntry);
+    h->cycles_per_second = cycles_per_second();
+    __atomic_store_n(&h->magic, TRACE_MAGIC, __ATOMIC_RELEASE);
+
+    trace_path   = path;
+    trace_keep   = keep;
+    trace_header = h;
+  }
+
+  void trace_close()
+  {
+    if (not trace_header) return;
+
+    // Threads may still be tracing, so we leave the mapping alone.
+    trace_enabled.store(false);
+    if (not trace_keep) unlink(trace_path.c_str());
+  }
+
+  void trace_toggle()
+  {
+    if (trace_header)
+      trace_enabled.store(not trace_enabled.load());
+  }
+
+}
 
 // EOF
@@ -0,0 +1,349 @@
+// Copyright (C) 2013, Julian Stecklina <jsteckli@os.inf.tu-dresden.de>
+// Economic rights: Technische Universitaet Dresden (Germany)
+
+// This file is part of sv3.
+
+// sv3 is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License version 2 as
+// published by the Free Software Foundation.
+
+// sv3 is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License version 2 for more details.
+
+#include <cinttypes>
+#include <cstddef>
+#include <cstring>
+#include <ctime>
+#include <algorithm>
+
+#include <unistd.h>
+
+#include <trafficgen.hh>
+#include <exceptions.hh>
+#include <timer.hh>
+
+namespace Switch {
+
+  enum {
+    UDP_HEADER  = 8,
+    L2_L3       = sizeof(Ethernet::Header) + sizeof(IPv4::Header),
+    SRC_PORT    = 1024,
+    DST_PORT    = 9,            // discard
+  };
+
+  static void ipv4_address(IPv4::Address &a, uint8_t net, unsigned host)
+  {
+    a.byte[0] = 10;
+    a.byte[1] = net;
+    a.byte[2] = host >> 8;
+    a.byte[3] = host;
+  }
+
+  unsigned TrafficGenerator::build_frame(unsigned idx, uint64_t now)
+  {
+    unsigned length = _config.sizes[_size_idx];
+    unsigned flow   = _flow_idx;
+    bool     tso    = length > MAX_FRAME;
+
+    if (++_size_idx == _config.sizes.size()) _size_idx = 0;
+    if (++_flow_idx == _config.flows)        _flow_idx = 0;
+
+    uint8_t *buf = buffer(idx);
+    auto    &hdr = *reinterpret_cast<virtio_net_hdr_mrg_rxbuf *>(buf);
+    auto    &eth = *reinterpret_cast<Ethernet::Header *>(buf + sizeof(hdr));
+    auto    &ip  = eth.ipv4[0];
+    uint8_t *l4  = buf + sizeof(hdr) + L2_L3;
+
+    memset(&hdr, 0, sizeof(hdr));
+
+    unsigned mac = flow % _config.macs;
+    eth.dst  = _config.dst;
+    eth.src  = Ethernet::Address::from_u64(0x020000000000ULL | 0x5300000000ULL | mac);
+    eth.type = Ethernet::Ethertype::IPV4;
+
+    memset(&ip, 0, sizeof(ip));
+    ip._version = 4;
+    ip.ihl      = 5;
+    ip.len      = Endian::bswap16(length - sizeof(Ethernet::Header));
+    ip.id       = Endian::bswap16(uint16_t(_seq));
+    ip.ttl      = 64;
+    ip.proto    = tso ? IPv4::Proto::TCP : IPv4::Proto::UDP;
+    ipv4_address(ip.src, 1, mac);
+    ipv4_address(ip.dst, 2, flow % _config.ips);
+    ip.checksum = ~OnesComplement::fold(OnesComplement::checksum(reinterpret_cast<uint8_t *>(&ip), sizeof(ip)));
+
+    unsigned l4_length;
+    if (not tso) {
+      uint16_t *udp = reinterpret_cast<uint16_t *>(l4);
+      udp[0] = Endian::bswap16(SRC_PORT + flow);
+      udp[1] = Endian::bswap16(DST_PORT);
+      udp[2] = Endian::bswap16(length - L2_L3);
+      udp[3] = 0;               // No checksum
+      l4_length = UDP_HEADER;
+    } else {
+      auto &tcp = *reinterpret_cast<TCP::Header *>(l4);
+      memset(&tcp, 0, sizeof(tcp));
+      tcp.src    = Endian::bswap16(SRC_PORT + flow);
+      tcp.dst    = Endian::bswap16(DST_PORT);
+      tcp.off    = sizeof(tcp) / 4;
+      tcp.flags  = 0x18;        // PSH, ACK
+      tcp.window = 0xFFFF;
+      // The receiver computes the rest of the checksum.
+      tcp.checksum = OnesComplement::fold(ip.pseudo_checksum());
+      l4_length    = sizeof(tcp);
+
+      hdr.flags       = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+      hdr.gso_type    = VIRTIO_NET_HDR_GSO_TCPV4;
+      hdr.gso_size    = _config.mss;
+      hdr.hdr_len     = L2_L3 + l4_length;
+      hdr.csum_start  = L2_L3;
+      hdr.csum_offset = offsetof(TCP::Header, checksum);
+    }
+
+    Stamp &s    = *reinterpret_cast<Stamp *>(l4 + l4_length);
+    s.magic     = STAMP_MAGIC + id();
+    s.seq       = _seq++;
+    s.sent      = now;
+
+    return sizeof(hdr) + length;
+  }
+
+  bool TrafficGenerator::poll(Packet &p, bool enable_notifications)
+  {
+    uint64_t now = rdtsc();
+
+    if (UNLIKELY(now - _last_report > _report_cycles))
+      report(now);
+
+    if (_interval) {
+      uint64_t next = _next.load(std::memory_order_relaxed);
+      if (now < next) {
+        if (UNLIKELY(enable_notifications)) arm_wakeup();
+        return false;
+      }
+
+      // Don't make up for all the time we were not polled.
+      next = std::max(next, now - BURST * _interval);
+      _next.store(next + _interval, std::memory_order_relaxed);
+    }
+
+    if (UNLIKELY(_free.empty()))
+      return false;
+
+    unsigned idx = _free.back();
+    _free.pop_back();
+    _holders[idx] = 1;
+
+    unsigned length = build_frame(idx, now);
+
+    p.fragments          = 1;
+    p.fragment[0]        = buffer(idx);
+    p.fragment_length[0] = length;
+    p.packet_length      = length;
+    p.completion_info.virtio.index = idx;
+
+    _counters.tx_packets += 1;
+    _counters.tx_bytes   += length - sizeof(virtio_net_hdr_mrg_rxbuf);
+    return true;
+  }
+
+  void TrafficGenerator::defer_done(Packet::CompletionInfo &c, unsigned holders)
+  {
+    _holders[c.virtio.index] = holders;
+  }
+
+  void TrafficGenerator::mark_done(Packet::CompletionInfo &c)
+  {
+    unsigned idx = c.virtio.index;
+
+    if (_holders[idx] > 1) {
+      _holders[idx]--;
+      return;
+    }
+
+    _free.push_back(idx);
+  }
+
+  void TrafficGenerator::receive(Packet &p)
+  {
+    // Enough for Ethernet, IPv4 and TCP with all options, followed by
+    // our stamp.
+    uint8_t  frame[sizeof(Ethernet::Header) + 60 + 60 + sizeof(Stamp)];
+    unsigned length = p.packet_length - sizeof(virtio_net_hdr_mrg_rxbuf);
+    uint64_t now    = rdtsc();
+
+    if (not p.read(0, frame, std::min<size_t>(length, sizeof(frame))))
+      goto other;
+
+    {
+      auto const &eth = *reinterpret_cast<Ethernet::Header const *>(frame);
+      if (length < L2_L3 or eth.type != Ethernet::Ethertype::IPV4)
+        goto other;
+
+      auto const &ip = eth.ipv4[0];
+      unsigned    l4 = sizeof(Ethernet::Header) + ip.ihl * 4;
+      unsigned    l4_length;
+
+      if (ip.proto == IPv4::Proto::UDP)
+        l4_length = UDP_HEADER;
+      else if (ip.proto == IPv4::Proto::TCP and l4 + sizeof(TCP::Header) <= length)
+        l4_length = reinterpret_cast<TCP::Header const *>(frame + l4)->off * 4;
+      else
+        goto other;
+
+      if (l4 + l4_length + sizeof(Stamp) > std::min<size_t>(length, sizeof(frame)))
+        goto other;
+
+      Stamp s;
+      memcpy(&s, frame + l4 + l4_length, sizeof(s));
+      if (s.magic != STAMP_MAGIC + id())
+        goto other;
+
+      if (int32_t(s.seq - _last_seq) < 0) _counters.reordered += 1;
+      _last_seq = s.seq;
+
+      _counters.rx_packets += 1;
+      _counters.rx_bytes   += length;
+      _latency.add(now > s.sent ? now - s.sent : 0);
+      return;
+    }
+
+  other:
+    _counters.rx_other += 1;
+  }
+
+  void TrafficGenerator::report(uint64_t now, bool final)
+  {
+    double   secs = double(now - _last_report) / cycles_per_second();
+    double   us   = cycles_per_second() / 1e6;
+    uint64_t tx   = _counters.tx_packets - _reported.tx_packets;
+    uint64_t rx   = _counters.rx_packets - _reported.rx_packets;
+
+    _last_report = now;
+
+    // Frames that are still on their way look lost, too. This is
+    // small compared to a second of traffic.
+    if (tx or rx or _counters.rx_other != _reported.rx_other)
+      logf("tx %.3f Mpps %.3f Gbit/s, rx %.3f Mpps %.3f Gbit/s, lost %.2f%%, "
+           "reordered %" PRIu64 ", other %" PRIu64 ", latency p50 %.1fus p99 %.1fus max %.1fus",
+           tx / secs / 1e6, (_counters.tx_bytes - _reported.tx_bytes) * 8 / secs / 1e9,
+           rx / secs / 1e6, (_counters.rx_bytes - _reported.rx_bytes) * 8 / secs / 1e9,
+           tx ? 100. * (double(tx) - double(rx)) / tx : 0.,
+           _counters.reordered - _reported.reordered, _counters.rx_other - _reported.rx_other,
+           _latency.percentile(0.5) / us, _latency.percentile(0.99) / us, _latency.max / us);
+
+    if (final)
+      logf("Sent %" PRIu64 " frames, %" PRIu64 " came back.",
+           _counters.tx_packets, _counters.rx_packets);
+
+    _reported = _counters;
+    _latency.reset();
+  }
+
+  void TrafficGenerator::arm_wakeup()
+  {
+    std::lock_guard<std::mutex> lock(_wakeup_mtx);
+    if (_wakeup_armed) return;
+
+    _wakeup_armed = true;
+    _wakeup_cv.notify_one();
+  }
+
+  void TrafficGenerator::wakeup_thread_fn()
+  {
+    std::unique_lock<std::mutex> lock(_wakeup_mtx);
+
+    while (not _stop) {
+      if (not _wakeup_armed) {
+        _wakeup_cv.wait(lock);
+        continue;
+      }
+
+      lock.unlock();
+
+      uint64_t now  = rdtsc();
+      uint64_t next = _next.load(std::memory_order_relaxed);
+      if (next > now) {
+        uint64_t ns = (next - now) * 1000000000ULL / cycles_per_second();
+        timespec ts = { time_t(ns / 1000000000ULL), long(ns % 1000000000ULL) };
+        nanosleep(&ts, nullptr);
+      }
+
+      // Disarm before the switch can wake up, otherwise we miss the
+      // next time it arms.
+      lock.lock();
+      _wakeup_armed = false;
+
+      uint64_t v = 1;
+      if (write(_switch.event_fd(), &v, sizeof(v)) != sizeof(v))
+        logf("Could not wake up the switch.");
+    }
+  }
+
+  TrafficGenerator::TrafficGenerator(Switch &sw, std::string name, Config const &config)
+    : Port(sw, name), _config(config),
+      _size_idx(0), _flow_idx(0), _seq(0),
+      _interval(config.rate ? cycles_per_second() / config.rate : 0),
+      _next(0), _counters(), _reported(), _last_seq(0),
+      _report_cycles(cycles_per_second()), _last_report(rdtsc()),
+      _wakeup_armed(false), _stop(false)
+  {
+    if (_config.sizes.empty() or not _config.macs or not _config.ips or not _config.flows)
+      throw ConfigurationError("Traffic generator needs sizes, MACs, IPs and flows.");
+
+    unsigned largest = 0;
+    unsigned minimum = L2_L3 + UDP_HEADER + sizeof(Stamp);
+    for (unsigned s : _config.sizes) {
+      if (s < minimum or s > MAX_TSO_FRAME or (s > MAX_FRAME and not _config.mss))
+        throw ConfigurationError("Frame size %u is not supported. Frames are between %u and %u bytes "
+                                 "(up to %u with TSO).", s, minimum,
+                                 unsigned(MAX_FRAME), unsigned(MAX_TSO_FRAME));
+      largest = std::max(largest, s);
+    }
+
+    _buffer_size = (sizeof(virtio_net_hdr_mrg_rxbuf) + largest + 63) & ~63;
+    if (0 != posix_memalign(reinterpret_cast<void **>(&_buffers), 4096, _buffer_size * BUFFERS))
+      throw Exception("posix_memalign failed");
+    memset(_buffers, 0, _buffer_size * BUFFERS);
+
+    _holders.resize(BUFFERS);
+    _free.reserve(BUFFERS);
+    for (unsigned i = BUFFERS; i > 0; i--) _free.push_back(i - 1);
+    _latency.reset();
+
+    logf("Generating %s frames, %u size%s, %u MAC%s, %u IP%s, %u flow%s to %s.",
+         _config.rate ? (std::to_string(_config.rate) + "/s").c_str() : "as many",
+         unsigned(_config.sizes.size()), _config.sizes.size() == 1 ? "" : "s",
+         _config.macs, _config.macs == 1 ? "" : "s",
+         _config.ips, _config.ips == 1 ? "" : "s",
+         _config.flows, _config.flows == 1 ? "" : "s",
+         _config.dst.to_str());
+
+    _wakeup_thread = std::thread(&TrafficGenerator::wakeup_thread_fn, this);
+    enable();
+
+    // The switch may be blocked and nobody else wakes it up.
+    arm_wakeup();
+  }
+
+  TrafficGenerator::~TrafficGenerator()
+  {
+    // The switch must be done with us, before the buffers go away.
+    disable();
+
+    {
+      std::lock_guard<std::mutex> lock(_wakeup_mtx);
+      _stop = true;
+      _wakeup_cv.notify_one();
+    }
+    _wakeup_thread.join();
+
+    report(rdtsc(), true);
+    free(_buffers);
+  }
+
+}
+
+// EOF
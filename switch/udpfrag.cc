@@ -0,0 +1,167 @@
+// Copyright (C) 2013, Julian Stecklina <jsteckli@os.inf.tu-dresden.de>
+// Economic rights: Technische Universitaet Dresden (Germany)
+
+// This file is part of sv3.
+
+// sv3 is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License version 2 as
+// published by the Free Software Foundation.
+
+// sv3 is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License version 2 for more details.
+
+
+#include <udpfrag.hh>
+#include <hash/onescomplement.hh>
+#include <util.hh>
+
+#include <algorithm>
+
+namespace Switch {
+
+  void
+  UdpFragmenter::seek(unsigned frame_offset, unsigned &i, unsigned &off) const
+  {
+    i   = _src.payload_fragment();
+    off = _src.payload_offset(i) + frame_offset;
+
+    while (i < _src.fragments and off >= _src.fragment_length[i]) {
+      off -= _src.fragment_length[i];
+      i   += 1;
+    }
+  }
+
+  uint32_t
+  UdpFragmenter::fragmented_length(Packet const &p)
+  {
+    virtio_net_hdr const *hdr = reinterpret_cast<virtio_net_hdr const *>(p.fragment[0]);
+    unsigned frag_size = std::max(hdr->gso_size & ~7U, 8U);
+
+    return p.packet_length + (p.packet_length / frag_size + 1) * MAX_HEADER;
+  }
+
+  bool
+  UdpFragmenter::next(Packet &frag, uint8_t *hdr_buf)
+  {
+    if (not _valid or _offset >= _total) return false;
+
+    unsigned const eth_off = sizeof(virtio_net_hdr_mrg_rxbuf);
+    unsigned const ip_off  = eth_off + sizeof(Ethernet::Header);
+    unsigned       len     = std::min(_frag_size, _total - _offset);
+
+    IPv4::Header *ip = reinterpret_cast<IPv4::Header *>(_hdr + ip_off);
+    ip->len      = Endian::bswap16(_ip_hlen + len);
+    ip->set_fragment(_offset, _offset + len < _total);
+    ip->checksum = 0;
+    ip->checksum = ~OnesComplement::fold(OnesComplement::checksum(_hdr + ip_off, _ip_hlen));
+
+    unsigned hlen = ip_off + _ip_hlen;
+    unsigned data = len;
+
+    if (_offset == 0) {
+      // _frag_size is at least 8, so the UDP header always fits into
+      // the first fragment.
+      memcpy(_hdr + hlen, _udp, sizeof(_udp));
+      hlen += sizeof(_udp);
+      data -= sizeof(_udp);
+    }
+
+    if (hdr_buf) memcpy(hdr_buf, _hdr, hlen);
+
+    frag                    = Packet(_src.completion_info.src_port);
+    frag.fragment[0]        = hdr_buf ? hdr_buf : _hdr;
+    frag.fragment_length[0] = hlen;
+    frag.fragments          = 1;
+    frag.packet_length      = hlen;
+
+    while (data) {
+      assert(_src_i < _src.fragments);
+      unsigned chunk = std::min<unsigned>(_src.fragment_length[_src_i] - _src_off, data);
+
+      if (chunk) {
+        assert(frag.fragments < Packet::MAX_FRAGMENTS);
+        frag.fragment[frag.fragments]        = _src.fragment[_src_i] + _src_off;
+        frag.fragment_length[frag.fragments] = chunk;
+        frag.fragments                      += 1;
+        frag.packet_length                  += chunk;
+      }
+
+      data     -= chunk;
+      _src_off += chunk;
+      if (_src_off == _src.fragment_length[_src_i]) {
+        _src_i  += 1;
+        _src_off = 0;
+      }
+    }
+
+    _offset += len;
+    return true;
+  }
+
+  UdpFragmenter::UdpFragmenter(Packet const &src)
+    : _src(src), _valid(false), _ip_hlen(0), _udp(),
+      _frag_size(0), _total(0), _offset(0), _src_i(0), _src_off(0)
+  {
+    virtio_net_hdr const *vhdr = reinterpret_cast<virtio_net_hdr const *>(src.fragment[0]);
+    Ethernet::Header const &ehdr = *reinterpret_cast<Ethernet::Header const *>(src.payload());
+
+    // We need Ethernet, IP and UDP header in one piece.
+    unsigned contiguous = src.payload_length();
+    if (contiguous < sizeof(Ethernet::Header) + sizeof(IPv4::Header) or
+        ehdr.type != Ethernet::Ethertype::IPV4)
+      return;
+
+    IPv4::Header const *ip = ehdr.ipv4;
+    _ip_hlen = ip->ihl * 4;
+
+    unsigned udp_off = sizeof(Ethernet::Header) + _ip_hlen;
+    if (ip->proto != IPv4::Proto::UDP or _ip_hlen < sizeof(IPv4::Header) or
+        contiguous < udp_off + sizeof(_udp) or
+        src.packet_length < sizeof(virtio_net_hdr_mrg_rxbuf) + udp_off + sizeof(_udp))
+      return;
+
+    _total     = src.packet_length - sizeof(virtio_net_hdr_mrg_rxbuf) - sizeof(Ethernet::Header) - _ip_hlen;
+    _frag_size = vhdr->gso_size & ~7U;
+    if (_frag_size < 8) return;
+
+    // Each fragment takes at most all remaining source fragments plus
+    // its header.
+    seek(udp_off + sizeof(_udp), _src_i, _src_off);
+    if (src.fragments - _src_i + 1 > Packet::MAX_FRAGMENTS) return;
+
+    memcpy(_udp, reinterpret_cast<uint8_t const *>(&ehdr) + udp_off, sizeof(_udp));
+
+    if (vhdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
+      // The checksum field already holds the pseudo header sum. It
+      // needs to be in the UDP header, because that's our copy.
+      unsigned csum_field = vhdr->csum_start + vhdr->csum_offset;
+      if (vhdr->csum_start < udp_off or csum_field + 2 > udp_off + sizeof(_udp))
+        return;
+
+      unsigned      i, off;
+      bool          odd   = false;
+      unsigned long state = 0;
+
+      for (seek(vhdr->csum_start, i, off); i < src.fragments; i++, off = 0)
+        state = OnesComplement::add(state,
+                                    OnesComplement::checksum(src.fragment[i] + off,
+                                                             src.fragment_length[i] - off,
+                                                             odd));
+
+      uint16_t csum = ~OnesComplement::fold(state);
+      if (csum == 0) csum = 0xFFFF; // 0 means no checksum for UDP.
+      memcpy(_udp + csum_field - udp_off, &csum, sizeof(csum));
+    }
+
+    // The header template. Fragments are not offloaded anymore.
+    memset(_hdr, 0, sizeof(virtio_net_hdr_mrg_rxbuf));
+    memcpy(_hdr + sizeof(virtio_net_hdr_mrg_rxbuf), &ehdr, udp_off);
+
+    _valid = true;
+  }
+
+}
+
+// EOF
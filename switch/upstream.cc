@@ -17,11 +17,44 @@
 #include <exceptions.hh>
 #include <upstream.hh>
 #include <intel82599.hh>
+#include <trafficgen.hh>
 
 #include <kvstore.hh>
 
 namespace Switch {
 
+  /// Parses frame sizes like 60:7/594:4/1514:1 into a schedule in
+  /// which each size appears as often as its weight (default 1). Sizes
+  /// are spread out evenly (smooth weighted round-robin) instead of
+  /// coming in runs.
+  static std::vector<unsigned> parse_sizes(std::string const &str)
+  {
+    std::vector<unsigned> size, weight;
+    std::vector<int>      current;
+    int                   total = 0;
+
+    for (auto &entry : string_split(str, '/')) {
+      auto parts = string_split(entry, ':');
+      size.push_back(std::stoi(parts.at(0)));
+      weight.push_back(parts.size() > 1 ? std::stoi(parts[1]) : 1);
+      current.push_back(0);
+      total += weight.back();
+    }
+
+    std::vector<unsigned> schedule;
+    for (int n = 0; n < total; n++) {
+      unsigned best = 0;
+      for (unsigned i = 0; i < size.size(); i++) {
+        current[i] += weight[i];
+        if (current[i] > current[best]) best = i;
+      }
+      current[best] -= total;
+      schedule.push_back(size[best]);
+    }
+
+    return schedule;
+  }
+
   void create_upstream_port(Switch &sw, std::vector<std::string> const &args)
   {
     std::string type = args[0];
@@ -52,8 +85,35 @@ namespace Switch {
       UNUSED Intel82599Port *device = group.get_device<Intel82599Port, Switch &>(kv["pciid"], sw, "upstream",
 										 tso, irq_rate);
 
+    } else if (type.compare("trafficgen") == 0) {
+      KeyValueStore kv = KeyValueStore::create(args.cbegin() + 1, args.cend(), '=');
+      KeyValueStore::iterator k;
+      TrafficGenerator::Config config;
+
+      try {
+	if ((k = kv.find("rate"))  != kv.end()) config.rate  = std::stoull(k->second);
+	if ((k = kv.find("sizes")) != kv.end()) config.sizes = parse_sizes(k->second);
+	if ((k = kv.find("macs"))  != kv.end()) config.macs  = std::stoi(k->second);
+	if ((k = kv.find("ips"))   != kv.end()) config.ips   = std::stoi(k->second);
+	if ((k = kv.find("flows")) != kv.end()) config.flows = std::stoi(k->second);
+	if ((k = kv.find("tso"))   != kv.end()) config.mss   = std::stoi(k->second) ? 1448 : 0;
+      } catch (std::logic_error &) {
+	throw ConfigurationError("trafficgen takes these parameters:\n"
+				 "\trate=FRAMES/s (default: as fast as possible)\n"
+				 "\tsizes=SIZE[:WEIGHT]/... (default: 60)\n"
+				 "\tmacs=N, ips=N, flows=N (default: 1)\n"
+				 "\tdst=MAC (default: broadcast)\n"
+				 "\ttso=0/1 (allow sizes up to 65000 sent with TSO)\n");
+      }
+
+      if ((k = kv.find("dst")) != kv.end() and not Ethernet::Address::from_str(k->second.c_str(), config.dst))
+	throw ConfigurationError("Invalid MAC address: %s", k->second);
+
+      // Like the NIC, this port lives as long as the switch.
+      UNUSED TrafficGenerator *gen = new TrafficGenerator(sw, "upstream", config);
+
     } else {
-      throw ConfigurationError("Unknown upstream port type. We only know 'ixgbe'.\n");
+      throw ConfigurationError("Unknown upstream port type. We know 'ixgbe' and 'trafficgen'.\n");
     }
   }
 
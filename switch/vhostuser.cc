@@ -0,0 +1,379 @@
+// Copyright (C) 2013, Julian Stecklina <jsteckli@os.inf.tu-dresden.de>
+// Economic rights: Technische Universitaet Dresden (Germany)
+
+// This file is part of sv3.
+
+// sv3 is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License version 2 as
+// published by the Free Software Foundation.
+
+// sv3 is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License version 2 for more details.
+
+
+#include <vhostuser.hh>
+#include <switch.hh>
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstring>
+
+namespace Switch {
+
+  uint8_t *VhostUserSession::translate_user(uint64_t addr, size_t size) const
+  {
+    for (auto &r : _user_regions)
+      if (r.contains(addr, size))
+	return r.translate(addr);
+
+    return nullptr;
+  }
+
+  bool VhostUserSession::receive(VhostUserMsg &msg, int *fds, unsigned &nfds)
+  {
+    struct msghdr hdr;
+    struct iovec  iov = { &msg, VHOST_USER_HDR_SIZE };
+    union {
+      struct cmsghdr chdr;
+      char           chdr_data[CMSG_SPACE(sizeof(int) * VHOST_USER_MAX_REGIONS)];
+    };
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov        = &iov;
+    hdr.msg_iovlen     = 1;
+    hdr.msg_control    = chdr_data;
+    hdr.msg_controllen = sizeof(chdr_data);
+
+    nfds = 0;
+
+    ssize_t res = recvmsg(_fd, &hdr, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+    if (res < 0) {
+      char err[128];
+      strerror_r(errno, err, sizeof(err));
+      _sw.logf("Got error from vhost-user client %d: %s", _fd, err);
+      return false;
+    }
+
+    if (res == 0) {
+      _sw.logf("Goodbye, vhost-user client %d!", _fd);
+      return false;
+    }
+
+    for (cmsghdr *c = CMSG_FIRSTHDR(&hdr); c; c = CMSG_NXTHDR(&hdr, c)) {
+      if (c->cmsg_level != SOL_SOCKET or c->cmsg_type != SCM_RIGHTS)
+	continue;
+
+      unsigned n = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      n = std::min<unsigned>(n, VHOST_USER_MAX_REGIONS - nfds);
+      memcpy(fds + nfds, CMSG_DATA(c), n * sizeof(int));
+      nfds += n;
+    }
+
+    if (res != VHOST_USER_HDR_SIZE or (hdr.msg_flags & MSG_CTRUNC) or
+	(msg.flags & VHOST_USER_VERSION_MASK) != VHOST_USER_VERSION or
+	msg.size > sizeof(msg) - VHOST_USER_HDR_SIZE) {
+      _sw.logf("vhost-user client %d violated protocol.", _fd);
+      return false;
+    }
+
+    if (msg.size and
+	recv(_fd, &msg.u64, msg.size, MSG_WAITALL) != ssize_t(msg.size)) {
+      _sw.logf("vhost-user client %d sent a short message.", _fd);
+      return false;
+    }
+
+    return true;
+  }
+
+  bool VhostUserSession::reply(VhostUserMsg &msg, uint32_t size)
+  {
+    msg.flags = VHOST_USER_VERSION | VHOST_USER_REPLY;
+    msg.size  = size;
+
+    ssize_t len = VHOST_USER_HDR_SIZE + size;
+    if (send(_fd, &msg, len, MSG_NOSIGNAL) != len) {
+      char err[128];
+      strerror_r(errno, err, sizeof(err));
+      _sw.logf("Error sending reply to vhost-user client %d: %s", _fd, err);
+      return false;
+    }
+
+    return true;
+  }
+
+  bool VhostUserSession::start_vring(unsigned idx)
+  {
+    Vring &v = _vring[idx];
+    VRing  ring;
+
+    if (not v.have_addr) {
+      _sw.logf("vhost-user client %d started ring %u without address.", _fd, idx);
+      return false;
+    }
+
+    ring.num   = v.num;
+    ring.desc  = reinterpret_cast<VRingDesc *>(translate_user(v.addr.desc_user_addr,
+							       sizeof(VRingDesc) * v.num));
+    ring.avail = reinterpret_cast<VRingAvail *>(translate_user(v.addr.avail_user_addr,
+								sizeof(VRingAvail) + sizeof(uint16_t) * v.num));
+    ring.used  = reinterpret_cast<VRingUsed *>(translate_user(v.addr.used_user_addr,
+							       sizeof(VRingUsed) + sizeof(VRingUsedElem) * v.num));
+
+    if (not _device.vhost_start_vring(idx, ring, v.base)) {
+      _sw.logf("vhost-user client %d gave us unusable ring %u (%u entries).",
+	       _fd, idx, v.num);
+      return false;
+    }
+
+    v.started = true;
+    if (v.kick_fd >= 0) watch(v.kick_fd);
+    return true;
+  }
+
+  void VhostUserSession::stop_vring(unsigned idx)
+  {
+    Vring &v = _vring[idx];
+
+    if (v.started) {
+      v.base = _device.vhost_stop_vring(idx);
+      if (v.kick_fd >= 0) unwatch(v.kick_fd);
+    }
+    v.started = false;
+  }
+
+  void VhostUserSession::set_kick(unsigned idx, int fd)
+  {
+    Vring &v = _vring[idx];
+
+    if (v.kick_fd >= 0) {
+      if (v.started) unwatch(v.kick_fd);
+      close(v.kick_fd);
+    }
+
+    v.kick_fd = fd;
+    if (v.started and fd >= 0) watch(fd);
+  }
+
+  void VhostUserSession::set_call(unsigned idx, int fd)
+  {
+    int old = _device.vhost_set_call(idx, fd);
+    if (old > 0) {
+      // The switch thread may still be interrupting with the old
+      // file descriptor in its current quantum.
+      synchronize_rcu();
+      close(old);
+    }
+  }
+
+  bool VhostUserSession::set_mem_table(VhostUserMemory const &mem, int *fds, unsigned nfds)
+  {
+    if (mem.nregions > VHOST_USER_MAX_REGIONS or mem.nregions != nfds) {
+      _sw.logf("vhost-user client %d sent %u regions with %u fds.",
+	       _fd, mem.nregions, nfds);
+      return false;
+    }
+
+    // The switch must not touch the old mappings anymore. Stopping
+    // the TX ring waits for packets other ports still hold.
+    bool restart[VirtioDevice::VHOST_QUEUES];
+    for (unsigned i = 0; i < VirtioDevice::VHOST_QUEUES; i++) {
+      restart[i] = _vring[i].started;
+      stop_vring(i);
+    }
+
+    wait_for_memory();
+    _user_regions.clear();
+    _regions.clear();
+    _sw.remove_dma_memory(_device);
+
+    for (unsigned i = 0; i < mem.nregions; i++) {
+      VhostUserMemoryRegion const &mr = mem.regions[i];
+
+      // qemu's offsets into memory backend files are page aligned,
+      // also for hugetlbfs. So we map exactly the region and the
+      // mapping can be unmapped like any other.
+      uint8_t *m = map_memory(fds[i], mr.mmap_offset, mr.memory_size);
+      if (m == nullptr) {
+	_sw.logf("mmap failed. Did you use share=on for the memory backend?");
+	return false;
+      }
+
+      if (not insert_region(Region(mr.guest_phys_addr, mr.memory_size, m))) {
+	munmap(m, mr.memory_size);
+	return false;
+      }
+
+      _user_regions.push_back(Region(mr.userspace_addr, mr.memory_size, m));
+    }
+
+    for (unsigned i = 0; i < VirtioDevice::VHOST_QUEUES; i++)
+      if (restart[i] and not start_vring(i))
+	return false;
+
+    return true;
+  }
+
+  void VhostUserSession::reset_owner()
+  {
+    for (unsigned i = 0; i < VirtioDevice::VHOST_QUEUES; i++) {
+      stop_vring(i);
+      set_kick(i, -1);
+      set_call(i, 0);
+
+      _vring[i].num       = 0;
+      _vring[i].base      = 0;
+      _vring[i].have_addr = false;
+    }
+
+    _device.reset();
+  }
+
+  bool VhostUserSession::handle_message(VhostUserMsg &msg, int *fds, unsigned nfds)
+  {
+    unsigned idx = 0;
+
+    // Check the ring index for all ring messages.
+    switch (msg.request) {
+    case VHOST_USER_SET_VRING_NUM:
+    case VHOST_USER_SET_VRING_BASE:
+    case VHOST_USER_GET_VRING_BASE:
+      idx = msg.state.index;
+      break;
+    case VHOST_USER_SET_VRING_ADDR:
+      idx = msg.addr.index;
+      break;
+    case VHOST_USER_SET_VRING_KICK:
+    case VHOST_USER_SET_VRING_CALL:
+    case VHOST_USER_SET_VRING_ERR:
+      idx = msg.u64 & VHOST_USER_VRING_IDX_MASK;
+      if (not (msg.u64 & VHOST_USER_VRING_NOFD) and nfds != 1) {
+	_sw.logf("vhost-user client %d: expected file descriptor.", _fd);
+	return false;
+      }
+      break;
+    }
+
+    if (idx >= VirtioDevice::VHOST_QUEUES) {
+      _sw.logf("vhost-user client %d used non-existent ring %u.", _fd, idx);
+      return false;
+    }
+
+    Vring &v = _vring[idx];
+
+    switch (msg.request) {
+    case VHOST_USER_GET_FEATURES:
+      msg.u64 = _device.vhost_features();
+      return reply(msg, sizeof(msg.u64));
+    case VHOST_USER_SET_FEATURES:
+      _device.vhost_set_features(msg.u64);
+      return true;
+    case VHOST_USER_SET_OWNER:
+      return true;
+    case VHOST_USER_RESET_OWNER:
+      reset_owner();
+      return true;
+    case VHOST_USER_SET_MEM_TABLE:
+      return set_mem_table(msg.memory, fds, nfds);
+    case VHOST_USER_SET_VRING_NUM:
+      v.num = msg.state.num;
+      return true;
+    case VHOST_USER_SET_VRING_ADDR:
+      v.addr      = msg.addr;
+      v.have_addr = true;
+
+      // A running ring moves. Unusual, but allowed.
+      if (v.started) {
+	stop_vring(idx);
+	return start_vring(idx);
+      }
+      return true;
+    case VHOST_USER_SET_VRING_BASE:
+      v.base = msg.state.num;
+      return true;
+    case VHOST_USER_GET_VRING_BASE:
+      stop_vring(idx);
+      msg.state.num = v.base;
+      return reply(msg, sizeof(msg.state));
+    case VHOST_USER_SET_VRING_KICK:
+      // Without a kick fd, the frontend expects us to poll. We do that
+      // anyway, until the switch goes idle.
+      if (msg.u64 & VHOST_USER_VRING_NOFD) {
+	set_kick(idx, -1);
+      } else {
+	set_kick(idx, fds[0]);
+	fds[0] = -1;
+      }
+
+      // A kick fd starts the ring.
+      stop_vring(idx);
+      return start_vring(idx);
+    case VHOST_USER_SET_VRING_CALL:
+      if (msg.u64 & VHOST_USER_VRING_NOFD) {
+	set_call(idx, 0);
+      } else {
+	set_call(idx, fds[0]);
+	fds[0] = -1;
+      }
+      return true;
+    case VHOST_USER_SET_VRING_ERR:
+      // We never report errors this way.
+      return true;
+    default:
+      _sw.logf("Didn't understand vhost-user message %u from client %d.",
+	       msg.request, _fd);
+      return false;
+    }
+  }
+
+  bool VhostUserSession::handle(int fd)
+  {
+    // We only watch kicks of running rings.
+    for (unsigned i = 0; i < VirtioDevice::VHOST_QUEUES; i++) {
+      if (fd != _vring[i].kick_fd) continue;
+
+      uint64_t val;
+      if (read(fd, &val, sizeof(val)) == sizeof(val))
+	_device.queue_notify(i);
+      return true;
+    }
+
+    return Session::handle(fd);
+  }
+
+  bool VhostUserSession::poll()
+  {
+    VhostUserMsg msg;
+    int          fds[VHOST_USER_MAX_REGIONS];
+    unsigned     nfds;
+
+    bool ok = receive(msg, fds, nfds) and handle_message(msg, fds, nfds);
+
+    for (unsigned i = 0; i < nfds; i++)
+      if (fds[i] >= 0) close(fds[i]);
+
+    return ok;
+  }
+
+  VhostUserSession::VhostUserSession(Switch &sw, int fd, sockaddr_un sa)
+    // qemu configures the guest's MAC, so don't take one from the pool.
+    : Session(sw, fd, sa, false), _vring(), _user_regions()
+  {
+    for (Vring &v : _vring) v.kick_fd = -1;
+
+    _sw.logf("vhost-user client %d connected.", _fd);
+  }
+
+  VhostUserSession::~VhostUserSession()
+  {
+    for (unsigned i = 0; i < VirtioDevice::VHOST_QUEUES; i++) {
+      stop_vring(i);
+      set_kick(i, -1);
+      set_call(i, 0);
+    }
+  }
+
+}
+
+// EOF
@@ -16,10 +16,12 @@
 
 #include <algorithm>
 #include <cinttypes>
+#include <unistd.h>
 #include <virtiodevice.hh>
 #include <switch.hh>
 #include <session.hh>
 #include <tracing.hh>
+#include <probes.hh>
 
 namespace Switch {
 
@@ -30,7 +32,7 @@ namespace Switch {
 
     if (UNLIKELY(not (status & VIRTIO_CONFIG_S_DRIVER_OK))) return;
 
-    trace(PACKET_RX, _session._fd, 0);
+    trace(PACKET_RX, id(), src.packet_length);
 
     // Deal with offloads. Check whether the guest can receive all our
     // offloads, if not always use the slow path (which is not implemented...).
@@ -45,6 +47,47 @@ namespace Switch {
       throw PortBrokenException(*this, "XXX implement slow path");
     }
 
+    // Don't overtake packets that are already waiting.
+    if (UNLIKELY(_backlog.count)) {
+      backlog_drain(rdtsc());
+      if (_backlog.count) {
+        backlog_push(src);
+        return;
+      }
+    }
+
+    if (UNLIKELY(not rx_has_room(rx_length(src)))) {
+      backlog_push(src);
+      return;
+    }
+
+    rx_deliver(src);
+  }
+
+  void
+  VirtioDevice::rx_deliver(Packet const &src)
+  {
+    account_copy(src.completion_info.src_port, src.packet_length);
+
+    if (LIKELY(not rx_needs_ufo_fallback(src))) {
+      rx_copy(src);
+      return;
+    }
+
+    UdpFragmenter frags(src);
+    if (UNLIKELY(not frags.valid())) {
+      logf("Dropping UFO packet we cannot fragment.");
+      return;
+    }
+
+    Packet frag;
+    while (frags.next(frag))
+      rx_copy(frag);
+  }
+
+  void
+  VirtioDevice::rx_copy(Packet const &src)
+  {
     // Points to src fragment currently in-use.
     unsigned       src_fragment = 0;
 
@@ -58,6 +101,8 @@ namespace Switch {
     // How many bytes are left in the source packet to copy.
     uint32_t       tot_space = src.packet_length;
 
+    trace(COPY_START, id(), src.packet_length);
+
     // logf("Packet is %u bytes long.", tot_space);
 
     auto c = [&]
@@ -125,37 +170,250 @@ namespace Switch {
     unsigned num_descriptors = 0; // Descriptors we consumed
 
     while (tot_space) {
-      unsigned head = vq_pop_generic(rx_vq(), true, c);
-      if (head == INVALID_DESC_ID) break;
+      RxChain *chain = rx_stash_get();
+      if (chain == nullptr) break;
+
+      for (unsigned i = 0; i < chain->fragments; i++)
+        if (c(chain->fragment[i], chain->fragment_length[i]))
+          break;
 
       uint32_t bytes_consumed = last_tot_space - tot_space;
-      vq_fill(rx_vq(), head, bytes_consumed, num_descriptors);
+      vq_fill(rx_vq(), chain->head, bytes_consumed, num_descriptors);
       num_descriptors += 1;
       last_tot_space   = tot_space;
     }
 
     // Update the header with the actual number of descriptors we
     // consumed. This might still be a null pointer, when the guest
-    // ran out of RX descriptors.
+    // ran out of RX descriptors. This cannot happen, unless the
+    // packet is larger than what fits into a full RX stash.
     if (num_buffers) *num_buffers = num_descriptors;
 
+    charge(STAGE_COPY);
     vq_flush(rx_vq(), num_descriptors);
+
+    trace(COPY_END, id(), src.packet_length - tot_space, num_descriptors);
+  }
+
+  void
+  VirtioDevice::rx_stash_refill()
+  {
+    VirtQueue &vq    = rx_vq();
+    unsigned   heads = std::min<unsigned>(vq_num_heads(vq, vq.last_avail_idx),
+                                          RX_STASH_CHAINS - _rx_stash.count);
+
+    for (unsigned i = 0; i < heads; i++) {
+      RxChain &chain = _rx_stash.chain[(_rx_stash.first + _rx_stash.count) % RX_STASH_CHAINS];
+      chain.fragments = 0;
+      chain.length    = 0;
+
+      auto c = [&] (uint8_t *data, uint32_t flen) {
+        if (UNLIKELY(chain.fragments >= Packet::MAX_FRAGMENTS))
+          throw PortBrokenException(*this, "RX chain too long");
+
+        chain.fragment[chain.fragments]        = data;
+        chain.fragment_length[chain.fragments] = flen;
+        chain.fragments += 1;
+        chain.length    += flen;
+
+        return false; // We want more
+      };
+
+      chain.head        = vq_pop_available(vq, true, c);
+      _rx_stash.count  += 1;
+      _rx_stash.bytes  += chain.length;
+    }
+  }
+
+  VirtioDevice::RxChain *
+  VirtioDevice::rx_stash_get()
+  {
+    if (_rx_stash.count == 0) {
+      rx_stash_refill();
+      if (_rx_stash.count == 0) return nullptr;
+    }
+
+    RxChain *chain = &_rx_stash.chain[_rx_stash.first];
+
+    _rx_stash.first  = (_rx_stash.first + 1) % RX_STASH_CHAINS;
+    _rx_stash.count -= 1;
+    _rx_stash.bytes -= chain->length;
+
+    return chain;
+  }
+
+  bool
+  VirtioDevice::rx_has_room(uint32_t bytes)
+  {
+    if (LIKELY(_rx_stash.bytes >= bytes)) return true;
+
+    rx_stash_refill();
+
+    // If the packet doesn't even fit into a full stash, the guest
+    // uses tiny buffers. Waiting won't help in this case. Copy as
+    // much as we can.
+    return (_rx_stash.bytes >= bytes) or (_rx_stash.count == RX_STASH_CHAINS);
+  }
+
+  void
+  VirtioDevice::backlog_push(Packet &src)
+  {
+    if (UNLIKELY(_backlog.count == BACKLOG_PACKETS)) {
+      _stats->drops_rx_ring_empty += 1;
+      PROBE3(drop, id(), DROP_RX_RING_EMPTY, src.packet_length - sizeof(virtio_net_hdr_mrg_rxbuf));
+      return;
+    }
+
+    unsigned idx = (_backlog.first + _backlog.count) % BACKLOG_PACKETS;
+
+    _backlog.packet[idx]   = src;
+    _backlog.deadline[idx] = rdtsc() + _backlog_cycles;
+    _backlog.count        += 1;
+    _backlog.bytes        += src.packet_length;
+
+    // The source must not complete the packet, until we are done.
+    src.copy_completion_info();
+  }
+
+  void
+  VirtioDevice::backlog_drain(uint64_t now)
+  {
+    while (_backlog.count) {
+      Packet &p = _backlog.packet[_backlog.first];
+
+      if ((status & VIRTIO_CONFIG_S_DRIVER_OK) and rx_has_room(rx_length(p))) {
+        rx_deliver(p);
+      } else if (now > _backlog.deadline[_backlog.first]) {
+        // The guest doesn't give us buffers. Give up on this packet.
+        _stats->drops_rx_ring_empty += 1;
+        PROBE3(drop, id(), DROP_RX_RING_EMPTY, p.packet_length - sizeof(virtio_net_hdr_mrg_rxbuf));
+      } else
+        break;
+
+      _backlog.first  = (_backlog.first + 1) % BACKLOG_PACKETS;
+      _backlog.count -= 1;
+      _backlog.bytes -= p.packet_length;
+
+      p.completion_info.src_port->mark_done(p.completion_info);
+    }
+  }
+
+  void
+  VirtioDevice::drop_held(Port const *src)
+  {
+    // Keep the packets from other ports in order.
+    unsigned kept  = 0;
+    uint32_t bytes = 0;
+
+    for (unsigned i = 0; i < _backlog.count; i++) {
+      unsigned idx = (_backlog.first + i) % BACKLOG_PACKETS;
+      Packet  &p   = _backlog.packet[idx];
+
+      if (src and p.completion_info.src_port != src) {
+        unsigned to = (_backlog.first + kept++) % BACKLOG_PACKETS;
+        if (to != idx) {
+          _backlog.packet[to]   = p;
+          _backlog.deadline[to] = _backlog.deadline[idx];
+        }
+        bytes += p.packet_length;
+        continue;
+      }
+
+      _stats->drops_rx_ring_empty += 1;
+      PROBE3(drop, id(), DROP_RX_RING_EMPTY, p.packet_length - sizeof(virtio_net_hdr_mrg_rxbuf));
+      p.completion_info.src_port->mark_done(p.completion_info);
+    }
+
+    _backlog.count = kept;
+    _backlog.bytes = bytes;
+  }
+
+  void
+  VirtioDevice::backlog_orphan()
+  {
+    if (_backlog.count)
+      logf("Dropping %u backlogged packets. %" PRIu64 " packets dropped before.",
+           _backlog.count, _stats->drops_rx_ring_empty);
+
+    for (; _backlog.count; _backlog.count--) {
+      _session._sw.complete_orphan(_backlog.packet[_backlog.first].completion_info);
+      _backlog.first = (_backlog.first + 1) % BACKLOG_PACKETS;
+    }
+
+    _backlog.first = _backlog.bytes = 0;
+  }
+
+  bool
+  VirtioDevice::tx_drain()
+  {
+    VirtQueue &q = tx_vq();
+    if (not q.vring.used) return true;
+
+    // Ports that queue our packets gave them back when we detached
+    // (see drop_held). Others complete them, when they are done
+    // with them, e.g. when the NIC has sent them.
+    for (unsigned ms = 0; ms < TX_DRAIN_MS; ms++) {
+      if (__atomic_load_n(&q.inuse, __ATOMIC_ACQUIRE) == 0) break;
+      _session._sw.schedule_poll();
+      usleep(1000);
+    }
+
+    // The switch thread may still be busy with the last completion.
+    synchronize_rcu();
+
+    if (q.inuse == 0) return true;
+    logf("%d TX packets still in flight. Giving up on them.", q.inuse);
+
+    // Completions of these may come any time. mark_done() ignores
+    // them, once the switch thread sees the new generation.
+    __atomic_store_n(&_tx_generation, _tx_generation + 1, __ATOMIC_RELEASE);
+    synchronize_rcu();
+    return false;
+  }
+
+  bool
+  VirtioDevice::congested()
+  {
+    return _backlog.bytes >= BACKLOG_BYTES or _backlog.count == BACKLOG_PACKETS;
+  }
+
+  uint64_t
+  VirtioDevice::deadline()
+  {
+    // The oldest backlogged packet expires first.
+    return _backlog.count ? _backlog.deadline[_backlog.first] : 0;
   }
 
   void
-  VirtioDevice::vq_irq(VirtQueue &vq)
+  VirtioDevice::vq_irq(VirtQueue &vq, IrqCoalescing *coal, uint64_t now, bool force)
   {
     unsigned vector = vq.vector;
-    if (UNLIKELY(vq.pending_irq) and LIKELY(_irq_fd[vector])) {
+    if (UNLIKELY(vq.pending_irq) and LIKELY(vector < MSIX_VECTORS and _irq_fd[vector])) {
+      if (coal and coal->max_usecs and coal->max_packets > 1 and not force) {
+        if (not coal->armed) {
+          coal->timer.arm(now);
+          coal->armed = true;
+        }
+
+        if (vq.unsignalled < coal->max_packets and not coal->timer.elapsed(now))
+          return;
+      }
+
+      if (coal) coal->armed = false;
+      vq.unsignalled = 0;
       vq.pending_irq = false;
 
       if (not (__atomic_load_n(&vq.vring.avail->flags, __ATOMIC_ACQUIRE) &
 	       VRING_AVAIL_F_NO_INTERRUPT)) {
 	// Guest asks to be interrupted.
 	isr.store(1, std::memory_order_release);
-	trace(IRQ, _session._fd);
-	uint64_t val = 1;
-	write(_irq_fd[vector], &val, sizeof(val));
+	trace(IRQ, id(), 0, vector);
+	_switch.trigger_irq(_irq_fd[vector]);
+	_stats->irqs += 1;
+	PROBE2(irq, id(), vector);
+
+	uint64_t t = now ? now : rdtsc();
+	_stats->deliver_to_irq.add(t > vq.pending_since ? t - vq.pending_since : 0);
       }
     }
   }
@@ -163,8 +421,234 @@ namespace Switch {
   void
   VirtioDevice::poll_irq()
   {
-    vq_irq(rx_vq());
-    vq_irq(tx_vq());
+    // TX completions are collected during the quantum. Publish them
+    // now in one go, before we decide whether to interrupt.
+    vq_publish(tx_vq());
+
+    // See whether the guest has given us RX buffers in the meantime.
+    if (UNLIKELY(_backlog.count))
+      backlog_drain(rdtsc());
+
+    uint64_t now = rdtsc();
+    if (UNLIKELY(_coal_adapt_timer.elapsed(now))) {
+      _coal_adapt_timer.arm(now);
+      coal_adapt(rx_coal(), rx_vq());
+      coal_adapt(tx_coal(), tx_vq());
+    }
+
+    vq_irq(rx_vq(), &rx_coal(), now);
+    vq_irq(tx_vq(), &tx_coal(), now);
+
+    if (UNLIKELY(guest_features & (1 << VIRTIO_NET_F_CTRL_VQ))) {
+      ctrl_poll();
+      vq_irq(ctrl_vq());
+    }
+  }
+
+  void
+  VirtioDevice::flush_irq()
+  {
+    // Completions can arrive after the last poll_irq() of a quantum
+    // (e.g. orphans). The guest must see them before we sleep.
+    vq_publish(tx_vq());
+
+    vq_irq(rx_vq(), &rx_coal(), 0, true);
+    vq_irq(tx_vq(), &tx_coal(), 0, true);
+  }
+
+  void
+  VirtioDevice::coal_set(IrqCoalescing &coal, unsigned usecs, unsigned packets)
+  {
+    coal.max_usecs   = usecs;
+    coal.max_packets = packets;
+    coal.timer.set_period(usecs, 1000000);
+  }
+
+  void
+  VirtioDevice::coal_reset()
+  {
+    // Start with immediate interrupts. coal_adapt will relax this,
+    // when the load goes up.
+    for (IrqCoalescing &coal : _coal) {
+      coal_set(coal, 0, 1);
+      coal.adaptive = _switch.irq_coalescing_us() != 0;
+      coal.armed    = false;
+    }
+  }
+
+  void
+  VirtioDevice::coal_adapt(IrqCoalescing &coal, VirtQueue &vq)
+  {
+    uint32_t used = vq.used;
+    vq.used = 0;
+
+    if (not coal.adaptive) return;
+
+    // Below COAL_LOW_PPS, every interrupt goes out right away. Above
+    // it, we delay interrupts more the more packets we see, up to
+    // the switch's limits at COAL_HIGH_PPS.
+    uint64_t pps = uint64_t(used) * (1000000 / COAL_ADAPT_US);
+    unsigned usecs, packets;
+
+    if (pps < COAL_LOW_PPS) {
+      usecs   = 0;
+      packets = 1;
+    } else {
+      uint64_t load = std::min<uint64_t>(pps, COAL_HIGH_PPS);
+      usecs   = _switch.irq_coalescing_us()      * load / COAL_HIGH_PPS;
+      packets = _switch.irq_coalescing_packets() * load / COAL_HIGH_PPS;
+      packets = std::max(packets, 1U);
+    }
+
+    if (usecs != coal.max_usecs or packets != coal.max_packets)
+      coal_set(coal, usecs, packets);
+  }
+
+  void
+  VirtioDevice::ctrl_poll()
+  {
+    VirtQueue &vq = ctrl_vq();
+
+    // The guest hasn't set up the queue yet.
+    if (not vq.vring.desc) return;
+
+    while (vq_num_heads(vq, vq.last_avail_idx)) {
+      VRingDesc *desc = vq.vring.desc;
+      unsigned   head;
+      unsigned   i    = head = vq_get_head(vq, vq.last_avail_idx++);
+      unsigned   descs = 0;
+
+      // Commands are small, except for MAC tables. If those don't
+      // fit, we turn them into overflows.
+      uint8_t              cmd[4096];
+      size_t               cmd_len = 0;
+      virtio_net_ctrl_ack *ack     = nullptr;
+
+      // The command is in readable buffers, followed by a writeable
+      // byte for the status.
+      do {
+        uint32_t flen = __atomic_load_n(&desc[i].len, __ATOMIC_RELAXED);
+        uint8_t *data = _session.translate_ptr(desc[i].addr, flen, &vq.last_region);
+
+        if (UNLIKELY(data == nullptr or ++descs > vq.vring.num))
+          throw PortBrokenException(*this, "broken control descriptor");
+
+        if (desc[i].flags & VRING_DESC_F_WRITE) {
+          if (flen >= sizeof(*ack)) ack = data;
+        } else {
+          size_t chunk = std::min<size_t>(flen, sizeof(cmd) - cmd_len);
+          memcpy(cmd + cmd_len, data, chunk);
+          cmd_len += chunk;
+        }
+      } while ((i = vq_next_desc(vq, &desc[i])) != INVALID_DESC_ID);
+
+      vq.inuse++;
+
+      if (UNLIKELY(ack == nullptr))
+        throw PortBrokenException(*this, "control command without status");
+
+      *ack = ctrl_handle(cmd, cmd_len);
+      vq_push(vq, head, sizeof(*ack));
+    }
+  }
+
+  virtio_net_ctrl_ack
+  VirtioDevice::ctrl_handle(uint8_t const *cmd, size_t len)
+  {
+    virtio_net_ctrl_hdr hdr;
+
+    if (len < sizeof(hdr)) return VIRTIO_NET_ERR;
+    memcpy(&hdr, cmd, sizeof(hdr));
+
+    uint8_t const *data = cmd + sizeof(hdr);
+    size_t         dlen = len - sizeof(hdr);
+
+    switch (hdr.klass) {
+    case VIRTIO_NET_CTRL_RX:
+      if (dlen < 1 or not _rx_filter.set_mode(hdr.cmd, data[0]))
+        return VIRTIO_NET_ERR;
+
+      logf("RX mode %u %s.", hdr.cmd, data[0] ? "on" : "off");
+      return VIRTIO_NET_OK;
+
+    case VIRTIO_NET_CTRL_MAC:
+      if (hdr.cmd == VIRTIO_NET_CTRL_MAC_ADDR_SET) {
+        Ethernet::Address mac;
+        if (dlen < sizeof(mac.byte)) return VIRTIO_NET_ERR;
+
+        memcpy(mac.byte, data, sizeof(mac.byte));
+        _rx_filter.set_mac(mac);
+        logf("Guest MAC is %s.", mac.to_str());
+        return VIRTIO_NET_OK;
+      }
+
+      if (hdr.cmd == VIRTIO_NET_CTRL_MAC_TABLE_SET) {
+        // Two tables follow each other: unicast, then multicast. Each
+        // is a 32-bit entry count followed by the addresses. Tables
+        // that were cut off are treated as overflowing.
+        Ethernet::Address const *table[2];
+        unsigned                 entries[2];
+
+        for (unsigned t = 0; t < 2; t++) {
+          uint32_t count = ~0U;
+          if (dlen >= sizeof(count)) {
+            memcpy(&count, data, sizeof(count));
+            data += sizeof(count);
+            dlen -= sizeof(count);
+          }
+
+          table[t]   = reinterpret_cast<Ethernet::Address const *>(data);
+          entries[t] = count;
+
+          if (count > dlen / sizeof(Ethernet::Address)) {
+            entries[t] = RxFilter::MAC_TABLE_ENTRIES + 1;
+            dlen       = 0;
+          } else {
+            data += count * sizeof(Ethernet::Address);
+            dlen -= count * sizeof(Ethernet::Address);
+          }
+        }
+
+        _rx_filter.set_mac_table(table[0], entries[0], table[1], entries[1]);
+        return VIRTIO_NET_OK;
+      }
+
+      return VIRTIO_NET_ERR;
+
+    case VIRTIO_NET_CTRL_VLAN: {
+      uint16_t vid;
+      if (dlen < sizeof(vid)) return VIRTIO_NET_ERR;
+      memcpy(&vid, data, sizeof(vid));
+
+      bool ok = false;
+      if (hdr.cmd == VIRTIO_NET_CTRL_VLAN_ADD) ok = _rx_filter.add_vlan(vid);
+      if (hdr.cmd == VIRTIO_NET_CTRL_VLAN_DEL) ok = _rx_filter.del_vlan(vid);
+
+      return ok ? VIRTIO_NET_OK : VIRTIO_NET_ERR;
+    }
+
+    case VIRTIO_NET_CTRL_NOTF_COAL: {
+      // The legacy interface cannot offer VIRTIO_NET_F_NOTF_COAL, but
+      // if a guest asks, it gets what it wants and we stop adapting.
+      virtio_net_ctrl_coal c;
+      if (dlen < sizeof(c) or hdr.cmd > VIRTIO_NET_CTRL_NOTF_COAL_RX_SET)
+        return VIRTIO_NET_ERR;
+      memcpy(&c, data, sizeof(c));
+
+      IrqCoalescing &coal = (hdr.cmd == VIRTIO_NET_CTRL_NOTF_COAL_RX_SET) ? rx_coal() : tx_coal();
+      coal.adaptive = false;
+      coal_set(coal, c.usecs, std::max(c.max_packets, 1U));
+
+      logf("%s interrupts coalesced to %uus/%u packets.",
+           (hdr.cmd == VIRTIO_NET_CTRL_NOTF_COAL_RX_SET) ? "RX" : "TX",
+           c.usecs, c.max_packets);
+      return VIRTIO_NET_OK;
+    }
+
+    default:
+      logf("Unknown control command %u/%u.", hdr.klass, hdr.cmd);
+      return VIRTIO_NET_ERR;
+    }
   }
 
   int
@@ -177,7 +661,7 @@ namespace Switch {
 
     /* Check if guest isn't doing very strange things with descriptor
        numbers. */
-    if (UNLIKELY(num_heads > QUEUE_ELEMENTS))
+    if (UNLIKELY(num_heads > vq.vring.num))
       throw PortBrokenException(*this, "avail->idx b0rken");
 
     return num_heads;
@@ -190,18 +674,18 @@ namespace Switch {
 
     /* Grab the next descriptor number they're advertising, and increment
      * the index we've seen. */
-    head = __atomic_load_n(&vq.vring.avail->ring[idx % QUEUE_ELEMENTS],
+    head = __atomic_load_n(&vq.vring.avail->ring[idx % vq.vring.num],
                            __ATOMIC_ACQUIRE);
 
     /* If their number is silly, that's a fatal mistake. */
-    if (UNLIKELY(head >= QUEUE_ELEMENTS))
+    if (UNLIKELY(head >= vq.vring.num))
       throw PortBrokenException(*this, "head b0rken");
 
     return head;
   }
 
   unsigned
-  VirtioDevice::vq_next_desc(VRingDesc *desc)
+  VirtioDevice::vq_next_desc(VirtQueue &vq, VRingDesc *desc)
   {
     unsigned int next;
 
@@ -211,7 +695,7 @@ namespace Switch {
 
     /* Check they're not leading us off end of descriptors. */
     next = __atomic_load_n(&desc->next, __ATOMIC_ACQUIRE);
-    if (UNLIKELY(next >= QUEUE_ELEMENTS))
+    if (UNLIKELY(next >= vq.vring.num))
       throw PortBrokenException(*this, "next beyond bounds");
 
     return next;
@@ -221,11 +705,17 @@ namespace Switch {
   int
   VirtioDevice::vq_pop_generic(VirtQueue &vq, bool writeable_bufs, T closure)
   {
-    VRingDesc *desc = vq.vring.desc;
-
     if (!vq_num_heads(vq, vq.last_avail_idx))
       return INVALID_DESC_ID;
 
+    return vq_pop_available(vq, writeable_bufs, closure);
+  }
+
+  template <typename T>
+  unsigned
+  VirtioDevice::vq_pop_available(VirtQueue &vq, bool writeable_bufs, T closure)
+  {
+    VRingDesc *desc = vq.vring.desc;
     unsigned head;
     unsigned i = head = this->vq_get_head(vq, vq.last_avail_idx++);
 
@@ -234,7 +724,7 @@ namespace Switch {
       // We need to load this only once. Otherwise, the guest may
       // fool pointer validation.
       uint32_t flen = __atomic_load_n(&desc[i].len, __ATOMIC_RELAXED);
-      uint8_t *data = _session.translate_ptr(desc[i].addr, flen);
+      uint8_t *data = _session.translate_ptr(desc[i].addr, flen, &vq.last_region);
 
       // We either collect only writeable or readable buffers. Check
       // for fragment list overflow and pointer translation failures
@@ -248,7 +738,7 @@ namespace Switch {
       if (closure(data, flen))
         break;
 
-    } while ((i = vq_next_desc(&desc[i])) != INVALID_DESC_ID);
+    } while ((i = vq_next_desc(vq, &desc[i])) != INVALID_DESC_ID);
 
     vq.inuse++;
     return head;
@@ -278,7 +768,8 @@ namespace Switch {
       return false; // We want more
     };
 
-    p.completion_info.virtio.index = vq_pop_generic(vq, writeable_bufs, c);
+    p.completion_info.virtio.index      = vq_pop_generic(vq, writeable_bufs, c);
+    p.completion_info.virtio.generation = _tx_generation;
     return p.fragments;
   }
 
@@ -286,7 +777,7 @@ namespace Switch {
   VirtioDevice::vq_fill(VirtQueue &vq, unsigned head,
                         uint32_t len, unsigned idx)
   {
-    idx = (idx + vq.vring.used->idx) % QUEUE_ELEMENTS;
+    idx = (idx + vq.vring.used->idx) % vq.vring.num;
 
     /* Get a pointer to the next entry in the used ring. */
     VRingUsedElem &el = vq.vring.used->ring[idx];
@@ -307,7 +798,10 @@ namespace Switch {
     vq.inuse -= count;
 
     // Guest may need to be interrupted. Check this in poll_irq.
-    vq.pending_irq = true;
+    if (not vq.pending_irq) vq.pending_since = rdtsc();
+    vq.pending_irq  = true;
+    vq.unsignalled += count;
+    vq.used        += count;
   }
 
 
@@ -317,22 +811,55 @@ namespace Switch {
     vq_flush(vq, 1);
   }
 
+  void VirtioDevice::vq_defer(VirtQueue &vq, unsigned head, uint32_t len)
+  {
+    // The guest never has more than num chains in flight, so we
+    // cannot overtake entries that are not yet published.
+    assert(vq.unpublished < vq.vring.num);
+    vq_fill(vq, head, len, vq.unpublished++);
+  }
+
+  void VirtioDevice::vq_publish(VirtQueue &vq)
+  {
+    if (vq.unpublished == 0) return;
+
+    vq_flush(vq, vq.unpublished);
+    vq.unpublished = 0;
+  }
+
 
   bool
   VirtioDevice::poll(Packet &p, bool enable_notifications)
   {
     VirtQueue &vq = tx_vq();
 
+    if (UNLIKELY(_kick_time.load(std::memory_order_relaxed))) {
+      // The kick was timestamped on another CPU.
+      uint64_t kicked = _kick_time.exchange(0, std::memory_order_relaxed);
+      uint64_t now    = rdtsc();
+      if (kicked) _stats->kick_to_poll.add(now > kicked ? now - kicked : 0);
+    }
+
     vq.vring.used->flags = enable_notifications ? 0 : VRING_USED_F_NO_NOTIFY;
 
+    // If we wait for RX buffers, we want to know when they show up.
+    if (UNLIKELY(_backlog.count))
+      rx_vq().vring.used->flags = vq.vring.used->flags;
+
     if (not (status & VIRTIO_CONFIG_S_DRIVER_OK) or
         not vq_pop(vq, p, false /* readable buffers */))
       return false;
 
-    if (UNLIKELY(p.fragment_length[0] != sizeof(struct virtio_net_hdr_mrg_rxbuf)))
-      throw PortBrokenException(*this, "invalid header size");
+    // The guest may put the Ethernet frame right behind the virtio
+    // header (VIRTIO_F_ANY_LAYOUT). Everyone downstream copes with
+    // that, but the header itself must be contiguous.
+    if (UNLIKELY(p.fragment_length[0] < sizeof(struct virtio_net_hdr_mrg_rxbuf)))
+      tx_gather_header(p);
 
-    trace(PACKET_TX, _session._fd, p.packet_length);
+    if (UNLIKELY(p.payload_length() < sizeof(Ethernet::Header)))
+      throw PortBrokenException(*this, "Ethernet header not contiguous");
+
+    trace(PACKET_TX, id(), p.packet_length);
 
     // XXX Do something with the packet.
 
@@ -340,10 +867,81 @@ namespace Switch {
   }
 
 
+  void
+  VirtioDevice::tx_gather_header(Packet &p)
+  {
+    virtio_net_hdr_mrg_rxbuf &hdr  = _tx_hdr[p.completion_info.virtio.index];
+    uint8_t                  *dst  = reinterpret_cast<uint8_t *>(&hdr);
+    size_t                    left = sizeof(hdr);
+    unsigned                  i    = 0;
+
+    // Find the first fragment with payload in it.
+    while (left) {
+      if (UNLIKELY(i == p.fragments))
+        throw PortBrokenException(*this, "packet shorter than header");
+
+      size_t chunk = std::min<size_t>(left, p.fragment_length[i]);
+      memcpy(dst, p.fragment[i], chunk);
+      dst  += chunk;
+      left -= chunk;
+
+      if (chunk < p.fragment_length[i]) {
+        p.fragment[i]        += chunk;
+        p.fragment_length[i] -= chunk;
+        break;
+      }
+
+      i++;
+    }
+
+    // Fragment 0 was shorter than the header, so i > 0 and we never
+    // need more fragments than we had.
+    assert(i > 0);
+    unsigned out = 1;
+    for (; i < p.fragments; i++, out++) {
+      p.fragment[out]        = p.fragment[i];
+      p.fragment_length[out] = p.fragment_length[i];
+    }
+
+    p.fragment[0]        = reinterpret_cast<uint8_t *>(&hdr);
+    p.fragment_length[0] = sizeof(hdr);
+    p.fragments          = out;
+  }
+
+  void
+  VirtioDevice::defer_done(Packet::CompletionInfo &c, unsigned holders)
+  {
+    _tx_holders[c.virtio.index] = holders;
+  }
+
   void
   VirtioDevice::mark_done(Packet::CompletionInfo &c)
   {
-    vq_push(tx_vq(), c.virtio.index, 0);
+    // We gave up on the packet. Its chain is not ours anymore.
+    if (UNLIKELY(c.virtio.generation != __atomic_load_n(&_tx_generation, __ATOMIC_ACQUIRE)))
+      return;
+
+    // Someone else still looks at the packet.
+    if (_tx_holders[c.virtio.index] > 1) {
+      _tx_holders[c.virtio.index]--;
+      return;
+    }
+
+    _tx_holders[c.virtio.index] = 0;
+
+    // The ring was stopped under the packet. The guest has taken the
+    // chain back already.
+    if (UNLIKELY(tx_vq().vring.used == nullptr)) return;
+
+    // Completions arrive in bursts (e.g. from the TX queue of a NIC)
+    // and the guest is polling used->idx. Don't bounce its cache line
+    // for every packet. poll_irq() publishes these at the end of the
+    // quantum.
+    vq_defer(tx_vq(), c.virtio.index, 0);
+
+    // Unless we are offline. Then nobody calls poll_irq() for us.
+    if (UNLIKELY(not online))
+      vq_publish(tx_vq());
   }
 
   uint64_t
@@ -354,6 +952,26 @@ namespace Switch {
     uint64_t val = ~0ULL;
     if (UNLIKELY(bar_no != 0)) return val;
 
+    // Device-specific configuration space. Without MSI-X, it starts
+    // where the MSI-X registers would be. Guests read their MAC from
+    // here before they set up interrupts.
+    uint64_t config = VIRTIO_PCI_CONFIG_OFF(msix_enabled);
+    if (addr >= config) {
+      if (addr + size <= config + sizeof(virtio_net_config)) {
+        // We don't offer VIRTIO_NET_F_STATUS, so status stays 0.
+        virtio_net_config c {};
+        if (_has_static_mac)
+          memcpy(c.mac, _static_mac.byte, sizeof(c.mac));
+
+        val = 0;
+        memcpy(&val, reinterpret_cast<uint8_t *>(&c) + addr - config,
+               std::min<size_t>(size, sizeof(val)));
+      } else
+        logf("Unimplemented register %zx read.", size_t(addr));
+
+      return val;
+    }
+
     switch (addr) {
     case VIRTIO_PCI_HOST_FEATURES:
       logf("Reading host features %x", host_features);
@@ -429,6 +1047,7 @@ namespace Switch {
     // XXX Use correct size here.
     char *va = _session.translate_ptr<char>(vq.pa);
     if (va != nullptr) {
+      vq.vring.num   = QUEUE_ELEMENTS;
       vq.vring.desc  = reinterpret_cast<VRingDesc *>(va);
       vq.vring.avail = reinterpret_cast<VRingAvail *>(va + QUEUE_ELEMENTS * sizeof(VRingDesc));
       vq.vring.used  = reinterpret_cast<VRingUsed *>(vnet_vring_align(reinterpret_cast<char *>(vq.vring.avail) +
@@ -443,12 +1062,77 @@ namespace Switch {
     }
   }
 
+  void VirtioDevice::set_guest_features(uint32_t features)
+  {
+    uint32_t supported_features = host_features; /* What do we support? */
+    uint32_t bad = features & ~supported_features;
+    if (bad)
+      logf("Guest features we don't support: %s.\n", features_to_string(bad).c_str());
+
+    guest_features = features & supported_features;
+
+    // Without VLAN filtering, the guest wants all VLANs.
+    _rx_filter.set_vlan_filtering(guest_features & (1 << VIRTIO_NET_F_CTRL_VLAN));
+    logf("Negotiated features: %08x", guest_features);
+    logf("%s", features_to_string(guest_features).c_str());
+  }
+
+  void VirtioDevice::queue_notify(unsigned queue)
+  {
+    _stats->kicks += 1;
+    PROBE2(kick, id(), queue);
+
+    // Only the first kick before a poll counts. Later ones are
+    // already covered.
+    uint64_t none = 0;
+    _kick_time.compare_exchange_strong(none, rdtsc(), std::memory_order_relaxed);
+
+    // poll() decides about notifications for RX and TX. Nobody turns
+    // them back on for the control queue, which is only looked at in
+    // poll_irq(), so we leave them on. Control commands are rare.
+    if (&vq[queue] != &ctrl_vq() and vq[queue].vring.used)
+      disable_notification(vq[queue]);
+    _session._sw.schedule_poll();
+  }
+
+  void VirtioDevice::update_online()
+  {
+    if (not online and rx_vq().vring.desc and tx_vq().vring.desc) {
+      // The switch thread should never take a page fault on guest
+      // memory.
+      _session.wait_for_memory();
+
+      _numa_node = _session.memory_node();
+      if (_numa_node >= 0)
+        logf("Guest memory is on NUMA node %d.", _numa_node);
+
+      enable();
+    }
+
+    // Take us offline, if the guest has screwed up queue
+    // configuration.
+    if (online and not (rx_vq().vring.desc and tx_vq().vring.desc))
+      disable();
+  }
+
   void VirtioDevice::io_write(unsigned bar_no,
                               uint64_t addr,
                               unsigned size,
                               uint64_t val,
                               bool &irqs_changed)
   {
+    // Old drivers set their MAC in configuration space. Newer ones
+    // use the control queue. Without MSI-X, the configuration space
+    // overlaps the MSI-X registers, but drivers write those with
+    // 16-bit accesses and the MAC bytewise.
+    uint64_t config = VIRTIO_PCI_CONFIG_OFF(msix_enabled);
+    if (addr >= config and addr < config + sizeof(virtio_net_config) and
+        not (size == 2 and (addr == VIRTIO_MSI_CONFIG_VECTOR or
+                            addr == VIRTIO_MSI_QUEUE_VECTOR))) {
+      logf("Ignoring write to configuration space at %zx.", size_t(addr));
+      return;
+    }
+
     switch (addr) {
     case VIRTIO_PCI_QUEUE_NOTIFY:
       if (val >= VIRT_QUEUES) {
@@ -456,8 +1140,7 @@ namespace Switch {
         break;
       }
 
-      disable_notification(vq[val]);
-      _session._sw.schedule_poll();
+      queue_notify(val);
       break;
     case VIRTIO_PCI_QUEUE_SEL:
       if (val >= VIRT_QUEUES) {
@@ -468,17 +1151,14 @@ namespace Switch {
     case VIRTIO_PCI_QUEUE_PFN:
       if (queue_sel >= VIRT_QUEUES) {
         logf("Guest set address on non-existent queue %u.", queue_sel);
-      } else
+      } else {
         vq_set_addr(vq[queue_sel], val << VIRTIO_PCI_QUEUE_ADDR_SHIFT);
 
-      if (not online and rx_vq().vring.desc and tx_vq().vring.desc)
-        enable();
-
-      // Take us offline, if the guest has screwed up queue
-      // configuration.
-      if (online and not (rx_vq().vring.desc and tx_vq().vring.desc))
-        disable();
+        // Stashed chains point into the old ring.
+        if (&vq[queue_sel] == &rx_vq()) rx_stash_clear();
+      }
 
+      update_online();
       break;
     case VIRTIO_PCI_GUEST_FEATURES: {
       /* Guest does not negotiate properly?  We have to assume nothing. */
@@ -486,16 +1166,7 @@ namespace Switch {
         logf("BAD FEATURE set. Guest broken.");
       }
 
-      uint32_t supported_features = host_features; /* What do we support? */
-      uint32_t bad = (val & ~supported_features) != 0;
-      if (bad)
-        logf("Guest features we don't support: %s.\n", features_to_string(bad).c_str());
-
-
-      val &= supported_features;
-      guest_features = val;
-      logf("Negotiated features: %08x", guest_features);
-      logf("%s", features_to_string(guest_features).c_str());
+      set_guest_features(val);
       break;
     }
     case VIRTIO_PCI_STATUS:
@@ -504,6 +1175,7 @@ namespace Switch {
     case VIRTIO_MSI_CONFIG_VECTOR:
       logf("Configuration change vector is %u.", (unsigned)val);
       config_vector = val;
+      msix_enabled  = (val != VIRTIO_MSI_NO_VECTOR);
       irqs_changed  = true;
       break;
     case VIRTIO_MSI_QUEUE_VECTOR:
@@ -536,13 +1208,30 @@ namespace Switch {
     // Take port offline.
     disable();
 
+    // The guest doesn't want packets from before the reset anymore.
+    backlog_orphan();
+
+    // It will reuse its TX buffers right away.
+    tx_drain();
+    coal_reset();
+    _rx_filter.reset();
+    if (_has_static_mac)
+      _rx_filter.set_mac(_static_mac);
+
     status         = 0;
     guest_features = 0;
     queue_sel      = 0;
     isr            = 0;
     config_vector  = VIRTIO_MSI_NO_VECTOR;
+    msix_enabled   = false;
 
     memset(vq, 0, sizeof(vq));
+    memset(_tx_holders, 0, sizeof(_tx_holders));
+
+    // Forget RX buffers we took from the guest. They belong to the
+    // old incarnation of the RX queue and the guest has reclaimed
+    // them.
+    rx_stash_clear();
     for (VirtQueue &q : vq) {
       q.vector    = VIRTIO_MSI_NO_VECTOR;
     }
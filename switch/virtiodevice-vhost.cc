@@ -0,0 +1,138 @@
+// Copyright (C) 2013, Julian Stecklina <jsteckli@os.inf.tu-dresden.de>
+// Economic rights: Technische Universitaet Dresden (Germany)
+
+// This file is part of sv3.
+
+// sv3 is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License version 2 as
+// published by the Free Software Foundation.
+
+// sv3 is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License version 2 for more details.
+
+// The device side of the vhost-user backend. See vhostuser.cc for
+// the protocol.
+
+#include <virtiodevice.hh>
+#include <switch.hh>
+
+namespace Switch {
+
+  uint64_t
+  VirtioDevice::vhost_features() const
+  {
+    // The frontend serves the control queue and configuration space
+    // and doesn't pass these on.
+    uint32_t frontend_only = (1 << VIRTIO_NET_F_MAC)
+      | (1 << VIRTIO_NET_F_CTRL_VQ)
+      | (1 << VIRTIO_NET_F_CTRL_RX)
+      | (1 << VIRTIO_NET_F_CTRL_RX_EXTRA)
+      | (1 << VIRTIO_NET_F_CTRL_VLAN)
+      | (1 << VIRTIO_NET_F_CTRL_MAC_ADDR);
+
+    // VERSION_1 doesn't change anything for us: the virtio header
+    // always has num_buffers and we are little endian anyway.
+    return (host_features & ~frontend_only) | (1ULL << VIRTIO_F_VERSION_1);
+  }
+
+  void
+  VirtioDevice::vhost_set_features(uint64_t features)
+  {
+    set_guest_features(features & vhost_features());
+  }
+
+  bool
+  VirtioDevice::vhost_start_vring(unsigned idx, VRing const &ring, uint16_t base)
+  {
+    if (idx >= VHOST_QUEUES or ring.num == 0 or ring.num > QUEUE_ELEMENTS or
+        (ring.num & (ring.num - 1)) != 0 or
+        not ring.desc or not ring.avail or not ring.used)
+      return false;
+
+    VirtQueue &q = vq[idx];
+
+    // The frontend usually stops a ring before it restarts it, but
+    // the switch thread must never see a half-updated ring.
+    if (online) disable();
+
+    q.vring          = ring;
+    q.last_avail_idx = base;
+    q.inuse          = 0;
+    q.unpublished    = 0;
+    q.pending_irq    = false;
+    q.pending_since  = 0;
+    q.vector         = idx;
+
+    // Guest memory may have changed since the ring last ran.
+    q.last_region    = Region();
+
+    if (&q == &rx_vq()) rx_stash_clear();
+
+    logf("Ring %u started with %u entries at avail index %u.", idx, ring.num, base);
+
+    // There is no status register. A running ring means the driver
+    // is ready.
+    status = VIRTIO_CONFIG_S_DRIVER_OK;
+    update_online();
+    return true;
+  }
+
+  uint16_t
+  VirtioDevice::vhost_stop_vring(unsigned idx)
+  {
+    if (idx >= VHOST_QUEUES) return 0;
+
+    VirtQueue &q = vq[idx];
+    if (not q.vring.desc) return q.last_avail_idx;
+
+    // Get the switch thread off the ring first.
+    if (online) disable();
+
+    // TX completions we collected, but didn't publish yet. Once we
+    // return, the frontend may reuse the buffers or unmap guest
+    // memory, so wait for those that are still in flight.
+    vq_publish(q);
+    if (&q == &tx_vq() and not tx_drain()) {
+      // Other ports complete out of order, so we cannot hand the
+      // stragglers back by rewinding the ring base. Report them as
+      // sent instead. Whoever still holds them may send garbage.
+      for (unsigned head = 0; head < QUEUE_ELEMENTS; head++)
+        if (_tx_holders[head]) {
+          _tx_holders[head] = 0;
+          vq_defer(q, head, 0);
+        }
+      vq_publish(q);
+    }
+
+    // Stashed RX chains are the last ones we popped. Give them back,
+    // so the next incarnation of the ring sees them again.
+    if (&q == &rx_vq()) {
+      q.last_avail_idx -= _rx_stash.count;
+      rx_stash_clear();
+    }
+
+    q.vring.desc  = nullptr;
+    q.vring.avail = nullptr;
+    q.vring.used  = nullptr;
+
+    if (not rx_vq().vring.desc and not tx_vq().vring.desc)
+      status = 0;
+
+    logf("Ring %u stopped at avail index %u.", idx, q.last_avail_idx);
+    return q.last_avail_idx;
+  }
+
+  int
+  VirtioDevice::vhost_set_call(unsigned idx, int fd)
+  {
+    if (idx >= VHOST_QUEUES) return fd;
+
+    // The switch thread may be about to interrupt with the old fd.
+    return __atomic_exchange_n(&_irq_fd[idx], fd, __ATOMIC_ACQ_REL);
+  }
+
+}
+
+// EOF
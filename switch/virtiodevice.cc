@@ -17,6 +17,7 @@
 #include <switch.hh>
 #include <session.hh>
 #include <config.hh>
+#include <timer.hh>
 
 #include <sstream>
 
@@ -69,11 +70,27 @@ namespace Switch {
     more = ((index + 1) < MSIX_VECTORS);
   }
 
-  VirtioDevice::VirtioDevice(Session &session)
+  VirtioDevice::VirtioDevice(Session &session, bool assign_mac)
     : ExternalDevice(session),
       Port(session._sw, std::string("VirtIO ") + std::to_string(session._fd)),
-      _irq_fd(), online(false)
+      _irq_fd(), online(false), msix_enabled(false),
+      status(0), isr(0), queue_sel(0), config_vector(VIRTIO_MSI_NO_VECTOR),
+      guest_features(0), vq(),
+      _backlog_cycles(cycles_per_second() / 1000000 * BACKLOG_US),
+      _kick_time(0),
+      _coal(),
+      _coal_adapt_timer(COAL_ADAPT_US, 1000000),
+      _tx_holders(), _tx_generation(0)
   {
+    coal_reset();
+    rx_stash_clear();
+    _backlog.first = _backlog.count = _backlog.bytes = 0;
+
+    // No rings until the guest sets them up. We must not find stale
+    // pointers from whatever lived here before.
+    for (VirtQueue &q : vq)
+      q.vector = VIRTIO_MSI_NO_VECTOR;
+
     // Always announce guest features. Doesn't harm.
     host_features = (1 << VIRTIO_NET_F_GUEST_CSUM) 
       | (1 << VIRTIO_NET_F_MRG_RXBUF)
@@ -81,7 +98,35 @@ namespace Switch {
       | (1 << VIRTIO_NET_F_GUEST_TSO6)
       | (1 << VIRTIO_NET_F_CSUM)
       | (1 << VIRTIO_NET_F_HOST_TSO4)
-      | (1 << VIRTIO_NET_F_HOST_TSO6);
+      | (1 << VIRTIO_NET_F_HOST_TSO6)
+      | (1 << VIRTIO_NET_F_HOST_UFO)
+      | (1 << VIRTIO_NET_F_GUEST_UFO)
+      | (1 << VIRTIO_NET_F_CTRL_VQ)
+      | (1 << VIRTIO_NET_F_CTRL_RX)
+      | (1 << VIRTIO_NET_F_CTRL_RX_EXTRA)
+      | (1 << VIRTIO_NET_F_CTRL_VLAN)
+      | (1 << VIRTIO_NET_F_CTRL_MAC_ADDR)
+      | (1 << VIRTIO_F_ANY_LAYOUT);
+
+    // If we have an address for the guest, tell it and make sure the
+    // switch knows where to find it before the guest says anything.
+    if (assign_mac and _switch.allocate_mac(_static_mac)) {
+      _has_static_mac = true;
+      host_features  |= (1 << VIRTIO_NET_F_MAC);
+      _rx_filter.set_mac(_static_mac);
+      logf("Guest MAC is %s.", _static_mac.to_str());
+    }
+  }
+
+  VirtioDevice::~VirtioDevice()
+  {
+    // Make sure the switch doesn't see us anymore, before we give
+    // away the packets we still hold.
+    disable();
+    backlog_orphan();
+
+    if (_has_static_mac)
+      _switch.release_mac(_static_mac);
   }
 
 }
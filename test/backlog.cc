@@ -0,0 +1,231 @@
+// Copyright (C) 2013, Julian Stecklina <jsteckli@os.inf.tu-dresden.de>
+// Economic rights: Technische Universitaet Dresden (Germany)
+
+// This file is part of sv3.
+
+// sv3 is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License version 2 as
+// published by the Free Software Foundation.
+
+// sv3 is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License version 2 for more details.
+
+// Packets wait in the backlog of a guest that has no RX buffers.
+// Checks that they go back to their source, when the source or the
+// guest goes away first, and that nothing from a source that is gone
+// is delivered later. Also checks that a vhost-user TX ring only
+// stops once ports that hold on to its packets (like a NIC) are done
+// with them.
+
+#include <cstdio>
+#include <cstdlib>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include <switch.hh>
+#include <exceptions.hh>
+
+#include "testguest.hh"
+
+using namespace Switch;
+
+// Enough to fill the backlog of a guest, so it is congested.
+enum { FRAMES = TestGuest::BUFFERS };
+
+static uint32_t const FEATURES = (1 << VIRTIO_NET_F_MRG_RXBUF) | (1 << VIRTIO_NET_F_GUEST_CSUM) |
+  (1 << VIRTIO_NET_F_GUEST_TSO4) | (1 << VIRTIO_NET_F_GUEST_TSO6);
+
+/// Keeps every packet until told to let go, like a NIC with a slow
+/// link. It doesn't give packets back when their source leaves. When
+/// it lets go, it still keeps the first keep packets, so it completes
+/// out of order.
+class HoldingPort : public Port {
+  std::vector<Packet::CompletionInfo> _held;
+
+public:
+  std::atomic<unsigned> held    { 0 };
+  std::atomic<unsigned> keep    { 0 };
+  std::atomic<bool>     release { false };
+
+  void receive(Packet &p) override
+  {
+    _held.push_back(p.copy_completion_info());
+    held++;
+  }
+
+  bool poll(Packet &, bool) override
+  {
+    unsigned k = keep;
+    if (release and _held.size() > k) {
+      for (auto it = _held.begin() + k; it != _held.end(); ++it)
+        it->src_port->mark_done(*it);
+      _held.resize(k);
+      held = k;
+    }
+    return false;
+  }
+
+  void mark_done(Packet::CompletionInfo &) override { }
+  void defer_done(Packet::CompletionInfo &, unsigned) override { }
+
+  explicit HoldingPort(Switch::Switch &sw) : Port(sw, "holder") { enable(); }
+
+  // The switch must stop polling us before we are gone.
+  ~HoldingPort() { disable(); }
+};
+
+static bool wait_for(std::function<bool()> f)
+{
+  for (unsigned i = 0; i < 10000; i++) {
+    if (f()) return true;
+    usleep(100);
+  }
+  return false;
+}
+
+static bool check(bool ok, char const *what)
+{
+  printf("%-56s %s\n", what, ok ? "ok" : "FAILED");
+  return ok;
+}
+
+/// Wait until the switch took all frames from src. They sit in the
+/// backlog of dst or, if we came too late, expired already.
+static bool sent(TestGuest &src, TestGuest &dst)
+{
+  return check(wait_for([&] { return dst.device().congested() or src.tx_used() == FRAMES; }),
+               "source sent its frames");
+}
+
+/// The source guest is reset (reset == true) or goes away, while the
+/// destination has its packets in the backlog.
+static bool source_leaves(Switch::Switch &sw, bool reset)
+{
+  bool ok = true;
+  std::unique_ptr<TestGuest> src(new TestGuest(sw, FEATURES));
+  TestGuest dst(sw, FEATURES);
+
+  src->send(FRAMES);
+  ok &= sent(*src, dst);
+
+  if (reset) {
+    src->device().reset();
+    ok &= check(src->tx_used() == FRAMES, "reset source got its frames back");
+  } else
+    src.reset();
+
+  ok &= check(dst.device().deadline() == 0, "destination dropped the frames");
+
+  dst.post_rx(FRAMES);
+  usleep(50000);
+  ok &= check(dst.rx_used() == 0, "destination got nothing from the old source");
+  return ok;
+}
+
+/// The destination goes away with packets in its backlog.
+static bool destination_leaves(Switch::Switch &sw)
+{
+  bool ok = true;
+  TestGuest src(sw, FEATURES);
+  std::unique_ptr<TestGuest> dst(new TestGuest(sw, FEATURES));
+
+  src.send(FRAMES);
+  ok &= sent(src, *dst);
+
+  dst.reset();
+  ok &= check(wait_for([&] { return src.tx_used() == FRAMES; }),
+              "source got its frames back");
+  return ok;
+}
+
+/// The TX ring stops while another port holds its packets. If they
+/// come back in time (late == false), the ring stops after them.
+/// Otherwise, the oldest frames don't come back, while newer ones
+/// did. The ring stops with all of them reported as sent.
+static bool tx_stop_in_flight(Switch::Switch &sw, bool late)
+{
+  enum { HELD = 8 };
+  bool ok = true;
+  HoldingPort holder(sw);
+  TestGuest src(sw, FEATURES);
+
+  src.send(HELD);
+  ok &= check(wait_for([&] { return holder.held == HELD; }), "holder got the frames");
+
+  if (late) {
+    holder.keep    = HELD / 2;
+    holder.release = true;
+    sw.schedule_poll();
+    ok &= check(wait_for([&] { return src.tx_used() == HELD / 2; }),
+                "newer frames completed first");
+  }
+
+  std::thread releaser;
+  if (not late)
+    releaser = std::thread([&] {
+        usleep(50000);
+        holder.release = true;
+        sw.schedule_poll();
+      });
+
+  uint16_t base = src.tx_stop();
+  if (releaser.joinable()) releaser.join();
+
+  if (late) {
+    ok &= check(base == HELD, "ring base includes frames in flight");
+    ok &= check(src.tx_used() == HELD, "frames in flight were reported as sent");
+
+    // The holder must not complete them a second time.
+    holder.keep = 0;
+    sw.schedule_poll();
+    ok &= check(wait_for([&] { return holder.held == 0; }), "holder let go of the frames");
+    ok &= check(src.tx_used() == HELD, "late completions are ignored");
+  } else {
+    ok &= check(base == HELD, "ring base includes completed frames");
+    ok &= check(src.tx_used() == HELD, "ring stopped after its frames completed");
+  }
+
+  return ok;
+}
+
+int main()
+{
+  Switch::Switch sw(0, 16);
+
+  std::thread switch_thread([&] () {
+      rcu_register_thread();
+      sw.loop();
+      rcu_unregister_thread();
+    });
+
+  bool ok = true;
+  try {
+    printf("Source is reset:\n");
+    ok &= source_leaves(sw, true);
+    printf("Source is destroyed:\n");
+    ok &= source_leaves(sw, false);
+    printf("Destination is destroyed:\n");
+    ok &= destination_leaves(sw);
+    printf("TX ring stops with frames in flight:\n");
+    ok &= tx_stop_in_flight(sw, false);
+    printf("TX ring stops with frames that don't come back:\n");
+    ok &= tx_stop_in_flight(sw, true);
+  } catch (Switch::Exception &e) {
+    printf("%s FAILED\n", e.reason().c_str());
+    ok = false;
+  }
+
+  sw.shutdown();
+  switch_thread.join();
+
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// EOF
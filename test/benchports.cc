@@ -0,0 +1,163 @@
+// Copyright (C) 2013, Julian Stecklina <jsteckli@os.inf.tu-dresden.de>
+// Economic rights: Technische Universitaet Dresden (Germany)
+
+// This file is part of sv3.
+
+// sv3 is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License version 2 as
+// published by the Free Software Foundation.
+
+// sv3 is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License version 2 for more details.
+
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <utility>
+
+#include <exceptions.hh>
+
+#include "benchports.hh"
+
+namespace Switch {
+
+  static uint8_t *allocate_buffers(size_t size)
+  {
+    void *p;
+    if (0 != posix_memalign(&p, 4096, size))
+      throw Exception("posix_memalign failed");
+    memset(p, 0, size);
+    return static_cast<uint8_t *>(p);
+  }
+
+  // NullPort
+
+  NullPort::NullPort(Switch &sw, std::string name, Ethernet::Address const &mac)
+    : Port(sw, name)
+  {
+    _has_static_mac = true;
+    _static_mac     = mac;
+    enable();
+  }
+
+  // ReflectorPort
+
+  void ReflectorPort::receive(Packet &p)
+  {
+    uint32_t length = p.packet_length - sizeof(virtio_net_hdr_mrg_rxbuf);
+
+    if (UNLIKELY(_head - _done == RING_SIZE or length > MAX_FRAME or
+                 length < sizeof(Ethernet::Header))) {
+      _stats->drops_tx_queue_full += 1;
+      return;
+    }
+
+    uint8_t *b     = buffer(_head);
+    auto    *frame = b + sizeof(virtio_net_hdr_mrg_rxbuf);
+    p.read(0, frame, length);
+
+    auto &ehdr = *reinterpret_cast<Ethernet::Header *>(frame);
+    std::swap(ehdr.src, ehdr.dst);
+
+    _length[_head % RING_SIZE] = sizeof(virtio_net_hdr_mrg_rxbuf) + length;
+    _head++;
+  }
+
+  bool ReflectorPort::poll(Packet &p, bool enable_notifications)
+  {
+    if (_tail == _head) return false;
+
+    unsigned idx = _tail++ % RING_SIZE;
+
+    _holders[idx]        = 1;
+    p.fragments          = 1;
+    p.fragment[0]        = buffer(idx);
+    p.fragment_length[0] = _length[idx];
+    p.packet_length      = _length[idx];
+    p.completion_info.virtio.index = idx;
+    return true;
+  }
+
+  void ReflectorPort::defer_done(Packet::CompletionInfo &c, unsigned holders)
+  {
+    _holders[c.virtio.index] = holders;
+  }
+
+  void ReflectorPort::mark_done(Packet::CompletionInfo &c)
+  {
+    _holders[c.virtio.index]--;
+
+    // Buffers are reused in order, so a late completion holds up
+    // everything behind it.
+    while (_done != _tail and _holders[_done % RING_SIZE] == 0)
+      _done++;
+  }
+
+  ReflectorPort::ReflectorPort(Switch &sw, std::string name, Ethernet::Address const &mac)
+    : Port(sw, name), _buffers(allocate_buffers(RING_SIZE * BUFFER_SIZE)),
+      _head(0), _tail(0), _done(0)
+  {
+    memset(_holders, 0, sizeof(_holders));
+    _has_static_mac = true;
+    _static_mac     = mac;
+    enable();
+  }
+
+  ReflectorPort::~ReflectorPort()
+  {
+    // Don't free buffers the switch might still look at.
+    disable();
+    free(_buffers);
+  }
+
+  // ReplayPort
+
+  bool ReplayPort::poll(Packet &p, bool enable_notifications)
+  {
+    unsigned idx = _next;
+    _next = (idx + 1 == _length.size()) ? 0 : idx + 1;
+
+    p.fragments          = 1;
+    p.fragment[0]        = _frames + idx * _slot_size;
+    p.fragment_length[0] = _length[idx];
+    p.packet_length      = _length[idx];
+    return true;
+  }
+
+  ReplayPort::ReplayPort(Switch &sw, std::string name,
+                         std::vector<std::vector<uint8_t>> const &frames)
+    : Port(sw, name), _frames(nullptr), _slot_size(0), _next(0)
+  {
+    if (frames.empty())
+      throw Exception("Nothing to replay");
+
+    for (auto const &f : frames) {
+      if (f.size() < sizeof(Ethernet::Header))
+        throw Exception("Frame too short to replay");
+      _slot_size = std::max(_slot_size, sizeof(virtio_net_hdr_mrg_rxbuf) + f.size());
+    }
+
+    // Keep frames cache line aligned, like guest buffers usually are.
+    _slot_size = (_slot_size + 63) & ~size_t(63);
+    _frames    = allocate_buffers(_slot_size * frames.size());
+
+    for (size_t i = 0; i < frames.size(); i++) {
+      memcpy(_frames + i * _slot_size + sizeof(virtio_net_hdr_mrg_rxbuf),
+             frames[i].data(), frames[i].size());
+      _length.push_back(sizeof(virtio_net_hdr_mrg_rxbuf) + frames[i].size());
+    }
+
+    enable();
+  }
+
+  ReplayPort::~ReplayPort()
+  {
+    disable();
+    free(_frames);
+  }
+
+}
+
+// EOF
@@ -0,0 +1,96 @@
+// Copyright (C) 2013, Julian Stecklina <jsteckli@os.inf.tu-dresden.de>
+// Economic rights: Technische Universitaet Dresden (Germany)
+
+// This file is part of sv3.
+
+// sv3 is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License version 2 as
+// published by the Free Software Foundation.
+
+// sv3 is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License version 2 for more details.
+
+// Ports that cost (almost) nothing, so benchmarks see the switch
+// itself and not guest rings or NICs.
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include <switch.hh>
+
+namespace Switch {
+
+  /// Swallows everything. Packets are complete as soon as receive()
+  /// returns and the port never has anything to send.
+  class NullPort : public Port {
+  public:
+    void receive(Packet &p) override { }
+    bool poll(Packet &p, bool enable_notifications) override { return false; }
+    void mark_done(Packet::CompletionInfo &c) override { }
+    void defer_done(Packet::CompletionInfo &c, unsigned holders) override { }
+
+    /// The switch sends packets for mac to this port without having
+    /// to learn it first.
+    NullPort(Switch &sw, std::string name, Ethernet::Address const &mac);
+  };
+
+  /// Sends back what it receives with source and destination MAC
+  /// swapped. Frames are copied into a fixed ring of buffers and
+  /// dropped, if the ring is full.
+  class ReflectorPort : public Port {
+  public:
+    enum {
+      RING_SIZE  = 256,         // Power of two
+      MAX_FRAME  = 1514,
+    };
+
+  private:
+    enum { BUFFER_SIZE = 2048 };
+
+    uint8_t  *_buffers;
+    uint16_t  _length[RING_SIZE];
+    uint16_t  _holders[RING_SIZE]; // See defer_done
+    unsigned  _head;            // Next frame we receive into
+    unsigned  _tail;            // Next frame we send
+    unsigned  _done;            // Oldest frame that is not complete
+
+    uint8_t  *buffer(unsigned idx) { return _buffers + (idx % RING_SIZE) * BUFFER_SIZE; }
+
+  public:
+    void receive(Packet &p) override;
+    bool poll(Packet &p, bool enable_notifications) override;
+    void mark_done(Packet::CompletionInfo &c) override;
+    void defer_done(Packet::CompletionInfo &c, unsigned holders) override;
+
+    ReflectorPort(Switch &sw, std::string name, Ethernet::Address const &mac);
+    ~ReflectorPort();
+  };
+
+  /// Sends the same set of frames over and over. The frames are
+  /// prepared once and handed to the switch as they are, so polling
+  /// costs neither allocations nor copies. Frames we get are dropped.
+  class ReplayPort : public Port {
+    uint8_t  *_frames;
+    size_t    _slot_size;
+    std::vector<uint32_t> _length; // Including virtio header
+    unsigned  _next;
+
+  public:
+    void receive(Packet &p) override { }
+    bool poll(Packet &p, bool enable_notifications) override;
+    void mark_done(Packet::CompletionInfo &c) override { }
+    void defer_done(Packet::CompletionInfo &c, unsigned holders) override { }
+
+    /// frames are Ethernet frames without FCS.
+    ReplayPort(Switch &sw, std::string name,
+               std::vector<std::vector<uint8_t>> const &frames);
+    ~ReplayPort();
+  };
+
+}
+
+// EOF
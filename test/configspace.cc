@@ -0,0 +1,111 @@
+// Copyright (C) 2013, Julian Stecklina <jsteckli@os.inf.tu-dresden.de>
+// Economic rights: Technische Universitaet Dresden (Germany)
+
+// This file is part of sv3.
+
+// sv3 is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License version 2 as
+// published by the Free Software Foundation.
+
+// sv3 is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License version 2 for more details.
+
+// Reads the device-specific configuration space of a VirtioDevice
+// the way a legacy guest does: before it sets up MSI-X, with MSI-X
+// and after it disabled MSI-X again. Also checks that the MAC pool
+// the address comes from keeps clear of multicast addresses.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <session.hh>
+#include <switch.hh>
+#include <exceptions.hh>
+
+using namespace Switch;
+
+static Ethernet::Address const MAC(0x02, 0, 0, 0, 0x42, 1);
+
+static bool failed = false;
+
+static void check(bool ok, char const *what)
+{
+  printf("%-60s %s\n", what, ok ? "ok" : "FAILED");
+  failed |= not ok;
+}
+
+/// Does the configuration space at offset hold our MAC? Read
+/// bytewise, like Linux does.
+static bool mac_at(VirtioDevice &dev, unsigned offset)
+{
+  for (unsigned i = 0; i < sizeof(MAC.byte); i++)
+    if (dev.io_read(0, offset + i, 1) != MAC.byte[i])
+      return false;
+  return true;
+}
+
+static void write16(VirtioDevice &dev, uint64_t addr, uint16_t val)
+{
+  bool irqs_changed = false;
+  dev.io_write(0, addr, 2, val, irqs_changed);
+}
+
+int main()
+{
+  Switch::Switch sw(0, 16);
+
+  // The second address would be 03:00:00:00:00:00.
+  bool rejected = false;
+  try {
+    sw.configure_mac_pool(Ethernet::Address(0x02, 0xff, 0xff, 0xff, 0xff, 0xff), 2);
+  } catch (ConfigurationError &) {
+    rejected = true;
+  }
+  check(rejected, "MAC pool that reaches the multicast bit is rejected");
+
+  sw.configure_mac_pool(MAC, 1);
+
+  int fd[2];
+  if (0 != socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fd)) {
+    perror("socketpair");
+    return EXIT_FAILURE;
+  }
+
+  try {
+    sockaddr_un sa;
+    memset(&sa, 0, sizeof(sa));
+    Session session(sw, fd[0], sa, true);
+    VirtioDevice &dev = session._device;
+
+    check(mac_at(dev, 20), "MAC at 20 without MSI-X");
+    check(dev.io_read(0, 26, 2) == 0, "no link status without VIRTIO_NET_F_STATUS");
+
+    write16(dev, VIRTIO_MSI_CONFIG_VECTOR, 0);
+    check(mac_at(dev, VIRTIO_PCI_CONFIG_MSI), "MAC at 24 with MSI-X");
+    check(dev.io_read(0, VIRTIO_MSI_CONFIG_VECTOR, 2) == 0, "configuration vector reads back");
+
+    write16(dev, VIRTIO_MSI_QUEUE_VECTOR, 1);
+    check(mac_at(dev, VIRTIO_PCI_CONFIG_MSI), "queue vector does not touch configuration space");
+
+    write16(dev, VIRTIO_MSI_CONFIG_VECTOR, VIRTIO_MSI_NO_VECTOR);
+    check(mac_at(dev, 20), "MAC at 20 after MSI-X is disabled");
+
+    write16(dev, VIRTIO_MSI_CONFIG_VECTOR, 0);
+    dev.reset();
+    check(mac_at(dev, 20), "MAC at 20 after reset");
+  } catch (Switch::Exception &e) {
+    printf("%s FAILED\n", e.reason().c_str());
+    failed = true;
+  }
+
+  close(fd[1]);
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// EOF
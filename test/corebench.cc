@@ -0,0 +1,236 @@
+// Copyright (C) 2013, Julian Stecklina <jsteckli@os.inf.tu-dresden.de>
+// Economic rights: Technische Universitaet Dresden (Germany)
+
+// This file is part of sv3.
+
+// sv3 is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License version 2 as
+// published by the Free Software Foundation.
+
+// sv3 is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License version 2 for more details.
+
+// Measures what the switch loop alone costs. Replay ports feed
+// preloaded frames to null or reflector ports, so the numbers are an
+// upper bound for one switch thread: no guest ring, no copy (except
+// for reflect), no NIC.
+//
+// Scenarios:
+//   unicast  One source sends to --ports sinks the switch knows.
+//   flood    One source broadcasts to --ports sinks.
+//   mactable Two sources with --macs addresses between them send to
+//            each other's addresses. Every frame is a MAC table
+//            lookup and a learning update.
+//   reflect  One source sends to a reflector that sends everything
+//            back, i.e. two switching decisions per frame.
+
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include <switch.hh>
+#include <exceptions.hh>
+#include <util.hh>
+
+#include "benchports.hh"
+
+using namespace Switch;
+
+// How many different frames sources cycle through. Enough to not
+// fit into a single cache line of headers, few enough to stay in L1.
+enum { FRAMES = 64 };
+
+static Ethernet::Address mac(uint8_t kind, unsigned n)
+{
+  return Ethernet::Address(0x02, kind, 0, n >> 16, n >> 8, n);
+}
+
+static std::vector<uint8_t> frame(Ethernet::Address const &dst,
+                                  Ethernet::Address const &src, unsigned size)
+{
+  std::vector<uint8_t> f(size);
+  auto &ehdr = *reinterpret_cast<Ethernet::Header *>(f.data());
+  ehdr.dst  = dst;
+  ehdr.src  = src;
+  // Local experimental Ethertype
+  f[12] = 0x88;
+  f[13] = 0xB5;
+  return f;
+}
+
+static double seconds()
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+struct Totals {
+  uint64_t polled;
+  uint64_t delivered;
+  uint64_t floods;
+  uint64_t drops;
+};
+
+static Totals totals(std::vector<std::unique_ptr<Port>> const &ports)
+{
+  Totals t = { 0, 0, 0, 0 };
+  for (auto &p : ports) {
+    PortStats const &s = p->stats();
+    t.polled    += s.rx_packets;
+    t.delivered += s.tx_packets;
+    t.floods    += s.floods;
+    t.drops     += s.drops_tx_queue_full;
+  }
+  return t;
+}
+
+static void run(std::string const &scenario, unsigned nports, unsigned macs,
+                unsigned size, unsigned batch_size, double duration, int cpu)
+{
+  Switch::Switch sw(0, batch_size);
+  std::vector<std::unique_ptr<Port>> ports;
+  Ethernet::Address const broadcast(0xff, 0xff, 0xff, 0xff, 0xff, 0xff);
+
+  if (scenario == "unicast" or scenario == "flood") {
+    std::vector<std::vector<uint8_t>> frames;
+    for (unsigned i = 0; i < FRAMES; i++)
+      frames.push_back(frame(scenario == "flood" ? broadcast : mac(1, i % nports),
+                             mac(0, 0), size));
+    ports.emplace_back(new ReplayPort(sw, "replay", frames));
+    for (unsigned i = 0; i < nports; i++)
+      ports.emplace_back(new NullPort(sw, "null" + std::to_string(i), mac(1, i)));
+  } else if (scenario == "mactable") {
+    // Sources cycle through their share of addresses, so every
+    // address is used at least once per round.
+    unsigned half = std::max(1U, macs / 2);
+    for (unsigned side = 0; side < 2; side++) {
+      std::vector<std::vector<uint8_t>> frames;
+      for (unsigned i = 0; i < std::max<unsigned>(half, FRAMES); i++)
+        frames.push_back(frame(mac(1 - side, (i * 7) % half), mac(side, i % half), size));
+      ports.emplace_back(new ReplayPort(sw, "replay" + std::to_string(side), frames));
+    }
+  } else if (scenario == "reflect") {
+    std::vector<std::vector<uint8_t>> frames;
+    for (unsigned i = 0; i < FRAMES; i++)
+      frames.push_back(frame(mac(1, 0), mac(0, 0), size));
+    ports.emplace_back(new ReplayPort(sw, "replay", frames));
+    ports.emplace_back(new ReflectorPort(sw, "reflector", mac(1, 0)));
+  } else
+    throw ConfigurationError("Unknown scenario '%s'.", scenario);
+
+  std::thread switch_thread([&] () {
+      if (cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (0 != pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+          fprintf(stderr, "Could not pin switch thread to CPU %d.\n", cpu);
+      }
+
+      rcu_register_thread();
+      sw.loop();
+      rcu_unregister_thread();
+    });
+
+  // Let the switch learn addresses and warm up caches.
+  usleep(200000);
+  Totals before = totals(ports);
+  double start  = seconds();
+  usleep(duration * 1000000);
+  Totals after  = totals(ports);
+  double elapsed = seconds() - start;
+
+  sw.shutdown();
+  switch_thread.join();
+
+  double polled    = (after.polled    - before.polled)    / elapsed;
+  double delivered = (after.delivered - before.delivered) / elapsed;
+
+  printf("%-8s %2u ports %5u macs %4u bytes batch %3u: %8.3f Mpps switched %8.3f Mpps delivered "
+         "%7.1f ns/frame  %.0f floods/s %.0f drops/s\n",
+         scenario.c_str(), unsigned(ports.size()),
+         scenario == "mactable" ? macs : 0, size, batch_size,
+         polled / 1e6, delivered / 1e6, polled ? 1e9 / polled : 0.0,
+         (after.floods - before.floods) / elapsed, (after.drops - before.drops) / elapsed);
+
+  // Ports detach themselves. The switch is not looking anymore.
+  ports.clear();
+}
+
+int main(int argc, char **argv)
+{
+  static struct option long_options [] = {
+    { "scenario",    required_argument, 0, 's' },
+    { "ports",       required_argument, 0, 'n' },
+    { "macs",        required_argument, 0, 'm' },
+    { "size",        required_argument, 0, 'S' },
+    { "batch-size",  required_argument, 0, 'b' },
+    { "seconds",     required_argument, 0, 'd' },
+    { "cpu",         required_argument, 0, 'c' },
+    { 0, 0, 0, 0 },
+  };
+
+  std::vector<std::string> scenarios  = { "unicast", "flood", "mactable", "reflect" };
+  std::vector<unsigned>    batches    = { 16 };
+  unsigned                 ports      = 4;
+  unsigned                 macs       = 256;
+  unsigned                 size       = 60;
+  double                   duration   = 1;
+  int                      cpu        = -1;
+
+  int opt, opt_idx;
+  while ((opt = getopt_long(argc, argv, "", long_options, &opt_idx)) != -1) {
+    switch (opt) {
+    case 's': scenarios  = string_split(optarg, ','); break;
+    case 'n': ports      = std::max(1, atoi(optarg)); break;
+    case 'm': macs       = std::max(2, atoi(optarg)); break;
+    case 'S': size       = std::min(std::max(atoi(optarg), int(sizeof(Ethernet::Header))),
+                                    int(ReflectorPort::MAX_FRAME)); break;
+    case 'd': duration   = atof(optarg); break;
+    case 'c': cpu        = atoi(optarg); break;
+    case 'b':
+      batches.clear();
+      for (auto &b : string_split(optarg, ','))
+        batches.push_back(std::max(1, atoi(b.c_str())));
+      if (not batches.empty()) break;
+      // FALLTHROUGH
+    default:
+      fprintf(stderr,
+              "Usage: %s [--scenario unicast|flood|mactable|reflect,...] [--ports n]\n"
+              "          [--macs n] [--size bytes] [--batch-size n,...] [--seconds s] [--cpu n]\n",
+              argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  try {
+    for (auto &s : scenarios)
+      for (unsigned b : batches)
+        run(s, ports, macs, size, b, duration, cpu);
+
+    return EXIT_SUCCESS;
+  } catch (Switch::Exception &e) {
+    fprintf(stderr, "\n%s:\n%s\n",
+            demangle(typeid(e).name()).c_str(), e.reason().c_str());
+  } catch (std::system_error &e) {
+    fprintf(stderr, "\nFatal system error: '%s'\n", e.what());
+  }
+
+  return EXIT_FAILURE;
+}
+
+// EOF
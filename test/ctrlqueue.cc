@@ -0,0 +1,161 @@
+// Copyright (C) 2013, Julian Stecklina <jsteckli@os.inf.tu-dresden.de>
+// Economic rights: Technische Universitaet Dresden (Germany)
+
+// This file is part of sv3.
+
+// sv3 is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License version 2 as
+// published by the Free Software Foundation.
+
+// sv3 is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License version 2 for more details.
+
+// Sends control queue commands to a VirtioDevice the way a legacy
+// guest does and checks the status it gets back and which flooded
+// frames the port accepts afterwards.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <switch.hh>
+#include <exceptions.hh>
+
+#include "testguest.hh"
+
+using namespace Switch;
+
+static Ethernet::Address const A(0x02, 0, 0, 0, 0, 0xA);
+static Ethernet::Address const B(0x02, 0, 0, 0, 0, 0xB);
+static Ethernet::Address const C(0x02, 0, 0, 0, 0, 0xC);
+static Ethernet::Address const M(0x01, 0, 0x5E, 0, 0, 1);
+static Ethernet::Address const N(0x01, 0, 0x5E, 0, 0, 2);
+static Ethernet::Address const BCAST(0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF);
+
+static std::vector<uint8_t> bytes(Ethernet::Address const &a)
+{
+  return std::vector<uint8_t>(a.byte, a.byte + sizeof(a.byte));
+}
+
+static std::vector<uint8_t> u32(uint32_t v)
+{
+  return std::vector<uint8_t>(reinterpret_cast<uint8_t *>(&v), reinterpret_cast<uint8_t *>(&v) + 4);
+}
+
+static std::vector<uint8_t> operator+(std::vector<uint8_t> a, std::vector<uint8_t> const &b)
+{
+  a.insert(a.end(), b.begin(), b.end());
+  return a;
+}
+
+/// Does the port take a flooded frame to dst, optionally tagged with
+/// VLAN vid?
+static bool accepts(Port &port, Ethernet::Address const &dst, int vid = -1)
+{
+  uint8_t frame[18] = {};
+  memcpy(frame, dst.byte, sizeof(dst.byte));
+  memcpy(frame + 6, A.byte, sizeof(A.byte));
+  if (vid >= 0) {
+    frame[12] = 0x81; frame[13] = 0x00;
+    frame[14] = vid >> 8; frame[15] = vid;
+    frame[16] = 0x08; frame[17] = 0x00;
+  } else {
+    frame[12] = 0x08; frame[13] = 0x00;
+  }
+
+  return port.accepts(*reinterpret_cast<Ethernet::Header *>(frame), sizeof(frame));
+}
+
+static bool failed = false;
+
+static void check(bool ok, char const *what)
+{
+  printf("%-60s %s\n", what, ok ? "ok" : "FAILED");
+  failed |= not ok;
+}
+
+int main()
+{
+  Switch::Switch sw(0, 16);
+
+  try {
+    TestGuest g(sw, (1 << VIRTIO_NET_F_CTRL_VQ) | (1 << VIRTIO_NET_F_CTRL_RX) |
+                (1 << VIRTIO_NET_F_CTRL_RX_EXTRA) | (1 << VIRTIO_NET_F_CTRL_VLAN) |
+                (1 << VIRTIO_NET_F_CTRL_MAC_ADDR));
+    VirtioDevice &dev = g.device();
+
+    check(accepts(dev, C) and accepts(dev, M), "a fresh port is promiscuous");
+
+    // Parsing
+    check(g.command(VIRTIO_NET_CTRL_RX, VIRTIO_NET_CTRL_RX_PROMISC, {}) == VIRTIO_NET_ERR,
+          "RX mode without argument fails");
+    check(g.command(VIRTIO_NET_CTRL_RX, 42, { 1 }) == VIRTIO_NET_ERR,
+          "unknown RX mode fails");
+    check(g.command(VIRTIO_NET_CTRL_MAC, VIRTIO_NET_CTRL_MAC_ADDR_SET, { 1, 2, 3 }) == VIRTIO_NET_ERR,
+          "short MAC address fails");
+    check(g.command(VIRTIO_NET_CTRL_VLAN, VIRTIO_NET_CTRL_VLAN_ADD, { 5 }) == VIRTIO_NET_ERR,
+          "short VLAN id fails");
+    check(g.command(42, 0, {}) == VIRTIO_NET_ERR, "unknown class fails");
+
+    // Unicast
+    check(g.command(VIRTIO_NET_CTRL_RX, VIRTIO_NET_CTRL_RX_PROMISC, { 0 }) == VIRTIO_NET_OK,
+          "promiscuous mode off");
+    check(accepts(dev, C), "without a MAC, all unicast passes");
+    check(g.command(VIRTIO_NET_CTRL_MAC, VIRTIO_NET_CTRL_MAC_ADDR_SET, bytes(A)) == VIRTIO_NET_OK,
+          "set MAC");
+    check(accepts(dev, A) and not accepts(dev, B), "only our own unicast passes");
+    check(accepts(dev, BCAST), "broadcast passes");
+    check(not accepts(dev, M), "multicast not in the table is dropped");
+
+    // MAC table
+    check(g.command(VIRTIO_NET_CTRL_MAC, VIRTIO_NET_CTRL_MAC_TABLE_SET,
+                    u32(1) + bytes(B) + u32(1) + bytes(M)) == VIRTIO_NET_OK,
+          "set MAC table");
+    check(accepts(dev, A) and accepts(dev, B) and not accepts(dev, C),
+          "unicast table entries pass");
+    check(accepts(dev, M) and not accepts(dev, N), "multicast table entries pass");
+    check(g.command(VIRTIO_NET_CTRL_MAC, VIRTIO_NET_CTRL_MAC_TABLE_SET,
+                    u32(1000) + bytes(B)) == VIRTIO_NET_OK,
+          "cut off MAC table");
+    check(accepts(dev, C) and accepts(dev, N), "cut off MAC table overflows");
+    check(g.command(VIRTIO_NET_CTRL_MAC, VIRTIO_NET_CTRL_MAC_TABLE_SET,
+                    u32(0) + u32(0)) == VIRTIO_NET_OK,
+          "empty MAC table");
+
+    // Modes
+    check(g.command(VIRTIO_NET_CTRL_RX, VIRTIO_NET_CTRL_RX_NOBCAST, { 1 }) == VIRTIO_NET_OK and
+          not accepts(dev, BCAST), "no broadcast");
+    check(g.command(VIRTIO_NET_CTRL_RX, VIRTIO_NET_CTRL_RX_ALLMULTI, { 1 }) == VIRTIO_NET_OK and
+          accepts(dev, N), "all multicast");
+    check(g.command(VIRTIO_NET_CTRL_RX, VIRTIO_NET_CTRL_RX_NOMULTI, { 1 }) == VIRTIO_NET_OK and
+          not accepts(dev, N), "no multicast wins over all multicast");
+    check(g.command(VIRTIO_NET_CTRL_RX, VIRTIO_NET_CTRL_RX_ALLUNI, { 1 }) == VIRTIO_NET_OK and
+          accepts(dev, C), "all unicast");
+    check(g.command(VIRTIO_NET_CTRL_RX, VIRTIO_NET_CTRL_RX_NOUNI, { 1 }) == VIRTIO_NET_OK and
+          not accepts(dev, A), "no unicast");
+    g.command(VIRTIO_NET_CTRL_RX, VIRTIO_NET_CTRL_RX_NOUNI, { 0 });
+
+    // VLANs. We negotiated VLAN filtering, so tagged frames need
+    // their VLAN in the filter.
+    check(not accepts(dev, A, 5), "tagged frame without VLAN is dropped");
+    check(g.command(VIRTIO_NET_CTRL_VLAN, VIRTIO_NET_CTRL_VLAN_ADD, { 5, 0 }) == VIRTIO_NET_OK and
+          accepts(dev, A, 5) and not accepts(dev, A, 6), "added VLAN passes");
+    check(g.command(VIRTIO_NET_CTRL_VLAN, VIRTIO_NET_CTRL_VLAN_DEL, { 5, 0 }) == VIRTIO_NET_OK and
+          not accepts(dev, A, 5), "deleted VLAN is dropped");
+    check(g.command(VIRTIO_NET_CTRL_VLAN, VIRTIO_NET_CTRL_VLAN_ADD, { 0, 0x10 }) == VIRTIO_NET_ERR,
+          "VLAN id out of range fails");
+
+    // The guest only kicks, if we want to be kicked.
+    check(not (g.ctrl_used_flags() & VRING_USED_F_NO_NOTIFY), "control queue notifications stay on");
+  } catch (Switch::Exception &e) {
+    printf("%s FAILED\n", e.reason().c_str());
+    failed = true;
+  }
+
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// EOF
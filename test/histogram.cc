@@ -0,0 +1,86 @@
+// Copyright (C) 2013, Julian Stecklina <jsteckli@os.inf.tu-dresden.de>
+// Economic rights: Technische Universitaet Dresden (Germany)
+
+// This file is part of sv3.
+
+// sv3 is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License version 2 as
+// published by the Free Software Foundation.
+
+// sv3 is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License version 2 for more details.
+
+
+#include <cstdio>
+#include <cstdlib>
+
+#include <histogram.hh>
+
+using namespace Switch;
+
+static bool check(char const *what, bool ok)
+{
+  if (not ok) printf("%s FAILED\n", what);
+  return ok;
+}
+
+static bool buckets()
+{
+  bool     ok   = true;
+  unsigned last = 0;
+
+  for (uint64_t v = 0; v < (1ULL << 40); v = v < 64 ? v + 1 : v + v / 7) {
+    unsigned idx = Histogram::index(v);
+    uint64_t lb  = Histogram::lower_bound(idx);
+
+    ok &= check("monotonic",   idx >= last);
+    ok &= check("lower bound", lb <= v);
+    ok &= check("precision",   v - lb <= v / Histogram::SUB_BUCKETS);
+    ok &= check("round trip",  Histogram::index(lb) == idx);
+    last = idx;
+  }
+
+  ok &= check("last bucket", Histogram::index(~0ULL) == Histogram::BUCKETS - 1);
+  return ok;
+}
+
+static bool percentiles()
+{
+  static Histogram h;
+  bool ok = true;
+
+  h.reset();
+  ok &= check("empty", h.percentile(0.5) == 0);
+
+  // 1..10000 once each
+  for (uint64_t v = 1; v <= 10000; v++)
+    h.add(v);
+
+  uint64_t p50 = h.percentile(0.5);
+  uint64_t p99 = h.percentile(0.99);
+
+  printf("p50 %llu p99 %llu max %llu\n", (unsigned long long)p50,
+         (unsigned long long)p99, (unsigned long long)h.max);
+
+  ok &= check("count", h.count == 10000);
+  ok &= check("sum",   h.sum == 10000ULL * 10001 / 2);
+  ok &= check("max",   h.max == 10000);
+  ok &= check("p50",   p50 <= 5001 and p50 >= 5000 - 5000 / Histogram::SUB_BUCKETS);
+  ok &= check("p99",   p99 <= 9901 and p99 >= 9900 - 9900 / Histogram::SUB_BUCKETS);
+  ok &= check("p100",  h.percentile(1.0) == h.max);
+
+  h.reset();
+  ok &= check("reset", h.count == 0 and h.percentile(0.99) == 0);
+  return ok;
+}
+
+int main()
+{
+  bool ok = buckets();
+  ok &= percentiles();
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// EOF
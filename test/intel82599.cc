@@ -0,0 +1,269 @@
+// Copyright (C) 2013, Julian Stecklina <jsteckli@os.inf.tu-dresden.de>
+// Economic rights: Technische Universitaet Dresden (Germany)
+
+// This file is part of sv3.
+
+// sv3 is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License version 2 as
+// published by the Free Software Foundation.
+
+// sv3 is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License version 2 for more details.
+
+// Runs the 82599 driver against Intel82599Model. Checks that every
+// frame makes it through RX (with and without RSC) and TX intact and
+// reports how many frames per second the driver's ring handling
+// manages. The model thread competes for CPU time, so numbers are
+// only comparable on the same machine.
+//
+// Usage: test/intel82599 [frames]
+
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <atomic>
+#include <vector>
+
+#include <poll.h>
+#include <unistd.h>
+
+#include <intel82599.hh>
+#include <timer.hh>
+
+#include "intel82599model.hh"
+
+using namespace Switch;
+
+// Frames carry a sequence number behind the Ethernet header and a
+// pattern derived from it everywhere else.
+
+// The pattern starts after where IPv4 has its protocol field.
+enum { SEQ_OFFSET = 14, PROTO_OFFSET = 23, PATTERN_OFFSET = 24 };
+
+static void fill_frame(uint8_t *f, size_t len, uint64_t seq, bool ipv4_tcp)
+{
+  memset(f, 0xFF, 6);
+  memset(f + 6, 0x02, 6);
+  // Either IPv4 (which the model parses for checksum status) or a
+  // local experimental Ethertype.
+  f[12] = ipv4_tcp ? 0x08 : 0x88;
+  f[13] = ipv4_tcp ? 0x00 : 0xB5;
+  memcpy(f + SEQ_OFFSET, &seq, sizeof(seq));
+  f[PROTO_OFFSET] = ipv4_tcp ? 6 : 0;
+  for (size_t i = PATTERN_OFFSET; i < len; i++)
+    f[i] = uint8_t(seq + i);
+}
+
+static bool check_frame(uint8_t const *f, size_t len, uint64_t &seq)
+{
+  if (len < PATTERN_OFFSET) return false;
+  memcpy(&seq, f + SEQ_OFFSET, sizeof(seq));
+  for (size_t i = PATTERN_OFFSET; i < len; i++)
+    if (f[i] != uint8_t(seq + i)) return false;
+  return true;
+}
+
+// The frame length for a sequence number.
+static size_t frame_length(std::vector<size_t> const &sizes, uint64_t seq)
+{
+  return sizes[seq % sizes.size()];
+}
+
+// A port that only receives completions for the packets we send.
+class SourcePort : public Port {
+public:
+  uint64_t completed = 0;
+
+  void receive(Packet &) override { }
+  bool poll(Packet &, bool) override { return false; }
+  void mark_done(Packet::CompletionInfo &) override { completed++; }
+  void defer_done(Packet::CompletionInfo &, unsigned) override { }
+
+  SourcePort(Switch::Switch &sw) : Port(sw, "source") { }
+};
+
+struct Traffic {
+  std::vector<size_t>   sizes;
+  std::atomic<uint64_t> produced { 0 };
+  uint64_t              limit = 0;
+
+  // Hands out frames until limit.
+  size_t produce(uint8_t *f, size_t space)
+  {
+    uint64_t seq = produced.load(std::memory_order_relaxed);
+    if (seq >= limit) return 0;
+    size_t len = std::min(space, frame_length(sizes, seq));
+    fill_frame(f, len, seq, seq & 1);
+    produced.store(seq + 1, std::memory_order_release);
+    return len;
+  }
+};
+
+static double seconds(uint64_t cycles)
+{
+  return double(cycles) / cycles_per_second();
+}
+
+// Receive count frames through port and check them. With RSC, chains
+// of different frames interleave and frames complete out of order.
+static bool rx_test(char const *name, Intel82599Port &port, Traffic &t,
+                    std::vector<size_t> const &sizes, uint64_t count)
+{
+  t.sizes    = sizes;
+  t.produced = 0;
+  t.limit    = count;
+
+  std::vector<bool> seen(count);
+  uint64_t received = 0, bytes = 0, chains = 0;
+  bool     ok = true;
+  uint64_t start = rdtsc();
+  uint64_t timeout = start + 10 * cycles_per_second();
+  std::vector<uint8_t> frame(64 << 10);
+
+  while (received < count and rdtsc() < timeout) {
+    Packet p;
+    if (not port.poll(p, false)) continue;
+
+    size_t len = 0;
+    for (unsigned i = 1; i < p.fragments; i++) {
+      memcpy(frame.data() + len, p.fragment[i], p.fragment_length[i]);
+      len += p.fragment_length[i];
+    }
+
+    uint64_t seq = ~0ULL;
+    auto const *hdr = reinterpret_cast<virtio_net_hdr_mrg_rxbuf const *>(p.fragment[0]);
+    if (not check_frame(frame.data(), len, seq) or seq >= count or seen[seq] or
+        len != frame_length(sizes, seq) or len + sizeof(*hdr) != p.packet_length or
+        bool(hdr->flags & VIRTIO_NET_HDR_F_DATA_VALID) != bool(seq & 1)) {
+      printf("%s: bad frame seq %llu len %zu FAILED\n", name, (unsigned long long)seq, len);
+      ok = false;
+    } else
+      seen[seq] = true;
+
+    if (p.fragments > 2) chains++;
+    received++;
+    bytes += len;
+    port.mark_done(p.completion_info);
+  }
+
+  uint64_t cycles = rdtsc() - start;
+
+  if (received != count) {
+    printf("%s: received %llu of %llu frames FAILED\n", name,
+           (unsigned long long)received, (unsigned long long)count);
+    ok = false;
+  }
+
+  printf("%-14s %8.3f Mpps %7.3f Gbit/s  %llu multi-buffer\n", name,
+         received / seconds(cycles) / 1e6, bytes * 8 / seconds(cycles) / 1e9,
+         (unsigned long long)chains);
+  return ok;
+}
+
+int main(int argc, char **argv)
+{
+  uint64_t count = argc > 1 ? strtoull(argv[1], nullptr, 0) : 200000;
+  bool     ok    = true;
+
+  Traffic plain, rsc;
+  std::atomic<uint64_t> sunk { 0 }, sunk_bad { 0 };
+  std::vector<size_t>   tx_sizes = { 60, 1514 };
+
+  auto sink = [&] (uint8_t const *f, size_t len, bool tso) {
+    uint64_t seq;
+    uint64_t n = sunk.load(std::memory_order_relaxed);
+    if (not check_frame(f, len, seq) or seq != n or len != frame_length(tx_sizes, seq) or tso)
+      sunk_bad.fetch_add(1, std::memory_order_relaxed);
+    sunk.store(n + 1, std::memory_order_release);
+  };
+
+  Switch::Switch sw(0, 16);
+
+  // The driver never joins its IRQ thread, so ports live until we
+  // exit, like the upstream port in sv3.
+  auto *plain_nic = new Intel82599Model([&] (uint8_t *f, size_t s) { return plain.produce(f, s); }, sink);
+  auto *rsc_nic   = new Intel82599Model([&] (uint8_t *f, size_t s) { return rsc.produce(f, s); }, nullptr);
+  auto *port      = new Intel82599Port(plain_nic, "model", sw, "ixgbe", false, 0);
+  auto *rsc_port  = new Intel82599Port(rsc_nic,   "model", sw, "ixgbe-rsc", true, 8000);
+
+  ok &= rx_test("rx 64",        *port,     plain, { 60 },             count);
+  ok &= rx_test("rx 1514",      *port,     plain, { 1514 },           count);
+  ok &= rx_test("rx jumbo",     *port,     plain, { 60, 9000 },       count / 10);
+  ok &= rx_test("rx rsc",       *rsc_port, rsc,   { 1514, 8000, 20000, 60, 30000 }, count / 10);
+
+  // Transmit.
+  {
+    SourcePort src(sw);
+    std::vector<uint8_t> frames(2048 * 2048);
+    virtio_net_hdr_mrg_rxbuf hdr;
+    memset(&hdr, 0, sizeof(hdr));
+
+    uint64_t start = rdtsc(), timeout = start + 10 * cycles_per_second();
+    uint64_t sent  = 0;
+    while ((sent < count or src.completed < sent) and rdtsc() < timeout) {
+      // Stay below the queue length, the driver drops otherwise.
+      while (sent < count and sent - src.completed < 1024) {
+        uint8_t *f   = &frames[(sent % 2048) * 2048];
+        size_t   len = frame_length(tx_sizes, sent);
+        fill_frame(f, len, sent, false);
+
+        Packet p;
+        p.fragments          = 2;
+        p.fragment[0]        = reinterpret_cast<uint8_t *>(&hdr);
+        p.fragment_length[0] = sizeof(hdr);
+        p.fragment[1]        = f;
+        p.fragment_length[1] = len;
+        p.packet_length      = sizeof(hdr) + len;
+        p.copied             = 0;
+        p.completion_info.src_port = &src;
+        port->receive(p);
+        sent++;
+      }
+
+      // Reap completions.
+      Packet p;
+      if (port->poll(p, false)) port->mark_done(p.completion_info);
+    }
+    uint64_t cycles = rdtsc() - start;
+
+    if (src.completed != count or sunk != count or sunk_bad != 0) {
+      printf("tx: sent %llu completed %llu sunk %llu bad %llu FAILED\n",
+             (unsigned long long)sent, (unsigned long long)src.completed,
+             (unsigned long long)sunk.load(), (unsigned long long)sunk_bad.load());
+      ok = false;
+    }
+
+    printf("%-14s %8.3f Mpps\n", "tx 64/1514", src.completed / seconds(cycles) / 1e6);
+  }
+
+  // Interrupts. Once the driver unmasks, the next frame has to wake
+  // up the switch.
+  {
+    uint64_t v;
+    Packet   p;
+    plain.sizes    = { 60 };
+    plain.produced = 0;
+    plain.limit    = 0;
+    while (port->poll(p, false)) port->mark_done(p.completion_info);
+
+    // Drain interrupts that are still pending.
+    pollfd pfd = { sw.event_fd(), POLLIN, 0 };
+    while (poll(&pfd, 1, 100) == 1 and read(sw.event_fd(), &v, sizeof(v)) == sizeof(v)) { }
+
+    if (port->poll(p, true)) port->mark_done(p.completion_info);
+    plain.limit = 1;
+
+    if (poll(&pfd, 1, 1000) != 1) {
+      printf("irq: no interrupt FAILED\n");
+      ok = false;
+    } else
+      printf("irq: ok\n");
+  }
+
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// EOF
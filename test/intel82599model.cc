@@ -0,0 +1,416 @@
+// Copyright (C) 2013, Julian Stecklina <jsteckli@os.inf.tu-dresden.de>
+// Economic rights: Technische Universitaet Dresden (Germany)
+
+// This file is part of sv3.
+
+// sv3 is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License version 2 as
+// published by the Free Software Foundation.
+
+// sv3 is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License version 2 for more details.
+
+
+#include "intel82599model.hh"
+
+#include <exceptions.hh>
+#include <timer.hh>
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+namespace Switch {
+
+  // The registers the driver uses. See switch/intel82599.cc.
+
+#define I99_REG(name, val) name = (val)/4
+
+  enum {
+    I99_REG(CTRL,     0x0000),
+    I99_REG(LINKS,    0x42A4),
+
+    I99_REG(EIMS,     0x0880),
+    I99_REG(EIMC,     0x0888),
+    I99_REG(GPIE,     0x0898),
+    I99_REG(EITR0,    0x0820),
+
+    I99_REG(RXCTRL,   0x3000),
+    I99_REG(RXDCTL0,  0x1028),
+    I99_REG(SRRCTL0,  0x1014),
+    I99_REG(RSCCTL0,  0x102C),
+
+    I99_REG(RAL0,     0xA200),
+    I99_REG(RAH0,     0xA204),
+    I99_REG(RDBAL0,   0x1000),
+    I99_REG(RDBAH0,   0x1004),
+    I99_REG(RDLEN0,   0x1008),
+    I99_REG(RDH0,     0x1010),
+    I99_REG(RDT0,     0x1018),
+
+    I99_REG(TDBAL0,   0x6000),
+    I99_REG(TDBAH0,   0x6004),
+    I99_REG(TDLEN0,   0x6008),
+    I99_REG(TDH0,     0x6010),
+    I99_REG(TDT0,     0x6018),
+    I99_REG(TDBWAL0,  0x6038),
+    I99_REG(TDBWAH0,  0x603C),
+    I99_REG(TXDCTL0,  0x6028),
+    I99_REG(DMATXCTL, 0x4A80),
+
+    I99_REG(SECRXSTAT, 0x8D04),
+  };
+#undef I99_REG
+
+  enum {
+    MSIX_RXTX_VECTOR      = 0,
+
+    CTRL_LRST             = 1U << 3,
+    CTRL_RST              = 1U << 26,
+
+    GPIE_EIAME            = 1U << 30,
+
+    EITR_INTERVAL_SHIFT   = 3,
+    EITR_INTERVAL_MASK    = 0x1FFU << EITR_INTERVAL_SHIFT,
+
+    RXCTRL_RXEN           = 1U << 0,
+    RXDCTL_EN             = 1U << 25,
+    TXDCTL_EN             = 1U << 25,
+    DMATXCTL_TE           = 1U,
+    TDBWAL_HEAD_WB_EN     = 1U << 0,
+
+    SRRCTL_BSIZEPACKET_MASK = 0x1F,
+
+    RSCCTL_RSCEN          = 1U << 0,
+    RSCCTL_MAXDESC_SHIFT  = 2,
+    RSCCTL_MAXDESC_MASK   = 3U << RSCCTL_MAXDESC_SHIFT,
+
+    LINKS_LINK_UP          = 1U << 30,
+    LINKS_LINK_SPEED_10G   = 3U << 28,
+
+    SECRXSTAT_SECRX_RDY   = 1U << 0,
+  };
+
+  enum : uint64_t {
+    RXDESC_LO_DD            = 1ULL << 0,
+    RXDESC_LO_EOP           = 1ULL << 1,
+    RXDESC_LO_NEXTP_SHIFT   = 4,
+    RXDESC_LO_STATUS_L4I    = 1ULL << 5,
+    RXDESC_LO_STATUS_IPCS   = 1ULL << 6,
+    RXDESC_LO_PKT_LEN_SHIFT = 32,
+    RXDESC_HI_RSCCNT_SHIFT  = 17,
+    RXDESC_HI_RSCCNT_MAX    = 0xF,
+
+    RXDESC_HI_PACKET_TYPE_IPV4 = 1ULL << (0 + 4),
+    RXDESC_HI_PACKET_TYPE_TCP  = 1ULL << (4 + 4),
+    RXDESC_HI_PACKET_TYPE_UDP  = 1ULL << (5 + 4),
+
+    TXDESC_LO_DTYP_SHIFT   = 20,
+    TXDESC_LO_DTYP_MASK    = 0xFULL << TXDESC_LO_DTYP_SHIFT,
+    TXDESC_LO_DTYP_ADV_DTA = 3ULL << TXDESC_LO_DTYP_SHIFT,
+    TXDESC_LO_DCMD_EOP     = 1ULL << (0 + 24),
+    TXDESC_LO_DCMD_TSE     = 1ULL << (7 + 24),
+    TXDESC_LO_LENGTH_MASK  = 0xFFFFULL,
+  };
+
+  static uint64_t pointer_load(uint32_t lo, uint32_t hi)
+  {
+    return uint64_t(hi) << 32 | lo;
+  }
+
+  void *Intel82599Model::map_bar(int bar, size_t *size)
+  {
+    if (bar != VFIO_PCI_BAR0_REGION_INDEX)
+      throw ConfigurationError("The model only has BAR0.");
+
+    *size = MMIO_SIZE;
+    return const_cast<uint32_t *>(_reg);
+  }
+
+  void Intel82599Model::set_irq_eventfd(unsigned idx, unsigned start, int event_fd)
+  {
+    if (start < sizeof(_irq_fd)/sizeof(_irq_fd[0]))
+      _irq_fd[start] = event_fd;
+  }
+
+  uint32_t Intel82599Model::read_config(int reg, int width)
+  {
+    assert(reg >= 0 and unsigned(reg + width) <= sizeof(_config));
+
+    uint32_t v = 0;
+    memcpy(&v, reinterpret_cast<uint8_t *>(_config) + reg, width);
+    return v;
+  }
+
+  void Intel82599Model::write_config(int reg, uint32_t val, int width)
+  {
+    assert(reg >= 0 and unsigned(reg + width) <= sizeof(_config));
+
+    // Vendor and device ID are read-only.
+    if (reg < 4) return;
+    memcpy(reinterpret_cast<uint8_t *>(_config) + reg, &val, width);
+  }
+
+  void Intel82599Model::reset_state()
+  {
+    _rx_head     = 0;
+    _tx_head     = 0;
+    _tx_length   = 0;
+    _tx_tso      = false;
+    _irq_pending = false;
+    for (auto &f : _rx_frame) f.length = 0;
+  }
+
+  void Intel82599Model::update_irq_mask()
+  {
+    // EIMC is write-1-to-clear for EIMS. We apply it when we get to
+    // it.
+    uint32_t eimc = __atomic_exchange_n(&_reg[EIMC], 0, __ATOMIC_ACQ_REL);
+    if (eimc)
+      __atomic_fetch_and(&_reg[EIMS], ~eimc, __ATOMIC_ACQ_REL);
+  }
+
+  bool Intel82599Model::process_tx()
+  {
+    if (not (_reg[DMATXCTL] & DMATXCTL_TE) or not (_reg[TXDCTL0] & TXDCTL_EN))
+      return false;
+
+    unsigned len  = _reg[TDLEN0] / sizeof(desc);
+    unsigned tail = __atomic_load_n(&_reg[TDT0], __ATOMIC_ACQUIRE);
+    desc    *ring = reinterpret_cast<desc *>(pointer_load(_reg[TDBAL0], _reg[TDBAH0]));
+
+    if (len == 0 or tail >= len or _tx_head == tail)
+      return false;
+
+    unsigned descriptors = 0;
+    unsigned frames      = 0;
+
+    for (; _tx_head != tail; _tx_head = (_tx_head + 1) % len, descriptors++) {
+      desc d = ring[_tx_head];
+
+      // Context descriptors only carry offload parameters.
+      if ((d.lo & TXDESC_LO_DTYP_MASK) != TXDESC_LO_DTYP_ADV_DTA)
+        continue;
+
+      size_t n = d.lo & TXDESC_LO_LENGTH_MASK;
+      if (_tx_length == 0)
+        _tx_tso = d.lo & TXDESC_LO_DCMD_TSE;
+
+      // The real NIC would hang. We cut the frame short.
+      n = std::min(n, _tx_frame.size() - _tx_length);
+      memcpy(_tx_frame.data() + _tx_length, reinterpret_cast<void const *>(d.hi), n);
+      _tx_length += n;
+
+      if (d.lo & TXDESC_LO_DCMD_EOP) {
+        if (_sink) _sink(_tx_frame.data(), _tx_length, _tx_tso);
+        _tx_length = 0;
+        frames++;
+      }
+    }
+
+    // The driver only looks at the head writeback.
+    __atomic_store_n(&_reg[TDH0], _tx_head, __ATOMIC_RELEASE);
+
+    uint32_t wbal = _reg[TDBWAL0];
+    if (wbal & TDBWAL_HEAD_WB_EN)
+      __atomic_store_n(reinterpret_cast<uint32_t *>(pointer_load(wbal & ~3U, _reg[TDBWAH0])),
+                       _tx_head, __ATOMIC_RELEASE);
+
+    _counters.tx_descriptors.fetch_add(descriptors, std::memory_order_relaxed);
+    _counters.tx_frames.fetch_add(frames, std::memory_order_relaxed);
+    return true;
+  }
+
+  bool Intel82599Model::process_rx()
+  {
+    if (not _source or not (_reg[RXCTRL] & RXCTRL_RXEN) or not (_reg[RXDCTL0] & RXDCTL_EN))
+      return false;
+
+    unsigned len  = _reg[RDLEN0] / sizeof(desc);
+    unsigned tail = __atomic_load_n(&_reg[RDT0], __ATOMIC_ACQUIRE);
+    desc    *ring = reinterpret_cast<desc *>(pointer_load(_reg[RDBAL0], _reg[RDBAH0]));
+    size_t   bsize = (_reg[SRRCTL0] & SRRCTL_BSIZEPACKET_MASK) * 1024;
+
+    if (len == 0 or tail >= len or bsize == 0)
+      return false;
+
+    uint32_t rscctl   = _reg[RSCCTL0];
+    bool     rsc      = rscctl & RSCCTL_RSCEN;
+    static const unsigned rsc_maxdesc[] = { 1, 4, 8, 16 };
+    unsigned maxdesc  = rsc ? rsc_maxdesc[(rscctl & RSCCTL_MAXDESC_MASK) >> RSCCTL_MAXDESC_SHIFT]
+                            : unsigned(MAX_RX_DESCRIPTORS);
+    unsigned group    = rsc ? INTERLEAVE : 1;
+
+    // Fetch frames until we have a group to write back.
+    unsigned frames  = 0;
+    unsigned needed  = 0;
+    unsigned descs[INTERLEAVE];
+    for (; frames < group; frames++) {
+      rx_frame &f = _rx_frame[frames];
+      if (f.length == 0)
+        f.length = _source(f.data.data(), std::min(f.data.size(), maxdesc * bsize));
+      if (f.length == 0) break;
+
+      descs[frames] = (f.length + bsize - 1) / bsize;
+      needed       += descs[frames];
+    }
+
+    if (frames == 0) return false;
+
+    unsigned available = (tail + len - _rx_head) % len;
+    if (available < needed) {
+      _counters.rx_no_descriptors.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+
+    // Hand out slots round-robin, so RSC chains of the frames in a
+    // group interleave. Without RSC, there is one frame per group and
+    // its descriptors are consecutive.
+    unsigned slot[INTERLEAVE][MAX_RX_DESCRIPTORS];
+    unsigned assigned[INTERLEAVE] = {};
+    for (unsigned s = _rx_head, left = needed; left; ) {
+      for (unsigned i = 0; i < frames; i++) {
+        if (assigned[i] == descs[i]) continue;
+        slot[i][assigned[i]++] = s;
+        s = (s + 1) % len;
+        left--;
+      }
+    }
+
+    // Write back in ring order, so the driver sees chains grow like
+    // it would on the real NIC.
+    for (unsigned k = 0, s = _rx_head; k < needed; k++, s = (s + 1) % len) {
+      unsigned i, j = 0;
+      for (i = 0; i < frames; i++) {
+        for (j = 0; j < descs[i] and slot[i][j] != s; j++) { }
+        if (j < descs[i]) break;
+      }
+      assert(i < frames);
+
+      rx_frame &f     = _rx_frame[i];
+      bool      eop   = j + 1 == descs[i];
+      size_t    off   = j * bsize;
+      size_t    n     = std::min(bsize, f.length - off);
+      desc     &d     = ring[s];
+
+      memcpy(reinterpret_cast<void *>(d.hi), f.data.data() + off, n);
+
+      uint8_t const *frame = f.data.data();
+      bool ipv4 = f.length >= 34 and frame[12] == 0x08 and frame[13] == 0x00;
+      bool tcp  = ipv4 and frame[23] == 6;
+      bool udp  = ipv4 and frame[23] == 17;
+
+      uint64_t hi = (ipv4 ? RXDESC_HI_PACKET_TYPE_IPV4 : 0)
+        | (tcp ? RXDESC_HI_PACKET_TYPE_TCP : 0)
+        | (udp ? RXDESC_HI_PACKET_TYPE_UDP : 0);
+      if (rsc and descs[i] > 1)
+        hi |= uint64_t(std::min<unsigned>(descs[i], RXDESC_HI_RSCCNT_MAX)) << RXDESC_HI_RSCCNT_SHIFT;
+
+      uint64_t lo = RXDESC_LO_DD | uint64_t(n) << RXDESC_LO_PKT_LEN_SHIFT;
+      if (eop) {
+        lo |= RXDESC_LO_EOP;
+        // We trust the source to produce correct checksums.
+        if (ipv4)        lo |= RXDESC_LO_STATUS_IPCS;
+        if (tcp or udp)  lo |= RXDESC_LO_STATUS_L4I;
+      } else if (rsc)
+        lo |= uint64_t(slot[i][j + 1]) << RXDESC_LO_NEXTP_SHIFT;
+
+      // DD is in lo, so it has to be last.
+      __atomic_store_n(&d.hi, hi, __ATOMIC_RELAXED);
+      __atomic_store_n(&d.lo, lo, __ATOMIC_RELEASE);
+    }
+
+    _rx_head = (_rx_head + needed) % len;
+    __atomic_store_n(&_reg[RDH0], _rx_head, __ATOMIC_RELEASE);
+
+    for (unsigned i = 0; i < frames; i++) _rx_frame[i].length = 0;
+
+    _counters.rx_descriptors.fetch_add(needed, std::memory_order_relaxed);
+    _counters.rx_frames.fetch_add(frames, std::memory_order_relaxed);
+    return true;
+  }
+
+  void Intel82599Model::maybe_irq(bool work)
+  {
+    _irq_pending |= work;
+    if (not _irq_pending or not (__atomic_load_n(&_reg[EIMS], __ATOMIC_ACQUIRE) & (1U << MSIX_RXTX_VECTOR)))
+      return;
+
+    // EITR0 is in 2us units. The driver reads it as a minimum
+    // distance between interrupts.
+    uint64_t now      = rdtsc();
+    uint64_t interval = ((_reg[EITR0] & EITR_INTERVAL_MASK) >> EITR_INTERVAL_SHIFT) * 2
+      * cycles_per_second() / 1000000;
+    if (now - _last_irq < interval)
+      return;
+
+    if (_reg[GPIE] & GPIE_EIAME)
+      __atomic_fetch_and(&_reg[EIMS], ~(1U << MSIX_RXTX_VECTOR), __ATOMIC_ACQ_REL);
+
+    _irq_pending = false;
+    _last_irq    = now;
+
+    uint64_t v = 1;
+    int      fd = _irq_fd[MSIX_RXTX_VECTOR];
+    if (fd >= 0 and write(fd, &v, sizeof(v)) == sizeof(v))
+      _counters.irqs.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  void Intel82599Model::run()
+  {
+    while (not _stop.load(std::memory_order_relaxed)) {
+      update_irq_mask();
+
+      if (_reg[CTRL] & (CTRL_RST | CTRL_LRST)) {
+        reset_state();
+        __atomic_fetch_and(&_reg[CTRL], ~(CTRL_RST | CTRL_LRST), __ATOMIC_RELEASE);
+      }
+
+      bool work = process_tx();
+      work     |= process_rx();
+      maybe_irq(work);
+
+      if (not work) sched_yield();
+    }
+  }
+
+  Intel82599Model::Intel82599Model(Source source, Sink sink)
+    : _config(), _irq_fd { -1, -1 }, _source(source), _sink(sink), _counters(),
+      _tx_frame(MAX_TX_FRAME), _last_irq(0), _stop(false)
+  {
+    void *m = mmap(nullptr, MMIO_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (m == MAP_FAILED)
+      throw SystemError("Could not allocate model registers.");
+    _reg = static_cast<uint32_t *>(m);
+
+    _config[0] = 0x151c8086;   // 82599/X520
+
+    // A locally administered address and a 10G link.
+    _reg[RAL0]      = 0x82000002;
+    _reg[RAH0]      = (1U << 31) | 0x0959;
+    _reg[LINKS]     = LINKS_LINK_UP | LINKS_LINK_SPEED_10G;
+    _reg[SECRXSTAT] = SECRXSTAT_SECRX_RDY;
+
+    // SRRCTL allows buffers up to 31K. The driver uses 4K.
+    for (auto &f : _rx_frame) f.data.resize(MAX_RX_DESCRIPTORS * 4096);
+    reset_state();
+
+    _thread = std::thread(&Intel82599Model::run, this);
+  }
+
+  Intel82599Model::~Intel82599Model()
+  {
+    _stop = true;
+    _thread.join();
+    munmap(const_cast<uint32_t *>(_reg), MMIO_SIZE);
+  }
+
+}
+
+// EOF
@@ -0,0 +1,134 @@
+// Copyright (C) 2013, Julian Stecklina <jsteckli@os.inf.tu-dresden.de>
+// Economic rights: Technische Universitaet Dresden (Germany)
+
+// This file is part of sv3.
+
+// sv3 is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License version 2 as
+// published by the Free Software Foundation.
+
+// sv3 is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License version 2 for more details.
+
+// A software 82599 for driver tests and benchmarks
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include <vfio.hh>
+#include <util.hh>
+
+namespace Switch {
+
+  /// Just enough of an 82599 for Intel82599Port. The model owns the
+  /// register file the driver maps as BAR0 and a thread that plays
+  /// the NIC: it acknowledges resets, fetches TX descriptors up to
+  /// TDT0, writes back the TX head, fills RX descriptors up to RDT0
+  /// with frames from a source and raises the RX/TX interrupt.
+  ///
+  /// Like the hardware, the model writes RX descriptors back in the
+  /// advanced one-buffer format: DD, EOP, PKT_LEN, the packet type and
+  /// checksum status (IPCS, L4I) for IPv4 TCP/UDP. If RSC is enabled
+  /// in RSCCTL0, frames larger than a buffer come as RSC chains with
+  /// RSCCNT and NEXTP and the chains of two frames are interleaved,
+  /// as they are when the NIC coalesces two flows at once.
+  ///
+  /// Addresses the driver programs are used as pointers, i.e. we
+  /// pretend the IOMMU maps everything 1:1, which is what VfioDevice
+  /// does.
+  class Intel82599Model : public PciDevice, Uncopyable {
+  public:
+    /// Writes the next frame to receive into frame (which has room
+    /// for space bytes) and returns its length or 0, if there is
+    /// nothing to receive right now. Called from the model thread.
+    typedef std::function<size_t (uint8_t *frame, size_t space)> Source;
+
+    /// Gets each frame the driver sent. tso is set, if the driver
+    /// asked for segmentation. Called from the model thread.
+    typedef std::function<void (uint8_t const *frame, size_t length, bool tso)> Sink;
+
+    struct Counters {
+      std::atomic<uint64_t> rx_frames;
+      std::atomic<uint64_t> rx_descriptors;
+      std::atomic<uint64_t> rx_no_descriptors; // Frame waited for RDT
+      std::atomic<uint64_t> tx_frames;
+      std::atomic<uint64_t> tx_descriptors;
+      std::atomic<uint64_t> irqs;
+    };
+
+    enum {
+      MMIO_SIZE     = 128 << 10,
+      MAX_TX_FRAME  = 64 << 10,
+
+      // The most descriptors the model uses for a frame. RSCCTL
+      // MAXDESC may allow less.
+      MAX_RX_DESCRIPTORS = 16,
+      INTERLEAVE         = 2,
+    };
+
+  private:
+    struct desc { uint64_t hi; uint64_t lo; };
+
+    uint32_t volatile *_reg;
+    uint32_t           _config[64];
+    int                _irq_fd[2];
+
+    Source             _source;
+    Sink               _sink;
+    Counters           _counters;
+
+    // Where the NIC is in the rings.
+    unsigned           _rx_head;
+    unsigned           _tx_head;
+
+    // TX frames are gathered here before they go to the sink.
+    std::vector<uint8_t> _tx_frame;
+    size_t               _tx_length;
+    bool                 _tx_tso;
+
+    // Frames we got from the source, but have no descriptors for yet.
+    struct rx_frame {
+      std::vector<uint8_t> data;
+      size_t               length;
+    } _rx_frame[INTERLEAVE];
+
+    // Interrupt moderation
+    uint64_t           _last_irq;
+    bool               _irq_pending;
+
+    std::atomic<bool>  _stop;
+    std::thread        _thread;
+
+    void reset_state();
+    void update_irq_mask();
+    bool process_tx();
+    bool process_rx();
+    void maybe_irq(bool work);
+    void run();
+
+  public:
+    Counters       &counters()       { return _counters; }
+
+    // PciDevice
+
+    void     map_memory_to_device(void *m, size_t len, bool read, bool write) override { }
+    void    *map_bar(int bar, size_t *size) override;
+    void     set_irq_eventfd(unsigned idx, unsigned start, int event_fd) override;
+    uint32_t read_config(int reg, int width) override;
+    void     write_config(int reg, uint32_t val, int width) override;
+    irq_list irqs() override { return irq_list(); }
+
+    Intel82599Model(Source source, Sink sink);
+    ~Intel82599Model();
+  };
+
+}
+
+// EOF
@@ -0,0 +1,79 @@
+// Copyright (C) 2013, Julian Stecklina <jsteckli@os.inf.tu-dresden.de>
+// Economic rights: Technische Universitaet Dresden (Germany)
+
+// This file is part of sv3.
+
+// sv3 is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License version 2 as
+// published by the Free Software Foundation.
+
+// sv3 is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License version 2 for more details.
+
+
+#include <cstdio>
+#include <cstdlib>
+
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include <irqbatch.hh>
+
+int main()
+{
+  // More eventfds than fit into one submission batch.
+  constexpr unsigned fds    = 300;
+  constexpr unsigned rounds = 3;
+
+  int ret = EXIT_SUCCESS;
+  int fd[fds];
+
+  Switch::IrqBatch batch;
+  printf("io_uring %s\n", batch.batching() ? "available" : "NOT available");
+
+  for (unsigned i = 0; i < fds; i++) {
+    fd[i] = eventfd(0, EFD_NONBLOCK);
+    if (fd[i] < 0) {
+      perror("eventfd");
+      return EXIT_FAILURE;
+    }
+  }
+
+  uint64_t start = rdtsc();
+  for (unsigned r = 0; r < rounds; r++) {
+    for (unsigned i = 0; i < fds; i++)
+      batch.trigger(fd[i]);
+    batch.flush();
+  }
+  uint64_t end = rdtsc();
+
+  printf("%.1lf cycles per interrupt\n", double(end - start) / (rounds * fds));
+
+  // A write to a bad fd is dropped. It doesn't make the batch give
+  // up on io_uring or lose the other interrupts.
+  bool batching = batch.batching();
+  batch.trigger(-1);
+  for (unsigned i = 0; i < fds; i++)
+    batch.trigger(fd[i]);
+  batch.flush();
+
+  if (batch.batching() != batching) {
+    printf("io_uring given up after a bad fd FAILED\n");
+    ret = EXIT_FAILURE;
+  }
+
+  for (unsigned i = 0; i < fds; i++) {
+    uint64_t v = 0;
+    if (read(fd[i], &v, sizeof(v)) != sizeof(v) or v != rounds + 1) {
+      printf("fd %u: %llu interrupts FAILED\n", i, (unsigned long long)v);
+      ret = EXIT_FAILURE;
+    }
+    close(fd[i]);
+  }
+
+  return ret;
+}
+
+// EOF
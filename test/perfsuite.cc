@@ -0,0 +1,663 @@
+// Copyright (C) 2013, Julian Stecklina <jsteckli@os.inf.tu-dresden.de>
+// Economic rights: Technische Universitaet Dresden (Germany)
+
+// This file is part of sv3.
+
+// sv3 is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License version 2 as
+// published by the Free Software Foundation.
+
+// sv3 is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License version 2 for more details.
+
+// Performance regression suite. Runs the kernels the data path is
+// built from and the switch as a whole, each several times on a fixed
+// CPU, and writes the results as JSON. scripts/perfcompare.py checks
+// them against a baseline.
+//
+// Every result is a rate, i.e. higher is better.
+//
+// The switch logs to stdout, so results go to a file (perf.json by
+// default).
+//
+// Usage: test/perfsuite [--repeat n] [--seconds s] [--cpu n]
+//                       [--filter <substring>] [--output <file>] [--list]
+
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <getopt.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <hash/onescomplement.hh>
+#include <regionlist.hh>
+#include <session.hh>
+#include <switch.hh>
+#include <exceptions.hh>
+#include <timer.hh>
+#include <util.hh>
+
+#include "benchports.hh"
+
+using namespace Switch;
+
+struct Options {
+  unsigned repeat;
+  double   seconds;
+};
+
+// Keep the compiler from optimizing away what we compute.
+template <typename T>
+static inline void keep(T const &v)
+{
+  asm volatile ("" : : "r" (v) : "memory");
+}
+
+/// Call f until duration seconds are over. f returns how much work
+/// it did and we return how much that was per second.
+template <typename F>
+static double per_second(double duration, F f)
+{
+  uint64_t cycles = duration * cycles_per_second();
+  double   work   = 0;
+  uint64_t start  = rdtsc(), now;
+
+  do {
+    for (unsigned i = 0; i < 16; i++) work += f();
+    now = rdtsc();
+  } while (now - start < cycles);
+
+  return work * cycles_per_second() / (now - start);
+}
+
+/// One warmup run that is thrown away, then o.repeat samples.
+template <typename F>
+static std::vector<double> samples(Options const &o, F sample)
+{
+  std::vector<double> s;
+  sample();
+  for (unsigned i = 0; i < o.repeat; i++)
+    s.push_back(sample());
+  return s;
+}
+
+// Checksum and copy kernels
+
+enum { BUFFER = 4096 };
+
+static std::vector<double> checksum_kernel(Options const &o, size_t size,
+                                           unsigned long (*fn)(uint8_t const *, size_t, bool &))
+{
+  std::vector<uint8_t> buf(BUFFER, 0xFE);
+
+  return samples(o, [&] () {
+      return per_second(o.seconds, [&] () {
+          bool odd = false;
+          keep(fn(buf.data(), size, odd));
+          return size / 1e9;
+        });
+    });
+}
+
+static std::vector<double> copy_kernel(Options const &o, size_t size,
+                                       std::function<void (uint8_t *, uint8_t const *, size_t)> fn)
+{
+  std::vector<uint8_t> src(BUFFER, 0xFE), dst(BUFFER);
+
+  return samples(o, [&] () {
+      return per_second(o.seconds, [&] () {
+          fn(dst.data(), src.data(), size);
+          keep(dst[0]);
+          return size / 1e9;
+        });
+    });
+}
+
+static std::vector<double> copy_packet(Options const &o, size_t size)
+{
+  // A frame in one buffer (like most guests send them) goes to a
+  // guest with 1K receive buffers.
+  enum { HDR = sizeof(virtio_net_hdr_mrg_rxbuf) };
+  std::vector<uint8_t> src(HDR + size, 0xFE), dst(HDR + BUFFER);
+  virtio_net_hdr hdr;
+  memset(&hdr, 0, sizeof(hdr));
+
+  Packet s, d;
+  s.fragments          = 1;
+  s.fragment[0]        = src.data();
+  s.fragment_length[0] = src.size();
+  s.packet_length      = src.size();
+
+  d.fragments          = 1 + (size + 1023) / 1024;
+  d.fragment[0]        = dst.data();
+  d.fragment_length[0] = HDR;
+  for (unsigned i = 1; i < d.fragments; i++) {
+    d.fragment[i]        = dst.data() + HDR + (i - 1) * 1024;
+    d.fragment_length[i] = 1024;
+  }
+
+  return samples(o, [&] () {
+      return per_second(o.seconds, [&] () {
+          d.copy_from(s, &hdr);
+          keep(dst[HDR]);
+          return size / 1e9;
+        });
+    });
+}
+
+// MAC table
+
+enum { MACS = 512 };
+
+static Ethernet::Address mac(unsigned n)
+{
+  return Ethernet::Address(0x02, 0, 0, n >> 16, n >> 8, n);
+}
+
+static std::vector<double> mactable(Options const &o, bool learn)
+{
+  std::unique_ptr<SwitchHash> table(new SwitchHash);
+  std::vector<Ethernet::Address> addrs;
+  Port * const port = reinterpret_cast<Port *>(0x1000);
+
+  for (unsigned i = 0; i < MACS; i++) {
+    addrs.push_back(mac(i * 7919));
+    table->add(addrs.back(), port);
+  }
+
+  return samples(o, [&] () {
+      return per_second(o.seconds, [&] () {
+          if (learn)
+            for (auto &a : addrs) table->add(a, port);
+          else
+            for (auto &a : addrs) keep((*table)[a]);
+          return MACS / 1e6;
+        });
+    });
+}
+
+// RegionList
+
+static std::vector<double> regionlist(Options const &o, bool cached)
+{
+  enum {
+    REGIONS     = 16,
+    REGION_SIZE = 64 << 20,
+    LOOKUPS     = 1024,
+  };
+
+  // Nothing is mapped here. RegionList unmaps its regions on
+  // destruction, which is harmless for these addresses.
+  uint8_t * const fake_mapping = reinterpret_cast<uint8_t *>(0x200000000000ULL);
+
+  RegionList rl;
+  for (unsigned i = 0; i < REGIONS; i++)
+    rl.insert(Region(uint64_t(i) * 2 * REGION_SIZE, REGION_SIZE,
+                     fake_mapping + uint64_t(i) * REGION_SIZE));
+
+  // Descriptors of one queue usually point into the same region,
+  // otherwise we jump around.
+  std::vector<uint64_t> addrs;
+  for (unsigned i = 0; i < LOOKUPS; i++) {
+    unsigned r = cached ? 3 : (i * 11) % REGIONS;
+    addrs.push_back(uint64_t(r) * 2 * REGION_SIZE + (i * 4096) % (REGION_SIZE - 2048));
+  }
+
+  Region cache;
+  return samples(o, [&] () {
+      return per_second(o.seconds, [&] () {
+          for (uint64_t a : addrs)
+            keep(rl.translate_ptr(a, 2048, cached ? &cache : nullptr));
+          return LOOKUPS / 1e6;
+        });
+    });
+}
+
+// Virtqueues. We play the guest for a VirtioDevice that is not
+// attached to a running switch.
+
+class Virtqueues {
+public:
+  enum {
+    QUEUE_SIZE  = 256,
+    BATCH       = 32,
+    BUFFER_SIZE = 2048,
+    RING_SIZE   = 0x4000,
+    RX_RING     = 0,
+    TX_RING     = RING_SIZE,
+    RX_BUFFERS  = 2 * RING_SIZE,
+    TX_BUFFERS  = RX_BUFFERS + QUEUE_SIZE * BUFFER_SIZE,
+    MEM_SIZE    = TX_BUFFERS + QUEUE_SIZE * BUFFER_SIZE,
+  };
+
+private:
+  struct Queue {
+    VRing    ring;
+    uint16_t avail_idx;
+    uint16_t last_used;
+  };
+
+  Switch::Switch           _sw;
+  int                      _fd[2];
+  std::unique_ptr<Session> _session;
+  uint8_t                 *_mem;
+  Queue                    _rx, _tx;
+
+  void setup(Queue &q, unsigned offset)
+  {
+    q.ring.num   = QUEUE_SIZE;
+    q.ring.desc  = reinterpret_cast<VRingDesc *>(_mem + offset);
+    q.ring.avail = reinterpret_cast<VRingAvail *>(_mem + offset + QUEUE_SIZE * sizeof(VRingDesc));
+    q.ring.used  = reinterpret_cast<VRingUsed *>(_mem + offset + RING_SIZE / 2);
+    q.avail_idx  = 0;
+    q.last_used  = 0;
+  }
+
+  void start(unsigned idx, Queue &q)
+  {
+    __atomic_store_n(&q.ring.avail->idx, q.avail_idx, __ATOMIC_RELEASE);
+    if (not _session->_device.vhost_start_vring(idx, q.ring, 0))
+      throw Exception("Could not start ring");
+  }
+
+  /// Give everything the device has used back to it.
+  unsigned recycle(Queue &q)
+  {
+    uint16_t used = __atomic_load_n(&q.ring.used->idx, __ATOMIC_ACQUIRE);
+    unsigned n    = uint16_t(used - q.last_used);
+
+    for (; q.last_used != used; q.last_used++)
+      q.ring.avail->ring[q.avail_idx++ % QUEUE_SIZE] =
+        q.ring.used->ring[q.last_used % QUEUE_SIZE].id;
+
+    __atomic_store_n(&q.ring.avail->idx, q.avail_idx, __ATOMIC_RELEASE);
+    return n;
+  }
+
+public:
+  VirtioDevice &device() { return _session->_device; }
+
+  /// The device takes a batch of TX chains and completes them. Returns
+  /// how many packets it sent.
+  unsigned tx()
+  {
+    VirtioDevice &dev = device();
+    unsigned      n   = 0;
+
+    for (; n < BATCH; n++) {
+      Packet p(&dev);
+      if (not dev.poll(p, false)) break;
+      dev.mark_done(p.completion_info);
+    }
+    dev.poll_irq();
+    recycle(_tx);
+    return n;
+  }
+
+  /// The device receives a batch of frames.
+  unsigned rx(Packet &p)
+  {
+    VirtioDevice &dev = device();
+
+    for (unsigned i = 0; i < BATCH; i++)
+      dev.receive(p);
+    dev.poll_irq();
+    return recycle(_rx);
+  }
+
+  Virtqueues(size_t frame)
+    : _sw(0, 16)
+  {
+    if (0 != socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, _fd))
+      throw SystemError("socketpair failed.");
+
+    _mem = static_cast<uint8_t *>(mmap(nullptr, MEM_SIZE, PROT_READ | PROT_WRITE,
+                                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0));
+    if (_mem == MAP_FAILED)
+      throw SystemError("Could not map guest memory.");
+
+    sockaddr_un sa;
+    memset(&sa, 0, sizeof(sa));
+    _session.reset(new Session(_sw, _fd[0], sa, false));
+
+    // The session unmaps guest memory when it goes away.
+    _session->insert_region(Region(0, MEM_SIZE, _mem));
+
+    VirtioDevice &dev = device();
+    dev.vhost_set_features(dev.vhost_features() &
+                           ((1ULL << VIRTIO_NET_F_MRG_RXBUF) |
+                            (1ULL << VIRTIO_NET_F_GUEST_CSUM) |
+                            (1ULL << VIRTIO_NET_F_GUEST_TSO4) |
+                            (1ULL << VIRTIO_NET_F_GUEST_TSO6)));
+
+    setup(_rx, RX_RING);
+    for (unsigned i = 0; i < QUEUE_SIZE; i++) {
+      _rx.ring.desc[i].addr  = RX_BUFFERS + i * BUFFER_SIZE;
+      _rx.ring.desc[i].len   = BUFFER_SIZE;
+      _rx.ring.desc[i].flags = VRING_DESC_F_WRITE;
+      _rx.ring.avail->ring[i] = i;
+    }
+    _rx.avail_idx = QUEUE_SIZE;
+
+    // TX chains have the virtio header and the frame in one buffer.
+    setup(_tx, TX_RING);
+    for (unsigned i = 0; i < QUEUE_SIZE; i++) {
+      uint8_t *b = _mem + TX_BUFFERS + i * BUFFER_SIZE;
+      auto &ehdr = *reinterpret_cast<Ethernet::Header *>(b + sizeof(virtio_net_hdr_mrg_rxbuf));
+      ehdr.dst   = mac(1);
+      ehdr.src   = mac(2);
+
+      _tx.ring.desc[i].addr  = TX_BUFFERS + i * BUFFER_SIZE;
+      _tx.ring.desc[i].len   = sizeof(virtio_net_hdr_mrg_rxbuf) + frame;
+      _tx.ring.desc[i].flags = 0;
+      _tx.ring.avail->ring[i] = i;
+    }
+    _tx.avail_idx = QUEUE_SIZE;
+
+    start(0, _rx);
+    start(1, _tx);
+  }
+
+  ~Virtqueues()
+  {
+    _session.reset();
+    close(_fd[1]);
+  }
+};
+
+static std::vector<double> virtqueue_tx(Options const &o, size_t frame)
+{
+  Virtqueues vq(frame);
+
+  return samples(o, [&] () {
+      return per_second(o.seconds, [&] () { return vq.tx() / 1e6; });
+    });
+}
+
+static std::vector<double> virtqueue_rx(Options const &o, size_t frame)
+{
+  Virtqueues vq(frame);
+  std::vector<uint8_t> buf(sizeof(virtio_net_hdr_mrg_rxbuf) + frame);
+  auto &ehdr = *reinterpret_cast<Ethernet::Header *>(buf.data() + sizeof(virtio_net_hdr_mrg_rxbuf));
+  ehdr.dst   = mac(2);
+  ehdr.src   = mac(1);
+
+  Packet p;
+  p.fragments          = 1;
+  p.fragment[0]        = buf.data();
+  p.fragment_length[0] = buf.size();
+  p.packet_length      = buf.size();
+
+  return samples(o, [&] () {
+      return per_second(o.seconds, [&] () { return vq.rx(p) / 1e6; });
+    });
+}
+
+// The whole switch, with ports that cost nothing. See test/corebench.
+
+static std::vector<double> whole_switch(Options const &o, bool flood, unsigned sinks)
+{
+  Switch::Switch sw(0, 16);
+  std::vector<std::unique_ptr<Port>> ports;
+
+  std::vector<std::vector<uint8_t>> frames;
+  for (unsigned i = 0; i < 64; i++) {
+    std::vector<uint8_t> f(60);
+    auto &ehdr = *reinterpret_cast<Ethernet::Header *>(f.data());
+    ehdr.dst   = flood ? Ethernet::Address(0xff, 0xff, 0xff, 0xff, 0xff, 0xff) : mac(1 + i % sinks);
+    ehdr.src   = mac(0);
+    frames.push_back(f);
+  }
+
+  ports.emplace_back(new ReplayPort(sw, "replay", frames));
+  for (unsigned i = 0; i < sinks; i++)
+    ports.emplace_back(new NullPort(sw, "null" + std::to_string(i), mac(1 + i)));
+
+  // The switch thread inherits our CPU.
+  std::thread switch_thread([&] () {
+      rcu_register_thread();
+      sw.loop();
+      rcu_unregister_thread();
+    });
+
+  PortStats const &src = ports[0]->stats();
+  auto result = samples(o, [&] () {
+      uint64_t before = src.rx_packets;
+      uint64_t start  = rdtsc();
+      usleep(o.seconds * 1000000);
+      uint64_t polled = src.rx_packets - before;
+      return polled / 1e6 * cycles_per_second() / (rdtsc() - start);
+    });
+
+  sw.shutdown();
+  switch_thread.join();
+  return result;
+}
+
+struct Benchmark {
+  std::string name;
+  char const *unit;
+  std::function<std::vector<double> (Options const &)> run;
+};
+
+static std::vector<Benchmark> benchmarks()
+{
+  using namespace OnesComplement;
+  using std::placeholders::_1;
+
+  auto move_adc = [] (uint8_t *d, uint8_t const *s, size_t n) { bool odd = false; keep(checksum_move_adc(s, d, n, odd)); };
+  auto move_sse = [] (uint8_t *d, uint8_t const *s, size_t n) { bool odd = false; keep(checksum_move_sse(s, d, n, odd)); };
+  auto rep_movs = [] (uint8_t *d, uint8_t const *s, size_t n) { movs<uint8_t>(d, s, n); };
+  auto libc     = [] (uint8_t *d, uint8_t const *s, size_t n) { memcpy(d, s, n); };
+
+  return {
+    { "checksum.adc.64",        "GB/s", std::bind(checksum_kernel, _1, 64,   checksum_adc) },
+    { "checksum.adc.1514",      "GB/s", std::bind(checksum_kernel, _1, 1514, checksum_adc) },
+    { "checksum.sse.64",        "GB/s", std::bind(checksum_kernel, _1, 64,   checksum_sse) },
+    { "checksum.sse.1514",      "GB/s", std::bind(checksum_kernel, _1, 1514, checksum_sse) },
+    { "copy.memcpy.1514",       "GB/s", std::bind(copy_kernel, _1, 1514, libc) },
+    { "copy.movs.64",           "GB/s", std::bind(copy_kernel, _1, 64,   rep_movs) },
+    { "copy.movs.1514",         "GB/s", std::bind(copy_kernel, _1, 1514, rep_movs) },
+    { "copy.move_adc.1514",     "GB/s", std::bind(copy_kernel, _1, 1514, move_adc) },
+    { "copy.move_sse.1514",     "GB/s", std::bind(copy_kernel, _1, 1514, move_sse) },
+    { "copy.packet.64",         "GB/s", std::bind(copy_packet, _1, 64) },
+    { "copy.packet.1514",       "GB/s", std::bind(copy_packet, _1, 1514) },
+    { "mactable.lookup",        "Mops", std::bind(mactable, _1, false) },
+    { "mactable.learn",         "Mops", std::bind(mactable, _1, true) },
+    { "regionlist.translate",   "Mops", std::bind(regionlist, _1, false) },
+    { "regionlist.cached",      "Mops", std::bind(regionlist, _1, true) },
+    { "virtqueue.tx.64",        "Mpps", std::bind(virtqueue_tx, _1, 60) },
+    { "virtqueue.rx.64",        "Mpps", std::bind(virtqueue_rx, _1, 60) },
+    { "virtqueue.rx.1514",      "Mpps", std::bind(virtqueue_rx, _1, 1514) },
+    { "switch.unicast.64",      "Mpps", std::bind(whole_switch, _1, false, 4) },
+    { "switch.flood.64",        "Mpps", std::bind(whole_switch, _1, true,  4) },
+  };
+}
+
+// Output
+
+/// The two-sided 95% quantile of Student's t distribution for df
+/// degrees of freedom. With a handful of runs, the normal quantile
+/// (1.96) makes the confidence interval much too narrow. Beyond the
+/// table, we round df down to the next row of the usual tables.
+static double t95(size_t df)
+{
+  static double const table[] = {
+    0,      12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262,
+    2.228,  2.201,  2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093,
+    2.086,  2.080,  2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045,
+    2.042,
+  };
+
+  if (df < sizeof(table) / sizeof(table[0])) return table[df];
+  if (df < 40)  return 2.042;
+  if (df < 60)  return 2.021;
+  if (df < 120) return 2.000;
+  return 1.980;
+}
+
+struct Summary {
+  double mean, stddev, min, max, median, ci95;
+
+  Summary(std::vector<double> s)
+  {
+    size_t n = s.size();
+    double sum = 0, sum_sq = 0;
+    for (double v : s) { sum += v; sum_sq += v * v; }
+
+    std::sort(s.begin(), s.end());
+    mean   = n ? sum / n : 0;
+    stddev = n > 1 ? sqrt(std::max(0.0, (sum_sq - sum * sum / n) / (n - 1))) : 0;
+    min    = n ? s.front() : 0;
+    max    = n ? s.back()  : 0;
+    median = n ? (s[(n - 1) / 2] + s[n / 2]) / 2 : 0;
+    ci95   = n > 1 ? t95(n - 1) * stddev / sqrt(n) : 0;
+  }
+};
+
+static std::string cpu_model()
+{
+  FILE *f = fopen("/proc/cpuinfo", "r");
+  if (not f) return "unknown";
+
+  char line[256];
+  std::string model = "unknown";
+  while (fgets(line, sizeof(line), f))
+    if (strncmp(line, "model name", 10) == 0 and strchr(line, ':')) {
+      model = strchr(line, ':') + 2;
+      model.erase(model.find_last_not_of(" \n") + 1);
+      break;
+    }
+
+  fclose(f);
+  return model;
+}
+
+static std::string json_string(std::string const &s)
+{
+  std::string r = "\"";
+  for (char c : s) {
+    if (c == '"' or c == '\\') r += '\\';
+    if (uint8_t(c) >= 0x20) r += c;
+  }
+  return r + "\"";
+}
+
+int main(int argc, char **argv)
+{
+  static struct option long_options [] = {
+    { "repeat",   required_argument, 0, 'r' },
+    { "seconds",  required_argument, 0, 'd' },
+    { "cpu",      required_argument, 0, 'c' },
+    { "filter",   required_argument, 0, 'f' },
+    { "output",   required_argument, 0, 'o' },
+    { "list",     no_argument,       0, 'l' },
+    { 0, 0, 0, 0 },
+  };
+
+  Options     o      = { 5, 0.2 };
+  int         cpu    = -1;
+  std::string filter;
+  char const *output = "perf.json";
+  bool        list   = false;
+
+  int opt, opt_idx;
+  while ((opt = getopt_long(argc, argv, "", long_options, &opt_idx)) != -1) {
+    switch (opt) {
+    case 'r': o.repeat  = std::max(1, atoi(optarg)); break;
+    case 'd': o.seconds = atof(optarg); break;
+    case 'c': cpu       = atoi(optarg); break;
+    case 'f': filter    = optarg;       break;
+    case 'o': output    = optarg;       break;
+    case 'l': list      = true;         break;
+    default:
+      fprintf(stderr,
+              "Usage: %s [--repeat n] [--seconds s] [--cpu n] [--filter <substring>]\n"
+              "          [--output <file>] [--list]\n",
+              argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  auto all = benchmarks();
+  if (list) {
+    for (auto &b : all) printf("%s\n", b.name.c_str());
+    return EXIT_SUCCESS;
+  }
+
+  try {
+    // Numbers are only comparable on the same CPU. Without --cpu, we
+    // stay on the first one we may use.
+    if (cpu < 0) cpu = thread_cpus().at(0);
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (0 != sched_setaffinity(0, sizeof(set), &set))
+      throw SystemError("Could not pin to CPU %d.", cpu);
+
+    FILE *out = fopen(output, "w");
+    if (not out)
+      throw SystemError("Could not open %s.", output);
+
+    char host[256] = "unknown";
+    gethostname(host, sizeof(host) - 1);
+
+    fprintf(out, "{\n  \"version\": 1,\n  \"host\": %s,\n  \"cpu_model\": %s,\n"
+            "  \"cpu\": %d,\n  \"optimized\": %s,\n  \"repeat\": %u,\n  \"seconds\": %g,\n"
+            "  \"benchmarks\": {",
+            json_string(host).c_str(), json_string(cpu_model()).c_str(), cpu,
+#ifdef SV3_BENCHMARK_OK
+            "true",
+#else
+            "false",
+#endif
+            o.repeat, o.seconds);
+
+    bool first = true;
+    for (auto &b : all) {
+      if (b.name.find(filter) == std::string::npos) continue;
+
+      std::vector<double> s = b.run(o);
+      Summary sum(s);
+
+      printf("%-24s %10.3f %-4s ±%.3f\n", b.name.c_str(), sum.mean, b.unit, sum.stddev);
+
+      fprintf(out, "%s\n    %s: {\n      \"unit\": %s,\n      \"samples\": [",
+              first ? "" : ",", json_string(b.name).c_str(), json_string(b.unit).c_str());
+      for (size_t i = 0; i < s.size(); i++)
+        fprintf(out, "%s%.6g", i ? ", " : "", s[i]);
+      fprintf(out, "],\n      \"mean\": %.6g, \"stddev\": %.6g, \"ci95\": %.6g,\n"
+              "      \"min\": %.6g, \"median\": %.6g, \"max\": %.6g\n    }",
+              sum.mean, sum.stddev, sum.ci95, sum.min, sum.median, sum.max);
+      first = false;
+    }
+
+    fprintf(out, "\n  }\n}\n");
+    fclose(out);
+    return EXIT_SUCCESS;
+  } catch (Switch::Exception &e) {
+    fprintf(stderr, "\n%s:\n%s\n",
+            demangle(typeid(e).name()).c_str(), e.reason().c_str());
+  } catch (std::system_error &e) {
+    fprintf(stderr, "\nFatal system error: '%s'\n", e.what());
+  }
+
+  return EXIT_FAILURE;
+}
+
+// EOF
@@ -0,0 +1,154 @@
+// Copyright (C) 2013, Julian Stecklina <jsteckli@os.inf.tu-dresden.de>
+// Economic rights: Technische Universitaet Dresden (Germany)
+
+// This file is part of sv3.
+
+// sv3 is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License version 2 as
+// published by the Free Software Foundation.
+
+// sv3 is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License version 2 for more details.
+
+
+#include <cstdio>
+#include <cstdlib>
+#include <list>
+
+#include <regionlist.hh>
+
+using namespace Switch;
+
+enum {
+  REGION_SIZE = 64 << 20,
+  REGION_GAP  = 16 << 20,
+  LOOKUPS     = 4096,
+  ROUNDS      = 256,
+};
+
+// Nothing is mapped here. RegionList unmaps its regions on
+// destruction, which is harmless for these addresses.
+static uint8_t * const fake_mapping = reinterpret_cast<uint8_t *>(0x200000000000ULL);
+
+// The linear list walk we used to have, for comparison.
+struct ListWalk {
+  std::list<Region> list;
+
+  uint8_t *translate_ptr(uint64_t addr, size_t size)
+  {
+    if (addr + size <= addr) return nullptr;
+
+    for (auto &r : list)
+      if (r.addr <= addr and addr + size < r.addr + r.size)
+        return r.mapping + (addr - r.addr);
+
+    return nullptr;
+  }
+};
+
+static bool check(char const *what, bool ok)
+{
+  if (not ok) printf("%s FAILED\n", what);
+  return ok;
+}
+
+static bool semantics()
+{
+  RegionList rl;
+  Region     cache;
+  bool       ok = true;
+
+  ok &= check("insert",           rl.insert(Region(0x1000, 0x1000, fake_mapping)));
+  ok &= check("overlap",      not rl.insert(Region(0x1800, 0x1000, fake_mapping)));
+  ok &= check("contained",    not rl.insert(Region(0x1100, 0x10,   fake_mapping)));
+  ok &= check("empty",        not rl.insert(Region(0x5000, 0,      fake_mapping)));
+  ok &= check("wrap",         not rl.insert(Region(~0ULL - 10, 0x100, fake_mapping)));
+  ok &= check("adjacent below",   rl.insert(Region(0x0000, 0x1000, fake_mapping + 0x10000)));
+  ok &= check("adjacent above",   rl.insert(Region(0x2000, 0x1000, fake_mapping + 0x20000)));
+
+  ok &= check("start",      rl.translate_ptr(0x1000, 8) == fake_mapping);
+  ok &= check("end",        rl.translate_ptr(0x1ff8, 8) == fake_mapping + 0xff8);
+  ok &= check("straddle",   rl.translate_ptr(0x1ffc, 8) == nullptr);
+  ok &= check("below",      rl.translate_ptr(0x0010, 8) == fake_mapping + 0x10010);
+  ok &= check("above",      rl.translate_ptr(0x2010, 8) == fake_mapping + 0x20010);
+  ok &= check("outside",    rl.translate_ptr(0x3000, 1) == nullptr);
+  ok &= check("huge",       rl.translate_ptr(0x1000, ~0ULL) == nullptr);
+
+  // The cache must not widen what we accept.
+  ok &= check("cache fill", rl.translate_ptr(0x1010, 8, &cache) == fake_mapping + 0x10);
+  ok &= check("cache hit",  rl.translate_ptr(0x1020, 8, &cache) == fake_mapping + 0x20);
+  ok &= check("cache end",  rl.translate_ptr(0x1ffc, 8, &cache) == nullptr);
+  ok &= check("cache miss", rl.translate_ptr(0x2010, 8, &cache) == fake_mapping + 0x20010);
+  ok &= check("empty cache", Region().contains(0, 0) == false);
+
+  return ok;
+}
+
+template <typename T>
+static double measure(T translate, uint64_t const *addrs)
+{
+  uint64_t sum   = 0;
+  uint64_t start = rdtsc();
+
+  for (unsigned r = 0; r < ROUNDS; r++)
+    for (unsigned i = 0; i < LOOKUPS; i++)
+      sum += reinterpret_cast<uintptr_t>(translate(addrs[i]));
+
+  uint64_t end = rdtsc();
+
+  asm volatile ("" :: "r" (sum));
+  return double(end - start) / (ROUNDS * LOOKUPS);
+}
+
+static bool benchmark(unsigned regions)
+{
+  RegionList rl;
+  ListWalk   lw;
+  Region     cache;
+  bool       ok = true;
+
+  for (unsigned i = 0; i < regions; i++) {
+    Region r(uint64_t(i) * (REGION_SIZE + REGION_GAP), REGION_SIZE,
+             fake_mapping + uint64_t(i) * REGION_SIZE);
+    ok &= check("benchmark insert", rl.insert(r));
+    lw.list.push_back(r);
+  }
+
+  // Scattered lookups and lookups that mostly stay within a region,
+  // like descriptors of a ring do.
+  static uint64_t scattered[LOOKUPS], local[LOOKUPS];
+  for (unsigned i = 0; i < LOOKUPS; i++) {
+    scattered[i] = uint64_t(rand() % regions) * (REGION_SIZE + REGION_GAP) + rand() % (REGION_SIZE - 2048);
+    local[i]     = uint64_t(i / 64 % regions) * (REGION_SIZE + REGION_GAP) + rand() % (REGION_SIZE - 2048);
+
+    ok &= check("translation differs",
+                rl.translate_ptr(scattered[i], 1500) == lw.translate_ptr(scattered[i], 1500));
+  }
+
+  auto list   = [&] (uint64_t a) { return lw.translate_ptr(a, 1500); };
+  auto search = [&] (uint64_t a) { return rl.translate_ptr(a, 1500); };
+  auto cached = [&] (uint64_t a) { return rl.translate_ptr(a, 1500, &cache); };
+
+  printf("%2u regions: list %6.1f / %6.1f  search %5.1f / %5.1f  cached %5.1f / %5.1f cycles\n",
+         regions,
+         measure(list,   scattered), measure(list,   local),
+         measure(search, scattered), measure(search, local),
+         measure(cached, scattered), measure(cached, local));
+
+  return ok;
+}
+
+int main()
+{
+  bool ok = semantics();
+
+  printf("Cycles per translation (scattered / local lookups):\n");
+  for (unsigned regions : { 1, 8, 64 })
+    ok &= benchmark(regions);
+
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// EOF
@@ -0,0 +1,235 @@
+// Copyright (C) 2013, Julian Stecklina <jsteckli@os.inf.tu-dresden.de>
+// Economic rights: Technische Universitaet Dresden (Germany)
+
+// This file is part of sv3.
+
+// sv3 is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License version 2 as
+// published by the Free Software Foundation.
+
+// sv3 is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License version 2 for more details.
+
+// End-to-end switching benchmark with synthetic guests. Without
+// --vhost-user, the switch runs in this process. Otherwise, the
+// guests connect to a running sv3.
+
+
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <getopt.h>
+#include <unistd.h>
+
+#include <switch.hh>
+#include <listener.hh>
+#include <exceptions.hh>
+#include <timer.hh>
+
+#include "vguest.hh"
+
+using namespace Switch;
+
+enum Phase { WARMUP, MEASURE, STOP };
+
+static std::atomic<int> phase { WARMUP };
+
+struct Result {
+  VirtualGuest::Counters start;
+  VirtualGuest::Counters end;
+};
+
+static void drive(VirtualGuest &g, std::vector<Ethernet::Address> const &dst,
+                  std::vector<unsigned> const &sizes, unsigned burst, Result &r)
+{
+  unsigned d = 0, s = 0;
+  int      seen = WARMUP;
+
+  while (seen != STOP) {
+    int now = phase.load(std::memory_order_relaxed);
+    if (UNLIKELY(now != seen)) {
+      if (now == MEASURE) {
+        g.counters().latency.reset();
+        r.start = g.counters();
+      } else
+        r.end = g.counters();
+      seen = now;
+    }
+
+    g.complete();
+    for (unsigned i = 0; i < burst; i++) {
+      if (not g.send(dst[d], sizes[s])) break;
+      d = (d + 1) % dst.size();
+      s = (s + 1) % sizes.size();
+    }
+    g.flush();
+    g.receive();
+  }
+}
+
+static double seconds()
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+  static struct option long_options [] = {
+    { "ports",       required_argument, 0, 'n' },
+    { "sizes",       required_argument, 0, 'S' },
+    { "matrix",      required_argument, 0, 'x' },
+    { "seconds",     required_argument, 0, 'd' },
+    { "burst",       required_argument, 0, 'B' },
+    { "poll-us",     required_argument, 0, 'p' },
+    { "batch-size",  required_argument, 0, 'b' },
+    { "vhost-user",  required_argument, 0, 'v' },
+    { 0, 0, 0, 0 },
+  };
+
+  unsigned              ports      = 2;
+  std::vector<unsigned> sizes      = { 64 };
+  std::string           matrix     = "pairs";
+  double                duration   = 2;
+  unsigned              burst      = 32;
+  unsigned              poll_us    = 0;
+  unsigned              batch_size = 16;
+  char const           *vhost_path = nullptr;
+
+  int opt, opt_idx;
+  while ((opt = getopt_long(argc, argv, "", long_options, &opt_idx)) != -1) {
+    switch (opt) {
+    case 'n': ports      = atoi(optarg); break;
+    case 'x': matrix     = optarg;       break;
+    case 'd': duration   = atof(optarg); break;
+    case 'B': burst      = std::max(1, atoi(optarg)); break;
+    case 'p': poll_us    = atoi(optarg); break;
+    case 'b': batch_size = atoi(optarg); break;
+    case 'v': vhost_path = optarg;       break;
+    case 'S':
+      sizes.clear();
+      for (auto &s : string_split(optarg, ','))
+        sizes.push_back(std::min<unsigned>(std::max<unsigned>(atoi(s.c_str()), VirtualGuest::MIN_FRAME),
+                                           VirtualGuest::MAX_FRAME));
+      if (not sizes.empty()) break;
+      // FALLTHROUGH
+    default:
+    usage:
+      fprintf(stderr,
+              "Usage: %s [--ports n] [--sizes <bytes>,...] [--matrix pairs|all|broadcast]\n"
+              "          [--seconds s] [--burst n] [--poll-us us] [--batch-size n]\n"
+              "          [--vhost-user <socket-path>]\n",
+              argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (ports < 2 or (matrix != "pairs" and matrix != "all" and matrix != "broadcast"))
+    goto usage;
+
+  try {
+    std::unique_ptr<Switch::Switch>   sw;
+    std::unique_ptr<Switch::Listener> listener;
+    std::thread                       switch_thread;
+
+    std::string path    = vhost_path ? vhost_path : "/tmp/sv3-bench-" + std::to_string(getpid());
+    std::string control = path + ".ctl";
+
+    if (not vhost_path) {
+      sw.reset(new Switch::Switch(poll_us, batch_size));
+      listener.reset(new Listener(*sw, true, path.c_str(), control.c_str()));
+      switch_thread = std::thread([&] () {
+          rcu_register_thread();
+          sw->loop();
+          rcu_unregister_thread();
+        });
+    }
+
+    std::vector<std::unique_ptr<VirtualGuest>> guests;
+    for (unsigned i = 0; i < ports; i++)
+      guests.emplace_back(new VirtualGuest(path.c_str(), i));
+
+    std::vector<std::vector<Ethernet::Address>> dst(ports);
+    for (unsigned i = 0; i < ports; i++) {
+      if (matrix == "pairs")
+        dst[i].push_back(guests[(i ^ 1) % ports]->mac());
+      else if (matrix == "all") {
+        for (unsigned j = 1; j < ports; j++)
+          dst[i].push_back(guests[(i + j) % ports]->mac());
+      } else
+        dst[i].push_back(Ethernet::Address(0xff, 0xff, 0xff, 0xff, 0xff, 0xff));
+    }
+
+    std::vector<Result>      results(ports);
+    std::vector<std::thread> drivers;
+    for (unsigned i = 0; i < ports; i++)
+      drivers.emplace_back(drive, std::ref(*guests[i]), std::cref(dst[i]),
+                           std::cref(sizes), burst, std::ref(results[i]));
+
+    // Until the switch has learned everyone's address, packets are
+    // flooded.
+    usleep(500000);
+    double start = seconds();
+    phase = MEASURE;
+    usleep(duration * 1000000);
+    phase = STOP;
+    double elapsed = seconds() - start;
+
+    for (auto &t : drivers) t.join();
+
+    uint64_t tx_packets = 0, tx_bytes = 0, rx_packets = 0, rx_bytes = 0, kicks = 0;
+    Histogram latency;
+    latency.reset();
+
+    for (auto &r : results) {
+      tx_packets += r.end.tx_packets - r.start.tx_packets;
+      tx_bytes   += r.end.tx_bytes   - r.start.tx_bytes;
+      rx_packets += r.end.rx_packets - r.start.rx_packets;
+      rx_bytes   += r.end.rx_bytes   - r.start.rx_bytes;
+      kicks      += r.end.kicks      - r.start.kicks;
+
+      Histogram const &h = r.end.latency;
+      latency.count += h.count;
+      latency.sum   += h.sum;
+      latency.max    = std::max(latency.max, h.max);
+      for (unsigned i = 0; i < Histogram::BUCKETS; i++)
+        latency.bucket[i] += h.bucket[i];
+    }
+
+    double us = cycles_per_second() / 1e6;
+
+    printf("%u ports, %s, %zu size%s, %.1fs: tx %.3f Mpps  rx %.3f Mpps %.3f Gbit/s  "
+           "%.0f kicks/s  latency p50 %.1fus p99 %.1fus max %.1fus\n",
+           ports, matrix.c_str(), sizes.size(), sizes.size() == 1 ? "" : "s", elapsed,
+           tx_packets / elapsed / 1e6, rx_packets / elapsed / 1e6,
+           rx_bytes * 8 / elapsed / 1e9, kicks / elapsed,
+           latency.percentile(0.5) / us, latency.percentile(0.99) / us, latency.max / us);
+
+    guests.clear();
+
+    if (sw) {
+      sw->shutdown();
+      switch_thread.join();
+    }
+
+    return EXIT_SUCCESS;
+  } catch (Switch::Exception &e) {
+    fprintf(stderr, "\n%s:\n%s\n",
+            demangle(typeid(e).name()).c_str(), e.reason().c_str());
+  } catch (std::system_error &e) {
+    fprintf(stderr, "\nFatal system error: '%s'\n", e.what());
+  }
+
+  return EXIT_FAILURE;
+}
+
+// EOF
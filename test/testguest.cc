@@ -0,0 +1,140 @@
+// Copyright (C) 2013, Julian Stecklina <jsteckli@os.inf.tu-dresden.de>
+// Economic rights: Technische Universitaet Dresden (Germany)
+
+// This file is part of sv3.
+
+// sv3 is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License version 2 as
+// published by the Free Software Foundation.
+
+// sv3 is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License version 2 for more details.
+
+#include <cstring>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <exceptions.hh>
+#include <switch.hh>
+
+#include "testguest.hh"
+
+namespace Switch {
+
+  void TestGuest::write(uint64_t addr, uint64_t val)
+  {
+    bool irqs_changed = false;
+    device().io_write(0, addr, 4, val, irqs_changed);
+  }
+
+  void TestGuest::setup_queue(unsigned idx, Ring &r, unsigned offset)
+  {
+    // The legacy ring layout.
+    r.desc  = reinterpret_cast<VRingDesc *>(_mem + offset);
+    r.avail = reinterpret_cast<VRingAvail *>(_mem + offset + QUEUE_ELEMENTS * sizeof(VRingDesc));
+    r.used  = reinterpret_cast<VRingUsed *>((reinterpret_cast<uintptr_t>(&r.avail->ring[QUEUE_ELEMENTS]) +
+                                             VIRTIO_PCI_VRING_ALIGN - 1) & ~uintptr_t(VIRTIO_PCI_VRING_ALIGN - 1));
+
+    write(VIRTIO_PCI_QUEUE_SEL, idx);
+    write(VIRTIO_PCI_QUEUE_PFN, offset >> VIRTIO_PCI_QUEUE_ADDR_SHIFT);
+  }
+
+  void TestGuest::publish(unsigned idx, Ring &r, unsigned count)
+  {
+    __atomic_store_n(&r.avail->idx, uint16_t(r.avail->idx + count), __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (not (__atomic_load_n(&r.used->flags, __ATOMIC_ACQUIRE) & VRING_USED_F_NO_NOTIFY))
+      write(VIRTIO_PCI_QUEUE_NOTIFY, idx);
+  }
+
+  void TestGuest::send(unsigned count)
+  {
+    uint16_t idx = _tx.avail->idx;
+    for (unsigned i = 0; i < count; i++, idx++) {
+      unsigned b    = idx % BUFFERS;
+      unsigned d    = 2 * b;
+      uint64_t addr = TX_BUFFERS + b * BUFFER_SIZE;
+
+      memset(_mem + addr, 0, HEADER_SIZE + FRAME_SIZE);
+      auto &ehdr = *reinterpret_cast<Ethernet::Header *>(_mem + addr + HEADER_SIZE);
+      memset(ehdr.dst.byte, 0xff, sizeof(ehdr.dst.byte));
+      ehdr.src = Ethernet::Address(0x02, 0, 0, 0, 0, 1);
+
+      _tx.desc[d]     = { addr, HEADER_SIZE, VRING_DESC_F_NEXT, uint16_t(d + 1) };
+      _tx.desc[d + 1] = { addr + HEADER_SIZE, FRAME_SIZE, 0, 0 };
+      _tx.avail->ring[idx % QUEUE_ELEMENTS] = d;
+    }
+
+    publish(1, _tx, count);
+  }
+
+  void TestGuest::post_rx(unsigned count)
+  {
+    uint16_t idx = _rx.avail->idx;
+    for (unsigned i = 0; i < count; i++, idx++) {
+      unsigned b = idx % BUFFERS;
+
+      _rx.desc[b] = { RX_BUFFERS + b * BUFFER_SIZE, BUFFER_SIZE, VRING_DESC_F_WRITE, 0 };
+      _rx.avail->ring[idx % QUEUE_ELEMENTS] = b;
+    }
+
+    publish(0, _rx, count);
+  }
+
+  int TestGuest::command(uint8_t klass, uint8_t cmd, std::vector<uint8_t> const &data)
+  {
+    virtio_net_ctrl_hdr hdr = { klass, cmd };
+    memcpy(_mem + COMMAND, &hdr, sizeof(hdr));
+    memcpy(_mem + COMMAND + sizeof(hdr), data.data(), data.size());
+    _mem[ACK] = 0xFF;
+
+    _ctrl.desc[0] = { COMMAND, uint32_t(sizeof(hdr) + data.size()), VRING_DESC_F_NEXT, 1 };
+    _ctrl.desc[1] = { ACK, 1, VRING_DESC_F_WRITE, 0 };
+    _ctrl.avail->ring[_ctrl.avail->idx % QUEUE_ELEMENTS] = 0;
+
+    uint16_t used = _ctrl.used->idx;
+    publish(2, _ctrl, 1);
+    device().poll_irq();
+
+    return _ctrl.used->idx == uint16_t(used + 1) ? _mem[ACK] : -1;
+  }
+
+  TestGuest::TestGuest(Switch &sw, uint32_t features)
+  {
+    if (0 != socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, _fd))
+      throw SystemError("socketpair failed.");
+
+    _mem = static_cast<uint8_t *>(mmap(nullptr, MEM_SIZE, PROT_READ | PROT_WRITE,
+                                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0));
+    if (_mem == MAP_FAILED)
+      throw SystemError("Could not map guest memory.");
+
+    sockaddr_un sa;
+    memset(&sa, 0, sizeof(sa));
+    _session.reset(new Session(sw, _fd[0], sa, false));
+
+    // The session unmaps guest memory when it goes away.
+    _session->insert_region(Region(0, MEM_SIZE, _mem));
+
+    write(VIRTIO_PCI_GUEST_FEATURES, features);
+    setup_queue(0, _rx, RX_RING);
+    setup_queue(1, _tx, TX_RING);
+    setup_queue(2, _ctrl, CTRL_RING);
+    write(VIRTIO_PCI_STATUS, VIRTIO_CONFIG_S_ACKNOWLEDGE | VIRTIO_CONFIG_S_DRIVER |
+          VIRTIO_CONFIG_S_DRIVER_OK);
+  }
+
+  TestGuest::~TestGuest()
+  {
+    _session.reset();
+    close(_fd[1]);
+  }
+
+}
+
+// EOF
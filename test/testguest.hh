@@ -0,0 +1,112 @@
+// Copyright (C) 2013, Julian Stecklina <jsteckli@os.inf.tu-dresden.de>
+// Economic rights: Technische Universitaet Dresden (Germany)
+
+// This file is part of sv3.
+
+// sv3 is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License version 2 as
+// published by the Free Software Foundation.
+
+// sv3 is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License version 2 for more details.
+
+// A legacy virtio-net guest for tests
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include <session.hh>
+#include <util.hh>
+
+namespace Switch {
+
+  /// Plays the guest for a VirtioDevice without a VM or a client. The
+  /// device lives in a Session on one end of a socket pair, guest
+  /// memory is anonymous memory and the queues are set up via the
+  /// legacy I/O registers, like a legacy driver does. The device is
+  /// attached to the switch, once RX and TX queue are set up.
+  ///
+  /// Methods touch the rings from the calling thread. The switch may
+  /// run in another one.
+  class TestGuest : Uncopyable {
+  public:
+    enum {
+      QUEUE_ELEMENTS = 1024,    // Fixed for legacy guests
+      BUFFERS        = 64,      // RX and TX buffers each
+      BUFFER_SIZE    = 2048,
+      HEADER_SIZE    = sizeof(virtio_net_hdr_mrg_rxbuf),
+      FRAME_SIZE     = 60,
+    };
+
+  private:
+    enum {
+      // Memory layout. Rings first, then buffers.
+      RING_SIZE  = 0x8000,
+      RX_RING    = 0,
+      TX_RING    = RING_SIZE,
+      CTRL_RING  = 2 * RING_SIZE,
+      RX_BUFFERS = 3 * RING_SIZE,
+      TX_BUFFERS = RX_BUFFERS + BUFFERS * BUFFER_SIZE,
+      COMMAND    = TX_BUFFERS + BUFFERS * BUFFER_SIZE,
+      ACK        = COMMAND + 0x1000,
+      MEM_SIZE   = ACK + 0x1000,
+    };
+
+    struct Ring {
+      VRingDesc  *desc;
+      VRingAvail *avail;
+      VRingUsed  *used;
+    };
+
+    int                      _fd[2];
+    std::unique_ptr<Session> _session;
+    uint8_t                 *_mem;
+
+    Ring                     _rx;
+    Ring                     _tx;
+    Ring                     _ctrl;
+
+    void write(uint64_t addr, uint64_t val);
+    void setup_queue(unsigned idx, Ring &r, unsigned offset);
+
+    /// Make count new available entries visible and kick, unless the
+    /// device asked us not to.
+    void publish(unsigned idx, Ring &r, unsigned count);
+
+  public:
+    VirtioDevice &device() { return _session->_device; }
+
+    uint16_t rx_used() const { return __atomic_load_n(&_rx.used->idx, __ATOMIC_ACQUIRE); }
+    uint16_t tx_used() const { return __atomic_load_n(&_tx.used->idx, __ATOMIC_ACQUIRE); }
+
+    /// Stop the TX queue like a vhost-user frontend does. Returns the
+    /// ring base.
+    uint16_t tx_stop() { return device().vhost_stop_vring(1); }
+
+    uint16_t ctrl_used_flags() const { return __atomic_load_n(&_ctrl.used->flags, __ATOMIC_ACQUIRE); }
+
+    /// Queue count broadcast frames. Each takes two descriptors: the
+    /// virtio header and the frame.
+    void send(unsigned count);
+
+    /// Give the device count RX buffers.
+    void post_rx(unsigned count);
+
+    /// Send a control command and return the status the device wrote
+    /// or -1, if it didn't. The device serves the control queue in
+    /// poll_irq(), which this calls, so the switch must not run.
+    int command(uint8_t klass, uint8_t cmd, std::vector<uint8_t> const &data);
+
+    /// Negotiate features and set up the queues.
+    TestGuest(Switch &sw, uint32_t features);
+    ~TestGuest();
+  };
+
+}
+
+// EOF
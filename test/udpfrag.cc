@@ -0,0 +1,211 @@
+// Copyright (C) 2013, Julian Stecklina <jsteckli@os.inf.tu-dresden.de>
+// Economic rights: Technische Universitaet Dresden (Germany)
+
+// This file is part of sv3.
+
+// sv3 is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License version 2 as
+// published by the Free Software Foundation.
+
+// sv3 is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License version 2 for more details.
+
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <udpfrag.hh>
+
+using namespace Switch;
+
+enum {
+  UDP_PAYLOAD = 4000,
+  HDR_LEN     = sizeof(virtio_net_hdr_mrg_rxbuf),
+  FRAME_HDR   = sizeof(Ethernet::Header) + sizeof(IPv4::Header) + 8,
+};
+
+static uint8_t buf[HDR_LEN + FRAME_HDR + UDP_PAYLOAD];
+
+// Build a UFO packet in buf. The UDP checksum field holds the
+// pseudo header sum, as a guest would leave it.
+static void build_packet(uint16_t gso_size)
+{
+  memset(buf, 0, sizeof(buf));
+
+  virtio_net_hdr_mrg_rxbuf *vhdr = reinterpret_cast<virtio_net_hdr_mrg_rxbuf *>(buf);
+  vhdr->flags       = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+  vhdr->gso_type    = VIRTIO_NET_HDR_GSO_UDP;
+  vhdr->gso_size    = gso_size;
+  vhdr->csum_start  = sizeof(Ethernet::Header) + sizeof(IPv4::Header);
+  vhdr->csum_offset = 6;
+
+  Ethernet::Header *ehdr = reinterpret_cast<Ethernet::Header *>(buf + HDR_LEN);
+  ehdr->dst  = Ethernet::Address(0x02, 0, 0, 0, 0, 1);
+  ehdr->src  = Ethernet::Address(0x02, 0, 0, 0, 0, 2);
+  ehdr->type = Ethernet::Ethertype::IPV4;
+
+  IPv4::Header *ip = ehdr->ipv4;
+  ip->_version = 4;
+  ip->ihl      = 5;
+  ip->len      = Endian::bswap16(sizeof(IPv4::Header) + 8 + UDP_PAYLOAD);
+  ip->id       = Endian::bswap16(0x1234);
+  ip->ttl      = 64;
+  ip->proto    = IPv4::Proto::UDP;
+  ip->src      = IPv4::Address { { 10, 0, 0, 1 } };
+  ip->dst      = IPv4::Address { { 10, 0, 0, 2 } };
+
+  uint8_t *udp = reinterpret_cast<uint8_t *>(ip->payload());
+  uint16_t udp_len = Endian::bswap16(8 + UDP_PAYLOAD);
+  udp[0] = 0x30; udp[1] = 0x39;	// Port 12345
+  udp[2] = 0x01; udp[3] = 0xbb;	// Port 443
+  memcpy(udp + 4, &udp_len, 2);
+
+  uint16_t pseudo = OnesComplement::fold(ip->pseudo_checksum());
+  memcpy(udp + 6, &pseudo, 2);
+
+  for (unsigned i = 0; i < UDP_PAYLOAD; i++)
+    udp[8 + i] = i * 7 + 3;
+}
+
+// Split buf into fragments at the given offsets.
+static Packet make_packet(std::vector<unsigned> const &splits)
+{
+  Packet p;
+  unsigned last = 0;
+
+  for (unsigned split : splits) {
+    p.fragment[p.fragments]        = buf + last;
+    p.fragment_length[p.fragments] = split - last;
+    p.fragments++;
+    last = split;
+  }
+
+  p.fragment[p.fragments]        = buf + last;
+  p.fragment_length[p.fragments] = sizeof(buf) - last;
+  p.fragments++;
+  p.packet_length = sizeof(buf);
+
+  return p;
+}
+
+static bool check(char const *name, Packet const &p, unsigned gso_size)
+{
+  uint8_t  datagram[8 + UDP_PAYLOAD];
+  unsigned received = 0;
+  bool     last     = false;
+  bool     ok       = true;
+
+  UdpFragmenter frags(p);
+  Packet        frag;
+
+  if (not frags.valid()) {
+    printf("%s: packet not valid\n", name);
+    return false;
+  }
+
+  unsigned fragments = frags.fragments();
+  unsigned buffers   = frags.buffers();
+  unsigned seen      = 0;
+  unsigned used      = 0;
+
+  while (frags.next(frag)) {
+    seen += 1;
+    used += frag.fragments;
+
+    if (last) {
+      printf("%s: fragment after last fragment\n", name);
+      ok = false;
+    }
+
+    IPv4::Header const *ip = reinterpret_cast<Ethernet::Header const *>(frag.payload())->ipv4;
+    uint16_t fraginfo = Endian::bswap16(*(&ip->id + 1));
+    unsigned offset   = (fraginfo & IPv4::Header::FRAG_OFFSET) * 8;
+    unsigned plen     = ip->payload_length();
+
+    last = not (fraginfo & IPv4::Header::FRAG_MF);
+
+    if (not ip->checksum_ok() or offset != received or plen > gso_size or
+        frag.packet_length != HDR_LEN + sizeof(Ethernet::Header) + sizeof(IPv4::Header) + plen) {
+      printf("%s: broken fragment at %u\n", name, offset);
+      ok = false;
+      break;
+    }
+
+    // Gather the IP payload of this fragment.
+    unsigned skip = HDR_LEN + sizeof(Ethernet::Header) + sizeof(IPv4::Header);
+    for (unsigned i = 0; i < frag.fragments; i++) {
+      unsigned l = frag.fragment_length[i];
+      if (skip >= l) { skip -= l; continue; }
+      memcpy(datagram + received, frag.fragment[i] + skip, l - skip);
+      received += l - skip;
+      skip      = 0;
+    }
+  }
+
+  if (seen != fragments or used > buffers) {
+    printf("%s: %u fragments with %u buffers, announced %u with at most %u\n",
+           name, seen, used, fragments, buffers);
+    ok = false;
+  }
+
+  if (not last or received != sizeof(datagram)) {
+    printf("%s: datagram incomplete (%u bytes)\n", name, received);
+    return false;
+  }
+
+  IPv4::Header const *ip = reinterpret_cast<Ethernet::Header const *>(buf + HDR_LEN)->ipv4;
+  uint16_t res = ~OnesComplement::fold(OnesComplement::add(ip->pseudo_checksum(),
+                                                           OnesComplement::checksum(datagram, sizeof(datagram))));
+  if (res != 0) {
+    printf("%s: UDP checksum wrong\n", name);
+    ok = false;
+  }
+
+  if (memcmp(datagram + 8, reinterpret_cast<uint8_t const *>(ip->payload()) + 8, UDP_PAYLOAD) != 0) {
+    printf("%s: payload corrupted\n", name);
+    ok = false;
+  }
+
+  return ok;
+}
+
+int main()
+{
+  int ret = EXIT_SUCCESS;
+
+  static struct {
+    char const            *name;
+    std::vector<unsigned>  splits;
+  } layouts[] = {
+    { "separate header",  { HDR_LEN } },
+    { "any layout",       { } },
+    { "odd fragments",    { HDR_LEN + FRAME_HDR + 1, HDR_LEN + FRAME_HDR + 1001, 3333 } },
+  };
+
+  for (auto &layout : layouts)
+    for (unsigned gso_size : { 1480U, 1473U, 512U, 8U }) {
+      build_packet(gso_size);
+
+      bool ok = check(layout.name, make_packet(layout.splits), gso_size & ~7U);
+      printf("%-16s gso %4u: %s\n", layout.name, gso_size, ok ? "ok" : "FAILED");
+      if (not ok) ret = EXIT_FAILURE;
+
+      // The original packet must stay untouched, so another port can
+      // fragment it again.
+      uint8_t copy[sizeof(buf)];
+      memcpy(copy, buf, sizeof(buf));
+      check(layout.name, make_packet(layout.splits), gso_size & ~7U);
+      if (memcmp(copy, buf, sizeof(buf)) != 0) {
+        printf("%s: original packet modified FAILED\n", layout.name);
+        ret = EXIT_FAILURE;
+      }
+    }
+
+  return ret;
+}
+
+// EOF
@@ -0,0 +1,295 @@
+// Copyright (C) 2013, Julian Stecklina <jsteckli@os.inf.tu-dresden.de>
+// Economic rights: Technische Universitaet Dresden (Germany)
+
+// This file is part of sv3.
+
+// sv3 is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License version 2 as
+// published by the Free Software Foundation.
+
+// sv3 is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License version 2 for more details.
+
+
+#include "vguest.hh"
+
+#include <exceptions.hh>
+
+#include <cstring>
+
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+
+namespace Switch {
+
+  // What we put behind the Ethernet header.
+  struct PACKED Payload {
+    uint64_t seq;
+    uint64_t sent;              // TSC
+  };
+
+  enum : uint16_t {
+    // IEEE 802 local experimental Ethertype
+    ETHERTYPE_BENCHMARK = 0xB588,
+  };
+
+  void VirtualGuest::request(VhostUserRequest req, void const *payload, uint32_t size,
+                             int const *fds, unsigned nfds)
+  {
+    VhostUserMsg msg;
+    msg.request = req;
+    msg.flags   = VHOST_USER_VERSION;
+    msg.size    = size;
+    if (size) memcpy(&msg.u64, payload, size);
+
+    struct iovec  iov = { &msg, VHOST_USER_HDR_SIZE + size };
+    struct msghdr hdr;
+    union {
+      struct cmsghdr chdr;
+      char           chdr_data[CMSG_SPACE(sizeof(int) * VHOST_USER_MAX_REGIONS)];
+    };
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov    = &iov;
+    hdr.msg_iovlen = 1;
+
+    if (nfds) {
+      hdr.msg_control    = chdr_data;
+      hdr.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+
+      cmsghdr *c    = CMSG_FIRSTHDR(&hdr);
+      c->cmsg_level = SOL_SOCKET;
+      c->cmsg_type  = SCM_RIGHTS;
+      c->cmsg_len   = CMSG_LEN(sizeof(int) * nfds);
+      memcpy(CMSG_DATA(c), fds, sizeof(int) * nfds);
+    }
+
+    if (sendmsg(_fd, &hdr, MSG_NOSIGNAL) != ssize_t(iov.iov_len))
+      throw SystemError("Could not send vhost-user request %u.", req);
+  }
+
+  void VirtualGuest::reply(VhostUserMsg &msg)
+  {
+    if (recv(_fd, &msg, VHOST_USER_HDR_SIZE, MSG_WAITALL) != VHOST_USER_HDR_SIZE or
+        not (msg.flags & VHOST_USER_REPLY) or msg.size > sizeof(msg) - VHOST_USER_HDR_SIZE or
+        recv(_fd, &msg.u64, msg.size, MSG_WAITALL) != ssize_t(msg.size))
+      throw SystemError("Bad vhost-user reply.");
+  }
+
+  void VirtualGuest::setup_queue(unsigned idx, Queue &q, size_t offset)
+  {
+    q.desc      = reinterpret_cast<VRingDesc  *>(_mem + offset);
+    q.avail     = reinterpret_cast<VRingAvail *>(_mem + offset + 0x1000);
+    q.used      = reinterpret_cast<VRingUsed  *>(_mem + offset + 0x2000);
+    q.avail_idx = 0;
+    q.last_used = 0;
+
+    // We poll, so we never want interrupts. The switch still wants a
+    // call file descriptor.
+    q.avail->flags = VRING_AVAIL_F_NO_INTERRUPT;
+
+    q.kick_fd = eventfd(0, EFD_CLOEXEC);
+    q.call_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (q.kick_fd < 0 or q.call_fd < 0)
+      throw SystemError("eventfd failed");
+
+    VhostUserVringState num  = { idx, QUEUE_SIZE };
+    VhostUserVringState base = { idx, 0 };
+    VhostUserVringAddr  addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.index           = idx;
+    addr.desc_user_addr  = reinterpret_cast<uintptr_t>(q.desc);
+    addr.avail_user_addr = reinterpret_cast<uintptr_t>(q.avail);
+    addr.used_user_addr  = reinterpret_cast<uintptr_t>(q.used);
+
+    uint64_t u64 = idx;
+
+    request(VHOST_USER_SET_VRING_NUM,  &num,  sizeof(num));
+    request(VHOST_USER_SET_VRING_ADDR, &addr, sizeof(addr));
+    request(VHOST_USER_SET_VRING_BASE, &base, sizeof(base));
+    request(VHOST_USER_SET_VRING_CALL, &u64,  sizeof(u64), &q.call_fd, 1);
+    request(VHOST_USER_SET_VRING_KICK, &u64,  sizeof(u64), &q.kick_fd, 1);
+  }
+
+  void VirtualGuest::publish(Queue &q)
+  {
+    if (__atomic_load_n(&q.avail->idx, __ATOMIC_RELAXED) == q.avail_idx)
+      return;
+
+    __atomic_store_n(&q.avail->idx, q.avail_idx, __ATOMIC_RELEASE);
+
+    // The switch must see the new index before we look whether it
+    // wants a kick. Otherwise we both wait for each other.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (not (__atomic_load_n(&q.used->flags, __ATOMIC_ACQUIRE) & VRING_USED_F_NO_NOTIFY)) {
+      uint64_t val = 1;
+      if (write(q.kick_fd, &val, sizeof(val)) == sizeof(val))
+        _counters.kicks += 1;
+    }
+  }
+
+  bool VirtualGuest::send(Ethernet::Address const &dst, unsigned length)
+  {
+    if (UNLIKELY(_tx_free.empty())) {
+      _counters.tx_ring_full += 1;
+      return false;
+    }
+
+    uint16_t id  = _tx_free.back();
+    uint8_t *buf = tx_buffer(id);
+    _tx_free.pop_back();
+
+    // The virtio header is all zero: no offloads.
+    auto &eth    = *reinterpret_cast<Ethernet::Header *>(buf + HEADER_SIZE);
+    auto &pl     = *reinterpret_cast<Payload *>(buf + HEADER_SIZE + 14);
+    eth.dst      = dst;
+    eth.src      = _mac;
+    eth.type     = Ethernet::Ethertype(ETHERTYPE_BENCHMARK);
+    pl.seq       = _seq++;
+    pl.sent      = rdtsc();
+
+    VRingDesc &d = _tx.desc[id];
+    d.addr       = gpa(buf);
+    d.len        = HEADER_SIZE + length;
+    d.flags      = 0;
+    d.next       = 0;
+
+    _tx.avail->ring[_tx.avail_idx % QUEUE_SIZE] = id;
+    _tx.avail_idx++;
+
+    _counters.tx_packets += 1;
+    _counters.tx_bytes   += length;
+    return true;
+  }
+
+  unsigned VirtualGuest::complete()
+  {
+    uint16_t used = __atomic_load_n(&_tx.used->idx, __ATOMIC_ACQUIRE);
+    unsigned n    = uint16_t(used - _tx.last_used);
+
+    for (; _tx.last_used != used; _tx.last_used++)
+      _tx_free.push_back(_tx.used->ring[_tx.last_used % QUEUE_SIZE].id);
+
+    return n;
+  }
+
+  unsigned VirtualGuest::receive()
+  {
+    uint16_t used = __atomic_load_n(&_rx.used->idx, __ATOMIC_ACQUIRE);
+    unsigned n    = uint16_t(used - _rx.last_used);
+    uint64_t now  = n ? rdtsc() : 0;
+
+    for (; _rx.last_used != used; _rx.last_used++) {
+      VRingUsedElem const &e = _rx.used->ring[_rx.last_used % QUEUE_SIZE];
+      uint8_t const *buf     = rx_buffer(e.id);
+      auto const    &eth     = *reinterpret_cast<Ethernet::Header const *>(buf + HEADER_SIZE);
+      auto const    &pl      = *reinterpret_cast<Payload const *>(buf + HEADER_SIZE + 14);
+
+      // Our buffers are large enough that the switch never merges
+      // them.
+      _counters.rx_packets += 1;
+      _counters.rx_bytes   += e.len - HEADER_SIZE;
+
+      // Other frames (e.g. from a traffic generator) have no time
+      // stamp.
+      if (eth.type == Ethernet::Ethertype(ETHERTYPE_BENCHMARK))
+        _counters.latency.add(now > pl.sent ? now - pl.sent : 0);
+
+      _rx.avail->ring[_rx.avail_idx % QUEUE_SIZE] = e.id;
+      _rx.avail_idx++;
+    }
+
+    publish(_rx);
+    return n;
+  }
+
+  VirtualGuest::VirtualGuest(char const *path, unsigned index)
+    : _fd(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)),
+      _mem_fd(syscall(SYS_memfd_create, "sv3-guest", 0)),
+      _mem(nullptr), _mem_size(MEM_SIZE),
+      _mac(Ethernet::Address::from_u64(0x020000000000ULL | (uint64_t(index + 1) << 8))),
+      _seq(0), _counters()
+  {
+    if (_fd < 0 or _mem_fd < 0)
+      throw SystemError("Could not create guest socket or memory.");
+
+    sockaddr_un sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strncpy(sa.sun_path, path, sizeof(sa.sun_path) - 1);
+    if (0 != connect(_fd, reinterpret_cast<sockaddr *>(&sa), sizeof(sa)))
+      throw SystemError("Could not connect to %s.", path);
+
+    if (0 != ftruncate(_mem_fd, _mem_size))
+      throw SystemError("Could not size guest memory.");
+
+    void *m = mmap(nullptr, _mem_size, PROT_READ | PROT_WRITE, MAP_SHARED, _mem_fd, 0);
+    if (m == MAP_FAILED)
+      throw SystemError("Could not map guest memory.");
+    _mem = static_cast<uint8_t *>(m);
+
+    // Guest-physical addresses are offsets into our memory.
+    VhostUserMsg msg;
+    request(VHOST_USER_GET_FEATURES);
+    reply(msg);
+    // The switch only talks to guests that take all of its receive
+    // offloads. We never send offloads, so we never get them either.
+    uint64_t features = msg.u64 & ((1ULL << VIRTIO_NET_F_MRG_RXBUF) |
+                                   (1ULL << VIRTIO_NET_F_GUEST_CSUM) |
+                                   (1ULL << VIRTIO_NET_F_GUEST_TSO4) |
+                                   (1ULL << VIRTIO_NET_F_GUEST_TSO6));
+
+    request(VHOST_USER_SET_OWNER);
+    request(VHOST_USER_SET_FEATURES, &features, sizeof(features));
+
+    VhostUserMemory mem;
+    memset(&mem, 0, sizeof(mem));
+    mem.nregions                   = 1;
+    mem.regions[0].guest_phys_addr = 0;
+    mem.regions[0].memory_size     = _mem_size;
+    mem.regions[0].userspace_addr  = reinterpret_cast<uintptr_t>(_mem);
+    mem.regions[0].mmap_offset     = 0;
+    request(VHOST_USER_SET_MEM_TABLE, &mem, offsetof(VhostUserMemory, regions[1]), &_mem_fd, 1);
+
+    // Fill the RX ring before the switch looks at it.
+    setup_queue(0, _rx, RX_RING);
+    for (unsigned i = 0; i < QUEUE_SIZE; i++) {
+      _rx.desc[i].addr  = gpa(rx_buffer(i));
+      _rx.desc[i].len   = BUFFER_SIZE;
+      _rx.desc[i].flags = VRING_DESC_F_WRITE;
+      _rx.desc[i].next  = 0;
+      _rx.avail->ring[i] = i;
+    }
+    _rx.avail_idx = QUEUE_SIZE;
+    __atomic_store_n(&_rx.avail->idx, _rx.avail_idx, __ATOMIC_RELEASE);
+
+    setup_queue(1, _tx, TX_RING);
+    for (unsigned i = QUEUE_SIZE; i > 0; i--)
+      _tx_free.push_back(i - 1);
+  }
+
+  VirtualGuest::~VirtualGuest()
+  {
+    // The switch lets go of our memory and rings, when we hang up.
+    close(_fd);
+
+    for (Queue *q : { &_rx, &_tx }) {
+      close(q->kick_fd);
+      close(q->call_fd);
+    }
+
+    munmap(_mem, _mem_size);
+    close(_mem_fd);
+  }
+
+}
+
+// EOF
@@ -0,0 +1,135 @@
+// Copyright (C) 2013, Julian Stecklina <jsteckli@os.inf.tu-dresden.de>
+// Economic rights: Technische Universitaet Dresden (Germany)
+
+// This file is part of sv3.
+
+// sv3 is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License version 2 as
+// published by the Free Software Foundation.
+
+// sv3 is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License version 2 for more details.
+
+// A synthetic virtio-net guest for benchmarks
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include <header/ethernet.hh>
+#include <histogram.hh>
+#include <util.hh>
+#include <vhostuser.hh>
+
+namespace Switch {
+
+  /// A guest without a VM. It connects to a vhost-user socket like
+  /// qemu does, shares anonymous memory (a memfd) with the switch and
+  /// drives the RX and TX rings from whatever thread calls it, like a
+  /// polling virtio-net driver would. It never asks for interrupts,
+  /// but kicks the switch whenever the switch wants to be kicked.
+  ///
+  /// Frames carry a sequence number and the time stamp counter when
+  /// they were queued, so receivers can measure latency.
+  class VirtualGuest : Uncopyable {
+  public:
+    enum {
+      QUEUE_SIZE  = 256,
+      BUFFER_SIZE = 2048,
+      HEADER_SIZE = sizeof(virtio_net_hdr_mrg_rxbuf),
+      MIN_FRAME   = 60,
+      MAX_FRAME   = BUFFER_SIZE - HEADER_SIZE,
+    };
+
+    struct Counters {
+      uint64_t tx_packets;
+      uint64_t tx_bytes;
+      uint64_t tx_ring_full;    // send() found no free descriptor
+      uint64_t rx_packets;
+      uint64_t rx_bytes;
+      uint64_t kicks;
+      Histogram latency;        // Cycles from send() to receive()
+    };
+
+  private:
+    struct Queue {
+      VRingDesc  *desc;
+      VRingAvail *avail;
+      VRingUsed  *used;
+      uint16_t    avail_idx;
+      uint16_t    last_used;
+      int         kick_fd;
+      int         call_fd;
+    };
+
+    int       _fd;              // vhost-user socket
+    int       _mem_fd;
+    uint8_t  *_mem;
+    size_t    _mem_size;
+
+    Queue     _rx;
+    Queue     _tx;
+
+    // TX descriptors (and buffers) that the switch gave back.
+    std::vector<uint16_t> _tx_free;
+
+    Ethernet::Address _mac;
+    uint64_t          _seq;
+    Counters          _counters;
+
+    uint64_t gpa(void const *p) const { return static_cast<uint8_t const *>(p) - _mem; }
+    uint8_t *rx_buffer(unsigned i) { return _mem + RX_BUFFERS + i * BUFFER_SIZE; }
+    uint8_t *tx_buffer(unsigned i) { return _mem + TX_BUFFERS + i * BUFFER_SIZE; }
+
+    enum {
+      // Memory layout. Rings first, then buffers.
+      RING_SIZE  = 0x4000,
+      RX_RING    = 0,
+      TX_RING    = RING_SIZE,
+      RX_BUFFERS = 2 * RING_SIZE,
+      TX_BUFFERS = RX_BUFFERS + QUEUE_SIZE * BUFFER_SIZE,
+      MEM_SIZE   = TX_BUFFERS + QUEUE_SIZE * BUFFER_SIZE,
+    };
+
+    void request(VhostUserRequest req, void const *payload = nullptr, uint32_t size = 0,
+                 int const *fds = nullptr, unsigned nfds = 0);
+    void reply(VhostUserMsg &msg);
+
+    void setup_queue(unsigned idx, Queue &q, size_t offset);
+
+    /// Make new available entries visible and kick, unless the switch
+    /// is polling anyway.
+    void publish(Queue &q);
+
+  public:
+    Ethernet::Address const &mac() const { return _mac; }
+
+    Counters       &counters()       { return _counters; }
+    Counters const &counters() const { return _counters; }
+
+    /// Queue a frame of length bytes (without the virtio header) to
+    /// dst. Returns false, if the TX ring is full. Call flush() to
+    /// hand queued frames to the switch.
+    bool send(Ethernet::Address const &dst, unsigned length);
+    void flush() { publish(_tx); }
+
+    /// Take back TX buffers the switch is done with. Returns how
+    /// many.
+    unsigned complete();
+
+    /// Consume received frames and give their buffers back to the
+    /// switch. Returns how many frames arrived.
+    unsigned receive();
+
+    /// Connect to the vhost-user socket at path. Guests with
+    /// different indices have different MAC addresses.
+    VirtualGuest(char const *path, unsigned index);
+    ~VirtualGuest();
+  };
+
+}
+
+// EOF